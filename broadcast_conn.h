@@ -0,0 +1,126 @@
+#pragma once
+#include "spmc_varq.h"
+#include "mmap.h"
+#include "conf_opt.h"
+#include <cerrno>
+#include <string>
+#include <new>
+#include <type_traits>
+
+namespace tcpshm {
+
+// A shm connection from server to all subscribed local clients, enabled by ConfOpt<Conf>::BroadcastQueueSize
+// Server writes a msg once and each client reads it in place, so fanout cost doesn't grow with the number of clients
+// Unlike TcpShmConnection, msgs are not persisted for a client: a client sees only msgs written after it subscribes,
+// and one lagging more than half of the queue is evicted, losing msgs until it subscribes again
+template<class Conf>
+class BroadcastConnection
+{
+    // the queue is never created if BroadcastQueueSize is 0, a placeholder size keeps this class valid as a member
+    static constexpr uint32_t QueueSize = ConfOpt<Conf>::BroadcastQueueSize ? ConfOpt<Conf>::BroadcastQueueSize : 64;
+    using BCQ = SPMCVarQueue<QueueSize, ConfOpt<Conf>::MaxBroadcastReaders>;
+
+public:
+    [[nodiscard]] bool IsOpen() const {
+        return q_ != nullptr;
+    }
+
+    // for server, allocate a msg of specified size, return nullptr if size is larger than half of the queue
+    // the returned address is guaranteed to be 8 byte aligned
+    // it never fails because of slow clients, which are evicted instead
+    MsgHeader* Alloc(uint32_t size) {
+        return q_->Alloc(size);
+    }
+
+    // for server, submit the last msg from Alloc() and publish it
+    void Push() {
+        q_->Push();
+    }
+
+    // for server, submit the last msg from Alloc() but don't publish it until the next Push() or Flush()
+    void PushMore() {
+        q_->PushMore();
+    }
+
+    // for server, publish msgs submitted by PushMore()
+    void Flush() {
+        q_->Flush();
+    }
+
+    // for server, typed version of Alloc() and Push(): msg of type T is filled in place by fill(T&)
+    // msgs are in host byte order as with other shm connections
+    template<class T, class Fill>
+        requires std::invocable<Fill, T&>
+    bool Send(Fill&& fill) {
+        static_assert(std::is_trivially_copyable_v<T>, "msg type must be trivially copyable");
+        static_assert(alignof(T) <= sizeof(MsgHeader), "msg type can't be aligned more than 8 bytes");
+        MsgHeader* header = Alloc(sizeof(T));
+        if(!header) return false;
+        header->msg_type = T::msg_type;
+        fill(*new(header->Body()) T);
+        Push();
+        return true;
+    }
+
+    // for server, copy msg into the queue
+    template<class T>
+    bool Send(const T& msg) {
+        return Send<T>([&](T& m) { m = msg; });
+    }
+
+    // for client, get the next msg, return nullptr if there's none or this client is evicted
+    // user dont need to call Front() directly as PollBroadcast() of client will do it
+    MsgHeader* Front() {
+        return reader_.Front();
+    }
+
+    // for client, consume the msg we got from Front() or PollBroadcast()
+    // return false if this client has been evicted for being slow, the msg might be overwritten while being read
+    bool Pop() {
+        return reader_.Pop();
+    }
+
+    // for client, if evicted it receives nothing until subscribing again
+    [[nodiscard]] bool IsEvicted() const {
+        return reader_.IsEvicted();
+    }
+
+private:
+    template<class T1, class T2>
+    friend class TcpShmClient;
+    template<class T1, class T2>
+    friend class TcpShmServer;
+
+    static std::string GetShmFile(const char* server_name) {
+        return std::string("/") + server_name + ".bcast";
+    }
+
+    // a newly created shm file is zero filled, which is an empty queue, so whichever side comes first creates it
+    // a restarted server just goes on writing and clients subscribed before are not affected
+    bool OpenFile(const char* server_name, const char** error_msg) {
+        if(!q_) q_ = my_mmap<BCQ>(GetShmFile(server_name).c_str(), true, error_msg, ConfOpt<Conf>::QueueMmapOpt);
+        return q_ != nullptr;
+    }
+
+    // for client, start reading from the newest msg
+    bool Attach(const char** error_msg) {
+        if(!reader_.Attach(q_)) {
+            *error_msg = "Too many broadcast readers";
+            errno = 0;
+            return false;
+        }
+        return true;
+    }
+
+    void Release() {
+        reader_.Detach();
+        if(q_) {
+            my_munmap<BCQ>(q_, true, ConfOpt<Conf>::QueueMmapOpt);
+            q_ = nullptr;
+        }
+    }
+
+    BCQ* q_ = nullptr;
+    typename BCQ::Reader reader_;
+};
+} // namespace tcpshm
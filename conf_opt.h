@@ -0,0 +1,229 @@
+#pragma once
+#include <cstdint>
+#include <sys/socket.h>
+#include "mmap.h"
+
+namespace tcpshm {
+
+// Optional items of Conf, an item not defined in user's Conf takes the default value here
+// so existing Conf definitions keep working when new options are added
+template<class Conf>
+struct ConfOpt
+{
+    // if true, tcp recv buffer is a memfd of TcpRecvBufMaxSize(rounded up to page size) mapped twice back to back,
+    // so it never needs memmove or expansion, and msgs wrapping around the end are still contiguous
+    static constexpr bool TcpRecvMagicBuf = [] {
+        if constexpr(requires { Conf::TcpRecvMagicBuf; })
+            return Conf::TcpRecvMagicBuf;
+        else
+            return false;
+    }();
+
+    // if true, tcp connections wait for readability through a multishot poll request in an io_uring
+    // owned by the polling thread, so idle connections cost no syscall per poll
+    static constexpr bool TcpUseIoUring = [] {
+        if constexpr(requires { Conf::TcpUseIoUring; })
+            return Conf::TcpUseIoUring;
+        else
+            return false;
+    }();
+
+    // if true, each tcp group of server owns an edge-triggered epoll set, and PollTcp() only services
+    // ready connections and those with due heartbeat or timeout checks, instead of reading all of them
+    static constexpr bool TcpUseEpoll = [] {
+        if constexpr(requires { Conf::TcpUseEpoll; })
+            return Conf::TcpUseEpoll;
+        else
+            return false;
+    }();
+
+    // if non-zero, tcp sends of at least this many bytes use MSG_ZEROCOPY, pages of the ptcp queue are
+    // handed to kernel without copy and the msgs are not released by acks until kernel notifies completion
+    // it pays off only for large bursts(e.g. >= 16KB), and is turned off for a socket if kernel reports copying
+    static constexpr uint32_t TcpZeroCopyMinSize = [] {
+        if constexpr(requires { Conf::TcpZeroCopyMinSize; })
+            return static_cast<uint32_t>(Conf::TcpZeroCopyMinSize);
+        else
+            return 0u;
+    }();
+
+    // if non-zero, epoll_wait of TcpUseEpoll busy polls the device queues of the sockets instead of waiting for
+    // interrupts, the value is busy_poll_usecs of EPIOCSPARAMS, requires linux 6.9 or later
+    static constexpr uint32_t TcpEpollBusyPollUs = [] {
+        if constexpr(requires { Conf::TcpEpollBusyPollUs; })
+            return static_cast<uint32_t>(Conf::TcpEpollBusyPollUs);
+        else
+            return 0u;
+    }();
+
+    // backlog of the listening socket of server, it should hold all clients reconnecting at once, e.g. after failover,
+    // as a connection dropped from a full accept queue has to wait for the client to retry
+    static constexpr int ListenBacklog = [] {
+        if constexpr(requires { Conf::ListenBacklog; })
+            return static_cast<int>(Conf::ListenBacklog);
+        else
+            return SOMAXCONN;
+    }();
+
+    // if non-zero, server accepts at most this many connections in a PollCtl(), otherwise it accepts until
+    // the backlog is drained or all Conf::MaxNewConnections slots are taken
+    static constexpr uint32_t MaxAcceptPerPoll = [] {
+        if constexpr(requires { Conf::MaxAcceptPerPoll; })
+            return static_cast<uint32_t>(Conf::MaxAcceptPerPoll);
+        else
+            return 0u;
+    }();
+
+    // number of control shards of server, each with its own SO_REUSEPORT listener polled by PollCtl(now, shard)
+    // shard s is responsible for groups whose grpid % CtlShards == s, see TcpShmServer::PollCtl()
+    static constexpr uint32_t CtlShards = [] {
+        if constexpr(requires { Conf::CtlShards; })
+            return static_cast<uint32_t>(Conf::CtlShards);
+        else
+            return 1u;
+    }();
+
+    // if non-zero, server creates a broadcast shm queue of this size(must be a power of 2), to which msgs are written
+    // once and read in place by every subscribed local client, see BroadcastConnection
+    static constexpr uint32_t BroadcastQueueSize = [] {
+        if constexpr(requires { Conf::BroadcastQueueSize; })
+            return static_cast<uint32_t>(Conf::BroadcastQueueSize);
+        else
+            return 0u;
+    }();
+
+    // max number of clients subscribing the broadcast queue at the same time
+    static constexpr uint32_t MaxBroadcastReaders = [] {
+        if constexpr(requires { Conf::MaxBroadcastReaders; })
+            return static_cast<uint32_t>(Conf::MaxBroadcastReaders);
+        else
+            return 32u;
+    }();
+
+    // if true, shm queues are MPSCVarQueue instead of SPSCVarQueue, so Alloc() and Push(header) of a shm connection can
+    // be called from multiple threads, it must be the same between server and client
+    static constexpr bool ShmMultiProducer = [] {
+        if constexpr(requires { Conf::ShmMultiProducer; })
+            return Conf::ShmMultiProducer;
+        else
+            return false;
+    }();
+
+    // if non-zero, a shm polling thread parks on a futex after this many consecutive polls that find no msg, and
+    // publishing shm msgs wakes a parked reader at the cost of a full fence, see SPSCVarQueue::PrepareWait()
+    // the side writing to a reader that parks must also set it, so it should be non-zero for both server and client
+    static constexpr uint32_t ShmWaitSpinCount = [] {
+        if constexpr(requires { Conf::ShmWaitSpinCount; })
+            return Conf::ShmWaitSpinCount;
+        else
+            return 0u;
+    }();
+
+    // max time in ns of each park, so a parked polling function returns to the user loop at least this often
+    static constexpr int64_t ShmWaitTimeoutNs = [] {
+        if constexpr(requires { Conf::ShmWaitTimeoutNs; })
+            return Conf::ShmWaitTimeoutNs;
+        else
+            return int64_t(1000000);
+    }();
+
+    // if positive, server releases the queue mappings and recv buffer of a connection offline for longer than this,
+    // measured in user provided timestamp, and the connection object is reused by the next new client of its group
+    // with the default 0 a connection is never released: it's kept for its client, also across restarts as client
+    // names of a group are persisted in ptcp_dir, so a group takes at most MaxShmConnsPerGrp/MaxTcpConnsPerGrp
+    // distinct client names until its name file is removed
+    static constexpr int64_t ConnectionReleaseTimeout = [] {
+        if constexpr(requires { Conf::ConnectionReleaseTimeout; })
+            return Conf::ConnectionReleaseTimeout;
+        else
+            return int64_t(0);
+    }();
+
+    // max msgs of a connection dispatched in a call of TcpShmServer::PollAll() before moving on to the next one
+    static constexpr uint32_t PollAllMsgBudget = [] {
+        if constexpr(requires { Conf::PollAllMsgBudget; })
+            return static_cast<uint32_t>(Conf::PollAllMsgBudget);
+        else
+            return 16u;
+    }();
+
+    // if non-zero, TcpShmServer::PollAll() sleeps after this many calls in a row that find no msg, so an idle server
+    // doesn't take a core, the sleep starts from 1us and doubles on each idle call up to PollAllMaxSleepNs
+    static constexpr uint32_t PollAllSpinCount = [] {
+        if constexpr(requires { Conf::PollAllSpinCount; })
+            return static_cast<uint32_t>(Conf::PollAllSpinCount);
+        else
+            return 0u;
+    }();
+
+    // max time in ns of each sleep of TcpShmServer::PollAll(), which also bounds the delay of heartbeats and logins
+    static constexpr int64_t PollAllMaxSleepNs = [] {
+        if constexpr(requires { Conf::PollAllMaxSleepNs; })
+            return Conf::PollAllMaxSleepNs;
+        else
+            return int64_t(1000000);
+    }();
+
+    // if positive, every this long in user provided timestamp PollCtl() samples msg rates of live connections, and
+    // moves one connection from the busiest group to the least busy one of its shard if that narrows the gap, see
+    // TcpShmServer::MigrateConnection()
+    static constexpr int64_t RebalanceInterval = [] {
+        if constexpr(requires { Conf::RebalanceInterval; })
+            return Conf::RebalanceInterval;
+        else
+            return int64_t(0);
+    }();
+
+    // if true, connections record latencies of received msgs in histograms mapped from a shm file, which external
+    // tools can read, see ConnLatencyStats, one-way latency of shm needs it set on the sending side too
+    static constexpr bool LatencyStats = [] {
+        if constexpr(requires { Conf::LatencyStats; })
+            return Conf::LatencyStats;
+        else
+            return false;
+    }();
+
+    // if set, shm queue files are created in this hugetlbfs mount, see MmapOpt
+    static constexpr const char* MmapHugetlbfsDir = [] {
+        if constexpr(requires { Conf::MmapHugetlbfsDir; })
+            return static_cast<const char*>(Conf::MmapHugetlbfsDir);
+        else
+            return static_cast<const char*>(nullptr);
+    }();
+
+    // if true, shm and ptcp queue files are advised to use transparent huge pages
+    static constexpr bool MmapTransparentHugePage = [] {
+        if constexpr(requires { Conf::MmapTransparentHugePage; })
+            return Conf::MmapTransparentHugePage;
+        else
+            return false;
+    }();
+
+    // if true, pages of shm and ptcp queue files are faulted in when mapped
+    static constexpr bool MmapPopulate = [] {
+        if constexpr(requires { Conf::MmapPopulate; })
+            return Conf::MmapPopulate;
+        else
+            return false;
+    }();
+
+    // if true, pages of shm and ptcp queue files are locked in memory
+    static constexpr bool MmapLock = [] {
+        if constexpr(requires { Conf::MmapLock; })
+            return Conf::MmapLock;
+        else
+            return false;
+    }();
+
+    // if non-negative, pages of shm and ptcp queue files are allocated on this NUMA node
+    static constexpr int MmapNumaNode = [] {
+        if constexpr(requires { Conf::MmapNumaNode; })
+            return Conf::MmapNumaNode;
+        else
+            return -1;
+    }();
+
+    static constexpr MmapOpt QueueMmapOpt = {
+        MmapHugetlbfsDir, MmapTransparentHugePage, MmapPopulate, MmapLock, MmapNumaNode};
+};
+} // namespace tcpshm
@@ -8,6 +8,8 @@ struct CommonConf
     static constexpr uint32_t NameSize = 16;
     static constexpr uint32_t ShmQueueSize = 1024 * 1024; // must be power of 2
     static constexpr bool ToLittleEndian = true; // set to the endian of majority of the hosts
+    static constexpr uint32_t BroadcastQueueSize = 1024 * 1024; // market data to all shm clients, must be power of 2
+    static constexpr bool LatencyStats = true; // latency histograms of each connection, see test/lat_stats.cpp
 
     using LoginUserData = char;
     using LoginRspUserData = char;
@@ -100,6 +100,8 @@ public:
         
         logger->info("客户端已启动, send_num: {} recv_num: {}", *send_num, *recv_num);
         if(use_shm) {
+            // market data for shm clients comes from the broadcast queue of server
+            if(!SubscribeBroadcast()) return;
             thread shm_thr([this]() {
                 if(do_cpupin) cpupin(7);
                 start_time = now();
@@ -109,13 +111,15 @@ public:
                         conn.Close();
                         break;
                     }
-                    PollShm();
+                    PollShmBatch();
+                    PollBroadcast();
                 }
             });
 
             // we still need to poll tcp for heartbeats even if using shm
             while(!conn.IsClosed()) {
               PollTcp(now());
+              tsc_clock.Calibrate();
             }
             shm_thr.join();
         }
@@ -129,6 +133,7 @@ public:
                     break;
                 }
                 PollTcp(now());
+                tsc_clock.Calibrate();
             }
         }
         uint64_t latency = stop_time - start_time;
@@ -208,7 +213,7 @@ private:
         return base_currencies[base_idx] + "-" + quote_currencies[quote_idx];
     }
 
-    void handleMarketDepthMsg(MarketDepthMsg* msg) {
+    void handleMarketDepthMsg(const MarketDepthMsg* msg) {
         int v = msg->instrument_id;
         if(v != (*recv_num % 120)) {
             logger->error("错误: 市场深度数据 ID: {} 期望值: {}", v, (*recv_num % 120));
@@ -242,7 +247,7 @@ private:
         (*recv_num)++;
     }
     
-    void handleTradeMsg(TradeMsg* msg) {
+    void handleTradeMsg(const TradeMsg* msg) {
         int v = msg->instrument_id;
         if(v != (*recv_num % 120)) {
             logger->error("错误: 成交数据 ID: {} 期望值: {}", v, (*recv_num % 120));
@@ -278,7 +283,7 @@ private:
         (*recv_num)++;
     }
     
-    void handleVolatilityMsg(VolatilityMsg* msg) {
+    void handleVolatilityMsg(const VolatilityMsg* msg) {
         int v = msg->instrument_id;
         if(v != (*recv_num % 120)) {
             logger->error("错误: 波动率数据 ID: {} 期望值: {}", v, (*recv_num % 120));
@@ -314,7 +319,7 @@ private:
         (*recv_num)++;
     }
     
-    void handleKLineMsg(KLineMsg* msg) {
+    void handleKLineMsg(const KLineMsg* msg) {
         int v = msg->instrument_id;
         if(v != (*recv_num % 120)) {
             logger->error("错误: K线数据 ID: {} 期望值: {}", v, (*recv_num % 120));
@@ -363,7 +368,7 @@ private:
         (*recv_num)++;
     }
     
-    void handleTickerMsg(TickerMsg* msg) {
+    void handleTickerMsg(const TickerMsg* msg) {
         int v = msg->instrument_id;
         if(v != (*recv_num % 120)) {
             logger->error("错误: 行情数据 ID: {} 期望值: {}", v, (*recv_num % 120));
@@ -400,7 +405,7 @@ private:
     }
 
     template<class T>
-    void handleMsg(T* msg) {
+    void handleMsg(const T* msg) {
         for(auto v : msg->val) {
             // convert from configurated network byte order
             Endian<ClientConf::ToLittleEndian>::ConvertInPlace(v);
@@ -449,22 +454,62 @@ private:
 
     // called by APP thread
     void OnServerMsg(MsgHeader* header) {
-        // auto msg_type = header->msg_type;
-        switch(header->msg_type) {
-            case 1: handleMsg(reinterpret_cast<Msg1*>(header + 1)); break;
-            case 2: handleMsg(reinterpret_cast<Msg2*>(header + 1)); break;
-            case 3: handleMsg(reinterpret_cast<Msg3*>(header + 1)); break;
-            case 4: handleMsg(reinterpret_cast<Msg4*>(header + 1)); break;
-            case 5: handleMarketDepthMsg(reinterpret_cast<MarketDepthMsg*>(header + 1)); break;
-            case 6: handleTradeMsg(reinterpret_cast<TradeMsg*>(header + 1)); break;
-            case 7: handleVolatilityMsg(reinterpret_cast<VolatilityMsg*>(header + 1)); break;
-            case 8: handleKLineMsg(reinterpret_cast<KLineMsg*>(header + 1)); break;
-            case 9: handleTickerMsg(reinterpret_cast<TickerMsg*>(header + 1)); break;
-            default: assert(false);
-        }
+        HandleServerMsg(header);
         conn.Pop();
     }
 
+    // called by APP thread when polling shm in batch
+    // market data usually comes in bursts, so we consume the whole run at once
+    void OnServerMsgs(Connection::ShmMsgRange& msgs) {
+        for(MsgHeader* header : msgs) {
+            HandleServerMsg(header);
+        }
+        conn.PopN(msgs.end());
+    }
+
+    // called by APP thread
+    void OnBroadcastMsg(MsgHeader* header) {
+        HandleServerMsg(header);
+        if(!GetBroadcastConnection().Pop()) logger->warn("广播消息在读取时可能已被覆盖");
+    }
+
+    // called by APP thread
+    // we're too slow to keep up with the broadcast queue, return true to skip the lost msgs and go on
+    bool OnBroadcastEvicted() {
+        logger->warn("读取广播队列过慢, 已丢失部分消息");
+        return true;
+    }
+
+    // we dispatch msgs ourselves instead of defining ServerMsgDispatcher
+    // as msgs from batch polling are popped all at once rather than in each handler
+    using MsgHandler =
+        MsgDispatcher<EchoClient, Msg1, Msg2, Msg3, Msg4, MarketDepthMsg, TradeMsg, VolatilityMsg, KLineMsg, TickerMsg>;
+    friend MsgHandler;
+
+    void HandleServerMsg(MsgHeader* header) {
+        if(!MsgHandler::Dispatch(*this, header)) assert(false);
+    }
+
+    template<class T>
+    void OnMsg(const T& msg) {
+        handleMsg(&msg);
+    }
+    void OnMsg(const MarketDepthMsg& msg) {
+        handleMarketDepthMsg(&msg);
+    }
+    void OnMsg(const TradeMsg& msg) {
+        handleTradeMsg(&msg);
+    }
+    void OnMsg(const VolatilityMsg& msg) {
+        handleVolatilityMsg(&msg);
+    }
+    void OnMsg(const KLineMsg& msg) {
+        handleKLineMsg(&msg);
+    }
+    void OnMsg(const TickerMsg& msg) {
+        handleTickerMsg(&msg);
+    }
+
     // called by tcp thread
     void OnDisconnected(const char* reason, int sys_errno) {
         logger->info("客户端断开连接 原因: {} 系统错误码: {}", reason, strerror(sys_errno));
@@ -498,6 +543,9 @@ int main(int argc, const char** argv) {
     const char* server_ip = argv[2];
     bool use_shm = argv[3][0] != '0';
 
+    if(!tsc_clock.Init(20000000, 1000000000, CLOCK_REALTIME)) {
+        cout << "tsc is not invariant, now() reads the system clock" << endl;
+    }
     EchoClient client(name, name);
     client.Run(use_shm, server_ip, 12345);
 
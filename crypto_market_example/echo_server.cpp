@@ -68,14 +68,9 @@ public:
         // Initialize spdlog
         logger = spdlog::stdout_color_mt("server");
         logger->set_level(spdlog::level::info);
-        
-        // 初始化数据发送计数器
-        for (int i = 0; i < 5; i++) {
-            msg_send_count[i+5] = 0;
-        }
     }
 
-    static void SignalHandler(int s) {
+    static void SignalHandler(int) {
         stopped = true;
     }
 
@@ -83,7 +78,7 @@ public:
         if(!Start(listen_ipv4, listen_port)) return;
         vector<thread> threads;
         // create threads for polling tcp
-        for(int i = 0; i < ServerConf::MaxTcpGrps; i++) {
+        for(uint32_t i = 0; i < ServerConf::MaxTcpGrps; i++) {
           threads.emplace_back([this, i]() {
             if (do_cpupin) cpupin(4 + i);
             while (!stopped) {
@@ -93,7 +88,7 @@ public:
         }
 
         // create threads for polling shm
-        for(int i = 0; i < ServerConf::MaxShmGrps; i++) {
+        for(uint32_t i = 0; i < ServerConf::MaxShmGrps; i++) {
           threads.emplace_back([this, i]() {
             if (do_cpupin) cpupin(4 + ServerConf::MaxTcpGrps + i);
             while (!stopped) {
@@ -111,6 +106,7 @@ public:
         // polling control using this thread
         while(!stopped) {
           PollCtl(now());
+          tsc_clock.Calibrate();
         }
 
         for(auto& thr : threads) {
@@ -120,7 +116,8 @@ public:
         
         // 输出发送统计信息
         logger->info("服务器已停止, 发送统计:");
-        for (const auto& [type, count] : msg_send_count) {
+        for (int type = MarketDepthMsg::msg_type; type <= TickerMsg::msg_type; type++) {
+            int count = msg_send_count[type];
             std::string type_name;
             switch(type) {
                 case 5: type_name = "市场深度数据"; break;
@@ -136,6 +133,17 @@ public:
         logger->info("服务器已停止");
     }
     
+    template<class Out>
+    void SendMarketData(Out& out, int msg_type, int instrument_id) {
+        switch(msg_type) {
+            case 5: SendMarketDepthMsg(out, instrument_id); break;
+            case 6: SendTradeMsg(out, instrument_id); break;
+            case 7: SendVolatilityMsg(out, instrument_id); break;
+            case 8: SendKLineMsg(out, instrument_id); break;
+            case 9: SendTickerMsg(out, instrument_id); break;
+        }
+    }
+
     // 定期发送市场数据的线程函数
     void SendMarketDataPeriodically() {
         logger->info("市场数据发送线程已启动");
@@ -158,24 +166,17 @@ public:
                 continue;
             }
             
+            // 随机选择一种市场数据类型发送
+            int msg_type = 5 + (total_sent % 5); // 循环发送5种类型的数据
+            int instrument_id = total_sent % 120; // 循环120个币对
+
+            // shm clients read it from the broadcast queue, which is written only once however many they are
+            SendMarketData(GetBroadcastConnection(), msg_type, instrument_id);
             for (auto& conn : connections) {
-                if (conn->IsClosed()) continue;
-                
-                // 随机选择一种市场数据类型发送
-                int msg_type = 5 + (total_sent % 5); // 循环发送5种类型的数据
-                int instrument_id = total_sent % 120; // 循环120个币对
-                
-                switch(msg_type) {
-                    case 5: SendMarketDepthMsg(*conn, instrument_id); break;
-                    case 6: SendTradeMsg(*conn, instrument_id); break;
-                    case 7: SendVolatilityMsg(*conn, instrument_id); break;
-                    case 8: SendKLineMsg(*conn, instrument_id); break;
-                    case 9: SendTickerMsg(*conn, instrument_id); break;
-                }
-                
-                total_sent++;
-                if (total_sent >= max_msgs_to_send) break;
+                if (conn->IsClosed() || conn->UseShm()) continue;
+                SendMarketData(*conn, msg_type, instrument_id);
             }
+            total_sent++;
             
             // 控制发送频率
             // std::this_thread::sleep_for(std::chrono::milliseconds(50));
@@ -272,197 +273,183 @@ private:
         }
     }
 
+    // market data msgs are dispatched to OnMsg() of the type by polling functions
+    using ClientMsgDispatcher = MsgDispatcher<EchoServer, MarketDepthMsg, TradeMsg, VolatilityMsg, KLineMsg, TickerMsg>;
+    friend ClientMsgDispatcher;
+
     // called by APP thread
-    void OnClientMsg(Connection& conn, MsgHeader* recv_header) {
-        int msg_type = recv_header->msg_type;
-        
-        // Parse the instrument ID from the incoming message
-        int instrument_id = 0;
-        if (msg_type >= 5 && msg_type <= 9) {
-            // For all market data messages
-            void* msg_body = recv_header + 1;
-            instrument_id = *reinterpret_cast<int*>(msg_body);
-            
-            // 在接收到请求时打印请求信息
-            std::string symbol = GetSymbolName(instrument_id);
-            logger->info("收到请求 - 类型: {}, 币对: {} (ID: {})", msg_type, symbol, instrument_id);
-        }
-        
+    template<class T>
+    void OnMsg(Connection& conn, const T& msg) {
+        // 在接收到请求时打印请求信息
+        std::string symbol = GetSymbolName(msg.instrument_id);
+        logger->info("收到请求 - 类型: {}, 币对: {} (ID: {})", T::msg_type, symbol, msg.instrument_id);
+
         // 现在我们只接收消息，不再响应请求
         conn.Pop();
     }
+
+    // called by APP thread
+    // msgs that ClientMsgDispatcher can't dispatch
+    void OnClientMsg(Connection& conn, MsgHeader*) {
+        conn.Pop();
+    }
     
-    void SendMarketDepthMsg(Connection& conn, int instrument_id) {
-        MsgHeader* header = conn.Alloc(sizeof(MarketDepthMsg));
-        if(!header) return;
-        
-        header->msg_type = MarketDepthMsg::msg_type;
-        MarketDepthMsg* msg = reinterpret_cast<MarketDepthMsg*>(header + 1);
-        
-        // Make sure instrument_id is in the valid range (0-119)
-        msg->instrument_id = instrument_id % 120;
-        
-        // Base price for this instrument
-        double base_price = 100.0 + (msg->instrument_id % 100);
-        
-        // Generate some test prices and sizes for 5 levels
-        for(int i = 0; i < 5; i++) {
-            msg->bid[i].price = base_price - i * 0.1 - RandomOffset();
-            msg->bid[i].size = 100 + i * 10 + RandomSize();
-            msg->ask[i].price = base_price + 0.1 + i * 0.1 + RandomOffset();
-            msg->ask[i].size = 100 + i * 10 + RandomSize();
-        }
-        
-        // Generate symbol name (e.g., BTC-USDT, ETH-USDT, etc.)
-        std::string symbol = GetSymbolName(msg->instrument_id);
+    // Out is either a Connection or the BroadcastConnection
+    template<class Out>
+    void SendMarketDepthMsg(Out& out, int instrument_id) {
+        // msg is filled in place in send queue
+        bool sent = out.template Send<MarketDepthMsg>([&](MarketDepthMsg& msg) {
+            // Make sure instrument_id is in the valid range (0-119)
+            msg.instrument_id = instrument_id % 120;
+        
+            // Base price for this instrument
+            double base_price = 100.0 + (msg.instrument_id % 100);
+        
+            // Generate some test prices and sizes for 5 levels
+            for(int i = 0; i < 5; i++) {
+                msg.bid[i].price = base_price - i * 0.1 - RandomOffset();
+                msg.bid[i].size = 100 + i * 10 + RandomSize();
+                msg.ask[i].price = base_price + 0.1 + i * 0.1 + RandomOffset();
+                msg.ask[i].size = 100 + i * 10 + RandomSize();
+            }
         
-        // Print the data being sent
-        logger->info("发送市场深度数据 - 币对: {} (ID: {}) 最优买价: {:.2f} 最优卖价: {:.2f}", 
-            symbol, msg->instrument_id, msg->bid[0].price, msg->ask[0].price);
+            // Generate symbol name (e.g., BTC-USDT, ETH-USDT, etc.)
+            std::string symbol = GetSymbolName(msg.instrument_id);
         
-        conn.Push();
-        msg_send_count[header->msg_type]++;
+            // Print the data being sent
+            logger->info("发送市场深度数据 - 币对: {} (ID: {}) 最优买价: {:.2f} 最优卖价: {:.2f}", 
+                symbol, msg.instrument_id, msg.bid[0].price, msg.ask[0].price);
+        });
+        if(sent) msg_send_count[MarketDepthMsg::msg_type]++;
     }
     
-    void SendTradeMsg(Connection& conn, int instrument_id) {
-        MsgHeader* header = conn.Alloc(sizeof(TradeMsg));
-        if(!header) return;
-        
-        header->msg_type = TradeMsg::msg_type;
-        TradeMsg* msg = reinterpret_cast<TradeMsg*>(header + 1);
-        
-        // Make sure instrument_id is in the valid range (0-119)
-        msg->instrument_id = instrument_id % 120;
-        
-        // Base price for this instrument
-        double base_price = 100.0 + (msg->instrument_id % 100);
-        
-        // Generate trade data
-        msg->price = base_price + RandomOffset();
-        msg->size = 100 + RandomSize();
-        msg->trade_id = ++last_trade_id;
-        msg->is_buy = (RandomSize() % 2 == 0);
-        msg->timestamp = now();
-        
-        // Generate symbol name
-        std::string symbol = GetSymbolName(msg->instrument_id);
-        
-        // Print the data being sent
-        logger->info("发送成交数据 - 币对: {} (ID: {}) 价格: {:.2f} 数量: {} 方向: {}", 
-            symbol, msg->instrument_id, msg->price, msg->size, msg->is_buy ? "买入" : "卖出");
-        
-        conn.Push();
-        msg_send_count[header->msg_type]++;
+    // Out is either a Connection or the BroadcastConnection
+    template<class Out>
+    void SendTradeMsg(Out& out, int instrument_id) {
+        // msg is filled in place in send queue
+        bool sent = out.template Send<TradeMsg>([&](TradeMsg& msg) {
+            // Make sure instrument_id is in the valid range (0-119)
+            msg.instrument_id = instrument_id % 120;
+        
+            // Base price for this instrument
+            double base_price = 100.0 + (msg.instrument_id % 100);
+        
+            // Generate trade data
+            msg.price = base_price + RandomOffset();
+            msg.size = 100 + RandomSize();
+            msg.trade_id = ++last_trade_id;
+            msg.is_buy = (RandomSize() % 2 == 0);
+            msg.timestamp = now();
+        
+            // Generate symbol name
+            std::string symbol = GetSymbolName(msg.instrument_id);
+        
+            // Print the data being sent
+            logger->info("发送成交数据 - 币对: {} (ID: {}) 价格: {:.2f} 数量: {} 方向: {}", 
+                symbol, msg.instrument_id, msg.price, msg.size, msg.is_buy ? "买入" : "卖出");
+        });
+        if(sent) msg_send_count[TradeMsg::msg_type]++;
     }
     
-    void SendVolatilityMsg(Connection& conn, int instrument_id) {
-        MsgHeader* header = conn.Alloc(sizeof(VolatilityMsg));
-        if(!header) return;
-        
-        header->msg_type = VolatilityMsg::msg_type;
-        VolatilityMsg* msg = reinterpret_cast<VolatilityMsg*>(header + 1);
-        
-        // Make sure instrument_id is in the valid range (0-119)
-        msg->instrument_id = instrument_id % 120;
-        
-        // Generate volatility data
-        msg->implied_volatility = 0.2 + (msg->instrument_id % 10) * 0.01 + RandomOffset() * 0.1;
-        msg->historical_volatility = 0.18 + (msg->instrument_id % 8) * 0.01 + RandomOffset() * 0.1;
-        msg->realized_volatility = 0.19 + (msg->instrument_id % 9) * 0.01 + RandomOffset() * 0.1;
-        msg->timestamp = now();
-        
-        // Generate symbol name
-        std::string symbol = GetSymbolName(msg->instrument_id);
-        
-        // Print the data being sent
-        logger->info("发送波动率数据 - 币对: {} (ID: {}) 隐含波动率: {:.4f} 历史波动率: {:.4f} 实际波动率: {:.4f}", 
-            symbol, msg->instrument_id, msg->implied_volatility, msg->historical_volatility, msg->realized_volatility);
-        
-        conn.Push();
-        msg_send_count[header->msg_type]++;
+    // Out is either a Connection or the BroadcastConnection
+    template<class Out>
+    void SendVolatilityMsg(Out& out, int instrument_id) {
+        // msg is filled in place in send queue
+        bool sent = out.template Send<VolatilityMsg>([&](VolatilityMsg& msg) {
+            // Make sure instrument_id is in the valid range (0-119)
+            msg.instrument_id = instrument_id % 120;
+        
+            // Generate volatility data
+            msg.implied_volatility = 0.2 + (msg.instrument_id % 10) * 0.01 + RandomOffset() * 0.1;
+            msg.historical_volatility = 0.18 + (msg.instrument_id % 8) * 0.01 + RandomOffset() * 0.1;
+            msg.realized_volatility = 0.19 + (msg.instrument_id % 9) * 0.01 + RandomOffset() * 0.1;
+            msg.timestamp = now();
+        
+            // Generate symbol name
+            std::string symbol = GetSymbolName(msg.instrument_id);
+        
+            // Print the data being sent
+            logger->info("发送波动率数据 - 币对: {} (ID: {}) 隐含波动率: {:.4f} 历史波动率: {:.4f} 实际波动率: {:.4f}", 
+                symbol, msg.instrument_id, msg.implied_volatility, msg.historical_volatility, msg.realized_volatility);
+        });
+        if(sent) msg_send_count[VolatilityMsg::msg_type]++;
     }
     
-    void SendKLineMsg(Connection& conn, int instrument_id) {
-        MsgHeader* header = conn.Alloc(sizeof(KLineMsg));
-        if(!header) return;
-        
-        header->msg_type = KLineMsg::msg_type;
-        KLineMsg* msg = reinterpret_cast<KLineMsg*>(header + 1);
-        
-        // Make sure instrument_id is in the valid range (0-119)
-        msg->instrument_id = instrument_id % 120;
-        
-        // Base price for this instrument
-        double base_price = 100.0 + (msg->instrument_id % 100);
-        
-        // Random period
-        msg->period = static_cast<KLineMsg::Period>(RandomSize() % 8);
-        
-        // Generate candle data
-        double range = 1.0 + (RandomOffset() * 0.5);
-        msg->close = base_price + RandomOffset();
-        msg->open = msg->close - RandomOffset();
-        msg->high = std::max(msg->open, msg->close) + (range * 0.2);
-        msg->low = std::min(msg->open, msg->close) - (range * 0.2);
-        msg->volume = 1000 + RandomSize() * 10;
-        msg->timestamp = now();
-        
-        // Map period enum to string for display
-        std::string period_str;
-        switch(msg->period) {
-            case KLineMsg::MIN_1: period_str = "1分钟"; break;
-            case KLineMsg::MIN_5: period_str = "5分钟"; break;
-            case KLineMsg::MIN_15: period_str = "15分钟"; break;
-            case KLineMsg::MIN_30: period_str = "30分钟"; break;
-            case KLineMsg::HOUR_1: period_str = "1小时"; break;
-            case KLineMsg::HOUR_4: period_str = "4小时"; break;
-            case KLineMsg::DAY_1: period_str = "1天"; break;
-            case KLineMsg::WEEK_1: period_str = "1周"; break;
-        }
-        
-        // Generate symbol name
-        std::string symbol = GetSymbolName(msg->instrument_id);
+    // Out is either a Connection or the BroadcastConnection
+    template<class Out>
+    void SendKLineMsg(Out& out, int instrument_id) {
+        // msg is filled in place in send queue
+        bool sent = out.template Send<KLineMsg>([&](KLineMsg& msg) {
+            // Make sure instrument_id is in the valid range (0-119)
+            msg.instrument_id = instrument_id % 120;
+        
+            // Base price for this instrument
+            double base_price = 100.0 + (msg.instrument_id % 100);
+        
+            // Random period
+            msg.period = static_cast<KLineMsg::Period>(RandomSize() % 8);
+        
+            // Generate candle data
+            double range = 1.0 + (RandomOffset() * 0.5);
+            msg.close = base_price + RandomOffset();
+            msg.open = msg.close - RandomOffset();
+            msg.high = std::max(msg.open, msg.close) + (range * 0.2);
+            msg.low = std::min(msg.open, msg.close) - (range * 0.2);
+            msg.volume = 1000 + RandomSize() * 10;
+            msg.timestamp = now();
+        
+            // Map period enum to string for display
+            std::string period_str;
+            switch(msg.period) {
+                case KLineMsg::MIN_1: period_str = "1分钟"; break;
+                case KLineMsg::MIN_5: period_str = "5分钟"; break;
+                case KLineMsg::MIN_15: period_str = "15分钟"; break;
+                case KLineMsg::MIN_30: period_str = "30分钟"; break;
+                case KLineMsg::HOUR_1: period_str = "1小时"; break;
+                case KLineMsg::HOUR_4: period_str = "4小时"; break;
+                case KLineMsg::DAY_1: period_str = "1天"; break;
+                case KLineMsg::WEEK_1: period_str = "1周"; break;
+            }
         
-        // Print the data being sent
-        logger->info("发送K线数据 - 币对: {} (ID: {}) 周期: {} 开: {:.2f} 高: {:.2f} 低: {:.2f} 收: {:.2f} 量: {}", 
-            symbol, msg->instrument_id, period_str, msg->open, msg->high, msg->low, msg->close, msg->volume);
+            // Generate symbol name
+            std::string symbol = GetSymbolName(msg.instrument_id);
         
-        conn.Push();
-        msg_send_count[header->msg_type]++;
+            // Print the data being sent
+            logger->info("发送K线数据 - 币对: {} (ID: {}) 周期: {} 开: {:.2f} 高: {:.2f} 低: {:.2f} 收: {:.2f} 量: {}", 
+                symbol, msg.instrument_id, period_str, msg.open, msg.high, msg.low, msg.close, msg.volume);
+        });
+        if(sent) msg_send_count[KLineMsg::msg_type]++;
     }
     
-    void SendTickerMsg(Connection& conn, int instrument_id) {
-        MsgHeader* header = conn.Alloc(sizeof(TickerMsg));
-        if(!header) return;
-        
-        header->msg_type = TickerMsg::msg_type;
-        TickerMsg* msg = reinterpret_cast<TickerMsg*>(header + 1);
-        
-        // Make sure instrument_id is in the valid range (0-119)
-        msg->instrument_id = instrument_id % 120;
-        
-        // Base price for this instrument
-        double base_price = 100.0 + (msg->instrument_id % 100);
-        
-        // Generate ticker data
-        msg->last_price = base_price + RandomOffset();
-        msg->daily_change = RandomOffset() * 2.0;
-        msg->daily_percent_change = (msg->daily_change / base_price) * 100.0;
-        msg->daily_high = base_price + std::abs(RandomOffset() * 2.0);
-        msg->daily_low = base_price - std::abs(RandomOffset() * 2.0);
-        msg->daily_volume = 10000 + RandomSize() * 100;
-        msg->timestamp = now();
-        
-        // Generate symbol name
-        std::string symbol = GetSymbolName(msg->instrument_id);
-        
-        // Print the data being sent
-        logger->info("发送行情数据 - 币对: {} (ID: {}) 最新价: {:.2f} 涨跌幅: {:.2f}% 高: {:.2f} 低: {:.2f} 量: {}", 
-            symbol, msg->instrument_id, msg->last_price, msg->daily_percent_change, 
-            msg->daily_high, msg->daily_low, msg->daily_volume);
-        
-        conn.Push();
-        msg_send_count[header->msg_type]++;
+    // Out is either a Connection or the BroadcastConnection
+    template<class Out>
+    void SendTickerMsg(Out& out, int instrument_id) {
+        // msg is filled in place in send queue
+        bool sent = out.template Send<TickerMsg>([&](TickerMsg& msg) {
+            // Make sure instrument_id is in the valid range (0-119)
+            msg.instrument_id = instrument_id % 120;
+        
+            // Base price for this instrument
+            double base_price = 100.0 + (msg.instrument_id % 100);
+        
+            // Generate ticker data
+            msg.last_price = base_price + RandomOffset();
+            msg.daily_change = RandomOffset() * 2.0;
+            msg.daily_percent_change = (msg.daily_change / base_price) * 100.0;
+            msg.daily_high = base_price + std::abs(RandomOffset() * 2.0);
+            msg.daily_low = base_price - std::abs(RandomOffset() * 2.0);
+            msg.daily_volume = 10000 + RandomSize() * 100;
+            msg.timestamp = now();
+        
+            // Generate symbol name
+            std::string symbol = GetSymbolName(msg.instrument_id);
+        
+            // Print the data being sent
+            logger->info("发送行情数据 - 币对: {} (ID: {}) 最新价: {:.2f} 涨跌幅: {:.2f}% 高: {:.2f} 低: {:.2f} 量: {}", 
+                symbol, msg.instrument_id, msg.last_price, msg.daily_percent_change, 
+                msg.daily_high, msg.daily_low, msg.daily_volume);
+        });
+        if(sent) msg_send_count[TickerMsg::msg_type]++;
     }
     
     // Helper function to generate small random price offsets
@@ -509,11 +496,14 @@ private:
     std::vector<Connection*> active_connections;
     std::mutex connections_mutex;
     
-    // 发送统计
-    std::map<int, int> msg_send_count;
+    // 发送统计, 按msg_type索引
+    std::array<int, TickerMsg::msg_type + 1> msg_send_count{};
 };
 
 int main() {
+    if(!tsc_clock.Init(20000000, 1000000000, CLOCK_REALTIME)) {
+        cout << "tsc is not invariant, now() reads the system clock" << endl;
+    }
     EchoServer server("server", "server");
     server.Run("0.0.0.0", 12345);
 
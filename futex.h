@@ -0,0 +1,35 @@
+#pragma once
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <ctime>
+
+namespace tcpshm {
+
+// Raw futex syscalls on words in shared memory, so they are not FUTEX_PRIVATE_FLAG and work across processes
+
+inline void FutexWake(std::atomic<uint32_t>* addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+inline void FutexInitWaiter(futex_waitv& w, std::atomic<uint32_t>* addr, uint32_t val) {
+    w.val = val;
+    w.uaddr = reinterpret_cast<uintptr_t>(addr);
+    w.flags = FUTEX_32;
+    w.__reserved = 0;
+}
+
+// block until any word of waiters differs from its val, one of them is woken or timeout_ns elapses
+// return at once if some word has changed already, spurious returns are possible so callers should poll again
+inline void FutexWaitv(futex_waitv* waiters, uint32_t cnt, int64_t timeout_ns) {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    int64_t ns = ts.tv_nsec + timeout_ns;
+    ts.tv_sec += ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    syscall(SYS_futex_waitv, waiters, cnt, 0, &ts, CLOCK_MONOTONIC);
+}
+} // namespace tcpshm
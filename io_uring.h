@@ -0,0 +1,143 @@
+#pragma once
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+namespace tcpshm {
+
+// Minimal single thread io_uring wrapper using raw syscalls, so no external library is needed
+// Submission is batched: GetSqe() only fills the ring in user space, Submit() enters kernel once for all of them
+// and does nothing if there's nothing to submit, completions are reaped from the shared ring without syscall
+class IoUring
+{
+public:
+    IoUring() = default;
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    ~IoUring() {
+        Release();
+    }
+
+    bool Init(uint32_t entries, const char** error_msg) {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        int fd = syscall(__NR_io_uring_setup, entries, &p);
+        if(fd < 0) {
+            *error_msg = "io_uring_setup";
+            return false;
+        }
+        sq_ring_sz_ = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+        cq_ring_sz_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+        if(single_mmap) sq_ring_sz_ = cq_ring_sz_ = std::max(sq_ring_sz_, cq_ring_sz_);
+        sqes_sz_ = p.sq_entries * sizeof(io_uring_sqe);
+        sq_ring_ = static_cast<char*>(
+            mmap(nullptr, sq_ring_sz_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING));
+        cq_ring_ = single_mmap ? sq_ring_ :
+                                 static_cast<char*>(mmap(nullptr,
+                                                         cq_ring_sz_,
+                                                         PROT_READ | PROT_WRITE,
+                                                         MAP_SHARED | MAP_POPULATE,
+                                                         fd,
+                                                         IORING_OFF_CQ_RING));
+        sqes_ = static_cast<io_uring_sqe*>(
+            mmap(nullptr, sqes_sz_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+        fd_ = fd;
+        if(sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED || sqes_ == MAP_FAILED) {
+            Release();
+            *error_msg = "mmap io_uring";
+            return false;
+        }
+        sq_head_ = reinterpret_cast<uint32_t*>(sq_ring_ + p.sq_off.head);
+        sq_tail_ = reinterpret_cast<uint32_t*>(sq_ring_ + p.sq_off.tail);
+        sq_flags_ = reinterpret_cast<uint32_t*>(sq_ring_ + p.sq_off.flags);
+        sq_mask_ = *reinterpret_cast<uint32_t*>(sq_ring_ + p.sq_off.ring_mask);
+        sq_entries_ = p.sq_entries;
+        // sqe index i is always in slot i, so the indirection array is filled once here
+        uint32_t* sq_array = reinterpret_cast<uint32_t*>(sq_ring_ + p.sq_off.array);
+        for(uint32_t i = 0; i < sq_entries_; i++) sq_array[i] = i;
+        cq_head_ = reinterpret_cast<uint32_t*>(cq_ring_ + p.cq_off.head);
+        cq_tail_ = reinterpret_cast<uint32_t*>(cq_ring_ + p.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<uint32_t*>(cq_ring_ + p.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq_ring_ + p.cq_off.cqes);
+        sqe_tail_ = *sq_tail_;
+        return true;
+    }
+
+    void Release() {
+        if(fd_ < 0) return;
+        if(sqes_ && sqes_ != MAP_FAILED) munmap(sqes_, sqes_sz_);
+        if(cq_ring_ && cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_sz_);
+        if(sq_ring_ && sq_ring_ != MAP_FAILED) munmap(sq_ring_, sq_ring_sz_);
+        sqes_ = nullptr;
+        cq_ring_ = sq_ring_ = nullptr;
+        ::close(fd_); // all pending requests are canceled
+        fd_ = -1;
+    }
+
+    [[nodiscard]] bool IsOpen() const {
+        return fd_ >= 0;
+    }
+
+    // return a zeroed sqe to be filled by caller, or nullptr if submission queue is full
+    io_uring_sqe* GetSqe() {
+        uint32_t head = std::atomic_ref<uint32_t>(*sq_head_).load(std::memory_order_acquire);
+        if(sqe_tail_ - head == sq_entries_) return nullptr;
+        io_uring_sqe* sqe = &sqes_[sqe_tail_ & sq_mask_];
+        sqe_tail_++;
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    // submit all sqes got from GetSqe() with one syscall, no syscall if there's nothing to do
+    void Submit() {
+        std::atomic_ref<uint32_t>(*sq_tail_).store(sqe_tail_, std::memory_order_release);
+        uint32_t to_submit = sqe_tail_ - std::atomic_ref<uint32_t>(*sq_head_).load(std::memory_order_acquire);
+        uint32_t flags = 0;
+        // completions that didn't fit in the cq ring are kept by kernel and flushed only when we enter
+        if(std::atomic_ref<uint32_t>(*sq_flags_).load(std::memory_order_relaxed) & IORING_SQ_CQ_OVERFLOW) {
+            flags |= IORING_ENTER_GETEVENTS;
+        }
+        if(to_submit == 0 && flags == 0) return;
+        // errors are ignored, unsubmitted sqes stay in the ring and will be submitted next time
+        syscall(__NR_io_uring_enter, fd_, to_submit, 0, flags, nullptr, 0);
+    }
+
+    // call handler(const io_uring_cqe&) for each available completion
+    template<typename Handler>
+    void ForEachCqe(Handler handler) {
+        uint32_t head = *cq_head_;
+        uint32_t tail = std::atomic_ref<uint32_t>(*cq_tail_).load(std::memory_order_acquire);
+        if(head == tail) return;
+        for(; head != tail; head++) {
+            handler(cqes_[head & cq_mask_]);
+        }
+        std::atomic_ref<uint32_t>(*cq_head_).store(head, std::memory_order_release);
+    }
+
+private:
+    int fd_ = -1;
+    char* sq_ring_ = nullptr;
+    char* cq_ring_ = nullptr;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sq_ring_sz_ = 0;
+    size_t cq_ring_sz_ = 0;
+    size_t sqes_sz_ = 0;
+    uint32_t* sq_head_ = nullptr;
+    uint32_t* sq_tail_ = nullptr;
+    uint32_t* sq_flags_ = nullptr;
+    uint32_t sq_mask_ = 0;
+    uint32_t sq_entries_ = 0;
+    uint32_t sqe_tail_ = 0; // local tail, published to sq_tail_ in Submit()
+    uint32_t* cq_head_ = nullptr;
+    uint32_t* cq_tail_ = nullptr;
+    uint32_t cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+};
+} // namespace tcpshm
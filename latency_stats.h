@@ -0,0 +1,203 @@
+#pragma once
+#include <cstdint>
+#include <atomic>
+#include <bit>
+#include <algorithm>
+#include "tsc_clock.h"
+#include "msg_header.h"
+
+namespace tcpshm {
+
+// Log-linear histogram of latencies in tsc ticks, like HdrHistogram: values below SubBucketCnt are counted exactly,
+// and each power of 2 range above is split into SubBucketCnt buckets, so the relative error is within 1/SubBucketCnt
+// It's placed in shared memory, Record() is called by a single writer with no atomic rmw, and readers in other
+// processes take a Snapshot with no locking, which may be off by the few values being recorded at the moment
+struct LatencyHistogram
+{
+    static constexpr uint32_t SubBucketBits = 5;
+    static constexpr uint32_t SubBucketCnt = 1 << SubBucketBits;
+    static constexpr uint32_t MaxValueBits = 40; // larger values are counted in the last bucket
+    static constexpr uint32_t BucketCnt = (MaxValueBits - SubBucketBits + 1) * SubBucketCnt;
+
+    static uint32_t BucketIndex(uint64_t v) {
+        if(v < SubBucketCnt) return v;
+        if(v >> MaxValueBits) return BucketCnt - 1;
+        uint32_t shift = std::bit_width(v) - SubBucketBits - 1;
+        return shift * SubBucketCnt + (v >> shift);
+    }
+
+    // the lowest value counted in bucket idx
+    static uint64_t BucketValue(uint32_t idx) {
+        if(idx < SubBucketCnt) return idx;
+        uint32_t shift = idx / SubBucketCnt - 1;
+        return uint64_t(idx % SubBucketCnt + SubBucketCnt) << shift;
+    }
+
+    void Record(uint64_t v) {
+        Add(counts[BucketIndex(v)], 1);
+        Add(total_cnt, 1);
+        Add(total, v);
+        if(v > max.load(std::memory_order_relaxed)) max.store(v, std::memory_order_relaxed);
+    }
+
+    // copy of the counts for reading, which can be subtracted from a later one to get stats of the interval between
+    struct Snapshot
+    {
+        uint64_t counts[BucketCnt];
+        uint64_t total_cnt;
+        uint64_t total;
+        uint64_t max; // the max since the histogram was created, it's not reduced by subtraction
+
+        void Load(const LatencyHistogram& h) {
+            for(uint32_t i = 0; i < BucketCnt; i++) counts[i] = h.counts[i].load(std::memory_order_relaxed);
+            total_cnt = h.total_cnt.load(std::memory_order_relaxed);
+            total = h.total.load(std::memory_order_relaxed);
+            max = h.max.load(std::memory_order_relaxed);
+        }
+
+        void Subtract(const Snapshot& earlier) {
+            for(uint32_t i = 0; i < BucketCnt; i++) counts[i] -= earlier.counts[i];
+            total_cnt -= earlier.total_cnt;
+            total -= earlier.total;
+        }
+
+        // the highest value of the bucket that the pct(e.g. 99.9) percentile falls in, 0 if empty
+        uint64_t Percentile(double pct) const {
+            uint64_t cnt = 0;
+            for(uint32_t i = 0; i < BucketCnt; i++) cnt += counts[i];
+            uint64_t target = static_cast<uint64_t>(cnt * pct / 100.0 + 0.5);
+            if(target == 0) target = 1;
+            uint64_t acc = 0;
+            for(uint32_t i = 0; i < BucketCnt; i++) {
+                acc += counts[i];
+                if(acc >= target) return i + 1 < BucketCnt ? std::min(BucketValue(i + 1) - 1, max) : max;
+            }
+            return 0;
+        }
+    };
+
+    std::atomic<uint64_t> counts[BucketCnt];
+    std::atomic<uint64_t> total_cnt;
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> max;
+
+private:
+    static void Add(std::atomic<uint64_t>& a, uint64_t v) {
+        a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+    }
+};
+
+// Latency stats of msgs received by a connection with ConfOpt<Conf>::LatencyStats, in tsc ticks
+// it's mapped from shm file "/<local_name>_<remote_name>.lat" (e.g. /dev/shm/client_server.lat), created empty by the
+// first process opening it and kept across restarts, an external tool can map it read-only and convert ticks to ns
+// by its own TscClock, see test/lat_stats.cpp
+struct ConnLatencyStats
+{
+    // from Push() of the sender to the first Front() or ShmFrontN() of the receiver returning the msg, only for shm
+    // the sender stamps the low 32 bits of tsc in MsgHeader::ack_seq, which is unused for shm, so a latency wraps
+    // around after 2^32 ticks(over 1s)
+    LatencyHistogram one_way;
+    // from the first Front() returning a msg to Pop() of it, i.e. the time of user handling the msg
+    // msgs consumed by a PopN() are counted once, from the first ShmFrontN() returning the first of them
+    LatencyHistogram handler;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "histograms in shm need lock-free atomics");
+
+// stamp of the sender in MsgHeader::ack_seq
+inline uint32_t LatencyStamp() {
+    return static_cast<uint32_t>(TscClock::ReadTsc());
+}
+
+// Records ConnLatencyStats of the msgs a connection receives, told by the receiving side of it
+// Iterator is that of a shm queue for the batch interface, e.g. SPSCVarQueue<>::Iterator
+// Front() keeps returning the same msg until Pop(), and FrontN() returns a run starting from the same msg until
+// PopN(), so a msg is first seen when it's returned while nothing is pending, or beyond what's pending
+template<class Iterator>
+class LatencyRecorder
+{
+public:
+    // start recording for a new connection, one_way is recorded only if shm
+    void Reset(ConnLatencyStats* stats, bool shm) {
+        stats_ = stats;
+        shm_ = shm;
+        front_pending_ = false;
+        run_begin_ = Iterator();
+        run_cnt_ = 0;
+        seen_head_ = seen_cnt_ = 0;
+    }
+
+    // header is returned by Front(), nullptr if none
+    void OnFront(const MsgHeader* header) {
+        if(!header || front_pending_) return;
+        front_pending_ = true;
+        front_tsc_ = TscClock::ReadTsc();
+        if(shm_) stats_->one_way.Record(static_cast<uint32_t>(front_tsc_) - header->ack_seq);
+    }
+
+    // the msg from Front() is consumed
+    void OnPop() {
+        if(front_pending_) stats_->handler.Record(TscClock::ReadTsc() - front_tsc_);
+        front_pending_ = false;
+    }
+
+    // the run [begin, end) of shm msgs is returned by FrontN()
+    void OnFrontN(const Iterator& begin, const Iterator& end) {
+        if(begin == end) return;
+        int64_t tsc = TscClock::ReadTsc();
+        uint32_t cnt = 0;
+        for(Iterator it = begin; it != end; ++it, ++cnt) {
+            if(cnt >= run_cnt_) stats_->one_way.Record(static_cast<uint32_t>(tsc) - (*it)->ack_seq);
+        }
+        run_begin_ = begin;
+        if(cnt == run_cnt_) return;
+        // msgs beyond the pending ones are first seen now, they're merged into the newest segment if all are taken,
+        // so their handling time counts from a little earlier
+        if(seen_cnt_ < MaxSeen)
+            seen_[(seen_head_ + seen_cnt_++) % MaxSeen] = {cnt - run_cnt_, tsc};
+        else
+            seen_[(seen_head_ + MaxSeen - 1) % MaxSeen].cnt += cnt - run_cnt_;
+        run_cnt_ = cnt;
+    }
+
+    // msgs before pos, which is in the run from the last FrontN(), are consumed
+    void OnPopN(const Iterator& pos) {
+        if(!run_cnt_) return;
+        uint32_t cnt = 0;
+        for(Iterator it = run_begin_; it != pos; ++it) cnt++;
+        if(!cnt) return;
+        stats_->handler.Record(TscClock::ReadTsc() - seen_[seen_head_].tsc);
+        run_cnt_ -= cnt;
+        run_begin_ = pos;
+        while(cnt) {
+            Seen& seen = seen_[seen_head_];
+            uint32_t n = std::min(cnt, seen.cnt);
+            seen.cnt -= n;
+            cnt -= n;
+            if(!seen.cnt) {
+                seen_head_ = (seen_head_ + 1) % MaxSeen;
+                seen_cnt_--;
+            }
+        }
+    }
+
+private:
+    // a segment of the pending run first seen by the same FrontN()
+    struct Seen
+    {
+        uint32_t cnt;
+        int64_t tsc;
+    };
+    static constexpr uint32_t MaxSeen = 4;
+
+    ConnLatencyStats* stats_ = nullptr;
+    bool shm_ = false;
+    bool front_pending_ = false; // the msg from Front() is not popped yet
+    int64_t front_tsc_ = 0; // when the msg pending was first seen
+    Iterator run_begin_; // the first msg of the run pending, if run_cnt_ > 0
+    uint32_t run_cnt_ = 0; // msgs of the run pending, returned by FrontN() but not consumed yet
+    Seen seen_[MaxSeen] = {}; // segments of the run pending, a ring starting from seen_head_
+    uint32_t seen_head_ = 0;
+    uint32_t seen_cnt_ = 0;
+};
+} // namespace tcpshm
@@ -26,42 +26,205 @@ SOFTWARE.
 #include <sys/shm.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <concepts>
+#include <algorithm>
+#include <cerrno>
+#include <new>
+#include <string>
 #include <string_view>
 
 namespace tcpshm {
 
+// Options of my_mmap, the default is a plain shared mapping faulted in on demand
+struct MmapOpt
+{
+    // for shm, if set the file is created in this hugetlbfs mount(e.g. "/dev/hugepages") instead of /dev/shm, so
+    // it's backed by huge pages, which must be reserved in advance by vm.nr_hugepages
+    const char* hugetlbfs_dir = nullptr;
+    // madvise(MADV_HUGEPAGE), for shm it takes effect only if shmem_enabled of transparent hugepage is advise
+    bool thp = false;
+    // fault in all pages at mapping time instead of on first access
+    bool populate = false;
+    // lock pages in memory, which also faults them in, subject to RLIMIT_MEMLOCK
+    bool lock = false;
+    // if non-negative, pages are preferably allocated on this NUMA node, e.g. the one of the polling thread
+    // pages already allocated elsewhere are moved if possible
+    int numa_node = -1;
+};
+
+// size of the mapping for an object of size bytes, rounded up to huge page size for hugetlbfs
+// return 0 if hugetlbfs_dir is not accessible
+inline size_t my_mmap_size(size_t size, bool use_shm, const MmapOpt& opt) {
+    if(!use_shm || !opt.hugetlbfs_dir) return size;
+    struct statfs st;
+    if(statfs(opt.hugetlbfs_dir, &st)) return 0;
+    return (size + st.f_bsize - 1) / st.f_bsize * st.f_bsize;
+}
+
+// open or create the file to be mapped, return -1 on error
+inline int my_mmap_open(const char* filename, bool use_shm, const MmapOpt& opt) {
+    if(use_shm && opt.hugetlbfs_dir) {
+        return open((std::string(opt.hugetlbfs_dir) + filename).c_str(), O_CREAT | O_RDWR, 0666);
+    }
+    if(use_shm) return shm_open(filename, O_CREAT | O_RDWR, 0666);
+    return open(filename, O_CREAT | O_RDWR, 0644);
+}
+
+// map size bytes of fd, extending the file if it's shorter
+inline char* my_mmap_fd(int fd, size_t size, const char** error_msg, const MmapOpt& opt) {
+    struct stat st;
+    if(fstat(fd, &st)) {
+        *error_msg = "fstat";
+        return nullptr;
+    }
+    if(st.st_size < static_cast<off_t>(size) && ftruncate(fd, size)) {
+        *error_msg = "ftruncate";
+        return nullptr;
+    }
+    // pages are faulted in only after the memory policy is set, so no MAP_POPULATE here
+    char* ret = static_cast<char*>(mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    if(ret == MAP_FAILED) {
+        *error_msg = "mmap";
+        return nullptr;
+    }
+    const char* err = nullptr;
+    if(opt.thp && madvise(ret, size, MADV_HUGEPAGE)) err = "madvise";
+    if(!err && opt.numa_node >= 0) {
+        unsigned long nodemask[16] = {};
+        if(opt.numa_node >= static_cast<int>(sizeof(nodemask) * 8))
+            err = "mbind";
+        else {
+            nodemask[opt.numa_node / 64] = 1ul << (opt.numa_node % 64);
+            if(syscall(SYS_mbind, ret, size, MPOL_PREFERRED, nodemask, sizeof(nodemask) * 8 + 1, MPOL_MF_MOVE))
+                err = "mbind";
+        }
+    }
+    if(!err && opt.lock && mlock(ret, size)) err = "mlock";
+    if(!err && opt.populate && !opt.lock) {
+        // MADV_POPULATE_WRITE needs linux 5.14, otherwise touch each page, a read fault allocates shm pages too
+        if(madvise(ret, size, MADV_POPULATE_WRITE)) {
+            long page_size = sysconf(_SC_PAGESIZE);
+            for(size_t i = 0; i < size; i += page_size) static_cast<volatile char*>(ret)[i];
+        }
+    }
+    if(err) {
+        *error_msg = err;
+        munmap(ret, size);
+        return nullptr;
+    }
+    return ret;
+}
+
 template<typename T>
-T* my_mmap(const char* filename, bool use_shm, const char** error_msg) {
-    int fd = -1;
-    if(use_shm) {
-        fd = shm_open(filename, O_CREAT | O_RDWR, 0666);
+T* my_mmap(const char* filename, bool use_shm, const char** error_msg, const MmapOpt& opt = {}) {
+    int fd = my_mmap_open(filename, use_shm, opt);
+    if(fd == -1) {
+        *error_msg = "open";
+        return nullptr;
     }
-    else {
-        fd = open(filename, O_CREAT | O_RDWR, 0644);
+    size_t size = my_mmap_size(sizeof(T), use_shm, opt);
+    if(!size) {
+        *error_msg = "statfs";
+        close(fd);
+        return nullptr;
     }
+    char* ret = my_mmap_fd(fd, size, error_msg, opt);
+    close(fd);
+    return reinterpret_cast<T*>(ret);
+}
+
+template<typename T>
+void my_munmap(void* addr, bool use_shm = false, const MmapOpt& opt = {}) {
+    munmap(addr, my_mmap_size(sizeof(T), use_shm, opt));
+}
+
+// map a queue of runtime capacity such as SPSCVarQueue, which starts with its magic, layout version and capacity
+// a new file is constructed as an empty queue of capacity, while an existing one keeps the capacity it was created
+// with, so the queue should be checked by Capacity() if it matters
+// an existing file of another queue type or layout, or with a header inconsistent with its capacity, is rejected
+template<typename Q>
+Q* my_mmap_queue(
+    const char* filename, bool use_shm, uint32_t capacity, const char** error_msg, const MmapOpt& opt = {}) {
+    int fd = my_mmap_open(filename, use_shm, opt);
     if(fd == -1) {
         *error_msg = "open";
         return nullptr;
     }
-    if(ftruncate(fd, sizeof(T))) {
-        *error_msg = "ftruncate";
+    // a new file is zero filled, and one too short to hold the header has never been constructed
+    alignas(Q) char stored_buf[sizeof(Q)] = {};
+    struct stat st = {};
+    if(fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(Q)) &&
+       pread(fd, stored_buf, sizeof(Q), 0) != sizeof(Q)) {
+        *error_msg = "pread";
+        close(fd);
+        return nullptr;
+    }
+    const Q* stored = reinterpret_cast<const Q*>(stored_buf);
+    bool exists = std::any_of(stored_buf, stored_buf + sizeof(Q), [](char c) { return c != 0; });
+    if(exists) {
+        if(const char* err = stored->CheckLayout(st.st_size)) {
+            *error_msg = err;
+            errno = 0;
+            close(fd);
+            return nullptr;
+        }
+        capacity = stored->Capacity();
+    }
+    size_t size = my_mmap_size(Q::MapSize(capacity), use_shm, opt);
+    if(!size) {
+        *error_msg = "statfs";
         close(fd);
         return nullptr;
     }
-    T* ret = static_cast<T*>(mmap(nullptr, sizeof(T), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    char* ret = my_mmap_fd(fd, size, error_msg, opt);
     close(fd);
+    if(ret && !exists) new(ret) Q(capacity);
+    return reinterpret_cast<Q*>(ret);
+}
+
+template<typename Q>
+void my_munmap_queue(Q* q, bool use_shm = false, const MmapOpt& opt = {}) {
+    munmap(q, my_mmap_size(Q::MapSize(q->Capacity()), use_shm, opt));
+}
+
+// map an anonymous memfd of size bytes twice back to back, so [addr, addr + 2 * size) is accessible
+// and addr[i] and addr[i + size] are the same byte
+// size must be a multiple of page size
+inline char* my_mmap_mirror(uint32_t size, const char** error_msg) {
+    int fd = memfd_create("tcpshm_mirror", 0);
+    if(fd == -1) {
+        *error_msg = "memfd_create";
+        return nullptr;
+    }
+    if(ftruncate(fd, size)) {
+        *error_msg = "ftruncate";
+        close(fd);
+        return nullptr;
+    }
+    // reserve the whole range first so the two mappings are guaranteed to be adjacent
+    char* ret = static_cast<char*>(mmap(nullptr, 2 * size_t(size), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
     if(ret == MAP_FAILED) {
         *error_msg = "mmap";
+        close(fd);
         return nullptr;
     }
+    if(mmap(ret, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+       mmap(ret + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        *error_msg = "mmap";
+        munmap(ret, 2 * size_t(size));
+        close(fd);
+        return nullptr;
+    }
+    close(fd);
     return ret;
 }
 
-template<typename T>
-void my_munmap(void* addr) {
-    munmap(addr, sizeof(T));
+inline void my_munmap_mirror(char* addr, uint32_t size) {
+    munmap(addr, 2 * size_t(size));
 }
 } // namespace tcpshm
@@ -0,0 +1,263 @@
+#pragma once
+#include "msg_header.h"
+#include "futex.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace tcpshm {
+
+// Multi producer variant of SPSCVarQueue with the same consumer interface
+// Producers reserve blocks by a CAS on write_idx_, so Alloc() is lock-free and still returns nullptr when full,
+// and a msg is published on its own by setting the commit word of its first block, so a slow producer only delays
+// the consumer at its msg, and never exposes a half written one
+// Alloc() and Push() can be called from any thread, a msg is pushed by the header returned from its Alloc(), so a
+// thread can hold msgs allocated from several queues, or several from one queue, before pushing them
+// WakeReader and runtime capacity are the same as those of SPSCVarQueue, the commit words follow the blocks
+template<bool WakeReader = false>
+class MPSCVarQueue
+{
+public:
+    static constexpr bool ValidCapacity(uint32_t capacity) {
+        return capacity >= 64 && !(capacity & (capacity - 1));
+    }
+
+    static constexpr size_t MapSize(uint32_t capacity) {
+        return sizeof(MPSCVarQueue) + capacity + capacity / 64 * sizeof(std::atomic<uint32_t>);
+    }
+
+    explicit MPSCVarQueue(uint32_t capacity)
+        : capacity_(capacity)
+        , blk_mask_(capacity / 64 - 1) {
+        for(uint32_t i = 0; i <= blk_mask_; i++) commit()[i].store(0, std::memory_order_relaxed);
+    }
+
+    uint32_t Capacity() const {
+        return capacity_;
+    }
+
+    // the same as those of SPSCVarQueue, so a file of either queue type is not taken as the other
+    static constexpr uint32_t Magic = 0x4350534d; // "MSPC"
+    static constexpr uint32_t LayoutVersion = 1;
+
+    const char* CheckLayout(size_t file_size) const {
+        if(magic_ != Magic || layout_version_ != LayoutVersion) return "Queue file of unknown layout";
+        if(!ValidCapacity(capacity_) || blk_mask_ != capacity_ / 64 - 1 || file_size < MapSize(capacity_)) {
+            return "Queue file corrupt";
+        }
+        return nullptr;
+    }
+
+    MsgHeader* Alloc(uint32_t size) {
+        if(size > capacity_) return nullptr;
+        size = MsgSizeOf(size);
+        uint32_t blk_sz = (size + sizeof(Block) - 1) / sizeof(Block);
+        uint32_t write_idx = write_idx_.load(std::memory_order_relaxed);
+        uint32_t padding_sz;
+        bool rewind;
+        do {
+            padding_sz = blk_mask_ + 1 - (write_idx & blk_mask_);
+            rewind = blk_sz > padding_sz;
+            // min_read_idx could be a negtive value which results in a large unsigned int
+            uint32_t min_read_idx = write_idx + blk_sz + (rewind ? padding_sz : 0) - (blk_mask_ + 1);
+            if(static_cast<int>(read_idx_cach_.load(std::memory_order_acquire) - min_read_idx) < 0) {
+                uint32_t read_idx = read_idx_.load(std::memory_order_acquire);
+                read_idx_cach_.store(read_idx, std::memory_order_release);
+                if(static_cast<int>(read_idx - min_read_idx) < 0) { // no enough space
+                    return nullptr;
+                }
+            }
+        } while(!write_idx_.compare_exchange_weak(
+            write_idx, write_idx + blk_sz + (rewind ? padding_sz : 0), std::memory_order_relaxed));
+        if(rewind) {
+            blk()[write_idx & blk_mask_].header.size = 0;
+            Commit(write_idx);
+            write_idx += padding_sz;
+        }
+        MsgHeader& header = blk()[write_idx & blk_mask_].header;
+        SetMsgSize(header, size);
+        return &header;
+    }
+
+    // publish the msg of header returned from Alloc()
+    void Push(MsgHeader* header) {
+        Commit(IndexOf(header));
+    }
+
+    // every msg is published on its own, so it's the same as Push()
+    void PushMore(MsgHeader* header) {
+        Push(header);
+    }
+
+    void Flush() {}
+
+    MsgHeader* Front() {
+        uint32_t read_idx = read_idx_.load(std::memory_order_relaxed);
+        if(!IsCommitted(read_idx)) return nullptr;
+        if(blk()[read_idx & blk_mask_].header.size == 0) { // rewind
+            read_idx += blk_mask_ + 1 - (read_idx & blk_mask_);
+            read_idx_.store(read_idx, std::memory_order_relaxed);
+            if(!IsCommitted(read_idx)) return nullptr;
+        }
+        return &blk()[read_idx & blk_mask_].header;
+    }
+
+    void Pop() {
+        uint32_t read_idx = read_idx_.load(std::memory_order_relaxed);
+        uint32_t blk_sz = (blk()[read_idx & blk_mask_].header.MsgSize() + sizeof(Block) - 1) / sizeof(Block);
+        read_idx_.store(read_idx + blk_sz, std::memory_order_release);
+    }
+
+    // iterator over a run of committed msgs snapshotted by FrontN(), rewind markers are skipped transparently
+    class Iterator
+    {
+    public:
+        Iterator() = default;
+
+        MsgHeader* operator*() const {
+            return &q_->blk()[idx_ & q_->blk_mask_].header;
+        }
+
+        Iterator& operator++() {
+            idx_ += (q_->blk()[idx_ & q_->blk_mask_].header.MsgSize() + sizeof(Block) - 1) / sizeof(Block);
+            SkipRewind();
+            return *this;
+        }
+
+        bool operator==(const Iterator& rhs) const {
+            return idx_ == rhs.idx_;
+        }
+
+    private:
+        friend class MPSCVarQueue;
+        Iterator(MPSCVarQueue* q, uint32_t idx, uint32_t end_idx)
+            : q_(q)
+            , idx_(idx)
+            , end_idx_(end_idx) {
+            SkipRewind();
+        }
+
+        void SkipRewind() {
+            if(idx_ != end_idx_ && q_->blk()[idx_ & q_->blk_mask_].header.size == 0) {
+                idx_ += q_->blk_mask_ + 1 - (idx_ & q_->blk_mask_);
+            }
+        }
+
+        MPSCVarQueue* q_ = nullptr;
+        uint32_t idx_ = 0;
+        uint32_t end_idx_ = 0;
+    };
+
+    class MsgRange
+    {
+    public:
+        Iterator begin() const {
+            return begin_;
+        }
+
+        Iterator end() const {
+            return end_;
+        }
+
+        [[nodiscard]] bool empty() const {
+            return begin_ == end_;
+        }
+
+    private:
+        friend class MPSCVarQueue;
+        MsgRange(Iterator b, Iterator e)
+            : begin_(b)
+            , end_(e) {}
+
+        Iterator begin_;
+        Iterator end_;
+    };
+
+    // get the run of msgs committed at the time of calling, it stops at the first msg not committed yet
+    MsgRange FrontN() {
+        uint32_t read_idx = read_idx_.load(std::memory_order_relaxed);
+        uint32_t end_idx = read_idx;
+        while(IsCommitted(end_idx)) {
+            const MsgHeader& header = blk()[end_idx & blk_mask_].header;
+            if(header.size == 0)
+                end_idx += blk_mask_ + 1 - (end_idx & blk_mask_);
+            else
+                end_idx += (header.MsgSize() + sizeof(Block) - 1) / sizeof(Block);
+        }
+        return MsgRange(Iterator(this, read_idx, end_idx), Iterator(this, end_idx, end_idx));
+    }
+
+    // consume all msgs before pos, read_idx is published only once
+    void PopN(const Iterator& pos) {
+        read_idx_.store(pos.idx_, std::memory_order_release);
+    }
+
+    // for reader, the same as SPSCVarQueue::PrepareWait(), it parks on the commit word of the next msg
+    bool PrepareWait(futex_waitv& w) {
+        static_assert(WakeReader, "writer doesn't wake reader");
+        reader_waiting_.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint32_t read_idx = read_idx_.load(std::memory_order_relaxed);
+        std::atomic<uint32_t>& word = commit()[read_idx & blk_mask_];
+        uint32_t val = word.load(std::memory_order_relaxed);
+        FutexInitWaiter(w, &word, val);
+        return val != read_idx + 1;
+    }
+
+    void FinishWait() {
+        reader_waiting_.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    // the commit word of a block is its index + 1 once the msg starting there is written
+    // it's unique in each round over the queue, so it needs no clearing after being consumed
+    void Commit(uint32_t idx) {
+        commit()[idx & blk_mask_].store(idx + 1, std::memory_order_release);
+        if constexpr(WakeReader) {
+            // the flag is cleared only by reader, as a producer committing a msg other than the one reader parks on
+            // doesn't wake it
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if(reader_waiting_.load(std::memory_order_relaxed)) FutexWake(&commit()[idx & blk_mask_]);
+        }
+    }
+
+    // the full index of an allocated msg not committed yet, which the consumer can't pass, so write_idx_ is ahead of
+    // it by at least its size and at most the queue size
+    uint32_t IndexOf(MsgHeader* header) {
+        uint32_t pos = reinterpret_cast<Block*>(header) - blk();
+        uint32_t write_idx = write_idx_.load(std::memory_order_relaxed);
+        uint32_t dist = (write_idx - pos) & blk_mask_;
+        return write_idx - (dist ? dist : blk_mask_ + 1);
+    }
+
+    bool IsCommitted(uint32_t idx) {
+        return commit()[idx & blk_mask_].load(std::memory_order_acquire) == idx + 1;
+    }
+
+    struct Block // size of 64, same as cache line
+    {
+        alignas(64) MsgHeader header;
+    };
+
+    Block* blk() {
+        return reinterpret_cast<Block*>(this + 1);
+    }
+
+    std::atomic<uint32_t>* commit() {
+        return reinterpret_cast<std::atomic<uint32_t>*>(blk() + blk_mask_ + 1);
+    }
+
+    // the first members as those of SPSCVarQueue
+    alignas(128) uint32_t magic_ = Magic;
+    uint32_t layout_version_ = LayoutVersion;
+    uint32_t capacity_;
+    uint32_t blk_mask_;
+
+    alignas(128) std::atomic<uint32_t> write_idx_{0};
+    std::atomic<uint32_t> read_idx_cach_{0}; // used only by producers
+
+    alignas(128) std::atomic<uint32_t> read_idx_{0};
+
+    alignas(128) std::atomic<uint32_t> reader_waiting_{0}; // set by reader while parked
+};
+} // namespace tcpshm
@@ -0,0 +1,62 @@
+#pragma once
+#include "msg_header.h"
+#include <algorithm>
+#include <array>
+
+namespace tcpshm {
+
+// Compile time msg dispatcher for the msg types Msgs..., each has a static constexpr uint16_t msg_type
+// A dense table indexed by msg_type is built at compile time, so dispatching a msg costs a bound check,
+// a size check and one indirect call to derived.OnMsg(args..., const T&)
+//
+// If Derived defines ClientMsgDispatcher(for TcpShmServer) or ServerMsgDispatcher(for TcpShmClient) as
+// a MsgDispatcher, polling functions dispatch msgs through it: OnMsg(conn, const T&) for server and
+// OnMsg(const T&) for client, and only msgs it can't dispatch go to OnClientMsg()/OnServerMsg()
+// The user is still responsible for calling Pop() in OnMsg()
+template<class Derived, class... Msgs>
+class MsgDispatcher
+{
+    static_assert(sizeof...(Msgs) > 0, "no msg types to dispatch");
+    static constexpr uint32_t TableSize = std::max({static_cast<uint32_t>(Msgs::msg_type)...}) + 1;
+    static_assert(
+        [] {
+            std::array<bool, TableSize> used{};
+            return ((used[Msgs::msg_type] ? false : (used[Msgs::msg_type] = true)) && ...);
+        }(),
+        "duplicate msg_type in Msgs");
+
+public:
+    // return false if msg_type is not one of Msgs, or msg is smaller than its type
+    // a larger msg is accepted, e.g. a newer version with fields appended
+    template<class... Args>
+    static bool Dispatch(Derived& derived, MsgHeader* header, Args&... args) {
+        using Table = DispatchTable<Args...>;
+        if(header->msg_type >= TableSize) return false;
+        const auto& entry = Table::entries[header->msg_type];
+        if(!entry.fn || header->MsgSize() < entry.min_size) return false;
+        entry.fn(derived, header, args...);
+        return true;
+    }
+
+private:
+    template<class T, class... Args>
+    static void Call(Derived& derived, MsgHeader* header, Args&... args) {
+        derived.OnMsg(args..., *static_cast<const T*>(header->Body()));
+    }
+
+    template<class... Args>
+    struct DispatchTable
+    {
+        struct Entry
+        {
+            void (*fn)(Derived&, MsgHeader*, Args&...); // nullptr if msg_type is not in Msgs
+            uint32_t min_size;
+        };
+        static constexpr std::array<Entry, TableSize> entries = [] {
+            std::array<Entry, TableSize> table{};
+            ((table[Msgs::msg_type] = Entry{&Call<Msgs, Args...>, MsgSizeOf(sizeof(Msgs))}), ...);
+            return table;
+        }();
+    };
+};
+} // namespace tcpshm
@@ -109,9 +109,13 @@ private:
   }
 };
 
+// MsgHeader::size of a large msg whose size doesn't fit in uint16_t, see LargeMsgHeader
+// a valid msg size is at least sizeof(MsgHeader), so it never conflicts with a real one
+static constexpr uint16_t LargeMsgMark = 1;
+
 struct MsgHeader
 {
-    // size of this msg, including header itself
+    // size of this msg, including header itself, or LargeMsgMark for a large msg
     // auto set by lib, can be read by user
     uint16_t size;
     // msg type of app msg is set by user and must not be 0
@@ -126,6 +130,69 @@ struct MsgHeader
         ed.ConvertInPlace(msg_type);
         ed.ConvertInPlace(ack_seq);
     }
+
+    [[nodiscard]] bool IsLarge() const {
+        return size == LargeMsgMark;
+    }
+
+    // size of the whole msg including headers, works for both normal and large msgs
+    [[nodiscard]] uint32_t MsgSize() const;
+
+    // size of the msg body, which is the size passed to Alloc()
+    [[nodiscard]] uint32_t BodySize() const;
+
+    // address of the msg body, which is this + 1 for a normal msg
+    [[nodiscard]] void* Body();
+    [[nodiscard]] const void* Body() const;
 };
+
+// A msg with body larger than UINT16_MAX - sizeof(MsgHeader) is allocated as a large msg by Alloc():
+// a MsgHeader with size being LargeMsgMark followed by the real size, then the body
+// it's stored and delivered contiguously just like a normal msg
+struct LargeMsgHeader
+{
+    MsgHeader header;
+    // size of this msg, including LargeMsgHeader itself
+    uint32_t size;
+    uint32_t reserved;
+
+    template<bool ToLittle>
+    void ConvertByteOrder() {
+        header.ConvertByteOrder<ToLittle>();
+        Endian<ToLittle>::ConvertInPlace(size);
+    }
+};
+
+// size of the whole msg with a body of body_size
+inline constexpr uint32_t MsgSizeOf(uint32_t body_size) {
+    return body_size + (body_size + sizeof(MsgHeader) > UINT16_MAX ? sizeof(LargeMsgHeader) : sizeof(MsgHeader));
+}
+
+// set up size fields of header for a msg of msg_size returned from MsgSizeOf()
+inline void SetMsgSize(MsgHeader& header, uint32_t msg_size) {
+    if(msg_size > UINT16_MAX) {
+        header.size = LargeMsgMark;
+        reinterpret_cast<LargeMsgHeader&>(header).size = msg_size;
+    }
+    else
+        header.size = msg_size;
+}
+
+inline uint32_t MsgHeader::MsgSize() const {
+    return IsLarge() ? reinterpret_cast<const LargeMsgHeader*>(this)->size : size;
+}
+
+inline uint32_t MsgHeader::BodySize() const {
+    return IsLarge() ? reinterpret_cast<const LargeMsgHeader*>(this)->size - sizeof(LargeMsgHeader)
+                     : size - sizeof(MsgHeader);
+}
+
+inline void* MsgHeader::Body() {
+    return IsLarge() ? static_cast<void*>(reinterpret_cast<LargeMsgHeader*>(this) + 1) : this + 1;
+}
+
+inline const void* MsgHeader::Body() const {
+    return const_cast<MsgHeader*>(this)->Body();
+}
 } // namespace tcpshm
 
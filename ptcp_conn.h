@@ -1,8 +1,16 @@
 #pragma once
 #include "ptcp_queue.h"
 #include "mmap.h"
+#include "conf_opt.h"
+#include "io_uring.h"
 #include <memory>
+#include <atomic>
+#include <algorithm>
 #include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <poll.h>
 #include <span>
 #include <concepts>
 
@@ -22,6 +30,8 @@ struct LoginMsgTpl
     static constexpr uint16_t msg_type = 1;
     uint32_t client_seq_start;
     uint32_t client_seq_end;
+    // heartbeat interval requested by client, 0 for the default of server's choice
+    int64_t heartbeat_interval;
     // user can put more information in user_data for auth, such as username, password...
     typename Conf::LoginUserData user_data;
 
@@ -34,6 +44,7 @@ struct LoginMsgTpl
         Endian<Conf::ToLittleEndian> ed;
         ed.ConvertInPlace(client_seq_start);
         ed.ConvertInPlace(client_seq_end);
+        ed.ConvertInPlace(heartbeat_interval);
     }
 };
 
@@ -43,6 +54,12 @@ struct LoginRspMsgTpl
     static constexpr uint16_t msg_type = 2;
     uint32_t server_seq_start;
     uint32_t server_seq_end;
+    // heartbeat interval of the connection on both sides, 0 for Conf::HeartBeatInverval of each side
+    // it's what client requested when OnNewConnection() is called, which can change it
+    int64_t heartbeat_interval;
+    // size of shm queues or server's ptcp queue of the connection, 0 for the default of server's Conf
+    // it can be set in OnNewConnection() of server, and is the actual size when received by client
+    uint32_t queue_size;
     typename Conf::LoginRspUserData user_data;
 
     // below are all char types, no alignment requirement
@@ -54,6 +71,8 @@ struct LoginRspMsgTpl
         Endian<Conf::ToLittleEndian> ed;
         ed.ConvertInPlace(server_seq_start);
         ed.ConvertInPlace(server_seq_end);
+        ed.ConvertInPlace(heartbeat_interval);
+        ed.ConvertInPlace(queue_size);
     }
 };
 
@@ -61,6 +80,12 @@ struct LoginRspMsgTpl
 template<class Conf>
 class PTCPConnection
 {
+    static_assert(!(ConfOpt<Conf>::TcpUseIoUring && ConfOpt<Conf>::TcpUseEpoll),
+                  "TcpUseIoUring and TcpUseEpoll can not be both enabled");
+    // whether readability can be notified by the polling thread instead of trying to read every time
+    static constexpr bool WaitReadiness = ConfOpt<Conf>::TcpUseIoUring || ConfOpt<Conf>::TcpUseEpoll;
+    static constexpr bool ZeroCopy = ConfOpt<Conf>::TcpZeroCopyMinSize > 0;
+
 public:
     PTCPConnection() {
         hbmsg_.size = sizeof(MsgHeader);
@@ -69,12 +94,46 @@ public:
         hbmsg_.ConvertByteOrder<Conf::ToLittleEndian>();
     }
 
-    bool OpenFile(const char* ptcp_queue_file,
-                  const char** error_msg) {
+    static constexpr bool ValidQueueSize(uint32_t size) {
+        return PTCPQ::ValidCapacity(size);
+    }
+
+    // range of a non-default heartbeat interval, see SetHeartbeatInterval()
+    // too short an interval can't be served by the timers of TcpUseEpoll in time, and too long a one would overflow
+    // timestamps of heartbeat and timeout, so it's at most 64 times the default and both times stay below 2^61
+    static constexpr int64_t MinHeartbeatInterval = std::max<int64_t>(Conf::HeartBeatInverval / 16, 1);
+    static constexpr int64_t MaxHeartbeatInterval =
+        Conf::HeartBeatInverval *
+        std::clamp<int64_t>((INT64_MAX / 4) / std::max(Conf::HeartBeatInverval, Conf::ConnectionTimeout), 1, 64);
+
+    // 0 if interval is not positive, otherwise it's clamped to [MinHeartbeatInterval, MaxHeartbeatInterval]
+    static constexpr int64_t ClampHeartbeatInterval(int64_t interval) {
+        return interval <= 0 ? 0 : std::clamp(interval, MinHeartbeatInterval, MaxHeartbeatInterval);
+    }
+
+    uint32_t GetQueueSize() const {
+        return q_ ? q_->Capacity() : 0;
+    }
+
+    // queue_size is used only if the ptcp file is created, an existing one keeps its size
+    // a file of the legacy layout is converted first, see ConvertLegacyFile()
+    bool OpenFile(const char* ptcp_queue_file, uint32_t queue_size, const char** error_msg) {
         if(!q_) {
-            q_ = my_mmap<PTCPQ>(ptcp_queue_file, false, error_msg);
+            if(!ConvertLegacyFile(ptcp_queue_file, error_msg)) return false;
+            q_ = my_mmap_queue<PTCPQ>(
+                ptcp_queue_file, false, queue_size, error_msg, ConfOpt<Conf>::QueueMmapOpt);
             if(!q_) return false;
         }
+        if constexpr(ConfOpt<Conf>::TcpRecvMagicBuf) {
+            if(!recvbuf_.get_deleter().mirror_size) {
+                uint32_t page_size = sysconf(_SC_PAGESIZE);
+                uint32_t size = (Conf::TcpRecvBufMaxSize + page_size - 1) / page_size * page_size;
+                char* buf = my_mmap_mirror(size, error_msg);
+                if(!buf) return false;
+                recvbuf_ = RecvBuf(buf, RecvBufDeleter{size});
+                recvbuf_size_ = size;
+            }
+        }
         return true;
     }
 
@@ -84,34 +143,53 @@ public:
     }
 
     void Reset() {
-        new (q_) PTCPQ();  // Use placement new instead of memset
+        new (q_) PTCPQ(q_->Capacity());  // Use placement new instead of memset
     }
 
     void Release() {
         Close("Release", 0);
         TryCloseFd();
         if(q_) {
-            my_munmap<PTCPQ>(q_);
+            my_munmap_queue<PTCPQ>(q_, false, ConfOpt<Conf>::QueueMmapOpt);
             q_ = nullptr;
         }
+        // reset the deleter too, so a magic buffer is mapped again by OpenFile()
+        recvbuf_ = RecvBuf();
+        recvbuf_size_ = 0;
+        writeidx_ = readidx_ = nextmsg_idx_ = 0;
     }
 
     // precondition: sockfd_ == fd_to_close_ == -1
     void Open(int sock_fd, uint32_t remote_ack_seq, int64_t now) {
         sockfd_ = fd_to_close_ = sock_fd;
         writeidx_ = readidx_ = nextmsg_idx_ = 0;
+        send_partial_ = 0;
         recv_time_ = send_time_ = now_ = now;
+        if constexpr(ConfOpt<Conf>::TcpUseIoUring) {
+            // poll request of the previous socket, if still alive, will be removed when it fires
+            uring_gen_.store(uring_gen_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            poll_armed_ = false;
+        }
+        if constexpr(WaitReadiness) readable_ = true;
+        if constexpr(ZeroCopy) {
+            // pins of the previous socket are dropped as its sends no longer matter
+            int yes = 1;
+            zc_enabled_ = setsockopt(sock_fd, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof(yes)) == 0;
+            zc_head_ = zc_tail_ = 0;
+            zc_done_ = 0;
+            zc_ack_ = remote_ack_seq;
+        }
         if(q_) {
             q_->LoginAck(remote_ack_seq);
             SendPending();
         }
         if(recvbuf_size_ == 0) {
             recvbuf_size_ = Conf::TcpRecvBufInitSize;
-            recvbuf_ = std::make_unique<char[]>(recvbuf_size_);
+            recvbuf_.reset(new char[recvbuf_size_]);
         }
     }
 
-    MsgHeader* Alloc(uint16_t size) {
+    MsgHeader* Alloc(uint32_t size) {
         return q_->Alloc(size);
     }
 
@@ -130,6 +208,9 @@ public:
             DoRecv();
             return nullptr;
         }
+        if constexpr(ZeroCopy) {
+            if(zc_head_ != zc_tail_) ReapZeroCopy();
+        }
         while(nextmsg_idx_ != readidx_) {
             MsgHeader* header = reinterpret_cast<MsgHeader*>(&recvbuf_[readidx_]);
             if(header->msg_type == HeartbeatMsg::msg_type) {
@@ -147,16 +228,23 @@ public:
             writeidx_ += len;
             while(writeidx_ - nextmsg_idx_ >= 8) {
                 MsgHeader* header = reinterpret_cast<MsgHeader*>(&recvbuf_[nextmsg_idx_]);
-                if(old_writeidx - static_cast<int>(nextmsg_idx_) < 8) { // we haven't converted this header
+                int old_len = old_writeidx - static_cast<int>(nextmsg_idx_);
+                if(old_len < 8) { // we haven't converted this header
                     header->ConvertByteOrder<Conf::ToLittleEndian>();
                 }
-                q_->Ack(header->ack_seq);
-                int msg_size = (header->size + 7) & -8;
-                if(static_cast<uint32_t>(msg_size) > Conf::TcpRecvBufMaxSize) {
+                OnAck(header->ack_seq);
+                if(header->IsLarge()) { // the real size follows the header
+                    if(writeidx_ - nextmsg_idx_ < sizeof(LargeMsgHeader)) break;
+                    if(old_len < static_cast<int>(sizeof(LargeMsgHeader))) {
+                        Endian<Conf::ToLittleEndian>::ConvertInPlace(reinterpret_cast<LargeMsgHeader*>(header)->size);
+                    }
+                }
+                uint32_t msg_size = (header->MsgSize() + 7) & -8;
+                if(msg_size > Conf::TcpRecvBufMaxSize) {
                     Close("Msg size larger than recv buf max size", 0);
                     return nullptr;
                 }
-                if(writeidx_ - nextmsg_idx_ < static_cast<uint32_t>(msg_size)) break;
+                if(writeidx_ - nextmsg_idx_ < msg_size) break;
                 // we have got a full msg
                 if(header->msg_type == HeartbeatMsg::msg_type && readidx_ == nextmsg_idx_) {
                     readidx_ += msg_size;
@@ -173,14 +261,14 @@ public:
     // we have consumed the msg we got from Front()
     void Pop() {
         MsgHeader* header = reinterpret_cast<MsgHeader*>(&recvbuf_[readidx_]);
-        readidx_ += (header->size + 7) & -8;
+        readidx_ += (header->MsgSize() + 7) & -8;
         q_->MyAck()++;
     }
 
     // safe if IsClosed
     void SendHB(int64_t now) {
         now_ = now;
-        if(now_ - send_time_ < Conf::HeartBeatInverval) return;
+        if(now_ - send_time_ < hb_interval_) return;
         if(q_) {
             if(SendPending()) return;
             hbmsg_.ack_seq = Endian<Conf::ToLittleEndian>::Convert(q_->MyAck());
@@ -200,25 +288,40 @@ public:
         int blk_sz;
         const char* p = static_cast<const char*>(q_->GetSendable(blk_sz));
         if(blk_sz == 0) return false;
-        uint32_t size = blk_sz << 3;
+        // a large msg can hardly be sent out at once, so the send may stop in the middle of a block
+        p += send_partial_;
         do {
-            int sent = ::send(sockfd_, p, size, MSG_NOSIGNAL);
-            if(sent < 0) {
-                if(errno != EAGAIN || (size & 7)) {
-                    Close("Send error", errno);
-                    return false;
+            uint32_t size = (blk_sz << 3) - send_partial_;
+            do {
+                int sent;
+                if constexpr(ZeroCopy) {
+                    sent = SendZeroCopy(p, size);
                 }
-                else
-                    break;
+                else {
+                    sent = ::send(sockfd_, p, size, MSG_NOSIGNAL);
+                }
+                if(sent < 0) {
+                    if(errno != EAGAIN) {
+                        Close("Send error", errno);
+                        return false;
+                    }
+                    else
+                        break;
+                }
+                p += sent;
+                size -= sent;
+            } while(size > 0);
+            uint32_t sent_bytes = (blk_sz << 3) - size;
+            int sent_blk = sent_bytes >> 3;
+            send_partial_ = sent_bytes & 7;
+            if(sent_blk > 0) {
+                send_time_ = now_;
+                q_->Sendout(sent_blk);
             }
-            p += sent;
-            size -= sent;
-        } while(size > 0);
-        int sent_blk = blk_sz - (size >> 3);
-        if(sent_blk > 0) {
-            send_time_ = now_;
-            q_->Sendout(sent_blk);
-        }
+            if(size > 0) break;
+            // if send queue has wrapped around, the newer part is sendable now
+            p = static_cast<const char*>(q_->GetSendable(blk_sz));
+        } while(blk_sz > 0);
         return true;
     }
 
@@ -229,6 +332,11 @@ public:
     // not thread safe
     bool TryCloseFd() {
         if(sockfd_ < 0 && fd_to_close_ >= 0) {
+            if constexpr(ConfOpt<Conf>::TcpUseIoUring) {
+                // the poll request holds a reference of the socket, so close() alone won't disconnect
+                // shutdown() notifies the peer now and fires the poll request so the polling thread can remove it
+                if(uring_) ::shutdown(fd_to_close_, SHUT_RDWR);
+            }
             ::close(fd_to_close_);
             fd_to_close_ = -1;
             return true;
@@ -249,6 +357,117 @@ public:
         return q_ == nullptr;
     }
 
+    // wait for readability through uring instead of trying to read every time
+    // uring must be owned by the thread polling this connection
+    void SetIoUring(IoUring* uring) {
+        uring_ = uring;
+        readable_notify_ = uring != nullptr;
+    }
+
+    // remove the poll request from the current uring before the connection is handed over to another one, called by
+    // the thread owning the current uring once it no longer polls this connection, IsIoUringDetached() tells when the
+    // request has ended and this connection is no longer touched by that thread
+    // return false if it should be called again as the submission queue is full
+    bool DetachIoUring() {
+        // a closed socket's request may have ended unnoticed, it's left to be removed as stale after the handover
+        if(!poll_armed_ || IsClosed()) {
+            uring_detach_.store(UringDetached, std::memory_order_release);
+            return true;
+        }
+        io_uring_sqe* sqe = uring_->GetSqe();
+        if(!sqe) return false;
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = UringUserData();
+        // the request ends with a completion without IORING_CQE_F_MORE, whether removed or ended by itself
+        uring_detach_.store(UringDetaching, std::memory_order_relaxed);
+        return true;
+    }
+
+    [[nodiscard]] bool IsIoUringDetached() const {
+        return uring_detach_.load(std::memory_order_acquire) == UringDetached;
+    }
+
+    // hand an open connection over to the uring of another polling thread
+    // precondition: IsIoUringDetached(), or the current uring is no longer polled by any thread
+    void MoveIoUring(IoUring* uring) {
+        // completions of requests of the previous sockets may still come to the current uring, they only read the
+        // generation, which no longer matches
+        uring_gen_.store(uring_gen_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        uring_detach_.store(UringAttached, std::memory_order_relaxed);
+        poll_armed_ = false;
+        readable_ = true; // readiness notified to the current uring may have been missed
+        uring_ = uring;
+    }
+
+    // use interval for heartbeats instead of Conf::HeartBeatInverval, 0 to restore the default
+    // connection timeout is scaled by the same ratio, as peer sends heartbeats at the same interval
+    // interval is clamped by ClampHeartbeatInterval(), which the server also applies to what it replies to client
+    void SetHeartbeatInterval(int64_t interval) {
+        interval = ClampHeartbeatInterval(interval);
+        if(!interval) {
+            hb_interval_ = Conf::HeartBeatInverval;
+            timeout_ = Conf::ConnectionTimeout;
+            return;
+        }
+        hb_interval_ = interval;
+        timeout_ = static_cast<int64_t>(static_cast<__int128>(interval) * Conf::ConnectionTimeout /
+                                        Conf::HeartBeatInverval);
+    }
+
+    [[nodiscard]] int64_t GetHeartbeatInterval() const {
+        return hb_interval_;
+    }
+
+    // readability is notified through OnReadable() by the polling thread, e.g. from an epoll set
+    void SetReadableNotify() {
+        readable_notify_ = true;
+    }
+
+    // socket may have something to read since the last time we drained it
+    void OnReadable() {
+        readable_ = true;
+    }
+
+    // if Front() may return a msg without a new readability notification
+    [[nodiscard]] bool HasRecvPending() const {
+        return readable_ || readidx_ != nextmsg_idx_;
+    }
+
+    // the earliest time SendHB() or timeout check can have something to do
+    [[nodiscard]] int64_t NextTimerTime() const {
+        return std::min(send_time_ + hb_interval_, recv_time_ + timeout_ + 1);
+    }
+
+    // handle a completion from the io_uring set by SetIoUring(), called by the polling thread
+    static void OnIoUringCqe(IoUring& uring, const io_uring_cqe& cqe) {
+        if(cqe.user_data == 0) return; // result of a poll remove request
+        PTCPConnection* conn = reinterpret_cast<PTCPConnection*>(cqe.user_data & UringPtrMask);
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+        // the connection may be owned by another thread if the generation doesn't match, so nothing else is touched
+        bool stale = cqe.user_data != conn->UringUserData();
+        if(!stale && conn->uring_detach_.load(std::memory_order_relaxed) == UringDetaching) {
+            if(!more) {
+                conn->poll_armed_ = false;
+                conn->uring_detach_.store(UringDetached, std::memory_order_release);
+            }
+            return;
+        }
+        if(stale || conn->IsClosed()) {
+            // poll request on a closed socket, remove it so the socket can be released
+            if(more) {
+                if(io_uring_sqe* sqe = uring.GetSqe()) {
+                    sqe->opcode = IORING_OP_POLL_REMOVE;
+                    sqe->fd = -1;
+                    sqe->addr = cqe.user_data;
+                }
+            }
+            return;
+        }
+        if(!more) conn->poll_armed_ = false; // need to arm again
+        conn->readable_ = true;
+    }
+
 private:
     // thread safe
     // need to call TryCloseFd to really close it
@@ -259,7 +478,70 @@ private:
         close_errno_ = sys_errno;
     }
 
+    // convert a ptcp file of the layout before the capacity was stored in the queue: blocks of Conf::TcpQueueSize
+    // bytes followed by PTCPQ::LegacyIndexes, without wrap_idx if older than the ring layout, so unacked msgs survive
+    // the upgrade, as long as Conf::TcpQueueSize is what the file was written with
+    // the converted file is written aside and renamed over the old one, so a crash leaves either of them intact
+    // a file of any other size, or one starting with the magic of the current layout, is left to my_mmap_queue()
+    static bool ConvertLegacyFile(const char* file, const char** error_msg) {
+        constexpr size_t legacy_size = Conf::TcpQueueSize + sizeof(typename PTCPQ::LegacyIndexes);
+        int fd = open(file, O_RDONLY);
+        if(fd < 0) return true; // to be created
+        struct stat st;
+        if(fstat(fd, &st)) {
+            *error_msg = "fstat";
+            close(fd);
+            return false;
+        }
+        size_t size = st.st_size;
+        if(size != legacy_size && size != legacy_size - sizeof(uint32_t)) {
+            close(fd);
+            return true;
+        }
+        // blocks are read to where they're in the current layout, followed by the legacy indexes
+        size_t map_size = PTCPQ::MapSize(Conf::TcpQueueSize);
+        std::unique_ptr<char[]> buf(new char[map_size + sizeof(typename PTCPQ::LegacyIndexes)]());
+        ssize_t ret = pread(fd, buf.get() + sizeof(PTCPQ), size, 0);
+        close(fd);
+        if(ret != static_cast<ssize_t>(size)) {
+            *error_msg = "pread";
+            return false;
+        }
+        uint32_t magic;
+        memcpy(&magic, buf.get() + sizeof(PTCPQ), sizeof(magic));
+        if(magic == PTCPQ::Magic) return true;
+        typename PTCPQ::LegacyIndexes idx;
+        memcpy(&idx, buf.get() + map_size, sizeof(idx));
+        new(buf.get()) PTCPQ(Conf::TcpQueueSize, idx);
+
+        std::string tmp_file = std::string(file) + ".tmp";
+        fd = open(tmp_file.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        if(fd < 0) {
+            *error_msg = "open";
+            return false;
+        }
+        if(write(fd, buf.get(), map_size) != static_cast<ssize_t>(map_size) || fsync(fd)) {
+            *error_msg = "write";
+            close(fd);
+            unlink(tmp_file.c_str());
+            return false;
+        }
+        close(fd);
+        if(rename(tmp_file.c_str(), file)) {
+            *error_msg = "rename";
+            unlink(tmp_file.c_str());
+            return false;
+        }
+        return true;
+    }
+
     int DoRecv() {
+        if constexpr(WaitReadiness) {
+            if(readable_notify_ && !WaitReadable()) return 0;
+        }
+        if constexpr(ConfOpt<Conf>::TcpRecvMagicBuf) {
+            if(recvbuf_.get_deleter().mirror_size) return DoRecvMagic();
+        }
         char stackbuf[65536];
         if(readidx_ > 0 && readidx_ == writeidx_) {
             readidx_ = nextmsg_idx_ = writeidx_ = 0;
@@ -284,22 +566,10 @@ private:
             ret = ::readv(sockfd_, vec, 2);
         }
         if(ret <= 0) {
-            if(ret < 0) {
-                if(errno == EAGAIN) {
-                    if(now_ - recv_time_ > Conf::ConnectionTimeout) {
-                        Close("Timeout", 0);
-                    }
-                }
-                else {
-                    Close("Read error", errno);
-                }
-            }
-            else { // ret == 0;
-                Close("Remote close", 0);
-            }
+            OnRecvFail(ret);
             return 0;
         }
-        recv_time_ = now_;
+        OnRecvOk(ret, writable + extra_size);
         if(static_cast<uint32_t>(ret) <= writable) return ret;
         if(static_cast<uint32_t>(ret) <= writable + readidx_) { // need to memmove
             std::memmove(&recvbuf_[0], &recvbuf_[readidx_], recvbuf_size_ - readidx_);
@@ -311,7 +581,7 @@ private:
             uint32_t newbufsize =
                 std::min(Conf::TcpRecvBufMaxSize, std::max(recvbuf_size_ * 2, (writeidx_ - readidx_ + ret + 7) & -8));
             // std::cout << "expand: " << recvbuf_size_ << " -> " << newbufsize << std::endl;
-            auto new_buf = std::make_unique<char[]>(newbufsize);
+            RecvBuf new_buf(new char[newbufsize]);
             std::memcpy(&new_buf[0], &recvbuf_[readidx_], recvbuf_size_ - readidx_);
             std::memcpy(&new_buf[recvbuf_size_ - readidx_], stackbuf, ret - writable);
             recvbuf_size_ = newbufsize;
@@ -324,8 +594,141 @@ private:
         return ret;
     }
 
+    // recvbuf_ is mapped twice back to back so free space is always contiguous for the kernel to write
+    // and a msg wrapping around the end is contiguous for the user, no memmove or expansion is needed
+    // indexes are kept in [0, 2 * recvbuf_size_) and shifted back once readidx_ goes into the second mapping
+    int DoRecvMagic() {
+        if(readidx_ >= recvbuf_size_) {
+            readidx_ -= recvbuf_size_;
+            nextmsg_idx_ -= recvbuf_size_;
+            writeidx_ -= recvbuf_size_;
+        }
+        uint32_t writable = recvbuf_size_ - (writeidx_ - readidx_);
+        if(writable == 0) return 0;
+        int ret = ::read(sockfd_, &recvbuf_[writeidx_], writable);
+        if(ret <= 0) {
+            OnRecvFail(ret);
+            return 0;
+        }
+        OnRecvOk(ret, writable);
+        return ret;
+    }
+
+    void OnAck(uint32_t ack_seq) {
+        if constexpr(ZeroCopy) {
+            zc_ack_ = ack_seq;
+            if(zc_head_ != zc_tail_) {
+                q_->Ack(ack_seq, zc_pin_idx_[zc_head_ % ZeroCopyMaxInflight]);
+                return;
+            }
+        }
+        q_->Ack(ack_seq);
+    }
+
+    // send with MSG_ZEROCOPY if it's large enough, the queue blocks from p are pinned until completion
+    int SendZeroCopy(const char* p, uint32_t size) {
+        if(zc_enabled_ && size >= ConfOpt<Conf>::TcpZeroCopyMinSize && zc_tail_ - zc_head_ < ZeroCopyMaxInflight) {
+            int sent = ::send(sockfd_, p, size, MSG_NOSIGNAL | MSG_ZEROCOPY);
+            if(sent >= 0) {
+                // kernel numbers successful zero copy sends of a socket from 0, same as zc_tail_
+                zc_pin_idx_[zc_tail_ % ZeroCopyMaxInflight] = q_->BlkIdx(p);
+                zc_tail_++;
+                return sent;
+            }
+            if(errno != ENOBUFS) return sent;
+            // out of optmem for pinning pages, just copy
+        }
+        return ::send(sockfd_, p, size, MSG_NOSIGNAL);
+    }
+
+    // read completion notifications from socket error queue, and release the msgs acked but pinned
+    void ReapZeroCopy() {
+        uint32_t old_head = zc_head_;
+        while(zc_head_ != zc_tail_) {
+            char control[128];
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if(::recvmsg(sockfd_, &msg, MSG_ERRQUEUE) < 0) break; // no more completions for now
+            for(cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+                if(cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR) continue;
+                const sock_extended_err* serr = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(cm));
+                if(serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+                // completions are in ranges of [ee_info, ee_data], and may come out of order
+                for(uint32_t id = serr->ee_info; static_cast<int>(serr->ee_data - id) >= 0; id++) {
+                    if(id - zc_head_ < zc_tail_ - zc_head_) zc_done_ |= 1ULL << (id % ZeroCopyMaxInflight);
+                }
+                // kernel had to copy the data anyway(e.g. loopback), pinning only costs more
+                if(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) zc_enabled_ = false;
+            }
+            while(zc_head_ != zc_tail_ && (zc_done_ & (1ULL << (zc_head_ % ZeroCopyMaxInflight)))) {
+                zc_done_ &= ~(1ULL << (zc_head_ % ZeroCopyMaxInflight));
+                zc_head_++;
+            }
+        }
+        if(zc_head_ != old_head) OnAck(zc_ack_);
+    }
+
+    // return false if socket is not readable since the last time we drained it
+    bool WaitReadable() {
+        if(IsClosed()) return false;
+        if constexpr(ConfOpt<Conf>::TcpUseIoUring) {
+            if(!poll_armed_) {
+                if(io_uring_sqe* sqe = uring_->GetSqe()) {
+                    sqe->opcode = IORING_OP_POLL_ADD;
+                    sqe->fd = sockfd_;
+                    sqe->len = IORING_POLL_ADD_MULTI;
+                    uint32_t mask = POLLIN | POLLRDHUP;
+                    if constexpr(!is_little_endian) mask = (mask << 16) | (mask >> 16);
+                    sqe->poll32_events = mask;
+                    sqe->user_data = UringUserData();
+                    poll_armed_ = true;
+                }
+            }
+        }
+        if(readable_) return true;
+        if(now_ - recv_time_ > timeout_) {
+            Close("Timeout", 0);
+        }
+        return false;
+    }
+
+    // a user space pointer fits in the low 48 bits, and the high 16 bits tell which socket the request is for
+    static constexpr uint64_t UringPtrMask = (1ULL << 48) - 1;
+    uint64_t UringUserData() const {
+        return reinterpret_cast<uint64_t>(this) |
+               (static_cast<uint64_t>(uring_gen_.load(std::memory_order_relaxed)) << 48);
+    }
+
+    void OnRecvOk(int ret, uint32_t len) {
+        recv_time_ = now_;
+        if constexpr(WaitReadiness) {
+            // a short read means socket is drained, wait for the next poll event
+            if(static_cast<uint32_t>(ret) < len) readable_ = false;
+        }
+    }
+
+    void OnRecvFail(int ret) {
+        if(ret < 0) {
+            if(errno == EAGAIN) {
+                if constexpr(WaitReadiness) readable_ = false;
+                if(now_ - recv_time_ > timeout_) {
+                    Close("Timeout", 0);
+                }
+            }
+            else {
+                Close("Read error", errno);
+            }
+        }
+        else { // ret == 0;
+            Close("Remote close", 0);
+        }
+    }
+
 private:
-    using PTCPQ = PTCPQueue<Conf::TcpQueueSize, Conf::ToLittleEndian>;
+    using PTCPQ = PTCPQueue<Conf::ToLittleEndian>;
+    static_assert(PTCPQ::ValidCapacity(Conf::TcpQueueSize), "Conf::TcpQueueSize must be a multiple of 8");
     PTCPQ* q_ = nullptr; // may be mmaped to file
     int sockfd_ = -1;
     int fd_to_close_ = -1;
@@ -334,16 +737,50 @@ private:
     static_assert(Conf::TcpRecvBufMaxSize >= Conf::TcpRecvBufInitSize, "Conf::TcpRecvBufMaxSize too small");
     static_assert((Conf::TcpRecvBufInitSize % 8) == 0, "Conf::TcpRecvBufInitSize must be a multiple of 8");
     static_assert((Conf::TcpRecvBufMaxSize % 8) == 0, "Conf::TcpRecvBufMaxSize must be a multiple of 8");
-    std::unique_ptr<char[]> recvbuf_;
+    struct RecvBufDeleter
+    {
+        uint32_t mirror_size = 0; // non-zero if recv buf is a magic buffer from my_mmap_mirror
+        void operator()(char* p) const {
+            if(mirror_size)
+                my_munmap_mirror(p, mirror_size);
+            else
+                delete[] p;
+        }
+    };
+    using RecvBuf = std::unique_ptr<char[], RecvBufDeleter>;
+    RecvBuf recvbuf_;
     uint32_t recvbuf_size_ = 0;
     uint32_t writeidx_ = 0;
     uint32_t nextmsg_idx_ = 0;
     uint32_t readidx_ = 0;
+    uint32_t send_partial_ = 0; // bytes of the block at the send position already sent out
     int64_t recv_time_ = 0;
     int64_t send_time_ = 0;
+    int64_t hb_interval_ = Conf::HeartBeatInverval;
+    int64_t timeout_ = Conf::ConnectionTimeout;
     int64_t now_ = 0;
     MsgHeader hbmsg_;
 
     uint32_t last_my_ack_ = 0;
+
+    // handover to another uring, uring_detach_ is written by the thread owning the current uring until detached
+    static constexpr uint8_t UringAttached = 0;
+    static constexpr uint8_t UringDetaching = 1; // poll remove request submitted, waiting for the poll request to end
+    static constexpr uint8_t UringDetached = 2;
+    IoUring* uring_ = nullptr;
+    std::atomic<uint16_t> uring_gen_{0}; // read by the thread of the previous uring for stale completions
+    std::atomic<uint8_t> uring_detach_{UringAttached};
+    bool poll_armed_ = false;
+    bool readable_notify_ = false;
+    bool readable_ = true;
+
+    // in flight zero copy sends, the i-th send since Open pins queue blocks from zc_pin_idx_[i % ZeroCopyMaxInflight]
+    static constexpr uint32_t ZeroCopyMaxInflight = 64; // bits of zc_done_
+    bool zc_enabled_ = false;
+    uint32_t zc_head_ = 0;
+    uint32_t zc_tail_ = 0;
+    uint64_t zc_done_ = 0; // completed but not yet reaped in order
+    uint32_t zc_ack_ = 0;  // the latest ack from remote, which may be partly applied because of pins
+    uint32_t zc_pin_idx_[ZeroCopyMaxInflight];
 };
 } // namespace tcpshm
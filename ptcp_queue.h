@@ -1,48 +1,110 @@
 #pragma once
 #include "msg_header.h"
 #include <cstring>
+#include <cstddef>
 
 namespace tcpshm {
 
 // Simple single thread persist Queue that can be mmap-ed to a file
-template<uint32_t Bytes, bool ToLittleEndian>
+// Msgs are kept in a ring of blocks so Alloc never moves data: if a msg doesn't fit in the tail
+// it's put at the beginning and wrap_idx_ marks where the older msgs end
+// The capacity is set at runtime and stored in the queue, whose blocks follow the object in memory, see SPSCVarQueue
+template<bool ToLittleEndian>
 class PTCPQueue
 {
 public:
-    static_assert(Bytes % sizeof(MsgHeader) == 0, "Bytes must be multiple of 8");
-    static constexpr uint32_t BLK_CNT = Bytes / sizeof(MsgHeader);
+    // capacity in bytes must be a non-zero multiple of 8
+    static constexpr bool ValidCapacity(uint32_t capacity) {
+        return capacity && capacity % sizeof(MsgHeader) == 0;
+    }
+
+    static constexpr size_t MapSize(uint32_t capacity) {
+        return sizeof(PTCPQueue) + capacity;
+    }
+
+    explicit PTCPQueue(uint32_t capacity)
+        : capacity_(capacity)
+        , blk_cnt_(capacity / sizeof(MsgHeader)) {}
+
+    // the indexes of the layout before the capacity was stored in the queue, which followed the blocks of a capacity
+    // of the compile-time TcpQueueSize, wrap_idx is 0 in files older than the ring layout as it was missing
+    struct LegacyIndexes
+    {
+        uint32_t write_idx;
+        uint32_t read_idx;
+        uint32_t send_idx;
+        uint32_t read_seq_num;
+        uint32_t ack_seq_num;
+        uint32_t wrap_idx;
+    };
+
+    // a queue of the legacy indexes, whose blocks have been placed after the object
+    PTCPQueue(uint32_t capacity, const LegacyIndexes& idx)
+        : capacity_(capacity)
+        , blk_cnt_(capacity / sizeof(MsgHeader))
+        , write_idx_(idx.write_idx)
+        , read_idx_(idx.read_idx)
+        , send_idx_(idx.send_idx)
+        , read_seq_num_(idx.read_seq_num)
+        , ack_seq_num_(idx.ack_seq_num)
+        , wrap_idx_(idx.wrap_idx) {}
+
+    [[nodiscard]] uint32_t Capacity() const {
+        return capacity_;
+    }
 
-    MsgHeader* Alloc(uint16_t size) {
-        size += sizeof(MsgHeader);
+    // the same as those of SPSCVarQueue
+    static constexpr uint32_t Magic = 0x50435450; // "PTCP"
+    static constexpr uint32_t LayoutVersion = 1;
+
+    [[nodiscard]] const char* CheckLayout(size_t file_size) const {
+        if(magic_ != Magic || layout_version_ != LayoutVersion) return "Queue file of unknown layout";
+        if(!ValidCapacity(capacity_) || blk_cnt_ != capacity_ / sizeof(MsgHeader) || file_size < MapSize(capacity_)) {
+            return "Queue file corrupt";
+        }
+        return nullptr;
+    }
+
+    // a large msg is reserved contiguously just as a normal one, it'll never fit if larger than capacity
+    MsgHeader* Alloc(uint32_t size) {
+        if(size > capacity_) return nullptr;
+        size = MsgSizeOf(size);
         uint32_t blk_sz = (size + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
-        uint32_t avail_sz = BLK_CNT - write_idx_;
-        if(blk_sz > avail_sz) {
-            if(blk_sz > avail_sz + read_idx_) return nullptr;
-            std::memmove(blk_, blk_ + read_idx_, (write_idx_ - read_idx_) * sizeof(MsgHeader));
-            write_idx_ -= read_idx_;
-            send_idx_ -= read_idx_;
-            read_idx_ = 0;
+        // when wrapped we always keep write_idx_ < read_idx_, so a full queue can't be taken as empty
+        if(wrap_idx_) {
+            if(blk_sz >= read_idx_ - write_idx_) return nullptr;
         }
-        MsgHeader& header = blk_[write_idx_];
-        header.size = size;
+        else if(blk_sz > blk_cnt_ - write_idx_) {
+            if(blk_sz >= read_idx_) return nullptr;
+            if(send_idx_ == write_idx_) send_idx_ = 0;
+            wrap_idx_ = write_idx_;
+            write_idx_ = 0;
+        }
+        MsgHeader& header = blk()[write_idx_];
+        SetMsgSize(header, size);
         return &header;
     }
 
     void Push() {
-        MsgHeader& header = blk_[write_idx_];
-        uint32_t blk_sz = (header.size + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
+        MsgHeader& header = blk()[write_idx_];
+        uint32_t blk_sz = (header.MsgSize() + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
         header.ack_seq = ack_seq_num_;
-        header.ConvertByteOrder<ToLittleEndian>();
+        if(header.IsLarge())
+            reinterpret_cast<LargeMsgHeader&>(header).ConvertByteOrder<ToLittleEndian>();
+        else
+            header.ConvertByteOrder<ToLittleEndian>();
         write_idx_ += blk_sz;
     }
 
+    // sendable data is contiguous except when wrapped, in which case the older part is returned first
     [[nodiscard]] const void* GetSendable(int& blk_sz) const {
-        blk_sz = write_idx_ - send_idx_;
-        return blk_ + send_idx_;
+        blk_sz = (wrap_idx_ && send_idx_ >= read_idx_ ? wrap_idx_ : write_idx_) - send_idx_;
+        return blk() + send_idx_;
     }
 
     void Sendout(int blk_sz) {
         send_idx_ += blk_sz;
+        if(wrap_idx_ && send_idx_ == wrap_idx_) send_idx_ = 0;
     }
 
     void LoginAck(uint32_t ack_seq) {
@@ -51,20 +113,31 @@ public:
     }
 
     // the next seq_num peer side expect
-    void Ack(uint32_t ack_seq) {
+    // release stops before the msg containing block pin_idx, as it may still be referenced by a zero copy send
+    // and the caller should Ack again after the pin is cleared
+    void Ack(uint32_t ack_seq, uint32_t pin_idx = UINT32_MAX) {
         if(static_cast<int>(ack_seq - read_seq_num_) <= 0) return; // if ack_seq is not newer than read_seq_num_
         // we assume that a successfuly logined client will not attack us
         // so_seq will never go beyond the msg write_idx_ points to during a connection lifecycle
         do {
-            read_idx_ +=
-                (Endian<ToLittleEndian>::Convert(blk_[read_idx_].size) + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
+            uint32_t blk_sz = (WireMsgSize(read_idx_) + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
+            if(pin_idx - read_idx_ < blk_sz) return;
+            read_idx_ += blk_sz;
+            if(read_idx_ == wrap_idx_) {
+                read_idx_ = wrap_idx_ = 0;
+            }
             read_seq_num_++;
         } while(read_seq_num_ != ack_seq);
-        if(read_idx_ == write_idx_) {
+        if(read_idx_ == write_idx_ && wrap_idx_ == 0) {
             read_idx_ = write_idx_ = send_idx_ = 0;
         }
     }
 
+    // block index of an address returned by GetSendable()
+    [[nodiscard]] uint32_t BlkIdx(const void* p) const {
+        return (static_cast<const char*>(p) - reinterpret_cast<const char*>(blk())) / sizeof(MsgHeader);
+    }
+
     [[nodiscard]] uint32_t& MyAck() {
         return ack_seq_num_;
     }
@@ -72,27 +145,66 @@ public:
     [[nodiscard]] bool SanityCheckAndGetSeq(uint32_t* seq_start, uint32_t* seq_end) const {
         uint32_t end = read_seq_num_;
         uint32_t idx = read_idx_;
-        while(idx < write_idx_) {
-            MsgHeader header = blk_[idx];
-            header.ConvertByteOrder<ToLittleEndian>();
-            if(static_cast<int>(ack_seq_num_ - header.ack_seq) < 0) return false; // ack_seq in this msg is too new
-            idx += (header.size + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
-            end++;
+        if(wrap_idx_) {
+            if(wrap_idx_ > blk_cnt_ || read_idx_ >= wrap_idx_ || write_idx_ >= read_idx_) return false;
+            if(!CheckMsgs(idx, wrap_idx_, end)) return false;
+            idx = 0;
         }
-        if(idx != write_idx_) return false;
+        if(write_idx_ > blk_cnt_ || !CheckMsgs(idx, write_idx_, end)) return false;
         *seq_start = read_seq_num_;
         *seq_end = end;
         return true;
     }
 
 private:
-    MsgHeader blk_[BLK_CNT];
-    // invariant: read_idx_ <= send_idx_ <= write_idx_
+    // size of the msg at idx, which is stored in wire byte order
+    [[nodiscard]] uint32_t WireMsgSize(uint32_t idx) const {
+        uint16_t size = Endian<ToLittleEndian>::Convert(blk()[idx].size);
+        if(size != LargeMsgMark) return size;
+        return Endian<ToLittleEndian>::Convert(reinterpret_cast<const LargeMsgHeader*>(blk() + idx)->size);
+    }
+
+    // walk msgs in [idx, end_idx), counting seq_num
+    bool CheckMsgs(uint32_t& idx, uint32_t end_idx, uint32_t& seq) const {
+        while(idx < end_idx) {
+            MsgHeader header = blk()[idx];
+            header.ConvertByteOrder<ToLittleEndian>();
+            uint32_t size = header.size;
+            if(header.IsLarge()) {
+                if(end_idx - idx < 2) return false;
+                size = WireMsgSize(idx);
+                if(size <= UINT16_MAX || size > capacity_) return false;
+            }
+            if(size < sizeof(MsgHeader)) return false;
+            if(static_cast<int>(ack_seq_num_ - header.ack_seq) < 0) return false; // ack_seq in this msg is too new
+            idx += (size + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
+            seq++;
+        }
+        return idx == end_idx;
+    }
+
+    // blocks are right after the object
+    MsgHeader* blk() {
+        return reinterpret_cast<MsgHeader*>(this + 1);
+    }
+
+    [[nodiscard]] const MsgHeader* blk() const {
+        return reinterpret_cast<const MsgHeader*>(this + 1);
+    }
+
+    // the first members, so my_mmap_queue() can check an existing file, never changed after construction
+    uint32_t magic_ = Magic;
+    uint32_t layout_version_ = LayoutVersion;
+    uint32_t capacity_;
+    uint32_t blk_cnt_;
+    // invariant if not wrapped: read_idx_ <= send_idx_ <= write_idx_
+    // if wrapped: write_idx_ < read_idx_ < wrap_idx_, msgs are in [read_idx_, wrap_idx_) and [0, write_idx_)
     // where send_idx_ may point to the middle of a msg
     uint32_t write_idx_ = 0;
     uint32_t read_idx_ = 0;
     uint32_t send_idx_ = 0;
     uint32_t read_seq_num_ = 0; // the seq_num_ of msg read_idx_ points to
     uint32_t ack_seq_num_ = 0;
+    uint32_t wrap_idx_ = 0; // 0 if not wrapped
 };
 } // namespace tcpshm
@@ -0,0 +1,175 @@
+#pragma once
+#include "msg_header.h"
+#include <atomic>
+#include <cstdint>
+
+namespace tcpshm {
+
+// Broadcast msg queue with one writer and up to MaxReaders readers, each reading every msg in place with its own cursor
+// The writer never waits for readers: a reader lagging more than half of the queue is evicted when the writer needs
+// room, so the msg it's reading won't be overwritten until the writer goes another half of the queue
+// The queue is placed in shared memory, a reader claims a slot to publish its cursor for the writer
+template<uint32_t Bytes, uint32_t MaxReaders>
+class SPMCVarQueue
+{
+public:
+    static constexpr uint32_t BLK_CNT = Bytes / 64;
+    static_assert(BLK_CNT && !(BLK_CNT & (BLK_CNT - 1)), "BLK_CNT must be a power of 2");
+    static_assert(MaxReaders > 0, "MaxReaders must be positive");
+
+private:
+    struct Block // size of 64, same as cache line
+    {
+        alignas(64) MsgHeader header;
+    };
+
+    struct Slot
+    {
+        // lowest bit is set if active, and the rest is the generation bumped on each Attach()
+        alignas(64) std::atomic<uint32_t> state{0};
+        std::atomic<uint32_t> read_idx{0};
+    };
+
+public:
+    // for writer
+    // a msg can't be larger than half of the queue, return nullptr in that case
+    MsgHeader* Alloc(uint32_t size) {
+        if(size > Bytes / 2) return nullptr;
+        size = MsgSizeOf(size);
+        uint32_t blk_sz = (size + sizeof(Block) - 1) / sizeof(Block);
+        uint32_t padding_sz = BLK_CNT - (write_idx_ % BLK_CNT);
+        bool rewind = blk_sz > padding_sz;
+        // readers behind min_read_idx are slow
+        uint32_t min_read_idx = write_idx_ + blk_sz + (rewind ? padding_sz : 0) - BLK_CNT / 2;
+        if(static_cast<int>(min_read_cach_ - min_read_idx) < 0) EvictSlowReaders(min_read_idx);
+        if(rewind) {
+            blk_[write_idx_ % BLK_CNT].header.size = 0;
+            write_idx_ += padding_sz;
+        }
+        MsgHeader& header = blk_[write_idx_ % BLK_CNT].header;
+        SetMsgSize(header, size);
+        return &header;
+    }
+
+    // for writer, submit the last msg from Alloc() and publish it along with those submitted by PushMore()
+    void Push() {
+        PushMore();
+        write_idx_atom_.store(write_idx_, std::memory_order_release);
+    }
+
+    // for writer, submit the last msg from Alloc() but don't publish it to readers yet
+    void PushMore() {
+        write_idx_ += (blk_[write_idx_ % BLK_CNT].header.MsgSize() + sizeof(Block) - 1) / sizeof(Block);
+    }
+
+    // for writer, publish msgs submitted by PushMore()
+    void Flush() {
+        if(write_idx_atom_.load(std::memory_order_relaxed) != write_idx_) {
+            write_idx_atom_.store(write_idx_, std::memory_order_release);
+        }
+    }
+
+    // the reading side of a process, which starts from the newest msg on Attach()
+    // Single thread class
+    class Reader
+    {
+    public:
+        // claim a free slot of q, return false if all slots are taken
+        bool Attach(SPMCVarQueue* q) {
+            Detach();
+            uint32_t read_idx = q->write_idx_atom_.load(std::memory_order_acquire);
+            for(auto& slot : q->slots_) {
+                uint32_t state = slot.state.load(std::memory_order_relaxed);
+                if(state & 1) continue;
+                // set cursor before activating, so the writer never sees a stale one of the previous owner
+                slot.read_idx.store(read_idx, std::memory_order_relaxed);
+                // state + 3 is the next generation with active bit set
+                if(!slot.state.compare_exchange_strong(state, state + 3, std::memory_order_acq_rel)) continue;
+                // the writer may have gone far and refreshed min_read_cach_ before seeing this slot active, so start
+                // from a cursor loaded after activating, which is not behind min_read_cach_, see EvictSlowReaders()
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                read_idx = q->write_idx_atom_.load(std::memory_order_acquire);
+                slot.read_idx.store(read_idx, std::memory_order_release);
+                q_ = q;
+                slot_ = &slot;
+                state_ = state + 3;
+                read_idx_ = read_idx;
+                return true;
+            }
+            return false;
+        }
+
+        void Detach() {
+            if(!slot_) return;
+            uint32_t state = state_;
+            slot_->state.compare_exchange_strong(state, state_ - 1, std::memory_order_acq_rel);
+            q_ = nullptr;
+            slot_ = nullptr;
+        }
+
+        [[nodiscard]] bool IsAttached() const {
+            return slot_ != nullptr;
+        }
+
+        // if the writer has evicted this reader for being slow, it should Attach() again to go on
+        [[nodiscard]] bool IsEvicted() const {
+            return slot_ && slot_->state.load(std::memory_order_relaxed) != state_;
+        }
+
+        // return nullptr if no new msg, evicted or not attached
+        MsgHeader* Front() {
+            if(!slot_ || slot_->state.load(std::memory_order_relaxed) != state_) return nullptr;
+            uint32_t write_idx = q_->write_idx_atom_.load(std::memory_order_acquire);
+            if(read_idx_ == write_idx) return nullptr;
+            if(q_->blk_[read_idx_ % BLK_CNT].header.size == 0) { // rewind
+                read_idx_ += BLK_CNT - (read_idx_ % BLK_CNT);
+                if(read_idx_ == write_idx) return nullptr;
+            }
+            return &q_->blk_[read_idx_ % BLK_CNT].header;
+        }
+
+        // consume the msg got from Front()
+        // return false if evicted, in which case the msg might have been overwritten while being read
+        bool Pop() {
+            read_idx_ += (q_->blk_[read_idx_ % BLK_CNT].header.MsgSize() + sizeof(Block) - 1) / sizeof(Block);
+            slot_->read_idx.store(read_idx_, std::memory_order_release);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return !IsEvicted();
+        }
+
+    private:
+        SPMCVarQueue* q_ = nullptr;
+        Slot* slot_ = nullptr;
+        uint32_t state_ = 0;
+        uint32_t read_idx_ = 0;
+    };
+
+private:
+    // evict active readers behind min_read_idx and refresh min_read_cach_ from the others
+    void EvictSlowReaders(uint32_t min_read_idx) {
+        // a reader activating its slot after the fence below is not missed: it starts from write_idx_atom_ or later
+        min_read_cach_ = write_idx_atom_.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for(auto& slot : slots_) {
+            uint32_t state = slot.state.load(std::memory_order_acquire);
+            if(!(state & 1)) continue;
+            uint32_t read_idx = slot.read_idx.load(std::memory_order_acquire);
+            if(static_cast<int>(read_idx - min_read_idx) < 0) {
+                // clear the active bit only, so the reader sees a different state but its generation is kept
+                slot.state.compare_exchange_strong(state, state - 1, std::memory_order_acq_rel);
+                continue;
+            }
+            if(static_cast<int>(read_idx - min_read_cach_) < 0) min_read_cach_ = read_idx;
+        }
+        // the eviction must be visible before the blocks are overwritten
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    Block blk_[BLK_CNT];
+    Slot slots_[MaxReaders];
+
+    alignas(128) uint32_t write_idx_ = 0;
+    uint32_t min_read_cach_ = 0; // used only by writer, no active reader is behind it
+    alignas(128) std::atomic<uint32_t> write_idx_atom_{0};
+};
+} // namespace tcpshm
@@ -1,45 +1,98 @@
 #pragma once
 #include "msg_header.h"
+#include "futex.h"
 #include <atomic>
+#include <cstddef>
 #include <cstdint>
 
 namespace tcpshm {
 
-template<uint32_t Bytes>
+// if WakeReader is true, the reader can park on a futex when idle, see PrepareWait(), and publishing msgs checks
+// a flag set by a parked reader, which costs a full fence, otherwise it's a plain store
+// The capacity is set at runtime and stored in the queue, whose blocks follow the object in memory, so it should be
+// placed in a buffer of MapSize(capacity) bytes, usually mapped by my_mmap_queue()
+template<bool WakeReader = false>
 class SPSCVarQueue
 {
 public:
-  static constexpr uint32_t BLK_CNT = Bytes / 64;
-  static_assert(BLK_CNT && !(BLK_CNT & (BLK_CNT - 1)), "BLK_CNT must be a power of 2");
+  // capacity in bytes must be a power of 2 and no less than a block
+  static constexpr bool ValidCapacity(uint32_t capacity) {
+    return capacity >= 64 && !(capacity & (capacity - 1));
+  }
+
+  static constexpr size_t MapSize(uint32_t capacity) {
+    return sizeof(SPSCVarQueue) + capacity;
+  }
+
+  explicit SPSCVarQueue(uint32_t capacity)
+    : capacity(capacity)
+    , blk_mask(capacity / 64 - 1) {}
+
+  uint32_t Capacity() const {
+    return capacity;
+  }
+
+  // my_mmap_queue() tells an existing file of this queue by them, LayoutVersion is bumped on any change of the layout
+  static constexpr uint32_t Magic = 0x43505351; // "QSPC"
+  static constexpr uint32_t LayoutVersion = 1;
 
-  MsgHeader* Alloc(uint16_t size) {
-    size += sizeof(MsgHeader);
+  // check the header read from an existing file of file_size bytes, return nullptr if it's a valid queue
+  const char* CheckLayout(size_t file_size) const {
+    if (magic != Magic || layout_version != LayoutVersion) return "Queue file of unknown layout";
+    if (!ValidCapacity(capacity) || blk_mask != capacity / 64 - 1 || file_size < MapSize(capacity)) {
+      return "Queue file corrupt";
+    }
+    return nullptr;
+  }
+
+  // a large msg is reserved contiguously just as a normal one, it'll never fit if larger than capacity
+  MsgHeader* Alloc(uint32_t size) {
+    if (size > capacity) return nullptr;
+    size = MsgSizeOf(size);
     uint32_t blk_sz = (size + sizeof(Block) - 1) / sizeof(Block);
-    uint32_t padding_sz = BLK_CNT - (write_idx % BLK_CNT);
+    uint32_t padding_sz = blk_mask + 1 - (write_idx & blk_mask);
     bool rewind = blk_sz > padding_sz;
     // min_read_idx could be a negtive value which results in a large unsigned int
-    uint32_t min_read_idx = write_idx + blk_sz + (rewind ? padding_sz : 0) - BLK_CNT;
+    uint32_t min_read_idx = write_idx + blk_sz + (rewind ? padding_sz : 0) - (blk_mask + 1);
     if (static_cast<int>(read_idx_cach - min_read_idx) < 0) {
       read_idx_cach = read_idx.load(std::memory_order_acquire);
       if (static_cast<int>(read_idx_cach - min_read_idx) < 0) { // no enough space
+        // publish msgs submitted by PushMore(), or the reader would never make room if they fill the queue
+        Flush();
         return nullptr;
       }
     }
     if (rewind) {
-      blk[write_idx % BLK_CNT].header.size = 0;
+      blk()[write_idx & blk_mask].header.size = 0;
       std::atomic_thread_fence(std::memory_order_release);
       write_idx += padding_sz;
     }
-    MsgHeader& header = blk[write_idx % BLK_CNT].header;
-    header.size = size;
+    MsgHeader& header = blk()[write_idx & blk_mask].header;
+    SetMsgSize(header, size);
     return &header;
   }
 
   void Push() {
     std::atomic_thread_fence(std::memory_order_release);
-    uint32_t blk_sz = (blk[write_idx % BLK_CNT].header.size + sizeof(Block) - 1) / sizeof(Block);
-    write_idx += blk_sz;
+    PushMore();
     write_idx_atom.store(write_idx, std::memory_order_release);
+    if constexpr (WakeReader) WakeIfWaiting();
+  }
+
+  // submit the last msg from Alloc() but don't publish it to the reader yet
+  // must be followed by a Push() or Flush(), which publishes all submitted msgs at once, an Alloc() failing for lack
+  // of space publishes them too
+  void PushMore() {
+    uint32_t blk_sz = (blk()[write_idx & blk_mask].header.MsgSize() + sizeof(Block) - 1) / sizeof(Block);
+    write_idx += blk_sz;
+  }
+
+  // publish msgs submitted by PushMore()
+  void Flush() {
+    if(write_idx_atom.load(std::memory_order_relaxed) != write_idx) {
+      write_idx_atom.store(write_idx, std::memory_order_release);
+      if constexpr (WakeReader) WakeIfWaiting();
+    }
   }
 
   MsgHeader* Front() {
@@ -50,9 +103,9 @@ public:
       return nullptr;
     }
     
-    uint16_t size = blk[curr_read_idx % BLK_CNT].header.size;
+    uint16_t size = blk()[curr_read_idx & blk_mask].header.size;
     if(size == 0) { // rewind
-      curr_read_idx += BLK_CNT - (curr_read_idx % BLK_CNT);
+      curr_read_idx += blk_mask + 1 - (curr_read_idx & blk_mask);
       read_idx.store(curr_read_idx, std::memory_order_relaxed);
       
       if(curr_read_idx == curr_write_idx) {
@@ -60,27 +113,140 @@ public:
       }
     }
     
-    return &blk[curr_read_idx % BLK_CNT].header;
+    return &blk()[curr_read_idx & blk_mask].header;
   }
 
   void Pop() {
     uint32_t curr_read_idx = read_idx.load(std::memory_order_relaxed);
     std::atomic_thread_fence(std::memory_order_acquire);
     
-    uint32_t blk_sz = (blk[curr_read_idx % BLK_CNT].header.size + sizeof(Block) - 1) / sizeof(Block);
+    uint32_t blk_sz = (blk()[curr_read_idx & blk_mask].header.MsgSize() + sizeof(Block) - 1) / sizeof(Block);
     read_idx.store(curr_read_idx + blk_sz, std::memory_order_release);
   }
 
+  // iterator over a run of msgs snapshotted by FrontN(), rewind markers are skipped transparently
+  class Iterator
+  {
+  public:
+    Iterator() = default;
+
+    MsgHeader* operator*() const {
+      return &q_->blk()[idx_ & q_->blk_mask].header;
+    }
+
+    Iterator& operator++() {
+      idx_ += (q_->blk()[idx_ & q_->blk_mask].header.MsgSize() + sizeof(Block) - 1) / sizeof(Block);
+      SkipRewind();
+      return *this;
+    }
+
+    bool operator==(const Iterator& rhs) const {
+      return idx_ == rhs.idx_;
+    }
+
+  private:
+    friend class SPSCVarQueue;
+    Iterator(SPSCVarQueue* q, uint32_t idx, uint32_t end_idx)
+      : q_(q)
+      , idx_(idx)
+      , end_idx_(end_idx) {
+      SkipRewind();
+    }
+
+    void SkipRewind() {
+      if(idx_ != end_idx_ && q_->blk()[idx_ & q_->blk_mask].header.size == 0) {
+        idx_ += q_->blk_mask + 1 - (idx_ & q_->blk_mask);
+      }
+    }
+
+    SPSCVarQueue* q_ = nullptr;
+    uint32_t idx_ = 0;
+    uint32_t end_idx_ = 0;
+  };
+
+  class MsgRange
+  {
+  public:
+    Iterator begin() const {
+      return begin_;
+    }
+
+    Iterator end() const {
+      return end_;
+    }
+
+    [[nodiscard]] bool empty() const {
+      return begin_ == end_;
+    }
+
+  private:
+    friend class SPSCVarQueue;
+    MsgRange(Iterator b, Iterator e)
+      : begin_(b)
+      , end_(e) {}
+
+    Iterator begin_;
+    Iterator end_;
+  };
+
+  // get all msgs ready at the time of calling, write_idx_atom is loaded only once
+  MsgRange FrontN() {
+    uint32_t curr_write_idx = write_idx_atom.load(std::memory_order_acquire);
+    uint32_t curr_read_idx = read_idx.load(std::memory_order_relaxed);
+    return MsgRange(Iterator(this, curr_read_idx, curr_write_idx), Iterator(this, curr_write_idx, curr_write_idx));
+  }
+
+  // consume all msgs before pos, read_idx is published only once
+  void PopN(const Iterator& pos) {
+    read_idx.store(pos.idx_, std::memory_order_release);
+  }
+
+  // for reader, announce that it's going to park and set w to the futex word to wait on by FutexWaitv()
+  // return false if there're msgs ready, so it shouldn't park
+  // FinishWait() must be called after waking up or deciding not to park
+  bool PrepareWait(futex_waitv& w) {
+    static_assert(WakeReader, "writer doesn't wake reader");
+    reader_waiting.store(1, std::memory_order_relaxed);
+    // pairs with the fence in WakeIfWaiting(), so either reader sees the new msg or writer sees the flag
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint32_t curr_write_idx = write_idx_atom.load(std::memory_order_relaxed);
+    FutexInitWaiter(w, &write_idx_atom, curr_write_idx);
+    return curr_write_idx == read_idx.load(std::memory_order_relaxed);
+  }
+
+  void FinishWait() {
+    reader_waiting.store(0, std::memory_order_relaxed);
+  }
+
 private:
+  void WakeIfWaiting() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (reader_waiting.load(std::memory_order_relaxed)) FutexWake(&write_idx_atom);
+  }
+
   struct Block // size of 64, same as cache line
   {
     alignas(64) MsgHeader header;
-  } blk[BLK_CNT];
+  };
+
+  // blocks are right after the object
+  Block* blk() {
+    return reinterpret_cast<Block*>(this + 1);
+  }
+
+  // the first members, so my_mmap_queue() can check an existing file, never changed after construction
+  alignas(128) uint32_t magic = Magic;
+  uint32_t layout_version = LayoutVersion;
+  uint32_t capacity;
+  uint32_t blk_mask;
 
   alignas(128) uint32_t write_idx = 0;
   alignas(128) std::atomic<uint32_t> write_idx_atom{0};
   uint32_t read_idx_cach = 0; // used only by writing thread
 
   alignas(128) std::atomic<uint32_t> read_idx{0};
+
+  // set by reader while parked on write_idx_atom, in its own cache line as writer reads it on each publish
+  alignas(128) std::atomic<uint32_t> reader_waiting{0};
 };
 } // namespace tcpshm
@@ -7,6 +7,7 @@
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include "tcpshm_conn.h"
+#include "broadcast_conn.h"
 
 namespace tcpshm {
 
@@ -24,7 +25,7 @@ protected:
         strncpy(client_name_, client_name.c_str(), sizeof(client_name_) - 1);
         mkdir(ptcp_dir_.c_str(), 0755);
         client_name_[sizeof(client_name_) - 1] = 0;
-        conn_.init(ptcp_dir.c_str(), client_name_);
+        conn_.init(ptcp_dir_.c_str(), client_name_);
     }
 
     ~TcpShmClient() {
@@ -32,17 +33,29 @@ protected:
     }
 
     // connect and login to server, may block for a short time
+    // heartbeat_interval is requested to server for this connection, 0 for server's choice, a non-zero one requires
+    // server and client to use the same unit of timestamp, and Conf::ConnectionTimeout is scaled accordingly
     // return true if success
     bool Connect(bool use_shm,
                  const char* server_ipv4,
                  uint16_t server_port,
-                 const typename Conf::LoginUserData& login_user_data) {
+                 const typename Conf::LoginUserData& login_user_data,
+                 int64_t heartbeat_interval = 0) {
         if(!conn_.IsClosed()) {
             static_cast<Derived*>(this)->OnSystemError("already connected", 0);
             return false;
         }
         conn_.TryCloseFd();
         const char* error_msg = "Unknown error";
+        if constexpr(ConfOpt<Conf>::TcpUseIoUring) {
+            if(!uring_.IsOpen()) {
+                if(!uring_.Init(4, &error_msg)) {
+                    static_cast<Derived*>(this)->OnSystemError(error_msg, errno);
+                    return false;
+                }
+                conn_.SetIoUring(&uring_);
+            }
+        }
         if(!server_name_) {
             std::string last_server_name_file = std::string(ptcp_dir_) + "/" + client_name_ + ".lastserver";
             server_name_ = (char*)my_mmap<ServerName>(last_server_name_file.c_str(), false, &error_msg);
@@ -64,9 +77,11 @@ protected:
         login->last_server_name[sizeof(login->last_server_name) - 1] = '\0';
         login->use_shm = use_shm;
         login->client_seq_start = login->client_seq_end = 0;
+        login->heartbeat_interval = heartbeat_interval;
         login->user_data = login_user_data;
-        if(server_name_[0] &&
-           (!conn_.OpenFile(use_shm, &error_msg) ||
+        // shm queues are opened after login, as their size is decided by server
+        if(server_name_[0] && !use_shm &&
+           (!conn_.OpenFile(false, Conf::TcpQueueSize, &error_msg) ||
             !conn_.GetSeq(&sendbuf[0].ack_seq, &login->client_seq_start, &login->client_seq_end, &error_msg))) {
             static_cast<Derived*>(this)->OnSystemError(error_msg, errno);
             return false;
@@ -153,31 +168,46 @@ protected:
             return false;
         }
         login_rsp->server_name[sizeof(login_rsp->server_name) - 1] = 0;
+        // shm queues are created by server, while tcp send queue is sized by our own Conf
+        uint32_t queue_size = use_shm ? login_rsp->queue_size : Conf::TcpQueueSize;
         // check if server name has changed
         if(strncmp(server_name_, login_rsp->server_name, sizeof(ServerName)) != 0) {
             conn_.Release();
+            bcast_.Release();
             strncpy(server_name_, login_rsp->server_name, sizeof(ServerName));
             strncpy(conn_.GetRemoteName(), server_name_, sizeof(ServerName) - 1);
             conn_.GetRemoteName()[sizeof(ServerName) - 1] = '\0';
-            if(!conn_.OpenFile(use_shm, &error_msg)) {
+            if(!conn_.OpenFile(use_shm, queue_size, &error_msg)) {
                 static_cast<Derived*>(this)->OnSystemError(error_msg, errno);
                 close(fd);
                 return false;
             }
             conn_.Reset();
         }
+        else if(use_shm && !conn_.OpenFile(true, queue_size, &error_msg)) {
+            static_cast<Derived*>(this)->OnSystemError(error_msg, errno);
+            close(fd);
+            return false;
+        }
         fcntl(fd, F_SETFL, O_NONBLOCK);
         int64_t now = static_cast<Derived*>(this)->OnLoginSuccess(login_rsp);
 
+        conn_.SetHeartbeatInterval(login_rsp->heartbeat_interval);
         conn_.Open(fd, recvbuf[0].ack_seq, now);
         return true;
     }
 
     // we need to PollTcp even if using shm
     void PollTcp(int64_t now) {
+        if constexpr(ConfOpt<Conf>::TcpUseIoUring) {
+            uring_.ForEachCqe([this](const io_uring_cqe& cqe) { PTCPConnection<Conf>::OnIoUringCqe(uring_, cqe); });
+        }
         if(!conn_.IsClosed()) {
             MsgHeader* head = conn_.TcpFront(now);
-            if(head) static_cast<Derived*>(this)->OnServerMsg(head);
+            if(head) DispatchServerMsg(head);
+        }
+        if constexpr(ConfOpt<Conf>::TcpUseIoUring) {
+            uring_.Submit();
         }
         if(conn_.TryCloseFd()) {
             int sys_errno;
@@ -187,9 +217,59 @@ protected:
     }
 
     // only for using shm
+    // if ConfOpt<Conf>::ShmWaitSpinCount is non-zero, it blocks for up to ConfOpt<Conf>::ShmWaitTimeoutNs when idle
     void PollShm() {
         MsgHeader* head = conn_.ShmFront();
-        if(head) static_cast<Derived*>(this)->OnServerMsg(head);
+        if(head) {
+            shm_idle_cnt_ = 0;
+            DispatchServerMsg(head);
+        }
+        else
+            OnShmIdle();
+    }
+
+    // same as PollShm, but hand all ready msgs to the user in one run
+    // user should call conn.PopN() for the msgs consumed
+    void PollShmBatch() {
+        auto msgs = conn_.ShmFrontN();
+        if(!msgs.empty()) {
+            shm_idle_cnt_ = 0;
+            static_cast<Derived*>(this)->OnServerMsgs(msgs);
+        }
+        else
+            OnShmIdle();
+    }
+
+    // subscribe the broadcast queue of the server on the same host, only if ConfOpt<Conf>::BroadcastQueueSize > 0
+    // it must be called after Connect() succeeds, and msgs are received from now on by PollBroadcast()
+    // if server name changes on a later Connect(), the subscription is dropped and should be made again
+    // return true if success
+    bool SubscribeBroadcast() {
+        static_assert(ConfOpt<Conf>::BroadcastQueueSize > 0, "broadcast is not enabled");
+        const char* error_msg;
+        if(!server_name_ || !server_name_[0]) {
+            static_cast<Derived*>(this)->OnSystemError("not connected", 0);
+            return false;
+        }
+        if(!bcast_.OpenFile(server_name_, &error_msg) || !bcast_.Attach(&error_msg)) {
+            static_cast<Derived*>(this)->OnSystemError(error_msg, errno);
+            return false;
+        }
+        return true;
+    }
+
+    // only for broadcast subscriber, it can be polled by a thread other than the one polling the connection
+    void PollBroadcast() {
+        MsgHeader* head = bcast_.Front();
+        if(head) {
+            static_cast<Derived*>(this)->OnBroadcastMsg(head);
+            return;
+        }
+        if(bcast_.IsEvicted()) {
+            // user decides whether to drop the lost msgs and go on from the newest one, or to unsubscribe
+            const char* error_msg;
+            if(!static_cast<Derived*>(this)->OnBroadcastEvicted() || !bcast_.Attach(&error_msg)) bcast_.Release();
+        }
     }
 
     // stop the connection and close files
@@ -199,6 +279,8 @@ protected:
             server_name_ = nullptr;
         }
         conn_.Release();
+        bcast_.Release();
+        uring_.Release();
     }
 
     // get the connection reference which can be kept by user as long as TcpShmClient is not destructed
@@ -206,11 +288,39 @@ protected:
         return conn_;
     }
 
+    // get the broadcast connection reference, valid as long as TcpShmClient is not destructed
+    BroadcastConnection<Conf>& GetBroadcastConnection() {
+        return bcast_;
+    }
+
 private:
+    // spin for ShmWaitSpinCount empty polls, and then park on each empty poll until a msg comes
+    void OnShmIdle() {
+        if constexpr(ConfOpt<Conf>::ShmWaitSpinCount > 0) {
+            if(shm_idle_cnt_ < ConfOpt<Conf>::ShmWaitSpinCount) {
+                shm_idle_cnt_++;
+                return;
+            }
+            futex_waitv w;
+            if(conn_.ShmPrepareWait(w)) FutexWaitv(&w, 1, ConfOpt<Conf>::ShmWaitTimeoutNs);
+            conn_.ShmFinishWait();
+        }
+    }
+
+    void DispatchServerMsg(MsgHeader* head) {
+        if constexpr(requires { typename Derived::ServerMsgDispatcher; }) {
+            if(Derived::ServerMsgDispatcher::Dispatch(*static_cast<Derived*>(this), head)) return;
+        }
+        static_cast<Derived*>(this)->OnServerMsg(head);
+    }
+
     char client_name_[Conf::NameSize];
     using ServerName = std::array<char, Conf::NameSize>;
     char* server_name_ = nullptr;
     std::string ptcp_dir_;
     Connection conn_;
+    BroadcastConnection<Conf> bcast_; // used only if ConfOpt<Conf>::BroadcastQueueSize > 0
+    IoUring uring_; // used only if ConfOpt<Conf>::TcpUseIoUring
+    uint32_t shm_idle_cnt_ = 0; // used only if ConfOpt<Conf>::ShmWaitSpinCount > 0
 };
 } // namespace tcpshm
@@ -1,14 +1,31 @@
 #pragma once
 #include "ptcp_conn.h"
 #include "spsc_varq.h"
+#include "mpsc_varq.h"
 #include "mmap.h"
+#include "timer_wheel.h"
+#include "msg_dispatcher.h"
+#include "latency_stats.h"
+#include <new>
+#include <atomic>
+#include <type_traits>
 
 namespace tcpshm {
 
 template<class Conf>
 class TcpShmConnection
 {
+    static constexpr bool ShmWakeReader = ConfOpt<Conf>::ShmWaitSpinCount > 0;
+    using SHMQ = std::conditional_t<ConfOpt<Conf>::ShmMultiProducer,
+                                    MPSCVarQueue<ShmWakeReader>,
+                                    SPSCVarQueue<ShmWakeReader>>;
+    static_assert(SHMQ::ValidCapacity(Conf::ShmQueueSize), "Conf::ShmQueueSize must be a power of 2 and at least 64");
+
 public:
+    // a run of msgs from shm recv queue, see PollShmBatch() of client and server
+    using ShmMsgRange = typename SHMQ::MsgRange;
+    using ShmMsgIterator = typename SHMQ::Iterator;
+
     std::string GetPtcpFile() {
         return std::string(ptcp_dir_) + "/" + local_name_ + "_" + remote_name_ + ".ptcp";
     }
@@ -17,6 +34,11 @@ public:
         return ptcp_conn_.IsClosed();
     }
 
+    // if msgs go through shm, which is decided by the client on login
+    [[nodiscard]] bool UseShm() const {
+        return shm_sendq_ != nullptr;
+    }
+
     // Close this connection
     void Close() {
         ptcp_conn_.RequestClose();
@@ -38,48 +60,170 @@ public:
         return ptcp_dir_;
     }
 
+    // heartbeat interval negotiated in the login, measured in user provided timestamp
+    int64_t GetHeartbeatInterval() const {
+        return ptcp_conn_.GetHeartbeatInterval();
+    }
+
+    // latency stats of msgs received, only if ConfOpt<Conf>::LatencyStats, nullptr before the connection is opened
+    const ConnLatencyStats* GetLatencyStats() const {
+        return lat_stats_;
+    }
+
+    // for server, number of msgs from the client dispatched so far, a run of PollShmBatch() counts as one
+    // it's updated by the polling thread and can be read from any thread
+    uint64_t GetRecvCount() const {
+        return recv_cnt_.load(std::memory_order_relaxed);
+    }
+
+    // size of the send queue, which is the shm or ptcp queue size decided on login
+    // Conf::ShmQueueSize or Conf::TcpQueueSize is only the default, see OnNewConnection() of server
+    uint32_t GetQueueSize() {
+        if(shm_sendq_) return shm_sendq_->Capacity();
+        return ptcp_conn_.GetQueueSize();
+    }
+
     // allocate a msg of specified size in send queue
     // the returned address is guaranteed to be 8 byte aligned
     // return nullptr if no enough space
-    MsgHeader* Alloc(uint16_t size) {
-        if(shm_sendq_) return shm_sendq_->Alloc(size);
+    // if size exceeds UINT16_MAX - sizeof(MsgHeader) a large msg is allocated, whose body is at header->Body()
+    // instead of header + 1, see LargeMsgHeader
+    // for shm with ConfOpt<Conf>::ShmMultiProducer, Alloc() and Push(header) can be called from multiple threads,
+    // see MPSCVarQueue
+    MsgHeader* Alloc(uint32_t size) {
+        if(shm_sendq_) {
+            MsgHeader* header = shm_sendq_->Alloc(size);
+            if constexpr(ConfOpt<Conf>::LatencyStats && !ConfOpt<Conf>::ShmMultiProducer) last_alloc_ = header;
+            return header;
+        }
         return ptcp_conn_.Alloc(size);
     }
 
     // submit the last msg from Alloc() and send out
-    void Push() {
-        if(shm_sendq_)
+    // not available with ConfOpt<Conf>::ShmMultiProducer, as the last msg may be allocated by another thread
+    void Push()
+        requires(!ConfOpt<Conf>::ShmMultiProducer)
+    {
+        if(shm_sendq_) {
+            StampSend(last_alloc_);
             shm_sendq_->Push();
+        }
         else
             ptcp_conn_.Push();
     }
 
-    // for shm, same as Push
-    // for tcp, don't send out immediately as we have more to push
-    void PushMore() {
-        if(shm_sendq_)
-            shm_sendq_->Push();
+    // submit the msg of header from Alloc() and send out
+    // header must be from the last Alloc() unless for shm with ConfOpt<Conf>::ShmMultiProducer
+    void Push(MsgHeader* header) {
+        if(shm_sendq_) {
+            StampSend(header);
+            if constexpr(ConfOpt<Conf>::ShmMultiProducer)
+                shm_sendq_->Push(header);
+            else
+                shm_sendq_->Push();
+        }
+        else
+            ptcp_conn_.Push();
+    }
+
+    // submit the last msg from Alloc() but don't send out immediately as we have more to push
+    // for shm, msgs are not visible to remote until the next Push() or Flush(), or an Alloc() returning nullptr as the
+    // queue is full, which publishes them so the remote can make room, thus retrying Alloc() never waits forever
+    void PushMore()
+        requires(!ConfOpt<Conf>::ShmMultiProducer)
+    {
+        if(shm_sendq_) {
+            StampSend(last_alloc_);
+            shm_sendq_->PushMore();
+        }
         else
             ptcp_conn_.PushMore();
     }
 
+    // same as PushMore() for the msg of header from Alloc(), see Push(header)
+    void PushMore(MsgHeader* header) {
+        if(shm_sendq_) {
+            StampSend(header);
+            if constexpr(ConfOpt<Conf>::ShmMultiProducer)
+                shm_sendq_->PushMore(header);
+            else
+                shm_sendq_->PushMore();
+        }
+        else
+            ptcp_conn_.PushMore();
+    }
+
+    // send out msgs submitted by PushMore(), not needed if the last one is submitted by Push()
+    void Flush() {
+        if(shm_sendq_)
+            shm_sendq_->Flush();
+        else
+            ptcp_conn_.SendPending();
+    }
+
+    // typed version of Alloc() and Push(): allocate a msg of type T in send queue, set msg_type to T::msg_type,
+    // construct it in place with args, and submit and send it out
+    // for tcp, if host endian differs from Conf::ToLittleEndian, the msg is converted by
+    // T::ConvertByteOrder<Conf::ToLittleEndian>(), which T must define in that case
+    // return false if no enough space
+    template<class T, class... Args>
+    bool Emplace(Args&&... args) {
+        return SendMsg<T, true>([&](void* p) { ConstructMsg<T>(p, std::forward<Args>(args)...); });
+    }
+
+    // same as Emplace() but submit by PushMore()
+    template<class T, class... Args>
+    bool EmplaceMore(Args&&... args) {
+        return SendMsg<T, false>([&](void* p) { ConstructMsg<T>(p, std::forward<Args>(args)...); });
+    }
+
+    // same as Emplace(), but msg of type T is filled in place by fill(T&) instead of a constructor
+    // e.g. conn.Send<MyMsg>([&](MyMsg& msg) { msg.id = id; });
+    template<class T, class Fill>
+        requires std::invocable<Fill, T&>
+    bool Send(Fill&& fill) {
+        return SendMsg<T, true>([&](void* p) { fill(*new(p) T); });
+    }
+
+    // same as Send(fill) but submit by PushMore()
+    template<class T, class Fill>
+        requires std::invocable<Fill, T&>
+    bool SendMore(Fill&& fill) {
+        return SendMsg<T, false>([&](void* p) { fill(*new(p) T); });
+    }
+
+    // copy msg into send queue, same as Emplace<T>(msg)
+    template<class T>
+    bool Send(const T& msg) {
+        return Emplace<T>(msg);
+    }
+
     // get the next msg from recv queue, return nullptr if queue is empty
     // the returned address is guaranteed to be 8 byte aligned
+    // a large msg is also returned as a whole, whose size and body should be got by MsgSize() and Body()
     // if caller dont call Pop() later, it will get the same msg again
     // user dont need to call Front() directly as polling functions will do it
     MsgHeader* Front() {
-        if(shm_recvq_) return shm_recvq_->Front();
-        return ptcp_conn_.Front();
+        if(shm_recvq_) return OnFront(shm_recvq_->Front());
+        return OnFront(ptcp_conn_.Front());
     }
 
     // consume the msg we got from Front() or polling function
     void Pop() {
+        if constexpr(ConfOpt<Conf>::LatencyStats) lat_recorder_.OnPop();
         if(shm_recvq_)
             shm_recvq_->Pop();
         else
             ptcp_conn_.Pop();
     }
 
+    // for shm only, consume all msgs before pos in the range we got from batch polling function
+    // read index is published once for the whole run, e.g. conn.PopN(msgs.end()) consumes all of them
+    void PopN(const ShmMsgIterator& pos) {
+        if constexpr(ConfOpt<Conf>::LatencyStats) lat_recorder_.OnPopN(pos);
+        shm_recvq_->PopN(pos);
+    }
+
     typename Conf::ConnectionUserData user_data;
 
 private:
@@ -90,6 +234,7 @@ private:
 
     TcpShmConnection() {
         remote_name_[0] = 0;
+        timer_node_.owner = this;
     }
 
     void init(const char* ptcp_dir, const char* local_name) {
@@ -97,22 +242,44 @@ private:
         local_name_ = local_name;
     }
 
-    bool OpenFile(bool use_shm, const char** error_msg) {
+    static uint32_t DefaultQueueSize(bool use_shm) {
+        return use_shm ? Conf::ShmQueueSize : Conf::TcpQueueSize;
+    }
+
+    static bool ValidQueueSize(bool use_shm, uint32_t queue_size) {
+        return use_shm ? SHMQ::ValidCapacity(queue_size) : PTCPConnection<Conf>::ValidQueueSize(queue_size);
+    }
+
+    // queue_size is used only for queue files to be created, existing ones keep their sizes
+    bool OpenFile(bool use_shm, uint32_t queue_size, const char** error_msg) {
         if(use_shm) {
             std::string shm_send_file = std::string("/") + local_name_ + "_" + remote_name_ + ".shm";
             std::string shm_recv_file = std::string("/") + remote_name_ + "_" + local_name_ + ".shm";
             if(!shm_sendq_) {
-                shm_sendq_ = my_mmap<SHMQ>(shm_send_file.c_str(), true, error_msg);
+                shm_sendq_ = my_mmap_queue<SHMQ>(
+                    shm_send_file.c_str(), true, queue_size, error_msg, ConfOpt<Conf>::QueueMmapOpt);
                 if(!shm_sendq_) return false;
             }
             if(!shm_recvq_) {
-                shm_recvq_ = my_mmap<SHMQ>(shm_recv_file.c_str(), true, error_msg);
+                shm_recvq_ = my_mmap_queue<SHMQ>(
+                    shm_recv_file.c_str(), true, queue_size, error_msg, ConfOpt<Conf>::QueueMmapOpt);
                 if(!shm_recvq_) return false;
             }
-            return true;
+            return OpenLatencyStats(error_msg);
         }
         std::string ptcp_send_file = GetPtcpFile();
-        return ptcp_conn_.OpenFile(ptcp_send_file.c_str(), error_msg);
+        return ptcp_conn_.OpenFile(ptcp_send_file.c_str(), queue_size, error_msg) && OpenLatencyStats(error_msg);
+    }
+
+    bool OpenLatencyStats(const char** error_msg) {
+        if constexpr(ConfOpt<Conf>::LatencyStats) {
+            if(!lat_stats_) {
+                std::string stats_file = std::string("/") + local_name_ + "_" + remote_name_ + ".lat";
+                lat_stats_ = my_mmap<ConnLatencyStats>(stats_file.c_str(), true, error_msg);
+                if(!lat_stats_) return false;
+            }
+        }
+        return true;
     }
 
     bool GetSeq(uint32_t* local_ack_seq, uint32_t* local_seq_start, uint32_t* local_seq_end, const char** error_msg) {
@@ -127,8 +294,8 @@ private:
 
     void Reset() {
         if(shm_sendq_) {
-            new (shm_sendq_) SHMQ();
-            new (shm_recvq_) SHMQ();
+            new (shm_sendq_) SHMQ(shm_sendq_->Capacity());
+            new (shm_recvq_) SHMQ(shm_recvq_->Capacity());
         }
         else {
             ptcp_conn_.Reset();
@@ -138,17 +305,22 @@ private:
     void Release() {
         remote_name_[0] = 0;
         if(shm_sendq_) {
-            my_munmap<SHMQ>(shm_sendq_);
+            my_munmap_queue<SHMQ>(shm_sendq_, true, ConfOpt<Conf>::QueueMmapOpt);
             shm_sendq_ = nullptr;
         }
         if(shm_recvq_) {
-            my_munmap<SHMQ>(shm_recvq_);
+            my_munmap_queue<SHMQ>(shm_recvq_, true, ConfOpt<Conf>::QueueMmapOpt);
             shm_recvq_ = nullptr;
         }
+        if(lat_stats_) {
+            my_munmap<ConnLatencyStats>(lat_stats_, true);
+            lat_stats_ = nullptr;
+        }
         ptcp_conn_.Release();
     }
 
     void Open(int sock_fd, uint32_t remote_ack_seq, int64_t now) {
+        if constexpr(ConfOpt<Conf>::LatencyStats) lat_recorder_.Reset(lat_stats_, shm_recvq_ != nullptr);
         ptcp_conn_.Open(sock_fd, remote_ack_seq, now);
     }
 
@@ -156,13 +328,108 @@ private:
         return ptcp_conn_.TryCloseFd();
     }
 
+    void SetIoUring(IoUring* uring) {
+        ptcp_conn_.SetIoUring(uring);
+    }
+
+    void SetHeartbeatInterval(int64_t interval) {
+        ptcp_conn_.SetHeartbeatInterval(interval);
+    }
+
+    bool DetachIoUring() {
+        return ptcp_conn_.DetachIoUring();
+    }
+
+    bool IsIoUringDetached() const {
+        return ptcp_conn_.IsIoUringDetached();
+    }
+
+    void MoveIoUring(IoUring* uring) {
+        ptcp_conn_.MoveIoUring(uring);
+    }
+
+    void SetTcpReadableNotify() {
+        ptcp_conn_.SetReadableNotify();
+    }
+
+    void OnTcpReadable() {
+        ptcp_conn_.OnReadable();
+    }
+
+    bool TcpHasRecvPending() {
+        return ptcp_conn_.HasRecvPending();
+    }
+
+    int64_t TcpNextTimerTime() {
+        return ptcp_conn_.NextTimerTime();
+    }
+
     MsgHeader* TcpFront(int64_t now) {
         ptcp_conn_.SendHB(now);
-        return ptcp_conn_.Front(); // for shm, we need to recv HB and Front() always return nullptr
+        return OnFront(ptcp_conn_.Front()); // for shm, we need to recv HB and Front() always return nullptr
+    }
+
+    // called by the polling thread of server, the only writer of recv_cnt_, so it needs no atomic increment
+    void CountRecv() {
+        recv_cnt_.store(recv_cnt_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
     }
 
     MsgHeader* ShmFront() {
-        return shm_recvq_->Front();
+        return OnFront(shm_recvq_->Front());
+    }
+
+    ShmMsgRange ShmFrontN() {
+        ShmMsgRange msgs = shm_recvq_->FrontN();
+        if constexpr(ConfOpt<Conf>::LatencyStats) lat_recorder_.OnFrontN(msgs.begin(), msgs.end());
+        return msgs;
+    }
+
+    MsgHeader* OnFront(MsgHeader* header) {
+        if constexpr(ConfOpt<Conf>::LatencyStats) lat_recorder_.OnFront(header);
+        return header;
+    }
+
+    void StampSend(MsgHeader* header) {
+        if constexpr(ConfOpt<Conf>::LatencyStats) header->ack_seq = LatencyStamp();
+    }
+
+    bool ShmPrepareWait(futex_waitv& w) {
+        return shm_recvq_->PrepareWait(w);
+    }
+
+    void ShmFinishWait() {
+        shm_recvq_->FinishWait();
+    }
+
+    template<class T, class... Args>
+    static void ConstructMsg(void* p, Args&&... args) {
+        if constexpr(std::is_constructible_v<T, Args...>)
+            new(p) T(std::forward<Args>(args)...);
+        else // aggregate
+            new(p) T{std::forward<Args>(args)...};
+    }
+
+    template<class T, bool Submit, class Construct>
+    bool SendMsg(Construct&& construct) {
+        static_assert(std::is_trivially_copyable_v<T>, "msg type must be trivially copyable");
+        static_assert(alignof(T) <= sizeof(MsgHeader), "msg type can't be aligned more than 8 bytes");
+        constexpr bool need_convert = Conf::ToLittleEndian != is_little_endian;
+        static_assert(!need_convert || requires(T& msg) { msg.template ConvertByteOrder<Conf::ToLittleEndian>(); },
+                      "msg type must define template<bool ToLittle> void ConvertByteOrder() as host endian differs "
+                      "from Conf::ToLittleEndian");
+        MsgHeader* header = Alloc(sizeof(T));
+        if(!header) return false;
+        header->msg_type = T::msg_type;
+        void* body = header->Body();
+        construct(body);
+        if constexpr(need_convert) {
+            if(!shm_sendq_) static_cast<T*>(body)->template ConvertByteOrder<Conf::ToLittleEndian>();
+        }
+        if constexpr(Submit)
+            Push(header);
+        else
+            PushMore(header);
+        return true;
     }
 
 private:
@@ -170,8 +437,32 @@ private:
     char remote_name_[Conf::NameSize];
     const char* ptcp_dir_ = nullptr;
     PTCPConnection<Conf> ptcp_conn_;
-    using SHMQ = SPSCVarQueue<Conf::ShmQueueSize>;
     alignas(64) SHMQ* shm_sendq_ = nullptr;
     SHMQ* shm_recvq_ = nullptr;
+
+    // used by server only if ConfOpt<Conf>::TcpUseEpoll, owned by the thread polling the tcp group
+    TimerNode<TcpShmConnection> timer_node_;
+    bool tcp_active_ = false; // if in the list of conns to be serviced in each poll
+    // set by ctl thread when it's added to the epoll set, and cleared by the polling thread once it's seen closed and
+    // out of the active list and timer wheel, until then ctl thread doesn't take it offline
+    std::atomic<bool> tcp_epoll_held_{false};
+
+    // used by server only if ConfOpt<Conf>::ConnectionReleaseTimeout > 0, when it was disconnected
+    int64_t offline_time_ = 0;
+    // used by server, the version of live conns first published without it after it went offline
+    uint32_t offline_ver_ = 0;
+    uint32_t slot_ = 0; // used by server, index in conns of its group
+    int grpid_ = -1; // used by server, the group it's in, or -1 while being migrated to another group
+
+    // used by server, written only by the polling thread
+    std::atomic<uint64_t> recv_cnt_{0};
+    // used by server for rebalancing, recv_cnt_ at the last sampling and the increase since the one before
+    uint64_t sampled_cnt_ = 0;
+    uint64_t recv_rate_ = 0;
+
+    // used only if ConfOpt<Conf>::LatencyStats
+    ConnLatencyStats* lat_stats_ = nullptr;
+    MsgHeader* last_alloc_ = nullptr; // the last msg from Alloc() of shm, to be stamped in Push() with no header
+    LatencyRecorder<ShmMsgIterator> lat_recorder_;
 };
 } // namespace tcpshm
@@ -5,7 +5,17 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <new>
+#include <bit>
+#include <span>
+#include <atomic>
+#include <algorithm>
+#include <limits>
+#include <memory>
 #include "tcpshm_conn.h"
+#include "broadcast_conn.h"
 
 namespace tcpshm {
 
@@ -23,103 +33,118 @@ protected:
         strncpy(server_name_, server_name.c_str(), sizeof(server_name_) - 1);
         server_name_[sizeof(server_name_) - 1] = 0;
         mkdir(ptcp_dir_.c_str(), 0755);
-        for(auto& conn : conn_pool_) {
-            conn.init(ptcp_dir.c_str(), server_name_);
-        }
-        int cnt = 0;
-        for(auto& grp : shm_grps_) {
-            for(auto& conn : grp.conns) {
-                conn = conn_pool_ + cnt++;
-            }
-        }
-        for(auto& grp : tcp_grps_) {
-            for(auto& conn : grp.conns) {
-                conn = conn_pool_ + cnt++;
-            }
-        }
+        for(auto& ctl : ctl_shards_) new(ctl.inbox_buf) InboxQ(InboxSize);
     }
 
     ~TcpShmServer() {
         Stop();
+        for(auto& grp : shm_grps_) {
+            for(uint32_t i = 0; i < grp.alloc_cnt; i++) delete grp.conns[i];
+            grp.UnmapNameFile();
+        }
+        for(auto& grp : tcp_grps_) {
+            for(uint32_t i = 0; i < grp.alloc_cnt; i++) delete grp.conns[i];
+            grp.UnmapNameFile();
+        }
     }
 
     // start the server
     // return true if success
     bool Start(const char* listen_ipv4, uint16_t listen_port) {
-        if(listenfd_ >= 0) {
+        if(ctl_shards_[0].listenfd >= 0) {
             static_cast<Derived*>(this)->OnSystemError("already started", 0);
             return false;
         }
 
-        if((listenfd_ = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-            static_cast<Derived*>(this)->OnSystemError("socket", errno);
-            return false;
-        }
-
-        fcntl(listenfd_, F_SETFL, O_NONBLOCK);
-        int yes = 1;
-        if(setsockopt(listenfd_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) {
-            static_cast<Derived*>(this)->OnSystemError("setsockopt SO_REUSEADDR", errno);
-            return false;
-        }
-        if(Conf::TcpNoDelay && setsockopt(listenfd_, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) < 0) {
-            static_cast<Derived*>(this)->OnSystemError("setsockopt TCP_NODELAY", errno);
-            return false;
-        }
-
         struct sockaddr_in local_addr;
         local_addr.sin_family = AF_INET;
         inet_pton(AF_INET, listen_ipv4, &(local_addr.sin_addr));
         local_addr.sin_port = htons(listen_port);
         bzero(&(local_addr.sin_zero), 8);
-        if(bind(listenfd_, (struct sockaddr*)&local_addr, sizeof(local_addr)) < 0) {
-            static_cast<Derived*>(this)->OnSystemError("bind", errno);
-            return false;
+        for(auto& ctl : ctl_shards_) {
+            if(!Listen(ctl, local_addr)) return false;
         }
-        if(listen(listenfd_, 5) < 0) {
-            static_cast<Derived*>(this)->OnSystemError("listen", errno);
-            return false;
+        if constexpr(ConfOpt<Conf>::TcpUseIoUring) {
+            for(uint32_t i = 0; i < Conf::MaxTcpGrps; i++) {
+                const char* error_msg;
+                // each live conn has at most one poll request and one poll remove request in flight
+                if(!tcp_urings_[i].IsOpen() && !tcp_urings_[i].Init(2 * Conf::MaxTcpConnsPerGrp, &error_msg)) {
+                    static_cast<Derived*>(this)->OnSystemError(error_msg, errno);
+                    return false;
+                }
+            }
+        }
+        if constexpr(ConfOpt<Conf>::TcpUseEpoll) {
+            for(uint32_t i = 0; i < Conf::MaxTcpGrps; i++) {
+                int& epfd = tcp_epolls_[i].epfd;
+                if(epfd < 0 && (epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+                    static_cast<Derived*>(this)->OnSystemError("epoll_create1", errno);
+                    return false;
+                }
+                if constexpr(ConfOpt<Conf>::TcpEpollBusyPollUs > 0) {
+                    EpollParams params = {ConfOpt<Conf>::TcpEpollBusyPollUs, 8, 0, 0}; // 8 is the default budget of kernel
+                    if(ioctl(epfd, EpollSetParams, &params) < 0) {
+                        static_cast<Derived*>(this)->OnSystemError("ioctl EPIOCSPARAMS", errno);
+                        return false;
+                    }
+                }
+            }
+        }
+        if constexpr(ConfOpt<Conf>::BroadcastQueueSize > 0) {
+            const char* error_msg;
+            if(!bcast_.OpenFile(server_name_, &error_msg)) {
+                static_cast<Derived*>(this)->OnSystemError(error_msg, errno);
+                return false;
+            }
+        }
+        for(uint32_t i = 0; i < Conf::MaxShmGrps; i++) {
+            if(!RestoreGroup(shm_grps_[i], "shm", i, -1)) return false;
+        }
+        for(uint32_t i = 0; i < Conf::MaxTcpGrps; i++) {
+            if(!RestoreGroup(tcp_grps_[i], "tcp", i, i)) return false;
         }
         return true;
     }
 
     // poll control for handling new connections and keep shm connections alive
-    void PollCtl(int64_t now) {
-        // every poll we accept only one connection
-        if(avail_idx_ != Conf::MaxNewConnections) {
-            NewConn& conn = new_conns_[avail_idx_];
-            socklen_t addr_len = sizeof(conn.addr);
-            conn.fd = accept(listenfd_, (struct sockaddr*)&(conn.addr), &addr_len);
-            // we ignore errors from accept as most errno should be treated like EAGAIN
-            if(conn.fd >= 0) {
-                fcntl(conn.fd, F_SETFL, O_NONBLOCK);
-                conn.time = now;
-                avail_idx_ = Conf::MaxNewConnections;
-            }
-        }
-        // visit all new connections, trying to read LoginMsg
-        for(int i = 0; i < Conf::MaxNewConnections; i++) {
-            NewConn& conn = new_conns_[i];
-            if(conn.fd < 0) {
-                avail_idx_ = i;
-                continue;
-            }
-            int ret = ::recv(conn.fd, conn.recvbuf, sizeof(conn.recvbuf), 0);
-            if(ret < 0 && errno == EAGAIN && now - conn.time <= Conf::NewConnectionTimeout) {
-                continue;
-            }
-            if(ret == sizeof(conn.recvbuf)) {
-                conn.recvbuf[0].template ConvertByteOrder<Conf::ToLittleEndian>();
-                if(conn.recvbuf[0].size == sizeof(MsgHeader) + sizeof(LoginMsg) &&
-                   conn.recvbuf[0].msg_type == LoginMsg::msg_type) {
-                    // looks like a valid login msg
-                    LoginMsg* login = (LoginMsg*)(conn.recvbuf + 1);
-                    login->ConvertByteOrder();
-                    if(login->use_shm) {
-                        HandleLogin(now, conn, shm_grps_);
-                    }
-                    else {
-                        HandleLogin(now, conn, tcp_grps_);
+    // with ConfOpt<Conf>::CtlShards > 1, each shard should be polled by its own thread, it accepts connections from
+    // its listener and serves groups of grpid % CtlShards == shard, a login for a group of another shard is handed
+    // over to that shard after OnNewConnection()
+    void PollCtl(int64_t now, uint32_t shard = 0) {
+        CtlShard& ctl = ctl_shards_[shard];
+        // accept only if the listening socket is ready, and read only new connections ready or just accepted
+        epoll_event events[Conf::MaxNewConnections + 1];
+        int n = epoll_wait(ctl.new_epfd, events, Conf::MaxNewConnections + 1, 0);
+        for(int i = 0; i < n; i++) {
+            uint32_t idx = events[i].data.u32;
+            if(idx == Conf::MaxNewConnections)
+                AcceptNewConns(now, ctl);
+            else
+                ctl.new_conns[idx].readable = true;
+        }
+        // visit all new connections, trying to read LoginMsg from ready ones and closing timeout ones
+        for(uint32_t i = 0; i < Conf::MaxNewConnections; i++) {
+            NewConn& conn = ctl.new_conns[i];
+            if(conn.fd < 0) continue;
+            if(!conn.readable) {
+                if(now - conn.time <= Conf::NewConnectionTimeout) continue;
+            }
+            else {
+                int ret = ::recv(conn.fd, conn.recvbuf, sizeof(conn.recvbuf), 0);
+                if(ret < 0 && errno == EAGAIN && now - conn.time <= Conf::NewConnectionTimeout) {
+                    conn.readable = false;
+                    continue;
+                }
+                if(ret == sizeof(conn.recvbuf)) {
+                    // the socket is either handed over to a connection or closed below
+                    epoll_ctl(ctl.new_epfd, EPOLL_CTL_DEL, conn.fd, nullptr);
+                    conn.recvbuf[0].template ConvertByteOrder<Conf::ToLittleEndian>();
+                    if(conn.recvbuf[0].size == sizeof(MsgHeader) + sizeof(LoginMsg) &&
+                       conn.recvbuf[0].msg_type == LoginMsg::msg_type) {
+                        // looks like a valid login msg
+                        LoginMsg* login = (LoginMsg*)(conn.recvbuf + 1);
+                        login->ConvertByteOrder();
+                        HandleLogin(now, shard, conn);
                     }
                 }
             }
@@ -128,92 +153,253 @@ protected:
                 ::close(conn.fd);
                 conn.fd = -1;
             }
-            avail_idx_ = i;
         }
 
-        for(auto& grp : shm_grps_) {
-            for(int i = 0; i < grp.live_cnt;) {
+        if constexpr(ConfOpt<Conf>::CtlShards > 1) {
+            // logins handed over by other shards
+            while(MsgHeader* header = ctl.Inbox()->Front()) {
+                LoginHandoff& handoff = *static_cast<LoginHandoff*>(header->Body());
+                LoginToGroup(now, handoff.conn, handoff.sendbuf, handoff.grpid);
+                if(handoff.conn.fd >= 0) ::close(handoff.conn.fd);
+                ctl.Inbox()->Pop();
+            }
+        }
+
+        if(ctl.migration_cnt) FinishMigrations(ctl, false);
+        if constexpr(ConfOpt<Conf>::RebalanceInterval > 0) {
+            if(now - ctl.rebalance_time >= ConfOpt<Conf>::RebalanceInterval) {
+                ctl.rebalance_time = now;
+                Rebalance(shard, shm_grps_, Conf::MaxShmGrps);
+                if constexpr(!ConfOpt<Conf>::TcpUseEpoll) Rebalance(shard, tcp_grps_, Conf::MaxTcpGrps);
+            }
+        }
+
+        for(uint32_t g = shard; g < Conf::MaxShmGrps; g += ConfOpt<Conf>::CtlShards) {
+            auto& grp = shm_grps_[g];
+            for(uint32_t i = 0; i < grp.live_cnt;) {
                 Connection& conn = *grp.conns[i];
                 conn.TcpFront(now); // poll heartbeats, ignore return
                 if(conn.TryCloseFd()) {
                     int sys_errno;
                     const char* reason = conn.GetCloseReason(&sys_errno);
                     static_cast<Derived*>(this)->OnClientDisconnected(conn, reason, sys_errno);
-                    std::swap(grp.conns[i], grp.conns[--grp.live_cnt]);
+                    conn.offline_time_ = now;
+                    grp.TakeOffline(i);
                 }
                 else {
                     i++;
                 }
             }
+            if(grp.dirty) grp.Publish();
+            if constexpr(ConfOpt<Conf>::ConnectionReleaseTimeout > 0) ReleaseOfflineConns(now, grp);
         }
 
-        for(auto& grp : tcp_grps_) {
-            for(int i = 0; i < grp.live_cnt;) {
+        for(uint32_t g = shard; g < Conf::MaxTcpGrps; g += ConfOpt<Conf>::CtlShards) {
+            auto& grp = tcp_grps_[g];
+            for(uint32_t i = 0; i < grp.live_cnt;) {
                 Connection& conn = *grp.conns[i];
+                if constexpr(ConfOpt<Conf>::TcpUseEpoll) {
+                    // a conn closed by another thread may still be in the timer wheel of the polling thread
+                    if(conn.tcp_epoll_held_.load(std::memory_order_acquire)) {
+                        i++;
+                        continue;
+                    }
+                }
                 if(conn.TryCloseFd()) {
                     int sys_errno;
                     const char* reason = conn.GetCloseReason(&sys_errno);
                     static_cast<Derived*>(this)->OnClientDisconnected(conn, reason, sys_errno);
-                    std::swap(grp.conns[i], grp.conns[--grp.live_cnt]);
+                    conn.offline_time_ = now;
+                    grp.TakeOffline(i);
                 }
                 else {
                     i++;
                 }
             }
+            if(grp.dirty) grp.Publish();
+            if constexpr(ConfOpt<Conf>::TcpUseEpoll) {
+                if(!grp.dirty) RegisterEpoll(g, grp);
+            }
+            if constexpr(ConfOpt<Conf>::ConnectionReleaseTimeout > 0) ReleaseOfflineConns(now, grp);
         }
     }
 
     // poll tcp for serving tcp connections
     void PollTcp(int64_t now, int grpid) {
         auto& grp = tcp_grps_[grpid];
-        // force read grp.live_cnt from memory, it could have been changed by Ctl thread
-        asm volatile("" : "=m"(grp.live_cnt) : :);
-        for(int i = 0; i < grp.live_cnt; i++) {
-            // it's possible that grp.conns is being swapped by Ctl thread
-            // so some live conn could be missed, some closed one could be visited
-            // even some conn could be visited twice, but those're all fine
-            Connection& conn = *grp.conns[i];
-            MsgHeader* head = conn.TcpFront(now);
-            if(head) static_cast<Derived*>(this)->OnClientMsg(conn, head);
+        // conns of this poll, it acknowledges the latest version from ctl thread even if not used by epoll
+        auto conns = grp.PollConns();
+        if constexpr(ConfOpt<Conf>::TcpUseEpoll) {
+            grp.CountPoll(PollTcpEpoll(now, grpid));
+            return;
         }
+        grp.CountPoll(ServeTcp(now, grpid, conns, 1));
     }
 
     // poll shm for serving shm connections
+    // if ConfOpt<Conf>::ShmWaitSpinCount is non-zero, it blocks for up to ConfOpt<Conf>::ShmWaitTimeoutNs when the
+    // whole group is idle, a connection newly added to the group is polled after it returns
     void PollShm(int grpid) {
         auto& grp = shm_grps_[grpid];
-        asm volatile("" : "=m"(grp.live_cnt) : :);
-        for(int i = 0; i < grp.live_cnt; i++) {
-            Connection& conn = *grp.conns[i];
-            MsgHeader* head = conn.ShmFront();
-            if(head) static_cast<Derived*>(this)->OnClientMsg(conn, head);
+        auto conns = grp.PollConns();
+        bool got = ServeShm(conns, 1);
+        grp.CountPoll(got);
+        OnShmPolled(grp, conns, got);
+    }
+
+    // same as PollShm, but hand all ready msgs of a connection to the user in one run
+    // user should call conn.PopN() for the msgs consumed
+    void PollShmBatch(int grpid) {
+        auto& grp = shm_grps_[grpid];
+        auto conns = grp.PollConns();
+        bool got = false;
+        for(Connection* conn : conns) {
+            auto msgs = conn->ShmFrontN();
+            if(!msgs.empty()) {
+                got = true;
+                conn->CountRecv();
+                static_cast<Derived*>(this)->OnClientMsgs(*conn, msgs);
+            }
+        }
+        grp.CountPoll(got);
+        OnShmPolled(grp, conns, got);
+    }
+
+    // poll control of all shards, all shm groups and all tcp groups, for serving the whole server by one thread
+    // each connection gets up to ConfOpt<Conf>::PollAllMsgBudget msgs dispatched in a call, so a busy one can't starve
+    // the others, and if ConfOpt<Conf>::PollAllSpinCount is non-zero, after that many calls in a row finding no msg,
+    // each call sleeps from 1us doubling up to ConfOpt<Conf>::PollAllMaxSleepNs until a msg comes
+    // it must not be used together with other polling functions
+    void PollAll(int64_t now) {
+        for(uint32_t shard = 0; shard < ConfOpt<Conf>::CtlShards; shard++) PollCtl(now, shard);
+        bool got = false;
+        for(uint32_t g = 0; g < Conf::MaxShmGrps; g++) {
+            auto& grp = shm_grps_[g];
+            bool grp_got = ServeShm(grp.PollConns(), ConfOpt<Conf>::PollAllMsgBudget);
+            grp.CountPoll(grp_got);
+            got |= grp_got;
+        }
+        for(uint32_t g = 0; g < Conf::MaxTcpGrps; g++) {
+            auto& grp = tcp_grps_[g];
+            auto conns = grp.PollConns();
+            bool grp_got;
+            if constexpr(ConfOpt<Conf>::TcpUseEpoll)
+                grp_got = PollTcpEpoll(now, g);
+            else
+                grp_got = ServeTcp(now, g, conns, ConfOpt<Conf>::PollAllMsgBudget);
+            grp.CountPoll(grp_got);
+            got |= grp_got;
+        }
+        if constexpr(ConfOpt<Conf>::PollAllSpinCount > 0) {
+            constexpr uint32_t spin = ConfOpt<Conf>::PollAllSpinCount;
+            if(got) {
+                poll_all_idle_cnt_ = 0;
+                return;
+            }
+            if(poll_all_idle_cnt_ < spin) {
+                poll_all_idle_cnt_++;
+                return;
+            }
+            uint32_t shift = poll_all_idle_cnt_ - spin;
+            int64_t ns = std::min(int64_t(1000) << shift, ConfOpt<Conf>::PollAllMaxSleepNs);
+            if(ns < ConfOpt<Conf>::PollAllMaxSleepNs && shift < 40) poll_all_idle_cnt_++;
+            timespec ts{ns / 1000000000, ns % 1000000000};
+            nanosleep(&ts, nullptr);
         }
     }
 
+    // get the broadcast connection for writing msgs to all subscribed local clients
+    // only if ConfOpt<Conf>::BroadcastQueueSize > 0 and the server is started
+    // it has a single writer, so only one thread should write to it
+    BroadcastConnection<Conf>& GetBroadcastConnection() {
+        return bcast_;
+    }
+
+    struct GroupStats
+    {
+        uint32_t conn_cnt;       // live conns, not including the ones migrating in
+        uint64_t poll_cnt;       // polls of the group since started
+        uint64_t busy_poll_cnt;  // polls that got any msg, busy_poll_cnt / poll_cnt over a period is the load of
+                                 // the polling thread
+    };
+
+    // called by ctl thread of the shard owning the group
+    GroupStats GetGroupStats(bool use_shm, int grpid) {
+        if(use_shm) return shm_grps_[grpid].Stats();
+        return tcp_grps_[grpid].Stats();
+    }
+
+    // move a live connection to another group of the same kind owned by the same shard, so it's served by the
+    // thread polling that group, called by the ctl thread of the shard, e.g. in OnClientLogon() or after PollCtl()
+    // it leaves the current group at once, and joins the new one in a later PollCtl() after the thread polling the
+    // current group has started a poll without it, so it's never polled by two threads, and no msg is lost or
+    // reordered as they wait in its queue or socket meanwhile
+    // OnClientMigrated(Connection& conn, int from_grpid, int to_grpid) is called by ctl thread on joining if Derived
+    // defines it, a client reconnecting later should be assigned to the new group by OnNewConnection()
+    // tcp connections can't be migrated with ConfOpt<Conf>::TcpUseEpoll
+    // return false if it can't be migrated now, e.g. the new group is full or being migrated already
+    bool MigrateConnection(Connection& conn, int grpid) {
+        if(conn.UseShm()) return MigrateConnection(conn, grpid, shm_grps_, Conf::MaxShmGrps);
+        if constexpr(ConfOpt<Conf>::TcpUseEpoll)
+            return false;
+        else
+            return MigrateConnection(conn, grpid, tcp_grps_, Conf::MaxTcpGrps);
+    }
+
     void Stop() {
-        if(listenfd_ < 0) {
+        if(ctl_shards_[0].listenfd < 0) {
             return;
         }
-        ::close(listenfd_);
-        listenfd_ = -1;
-        for(int i = 0; i < Conf::MaxNewConnections; i++) {
-            int& fd = new_conns_[i].fd;
-            if(fd >= 0) {
-                ::close(fd);
-                fd = -1;
+        bcast_.Release();
+        for(auto& ctl : ctl_shards_) {
+            if(ctl.listenfd >= 0) {
+                ::close(ctl.listenfd);
+                ctl.listenfd = -1;
+            }
+            for(uint32_t i = 0; i < Conf::MaxNewConnections; i++) {
+                int& fd = ctl.new_conns[i].fd;
+                if(fd >= 0) {
+                    ::close(fd);
+                    fd = -1;
+                }
             }
+            if(ctl.new_epfd >= 0) {
+                ::close(ctl.new_epfd);
+                ctl.new_epfd = -1;
+            }
+            while(MsgHeader* header = ctl.Inbox()->Front()) {
+                ::close(static_cast<LoginHandoff*>(header->Body())->conn.fd);
+                ctl.Inbox()->Pop();
+            }
+            FinishMigrations(ctl, true);
         }
-        avail_idx_ = 0;
+        // connection objects are kept for reuse after restart
         for(auto& grp : shm_grps_) {
-            for(auto& conn : grp.conns) {
-                conn->Release();
-            }
-            grp.live_cnt = 0;
+            grp.ReleaseAll();
         }
         for(auto& grp : tcp_grps_) {
-            for(auto& conn : grp.conns) {
-                conn->Release();
+            grp.ReleaseAll();
+        }
+        for(auto& uring : tcp_urings_) {
+            uring.Release();
+        }
+        for(auto& dq : tcp_uring_detaches_) {
+            dq.write_cnt.store(0, std::memory_order_relaxed);
+            dq.read_cnt = 0;
+        }
+        for(uint32_t i = 0; i < Conf::MaxTcpGrps; i++) {
+            TcpEpollGroup& ep = tcp_epolls_[i];
+            if(ep.epfd >= 0) {
+                ::close(ep.epfd);
+                ep.epfd = -1;
             }
-            grp.live_cnt = 0;
+            for(uint32_t j = 0; j < tcp_grps_[i].alloc_cnt; j++) {
+                Connection* conn = tcp_grps_[i].conns[j];
+                ep.timers.Cancel(&conn->timer_node_);
+                conn->tcp_active_ = false;
+                conn->tcp_epoll_held_.store(false, std::memory_order_relaxed);
+            }
+            ep.active_cnt = 0;
         }
     }
 
@@ -222,28 +408,674 @@ private:
     {
         int64_t time;
         int fd = -1;
+        bool readable = false; // if it may have something to read
         struct sockaddr_in addr;
         MsgHeader recvbuf[1 + (sizeof(LoginMsg) + 7) / 8];
     };
+    using LoginRspBuf = MsgHeader[1 + (sizeof(LoginRspMsg) + 7) / 8];
+
+    // a login accepted by a shard for a group of another shard, after OnNewConnection() was called
+    struct LoginHandoff
+    {
+        NewConn conn;
+        LoginRspBuf sendbuf;
+        int grpid;
+    };
+    // each shard may have all its new connections handed over to the same shard at once
+    using InboxQ = MPSCVarQueue<false>;
+    static constexpr uint32_t InboxSize =
+        std::bit_ceil((sizeof(MsgHeader) + sizeof(LoginHandoff) + 63) / 64 * 64 * Conf::MaxNewConnections *
+                      ConfOpt<Conf>::CtlShards);
+    static_assert(ConfOpt<Conf>::CtlShards > 0, "CtlShards must be positive");
+    static_assert(ConfOpt<Conf>::PollAllMsgBudget > 0, "PollAllMsgBudget must be positive");
+
+    // a connection left its old group and waits for the polling thread of it before joining the new one
+    struct Migration
+    {
+        Connection* conn;
+        int from;
+        int to;
+        bool uring_detaching; // if TcpUseIoUring, its poll request is being removed from the uring of the old group
+    };
+    static constexpr uint32_t MaxPendingMigrations = 16;
+
+    // tcp conns leaving a group to be detached from its uring, from the ctl thread to the polling thread of the group
+    // a conn stays pending migration until detached, so no more than MaxPendingMigrations are unread
+    struct UringDetachQ
+    {
+        Connection* conns[MaxPendingMigrations];
+        std::atomic<uint32_t> write_cnt{0};
+        uint32_t read_cnt = 0; // owned by the polling thread
+    };
+
+    // state of a control shard, owned by the thread calling PollCtl() of it
+    struct CtlShard
+    {
+        int listenfd = -1;
+        int new_epfd = -1; // epoll set of listenfd and new_conns
+        NewConn new_conns[Conf::MaxNewConnections];
+        Migration migrations[MaxPendingMigrations];
+        uint32_t migration_cnt = 0;
+        int64_t rebalance_time = 0; // the last time of rebalancing if ConfOpt<Conf>::RebalanceInterval > 0
+        // logins handed over by other shards, written by them
+        alignas(128) char inbox_buf[InboxQ::MapSize(InboxSize)];
+
+        InboxQ* Inbox() {
+            return reinterpret_cast<InboxQ*>(inbox_buf);
+        }
+    };
+
+    bool Listen(CtlShard& ctl, const struct sockaddr_in& local_addr) {
+        if((ctl.listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            static_cast<Derived*>(this)->OnSystemError("socket", errno);
+            return false;
+        }
+
+        fcntl(ctl.listenfd, F_SETFL, O_NONBLOCK);
+        int yes = 1;
+        if(setsockopt(ctl.listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) {
+            static_cast<Derived*>(this)->OnSystemError("setsockopt SO_REUSEADDR", errno);
+            return false;
+        }
+        // kernel spreads incoming connections over the listeners of all shards
+        if(ConfOpt<Conf>::CtlShards > 1 && setsockopt(ctl.listenfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0) {
+            static_cast<Derived*>(this)->OnSystemError("setsockopt SO_REUSEPORT", errno);
+            return false;
+        }
+        if(Conf::TcpNoDelay && setsockopt(ctl.listenfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) < 0) {
+            static_cast<Derived*>(this)->OnSystemError("setsockopt TCP_NODELAY", errno);
+            return false;
+        }
+        if(bind(ctl.listenfd, (struct sockaddr*)&local_addr, sizeof(local_addr)) < 0) {
+            static_cast<Derived*>(this)->OnSystemError("bind", errno);
+            return false;
+        }
+        if(listen(ctl.listenfd, ConfOpt<Conf>::ListenBacklog) < 0) {
+            static_cast<Derived*>(this)->OnSystemError("listen", errno);
+            return false;
+        }
+        // new connections and the listening socket are level triggered, polled by PollCtl() without blocking
+        if((ctl.new_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+            static_cast<Derived*>(this)->OnSystemError("epoll_create1", errno);
+            return false;
+        }
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = Conf::MaxNewConnections;
+        if(epoll_ctl(ctl.new_epfd, EPOLL_CTL_ADD, ctl.listenfd, &ev) < 0) {
+            static_cast<Derived*>(this)->OnSystemError("epoll_ctl", errno);
+            return false;
+        }
+        return true;
+    }
+
+    // accept into free slots of new_conns_ until the backlog is drained, all slots are taken or
+    // ConfOpt<Conf>::MaxAcceptPerPoll is reached
+    void AcceptNewConns(int64_t now, CtlShard& ctl) {
+        uint32_t cnt = 0;
+        for(uint32_t i = 0; i < Conf::MaxNewConnections; i++) {
+            NewConn& conn = ctl.new_conns[i];
+            if(conn.fd >= 0) continue;
+            if(ConfOpt<Conf>::MaxAcceptPerPoll && cnt == ConfOpt<Conf>::MaxAcceptPerPoll) return;
+            socklen_t addr_len = sizeof(conn.addr);
+            // we ignore errors from accept as most errno should be treated like EAGAIN
+            conn.fd = accept4(ctl.listenfd, (struct sockaddr*)&(conn.addr), &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if(conn.fd < 0) return;
+            epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.u32 = i;
+            if(epoll_ctl(ctl.new_epfd, EPOLL_CTL_ADD, conn.fd, &ev) < 0) {
+                ::close(conn.fd);
+                conn.fd = -1;
+                return;
+            }
+            // login msg usually comes along with the connection, so try reading it at once
+            conn.readable = true;
+            conn.time = now;
+            cnt++;
+        }
+    }
+
+    // conns[0, live_cnt) are live, conns[live_cnt, alloc_cnt) are offline ones kept for their clients
+    // or released ones in free[0, free_cnt) to be reused, and the rest are not allocated yet
+    // a connection is allocated on the first login it's needed and stays in its group until the server is destroyed
+    // or it's migrated to another group with the slot taken by the last allocated one
+    // named conns are indexed by remote name in an open addressing table with linear probing, kept at most half full
+    // conns is owned by ctl thread, and the polling thread reads a copy of live conns published by Publish()
     template<uint32_t N>
     struct alignas(64) ConnectionGroup
     {
-        uint32_t live_cnt = 0;
+        // live conns for the polling thread, double buffered: a poll uses snaps[pub_ver & 1] of pub_ver it loads
+        std::atomic<uint32_t> pub_ver{0};
+        uint32_t snap_cnt[2] = {0, 0};
+        Connection* snaps[2][N];
+
+        // written by the polling thread
+        alignas(64) std::atomic<uint32_t> seen_ver{0}; // the latest pub_ver a poll has started with
+        uint32_t idle_cnt = 0; // empty polls in a row, used only by shm groups if ConfOpt<Conf>::ShmWaitSpinCount > 0
+        std::atomic<uint64_t> poll_cnt{0};
+        std::atomic<uint64_t> busy_poll_cnt{0};
+
+        // below are used only by ctl thread
+        alignas(64) uint32_t live_cnt = 0;
+        uint32_t alloc_cnt = 0;
+        bool dirty = false; // if live conns changed since the last Publish()
+        uint32_t incoming = 0; // conns migrating in, each with an allocation slot reserved
+        uint64_t sampled_poll_cnt = 0; // poll_cnt at the last rebalance sampling
         Connection* conns[N];
+        // used only by tcp groups if ConfOpt<Conf>::TcpUseEpoll, conns logged on but not yet registered with the
+        // epoll set of the polling thread, which is done after they're published
+        struct EpollJoin
+        {
+            Connection* conn;
+            int fd;
+        };
+        uint32_t join_cnt = 0;
+        EpollJoin joins[N];
+
+        static constexpr uint32_t IndexSize = std::bit_ceil(2 * N);
+        struct IndexEntry
+        {
+            Connection* conn = nullptr;
+            uint32_t hash = 0;
+        };
+        IndexEntry index[IndexSize];
+        uint32_t free_cnt = 0;
+        Connection* free[N];
+
+        // names of the index persisted in ptcp_dir, names[i] is the remote name of index[i] or empty, so the conns of
+        // known clients are restored by Start() and keep their places in the group across restarts
+        struct NameFile
+        {
+            static constexpr uint32_t Magic = 0x58444e49;
+            static constexpr uint32_t LayoutVersion = 1;
+            uint32_t magic;
+            uint32_t layout_version;
+            uint32_t index_size;
+            uint32_t name_size;
+            char names[IndexSize][Conf::NameSize];
+        };
+        NameFile* name_file = nullptr;
+
+        void UnmapNameFile() {
+            if(name_file) my_munmap<NameFile>(name_file);
+            name_file = nullptr;
+        }
+
+        static uint32_t Hash(const char* name) {
+            uint32_t h = 2166136261u; // FNV-1a
+            for(uint32_t i = 0; i < Conf::NameSize && name[i]; i++) h = (h ^ (uint8_t)name[i]) * 16777619u;
+            return h;
+        }
+
+        Connection* Find(const char* name) {
+            uint32_t hash = Hash(name);
+            for(uint32_t i = hash & (IndexSize - 1); index[i].conn; i = (i + 1) & (IndexSize - 1)) {
+                if(index[i].hash == hash && strncmp(index[i].conn->GetRemoteName(), name, Conf::NameSize) == 0) {
+                    return index[i].conn;
+                }
+            }
+            return nullptr;
+        }
+
+        // precondition: remote name of conn is set and not in the index
+        void Insert(Connection* conn) {
+            uint32_t hash = Hash(conn->GetRemoteName());
+            uint32_t i = hash & (IndexSize - 1);
+            while(index[i].conn) i = (i + 1) & (IndexSize - 1);
+            index[i].conn = conn;
+            index[i].hash = hash;
+            if(name_file) memcpy(name_file->names[i], conn->GetRemoteName(), Conf::NameSize);
+        }
+
+        // precondition: conn is in the index
+        void Erase(Connection* conn) {
+            uint32_t i = Hash(conn->GetRemoteName()) & (IndexSize - 1);
+            while(index[i].conn != conn) i = (i + 1) & (IndexSize - 1);
+            // shift back the following entries which can't be reached from their home slots once i is emptied
+            for(uint32_t j = (i + 1) & (IndexSize - 1); index[j].conn; j = (j + 1) & (IndexSize - 1)) {
+                uint32_t home = index[j].hash & (IndexSize - 1);
+                if(((j - home) & (IndexSize - 1)) >= ((j - i) & (IndexSize - 1))) {
+                    index[i] = index[j];
+                    if(name_file) memcpy(name_file->names[i], name_file->names[j], Conf::NameSize);
+                    i = j;
+                }
+            }
+            index[i] = IndexEntry();
+            if(name_file) memset(name_file->names[i], 0, Conf::NameSize);
+        }
+
+        void Swap(uint32_t i, uint32_t j) {
+            std::swap(conns[i], conns[j]);
+            conns[i]->slot_ = i;
+            conns[j]->slot_ = j;
+            dirty = true;
+        }
+
+        // for the polling thread, get live conns as of the latest Publish(), each visited exactly once by a poll
+        // the acknowledgement in seen_ver tells ctl thread that the other buffer is no longer being read
+        std::span<Connection* const> PollConns() {
+            uint32_t ver = pub_ver.load(std::memory_order_acquire);
+            if(seen_ver.load(std::memory_order_relaxed) != ver) seen_ver.store(ver, std::memory_order_release);
+            return {snaps[ver & 1], snap_cnt[ver & 1]};
+        }
+
+        // for the polling thread, the only writer of the counters
+        void CountPoll(bool got) {
+            poll_cnt.store(poll_cnt.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            if(got) busy_poll_cnt.store(busy_poll_cnt.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        GroupStats Stats() {
+            return {live_cnt, poll_cnt.load(std::memory_order_relaxed), busy_poll_cnt.load(std::memory_order_relaxed)};
+        }
+
+        // for ctl thread, copy live conns to the buffer not in use, it's deferred to a later PollCtl() if the polling
+        // thread hasn't started a poll with the current version, as it may still be reading the other buffer
+        void Publish() {
+            uint32_t ver = pub_ver.load(std::memory_order_relaxed);
+            if(seen_ver.load(std::memory_order_acquire) != ver) return;
+            ver++;
+            std::copy(conns, conns + live_cnt, snaps[ver & 1]);
+            snap_cnt[ver & 1] = live_cnt;
+            pub_ver.store(ver, std::memory_order_release);
+            dirty = false;
+        }
+
+        // for ctl thread, if the polling thread can't visit any offline conn
+        bool Quiescent() {
+            return !dirty && seen_ver.load(std::memory_order_acquire) == pub_ver.load(std::memory_order_relaxed);
+        }
+
+        // for ctl thread, take the live conn at i offline, it's in no version of live conns published from now on
+        void TakeOffline(uint32_t i) {
+            conns[i]->offline_ver_ = pub_ver.load(std::memory_order_relaxed) + 1;
+            Swap(i, --live_cnt);
+        }
+
+        // for ctl thread, if the polling thread can't visit an offline conn, as a poll has started with a version
+        // published after it went offline
+        bool Left(const Connection* conn) {
+            return static_cast<int32_t>(seen_ver.load(std::memory_order_acquire) - conn->offline_ver_) >= 0;
+        }
+
+        // precondition: conn is offline and named
+        void Release(Connection* conn) {
+            Erase(conn);
+            conn->Release();
+            conn->offline_ver_ = 0;
+            free[free_cnt++] = conn;
+        }
+
+        void ReleaseAll() {
+            for(uint32_t i = 0; i < alloc_cnt; i++) {
+                conns[i]->Release();
+                conns[i]->offline_ver_ = 0;
+                free[i] = conns[i];
+            }
+            free_cnt = alloc_cnt;
+            live_cnt = 0;
+            for(auto& entry : index) entry = IndexEntry();
+            pub_ver.store(0, std::memory_order_relaxed);
+            seen_ver.store(0, std::memory_order_relaxed);
+            snap_cnt[0] = snap_cnt[1] = 0;
+            join_cnt = 0;
+            poll_cnt.store(0, std::memory_order_relaxed);
+            busy_poll_cnt.store(0, std::memory_order_relaxed);
+            sampled_poll_cnt = 0;
+            dirty = false;
+        }
     };
 
+    // release conns offline for longer than ConnectionReleaseTimeout and put them in the free list
+    // it waits until the polling thread has left the live conns containing them
+    // offline_time_ of a conn restored by Start(), as it has no time of its own
+    static constexpr int64_t RestoredOfflineTime = std::numeric_limits<int64_t>::min();
+
+    // map the name file of a group, and allocate offline conns for the names in it, as if their clients had logged on
+    // and off before, so they're found by logins and count toward the capacity of the group as before the restart
+    // names are taken out and inserted again, which drops duplicates left by a crash in the middle of an update
+    template<uint32_t N>
+    bool RestoreGroup(ConnectionGroup<N>& grp, const char* type, uint32_t grpid, int tcp_grpid) {
+        using NameFile = typename ConnectionGroup<N>::NameFile;
+        if(!grp.name_file) {
+            std::string file = ptcp_dir_ + "/" + server_name_ + "_" + type + std::to_string(grpid) + ".idx";
+            const char* error_msg = "Unknown error";
+            grp.name_file = my_mmap<NameFile>(file.c_str(), false, &error_msg);
+            if(!grp.name_file) {
+                static_cast<Derived*>(this)->OnSystemError(error_msg, errno);
+                return false;
+            }
+        }
+        NameFile* file = grp.name_file;
+        // a new file, or one of another layout, e.g. written with other MaxConnsPerGrp or NameSize, starts empty
+        if(file->magic != NameFile::Magic || file->layout_version != NameFile::LayoutVersion ||
+           file->index_size != ConnectionGroup<N>::IndexSize || file->name_size != Conf::NameSize) {
+            memset(file->names, 0, sizeof(file->names));
+            file->layout_version = NameFile::LayoutVersion;
+            file->index_size = ConnectionGroup<N>::IndexSize;
+            file->name_size = Conf::NameSize;
+            file->magic = NameFile::Magic;
+            return true;
+        }
+        auto names = std::make_unique<char[][Conf::NameSize]>(ConnectionGroup<N>::IndexSize);
+        memcpy(names.get(), file->names, sizeof(file->names));
+        memset(file->names, 0, sizeof(file->names));
+        for(uint32_t i = 0; i < ConnectionGroup<N>::IndexSize && (grp.free_cnt || grp.alloc_cnt < N); i++) {
+            const char* name = names[i];
+            if(!name[0] || grp.Find(name)) continue;
+            Connection* conn;
+            if(grp.free_cnt) {
+                conn = grp.free[--grp.free_cnt];
+            }
+            else {
+                conn = NewConnection(tcp_grpid);
+                if(!conn) {
+                    static_cast<Derived*>(this)->OnSystemError("new Connection", ENOMEM);
+                    return false;
+                }
+                conn->slot_ = grp.alloc_cnt;
+                conn->grpid_ = grpid;
+                grp.conns[grp.alloc_cnt++] = conn;
+            }
+            memcpy(conn->GetRemoteName(), name, Conf::NameSize);
+            conn->offline_time_ = RestoredOfflineTime;
+            grp.Insert(conn);
+        }
+        return true;
+    }
+
+    template<uint32_t N>
+    void ReleaseOfflineConns(int64_t now, ConnectionGroup<N>& grp) {
+        if(!grp.Quiescent()) return;
+        for(uint32_t i = grp.live_cnt; i < grp.alloc_cnt; i++) {
+            Connection* conn = grp.conns[i];
+            if(!conn->GetRemoteName()[0]) continue;
+            // a conn restored by Start() is timed from the first check
+            if(conn->offline_time_ == RestoredOfflineTime) conn->offline_time_ = now;
+            if(now - conn->offline_time_ > ConfOpt<Conf>::ConnectionReleaseTimeout) grp.Release(conn);
+        }
+    }
+
+    template<uint32_t N>
+    bool MigrateConnection(Connection& conn, int grpid, ConnectionGroup<N>* grps, uint32_t grp_cnt) {
+        int from_grpid = conn.grpid_;
+        if(from_grpid < 0 || grpid < 0 || grpid >= (int)grp_cnt || grpid == from_grpid) return false;
+        uint32_t shard = from_grpid % ConfOpt<Conf>::CtlShards;
+        if(grpid % ConfOpt<Conf>::CtlShards != shard) return false;
+        CtlShard& ctl = ctl_shards_[shard];
+        auto& from = grps[from_grpid];
+        auto& to = grps[grpid];
+        uint32_t i = conn.slot_;
+        if(i >= from.live_cnt || ctl.migration_cnt == MaxPendingMigrations || to.alloc_cnt + to.incoming == N) {
+            return false;
+        }
+        from.Swap(i, --from.live_cnt);
+        from.Swap(from.live_cnt, --from.alloc_cnt);
+        from.Erase(&conn);
+        // a login of the same name to the new group is rejected until it joins
+        to.Insert(&conn);
+        to.incoming++;
+        conn.grpid_ = -1;
+        ctl.migrations[ctl.migration_cnt++] = {&conn, from_grpid, grpid, false};
+        return true;
+    }
+
+    // join conns into their new groups if the old groups have been left by their polling threads, or all if force
+    void FinishMigrations(CtlShard& ctl, bool force) {
+        for(uint32_t i = 0; i < ctl.migration_cnt;) {
+            Migration& m = ctl.migrations[i];
+            bool done = m.conn->UseShm() ? FinishMigration(m, shm_grps_, force) : FinishMigration(m, tcp_grps_, force);
+            if(done)
+                ctl.migrations[i] = ctl.migrations[--ctl.migration_cnt];
+            else
+                i++;
+        }
+    }
+
+    template<uint32_t N>
+    bool FinishMigration(Migration& m, ConnectionGroup<N>* grps, bool force) {
+        if(!force && !grps[m.from].Quiescent()) return false;
+        auto& to = grps[m.to];
+        Connection& conn = *m.conn;
+        if constexpr(ConfOpt<Conf>::TcpUseIoUring) {
+            // completions of its poll request may still be handled by the old polling thread, so it can't move to
+            // the new uring until the request has ended
+            if(!conn.UseShm() && !force) {
+                if(!m.uring_detaching) {
+                    UringDetachQ& dq = tcp_uring_detaches_[m.from];
+                    uint32_t cnt = dq.write_cnt.load(std::memory_order_relaxed);
+                    dq.conns[cnt % MaxPendingMigrations] = &conn;
+                    dq.write_cnt.store(cnt + 1, std::memory_order_release);
+                    m.uring_detaching = true;
+                    return false;
+                }
+                if(!conn.IsIoUringDetached()) return false;
+            }
+        }
+        to.incoming--;
+        conn.slot_ = to.alloc_cnt;
+        to.conns[to.alloc_cnt++] = &conn;
+        to.Swap(conn.slot_, to.live_cnt++);
+        conn.grpid_ = m.to;
+        if constexpr(ConfOpt<Conf>::TcpUseIoUring) {
+            if(!conn.UseShm()) conn.MoveIoUring(&tcp_urings_[m.to]);
+        }
+        if constexpr(requires(Derived& d) { d.OnClientMigrated(conn, m.from, m.to); }) {
+            static_cast<Derived*>(this)->OnClientMigrated(conn, m.from, m.to);
+        }
+        return true;
+    }
+
+    // sample msg rates of live conns in groups of the shard, and move a conn from the busiest group to the least busy
+    // one being polled, the one closest to half of the gap as it minimizes the larger load of the two afterwards
+    template<uint32_t N>
+    void Rebalance(uint32_t shard, ConnectionGroup<N>* grps, uint32_t grp_cnt) {
+        int busiest = -1, idlest = -1;
+        uint64_t max_load = 0, min_load = 0;
+        for(uint32_t g = shard; g < grp_cnt; g += ConfOpt<Conf>::CtlShards) {
+            auto& grp = grps[g];
+            uint64_t load = 0;
+            for(uint32_t i = 0; i < grp.live_cnt; i++) {
+                Connection& conn = *grp.conns[i];
+                uint64_t cnt = conn.GetRecvCount();
+                conn.recv_rate_ = cnt - conn.sampled_cnt_;
+                conn.sampled_cnt_ = cnt;
+                load += conn.recv_rate_;
+            }
+            uint64_t polls = grp.poll_cnt.load(std::memory_order_relaxed);
+            bool polled = polls != grp.sampled_poll_cnt;
+            grp.sampled_poll_cnt = polls;
+            if(busiest < 0 || load > max_load) {
+                busiest = g;
+                max_load = load;
+            }
+            if(polled && grp.alloc_cnt + grp.incoming < N && (idlest < 0 || load < min_load)) {
+                idlest = g;
+                min_load = load;
+            }
+        }
+        // ignore a gap within a quarter of the load, so conns don't move back and forth on fluctuation
+        if(idlest < 0 || busiest == idlest || (max_load - min_load) * 4 <= max_load) return;
+        uint64_t gap = max_load - min_load;
+        auto& grp = grps[busiest];
+        Connection* best = nullptr;
+        uint64_t best_diff = gap;
+        for(uint32_t i = 0; i < grp.live_cnt; i++) {
+            Connection* conn = grp.conns[i];
+            uint64_t rate = conn->recv_rate_;
+            if(rate == 0 || rate >= gap) continue;
+            uint64_t diff = rate * 2 > gap ? rate * 2 - gap : gap - rate * 2;
+            if(diff < best_diff) {
+                best = conn;
+                best_diff = diff;
+            }
+        }
+        if(best) MigrateConnection(*best, idlest, grps, grp_cnt);
+    }
+
+    // spin for ShmWaitSpinCount empty polls of the group, and then park on each empty poll until any conn gets a msg
+    // a group of more than FUTEX_WAITV_MAX conns never parks
     template<uint32_t N>
-    void HandleLogin(int64_t now, NewConn& conn, ConnectionGroup<N>* grps) {
-        MsgHeader sendbuf[1 + (sizeof(LoginRspMsg) + 7) / 8];
+    void OnShmPolled(ConnectionGroup<N>& grp, std::span<Connection* const> conns, bool got) {
+        if constexpr(ConfOpt<Conf>::ShmWaitSpinCount > 0) {
+            if(got) {
+                grp.idle_cnt = 0;
+                return;
+            }
+            if(grp.idle_cnt < ConfOpt<Conf>::ShmWaitSpinCount) {
+                grp.idle_cnt++;
+                return;
+            }
+            uint32_t cnt = conns.size();
+            if(cnt > FUTEX_WAITV_MAX) return;
+            if(cnt == 0) {
+                timespec ts{ConfOpt<Conf>::ShmWaitTimeoutNs / 1000000000, ConfOpt<Conf>::ShmWaitTimeoutNs % 1000000000};
+                nanosleep(&ts, nullptr);
+                return;
+            }
+            futex_waitv waiters[FUTEX_WAITV_MAX];
+            bool ready = false;
+            uint32_t prepared = 0;
+            while(prepared < cnt && !ready) {
+                ready = !conns[prepared]->ShmPrepareWait(waiters[prepared]);
+                prepared++;
+            }
+            if(!ready) FutexWaitv(waiters, cnt, ConfOpt<Conf>::ShmWaitTimeoutNs);
+            for(uint32_t i = 0; i < prepared; i++) conns[i]->ShmFinishWait();
+        }
+    }
+
+    // tcp group state for ConfOpt<Conf>::TcpUseEpoll, owned by the thread polling the group
+    struct TcpEpollGroup
+    {
+        int epfd = -1;
+        uint32_t active_cnt = 0;
+        Connection* active[Conf::MaxTcpConnsPerGrp]; // conns to be serviced in every poll until drained
+        // heartbeat and timeout checks of idle conns, a tick is 1/64 of Conf::HeartBeatInverval, and 4 levels cover
+        // intervals of up to 2^18 times of it negotiated by conns
+        TimerWheel<Connection, 64, 4> timers{std::max<int64_t>(Conf::HeartBeatInverval / 64, 1)};
+
+        void Activate(Connection& conn) {
+            if(conn.tcp_active_) return;
+            conn.tcp_active_ = true;
+            active[active_cnt++] = &conn;
+        }
+    };
+
+    // struct epoll_params and EPIOCSPARAMS of linux/eventpoll.h, which may be missing in older headers
+    struct EpollParams
+    {
+        uint32_t busy_poll_usecs;
+        uint16_t busy_poll_budget;
+        uint8_t prefer_busy_poll;
+        uint8_t pad;
+    };
+    static constexpr unsigned long EpollSetParams = _IOW(0x8A, 0x01, EpollParams);
+
+    // dispatch up to budget msgs of each conn, return true if any msg is dispatched
+    // a msg not popped by the user ends the turn of its conn, and it's dispatched again in the next call
+    bool ServeShm(std::span<Connection* const> conns, uint32_t budget) {
+        bool got = false;
+        for(Connection* conn : conns) {
+            MsgHeader* last = nullptr;
+            for(uint32_t i = 0; i < budget; i++) {
+                MsgHeader* head = conn->ShmFront();
+                if(!head || head == last) break;
+                got = true;
+                DispatchClientMsg(*conn, head);
+                last = head;
+            }
+        }
+        return got;
+    }
+
+    bool ServeTcp(int64_t now, int grpid, std::span<Connection* const> conns, uint32_t budget) {
+        if constexpr(ConfOpt<Conf>::TcpUseIoUring) {
+            UringDetachQ& dq = tcp_uring_detaches_[grpid];
+            for(uint32_t cnt = dq.write_cnt.load(std::memory_order_acquire); dq.read_cnt != cnt; dq.read_cnt++) {
+                if(!dq.conns[dq.read_cnt % MaxPendingMigrations]->DetachIoUring()) break; // sq full, retry next time
+            }
+            IoUring& uring = tcp_urings_[grpid];
+            uring.ForEachCqe([&uring](const io_uring_cqe& cqe) { PTCPConnection<Conf>::OnIoUringCqe(uring, cqe); });
+        }
+        bool got = false;
+        for(Connection* conn : conns) {
+            MsgHeader* last = nullptr;
+            for(uint32_t i = 0; i < budget; i++) {
+                MsgHeader* head = conn->TcpFront(now);
+                if(!head || head == last) break;
+                got = true;
+                DispatchClientMsg(*conn, head);
+                last = head;
+            }
+        }
+        if constexpr(ConfOpt<Conf>::TcpUseIoUring) {
+            tcp_urings_[grpid].Submit(); // poll requests of all conns in one syscall, if any
+        }
+        return got;
+    }
+
+    // return true if any msg is dispatched
+    bool PollTcpEpoll(int64_t now, int grpid) {
+        TcpEpollGroup& ep = tcp_epolls_[grpid];
+        epoll_event events[64];
+        int n = epoll_wait(ep.epfd, events, 64, 0);
+        for(int i = 0; i < n; i++) {
+            Connection& conn = *static_cast<Connection*>(events[i].data.ptr);
+            // for EPOLLRDHUP, EPOLLHUP and EPOLLERR, a read will tell what happened
+            if(events[i].events & ~EPOLLOUT) conn.OnTcpReadable();
+            if(events[i].events & EPOLLOUT) conn.Flush(); // send out what was blocked by a full socket buffer
+            ep.Activate(conn);
+        }
+        ep.timers.Expire(now, [&ep](Connection& conn) { ep.Activate(conn); });
+        bool got = false;
+        for(uint32_t i = 0; i < ep.active_cnt;) {
+            Connection& conn = *ep.active[i];
+            MsgHeader* head = conn.TcpFront(now);
+            if(head) {
+                got = true;
+                DispatchClientMsg(conn, head);
+            }
+            if(conn.IsClosed()) {
+                // it'll be registered again when the ctl thread reopens it
+                ep.timers.Cancel(&conn.timer_node_);
+                conn.tcp_epoll_held_.store(false, std::memory_order_release);
+            }
+            else {
+                ep.timers.Schedule(&conn.timer_node_, conn.TcpNextTimerTime());
+                if(conn.TcpHasRecvPending()) {
+                    i++;
+                    continue;
+                }
+            }
+            conn.tcp_active_ = false;
+            ep.active[i] = ep.active[--ep.active_cnt];
+        }
+        return got;
+    }
+
+    void DispatchClientMsg(Connection& conn, MsgHeader* head) {
+        conn.CountRecv();
+        if constexpr(requires { typename Derived::ClientMsgDispatcher; }) {
+            if(Derived::ClientMsgDispatcher::Dispatch(*static_cast<Derived*>(this), head, conn)) return;
+        }
+        static_cast<Derived*>(this)->OnClientMsg(conn, head);
+    }
+
+    void HandleLogin(int64_t now, uint32_t shard, NewConn& conn) {
+        LoginRspBuf sendbuf;
         sendbuf[0].size = sizeof(MsgHeader) + sizeof(LoginRspMsg);
         sendbuf[0].msg_type = LoginRspMsg::msg_type;
         sendbuf[0].template ConvertByteOrder<Conf::ToLittleEndian>();
         LoginRspMsg* login_rsp = (LoginRspMsg*)(sendbuf + 1);
-        strncpy(login_rsp->server_name, server_name_, sizeof(login_rsp->server_name));
+        memcpy(login_rsp->server_name, server_name_, sizeof(login_rsp->server_name));
         login_rsp->status = 2;
         login_rsp->error_msg[0] = 0;
+        login_rsp->queue_size = 0;
 
         LoginMsg* login = (LoginMsg*)(conn.recvbuf + 1);
+        login_rsp->heartbeat_interval = login->heartbeat_interval;
         if(login->client_name[0] == 0) {
             strncpy(login_rsp->error_msg, "Invalid client name", sizeof(login_rsp->error_msg));
             ::send(conn.fd, sendbuf, sizeof(sendbuf), MSG_NOSIGNAL);
@@ -258,84 +1090,184 @@ private:
             ::send(conn.fd, sendbuf, sizeof(sendbuf), MSG_NOSIGNAL);
             return;
         }
-        auto& grp = grps[grpid];
-        for(int i = 0; i < N; i++) {
-            Connection& curconn = *grp.conns[i];
-            char* remote_name = curconn.GetRemoteName();
-            if(remote_name[0] == 0) { // found an unused one, use it then
-                strncpy(remote_name, login->client_name, sizeof(login->client_name));
-            }
-            if(strncmp(remote_name, login->client_name, sizeof(login->client_name)) != 0) {
-                // client name does not match
-                continue;
-            }
-            // match
-            if(i < grp.live_cnt) {
-                strncpy(login_rsp->error_msg, "Already loggned on", sizeof(login_rsp->error_msg));
-                ::send(conn.fd, sendbuf, sizeof(sendbuf), MSG_NOSIGNAL);
-                return;
-            }
+        uint32_t owner = grpid % ConfOpt<Conf>::CtlShards;
+        if(owner == shard) {
+            LoginToGroup(now, conn, sendbuf, grpid);
+            return;
+        }
+        InboxQ* inbox = ctl_shards_[owner].Inbox();
+        MsgHeader* header = inbox->Alloc(sizeof(LoginHandoff));
+        if(!header) {
+            strncpy(login_rsp->error_msg, "Server busy", sizeof(login_rsp->error_msg));
+            ::send(conn.fd, sendbuf, sizeof(sendbuf), MSG_NOSIGNAL);
+            return;
+        }
+        LoginHandoff* handoff = new(header->Body()) LoginHandoff;
+        handoff->conn = conn;
+        memcpy(handoff->sendbuf, sendbuf, sizeof(sendbuf));
+        handoff->grpid = grpid;
+        inbox->Push(header);
+        conn.fd = -1; // it's owned by the owner shard now
+    }
 
-            const char* error_msg;
-            if(!curconn.OpenFile(login->use_shm, &error_msg)) {
-                // we can not mmap to ptcp or chm files with filenames related to local and remote name
-                static_cast<Derived*>(this)->OnClientFileError(curconn, error_msg, errno);
-                strncpy(login_rsp->error_msg, "System error", sizeof(login_rsp->error_msg));
-                ::send(conn.fd, sendbuf, sizeof(sendbuf), MSG_NOSIGNAL);
-                return;
-            }
-            uint32_t local_ack_seq = 0;
-            uint32_t local_seq_start = 0;
-            uint32_t local_seq_end = 0;
-            uint32_t remote_ack_seq = conn.recvbuf[0].ack_seq;
-            uint32_t remote_seq_start = login->client_seq_start;
-            uint32_t remote_seq_end = login->client_seq_end;
-            // if server_name has changed, reset the ack_seq
-            if(strncmp(login->last_server_name, server_name_, sizeof(server_name_)) != 0) {
-                curconn.Reset();
-                remote_ack_seq = remote_seq_start = remote_seq_end = 0;
+    void LoginToGroup(int64_t now, NewConn& conn, LoginRspBuf& sendbuf, int grpid) {
+        LoginMsg* login = (LoginMsg*)(conn.recvbuf + 1);
+        if(login->use_shm) {
+            LoginToGroup(now, conn, sendbuf, grpid, shm_grps_);
+        }
+        else {
+            LoginToGroup(now, conn, sendbuf, grpid, tcp_grps_);
+        }
+    }
+
+    template<uint32_t N>
+    void LoginToGroup(int64_t now, NewConn& conn, LoginRspBuf& sendbuf, int grpid, ConnectionGroup<N>* grps) {
+        LoginRspMsg* login_rsp = (LoginRspMsg*)(sendbuf + 1);
+        LoginMsg* login = (LoginMsg*)(conn.recvbuf + 1);
+        auto& grp = grps[grpid];
+        Connection* found = grp.Find(login->client_name);
+        // an offline conn may still be visited by the polling thread until it has started a poll with the live conns
+        // published after the conn went offline, so it can't be reopened before that, and the client should retry
+        if(found && found->slot_ >= grp.live_cnt && found->grpid_ >= 0 && !grp.Left(found)) {
+            strncpy(login_rsp->error_msg, "Server busy", sizeof(login_rsp->error_msg));
+            ::send(conn.fd, sendbuf, sizeof(sendbuf), MSG_NOSIGNAL);
+            return;
+        }
+        if(!found) { // a new remote name, reuse a released conn or allocate one
+            if(grp.free_cnt) {
+                found = grp.free[--grp.free_cnt];
             }
-            else {
-                if(!curconn.GetSeq(&local_ack_seq, &local_seq_start, &local_seq_end, &error_msg)) {
-                    static_cast<Derived*>(this)->OnClientFileError(curconn, error_msg, errno);
+            else if(grp.alloc_cnt + grp.incoming < N) {
+                found = NewConnection(login->use_shm ? -1 : grpid);
+                if(!found) {
                     strncpy(login_rsp->error_msg, "System error", sizeof(login_rsp->error_msg));
                     ::send(conn.fd, sendbuf, sizeof(sendbuf), MSG_NOSIGNAL);
                     return;
                 }
+                found->slot_ = grp.alloc_cnt;
+                found->grpid_ = grpid;
+                grp.conns[grp.alloc_cnt++] = found;
             }
-            sendbuf[0].ack_seq = Endian<Conf::ToLittleEndian>::Convert(local_ack_seq);
-            login_rsp->server_seq_start = local_seq_start;
-            login_rsp->server_seq_end = local_seq_end;
-            login_rsp->ConvertByteOrder();
-            if(!CheckAckInQueue(remote_ack_seq, local_seq_start, local_seq_end) ||
-               !CheckAckInQueue(local_ack_seq, remote_seq_start, remote_seq_end)) {
-                static_cast<Derived*>(this)->OnSeqNumberMismatch(curconn,
-                                                                 local_ack_seq,
-                                                                 local_seq_start,
-                                                                 local_seq_end,
-                                                                 remote_ack_seq,
-                                                                 remote_seq_start,
-                                                                 remote_seq_end);
-                login_rsp->status = 1;
+            else {
+                // no space for new remote name
+                strncpy(login_rsp->error_msg, "Max client cnt exceeded", sizeof(login_rsp->error_msg));
                 ::send(conn.fd, sendbuf, sizeof(sendbuf), MSG_NOSIGNAL);
                 return;
             }
+            strncpy(found->GetRemoteName(), login->client_name, Conf::NameSize);
+            grp.Insert(found);
+        }
+        Connection& curconn = *found;
+        uint32_t i = curconn.slot_;
+        if(i < grp.live_cnt || curconn.grpid_ < 0) { // live or migrating in
+            strncpy(login_rsp->error_msg, "Already loggned on", sizeof(login_rsp->error_msg));
+            ::send(conn.fd, sendbuf, sizeof(sendbuf), MSG_NOSIGNAL);
+            return;
+        }
 
-            // send Login OK
-            login_rsp->status = 0;
-            if(::send(conn.fd, sendbuf, sizeof(sendbuf), MSG_NOSIGNAL) != sizeof(sendbuf)) {
+        uint32_t queue_size = login_rsp->queue_size;
+        if(!queue_size) queue_size = Connection::DefaultQueueSize(login->use_shm);
+        if(!Connection::ValidQueueSize(login->use_shm, queue_size)) {
+            strncpy(login_rsp->error_msg, "Invalid queue size", sizeof(login_rsp->error_msg));
+            ::send(conn.fd, sendbuf, sizeof(sendbuf), MSG_NOSIGNAL);
+            return;
+        }
+        const char* error_msg;
+        if(!curconn.OpenFile(login->use_shm, queue_size, &error_msg)) {
+            // we can not mmap to ptcp or chm files with filenames related to local and remote name
+            static_cast<Derived*>(this)->OnClientFileError(curconn, error_msg, errno);
+            strncpy(login_rsp->error_msg, "System error", sizeof(login_rsp->error_msg));
+            ::send(conn.fd, sendbuf, sizeof(sendbuf), MSG_NOSIGNAL);
+            return;
+        }
+        // the interval replied is what both sides use
+        int64_t hb_interval = PTCPConnection<Conf>::ClampHeartbeatInterval(login_rsp->heartbeat_interval);
+        uint32_t local_ack_seq = 0;
+        uint32_t local_seq_start = 0;
+        uint32_t local_seq_end = 0;
+        uint32_t remote_ack_seq = conn.recvbuf[0].ack_seq;
+        uint32_t remote_seq_start = login->client_seq_start;
+        uint32_t remote_seq_end = login->client_seq_end;
+        // if server_name has changed, reset the ack_seq
+        if(strncmp(login->last_server_name, server_name_, sizeof(server_name_)) != 0) {
+            curconn.Reset();
+            remote_ack_seq = remote_seq_start = remote_seq_end = 0;
+        }
+        else {
+            if(!curconn.GetSeq(&local_ack_seq, &local_seq_start, &local_seq_end, &error_msg)) {
+                static_cast<Derived*>(this)->OnClientFileError(curconn, error_msg, errno);
+                strncpy(login_rsp->error_msg, "System error", sizeof(login_rsp->error_msg));
+                ::send(conn.fd, sendbuf, sizeof(sendbuf), MSG_NOSIGNAL);
                 return;
             }
-            curconn.Open(conn.fd, remote_ack_seq, now);
-            conn.fd = -1; // so it won't be closed by caller
-            // switch to live
-            std::swap(grp.conns[i], grp.conns[grp.live_cnt++]);
-            static_cast<Derived*>(this)->OnClientLogon(conn.addr, curconn);
+        }
+        sendbuf[0].ack_seq = Endian<Conf::ToLittleEndian>::Convert(local_ack_seq);
+        login_rsp->server_seq_start = local_seq_start;
+        login_rsp->server_seq_end = local_seq_end;
+        login_rsp->queue_size = curconn.GetQueueSize();
+        login_rsp->heartbeat_interval = hb_interval;
+        login_rsp->ConvertByteOrder();
+        if(!CheckAckInQueue(remote_ack_seq, local_seq_start, local_seq_end) ||
+           !CheckAckInQueue(local_ack_seq, remote_seq_start, remote_seq_end)) {
+            static_cast<Derived*>(this)->OnSeqNumberMismatch(curconn,
+                                                             local_ack_seq,
+                                                             local_seq_start,
+                                                             local_seq_end,
+                                                             remote_ack_seq,
+                                                             remote_seq_start,
+                                                             remote_seq_end);
+            login_rsp->status = 1;
+            ::send(conn.fd, sendbuf, sizeof(sendbuf), MSG_NOSIGNAL);
+            return;
+        }
+
+        // send Login OK
+        login_rsp->status = 0;
+        if(::send(conn.fd, sendbuf, sizeof(sendbuf), MSG_NOSIGNAL) != sizeof(sendbuf)) {
             return;
         }
-        // no space for new remote name
-        strncpy(login_rsp->error_msg, "Max client cnt exceeded", sizeof(login_rsp->error_msg));
-        ::send(conn.fd, sendbuf, sizeof(sendbuf), MSG_NOSIGNAL);
+        curconn.SetHeartbeatInterval(hb_interval);
+        curconn.Open(conn.fd, remote_ack_seq, now);
+        if constexpr(ConfOpt<Conf>::TcpUseEpoll) {
+            // the polling thread mustn't see it before it's published, see RegisterEpoll()
+            if(!login->use_shm) grp.joins[grp.join_cnt++] = {&curconn, conn.fd};
+        }
+        conn.fd = -1; // so it won't be closed by caller
+        // switch to live
+        curconn.sampled_cnt_ = curconn.GetRecvCount();
+        grp.Swap(i, grp.live_cnt++);
+        static_cast<Derived*>(this)->OnClientLogon(conn.addr, curconn);
+    }
+
+    // hand conns logged on to the polling thread of the group by its epoll set, after they're published
+    // EPOLLOUT of a new socket fires immediately, so the polling thread takes over a conn at once
+    template<uint32_t N>
+    void RegisterEpoll(int grpid, ConnectionGroup<N>& grp) {
+        for(uint32_t i = 0; i < grp.join_cnt; i++) {
+            Connection& conn = *grp.joins[i].conn;
+            epoll_event ev;
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.ptr = &conn;
+            conn.tcp_epoll_held_.store(true, std::memory_order_relaxed);
+            if(epoll_ctl(tcp_epolls_[grpid].epfd, EPOLL_CTL_ADD, grp.joins[i].fd, &ev) < 0) {
+                static_cast<Derived*>(this)->OnSystemError("epoll_ctl", errno);
+                conn.tcp_epoll_held_.store(false, std::memory_order_relaxed);
+                conn.Close(); // the ctl thread finds it closed in the next PollCtl()
+            }
+        }
+        grp.join_cnt = 0;
+    }
+
+    // allocate a connection for a tcp group of tcp_grpid, or a shm group if tcp_grpid is -1
+    Connection* NewConnection(int tcp_grpid) {
+        Connection* conn = new(std::nothrow) Connection;
+        if(!conn) return nullptr;
+        conn->init(ptcp_dir_.c_str(), server_name_);
+        if(tcp_grpid >= 0) {
+            if constexpr(ConfOpt<Conf>::TcpUseIoUring) conn->SetIoUring(&tcp_urings_[tcp_grpid]);
+            if constexpr(ConfOpt<Conf>::TcpUseEpoll) conn->SetTcpReadableNotify();
+        }
+        return conn;
     }
 
     // check if seq_start <= ack_seq <= seq_end, considering uint32_t wrap around
@@ -346,13 +1278,19 @@ private:
 private:
     char server_name_[Conf::NameSize];
     std::string ptcp_dir_;
-    int listenfd_ = -1;
 
-    NewConn new_conns_[Conf::MaxNewConnections];
-    int avail_idx_ = 0;
+    CtlShard ctl_shards_[ConfOpt<Conf>::CtlShards];
 
-    Connection conn_pool_[Conf::MaxShmConnsPerGrp * Conf::MaxShmGrps + Conf::MaxTcpConnsPerGrp * Conf::MaxTcpGrps];
     ConnectionGroup<Conf::MaxShmConnsPerGrp> shm_grps_[Conf::MaxShmGrps];
     ConnectionGroup<Conf::MaxTcpConnsPerGrp> tcp_grps_[Conf::MaxTcpGrps];
+    // used only if ConfOpt<Conf>::TcpUseIoUring, one for each tcp group as it's polled by its own thread
+    IoUring tcp_urings_[Conf::MaxTcpGrps];
+    UringDetachQ tcp_uring_detaches_[Conf::MaxTcpGrps];
+    // used only if ConfOpt<Conf>::TcpUseEpoll
+    TcpEpollGroup tcp_epolls_[Conf::MaxTcpGrps];
+    // used only if ConfOpt<Conf>::BroadcastQueueSize > 0
+    BroadcastConnection<Conf> bcast_;
+    // calls of PollAll() in a row finding no msg, used only if ConfOpt<Conf>::PollAllSpinCount > 0
+    uint32_t poll_all_idle_cnt_ = 0;
 };
 } // namespace tcpshm
@@ -0,0 +1,173 @@
+#include "../spmc_varq.h"
+#include "../spsc_varq.h"
+#include <bits/stdc++.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// measure fanout of market data ticks to 1, 8 and 32 reader threads: written once to a broadcast SPMCVarQueue, every
+// reader reading it in place, against written to a private SPSCVarQueue of each reader, as a server does without
+// the broadcast queue
+// the writer keeps at most Window ticks ahead of the slowest reader, so no reader of the broadcast queue is evicted
+// ticks are of the size of MarketDepthMsg of crypto_market_example, and readers sum the whole body of each
+const uint32_t QueueBytes = 1 << 20;
+const uint32_t MaxReaders = 32;
+const uint32_t TickSize = 168;
+const uint64_t Window = 1024;
+const uint64_t Batch = 64;
+
+using BQ = SPMCVarQueue<QueueBytes, MaxReaders>;
+using Q = SPSCVarQueue<>;
+
+struct alignas(64) ReadCnt
+{
+    atomic<uint64_t> n{0};
+};
+
+int64_t Now() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void FillTick(MsgHeader* header, uint64_t seq) {
+    header->msg_type = 1;
+    uint64_t* body = static_cast<uint64_t*>(header->Body());
+    for(uint32_t i = 0; i < TickSize / 8; i++) body[i] = seq + i;
+}
+
+// the sum a reader gets from reading ticks [0, n)
+uint64_t TickSum(uint64_t n) {
+    uint64_t k = TickSize / 8;
+    return k * (n * (n - 1) / 2) + n * (k * (k - 1) / 2);
+}
+
+uint64_t ReadTick(MsgHeader* header) {
+    const uint64_t* body = static_cast<const uint64_t*>(header->Body());
+    uint64_t sum = 0;
+    for(uint32_t i = 0; i < TickSize / 8; i++) sum += body[i];
+    return sum;
+}
+
+// write ticks by write_batch(seq, cnt) as fast as readers let it, then wait until all are read
+// return ns the writer spent in write_batch() in total, and ns until all readers have read all ticks
+template<class F>
+pair<int64_t, int64_t> WriteTicks(uint64_t ticks, vector<ReadCnt>& cnts, F write_batch) {
+    auto min_read = [&]() {
+        uint64_t m = UINT64_MAX;
+        for(auto& c : cnts) m = min(m, c.n.load(memory_order_acquire));
+        return m;
+    };
+    int64_t start = Now(), write_ns = 0;
+    for(uint64_t seq = 0; seq < ticks; seq += Batch) {
+        while(seq > Window && min_read() < seq - Window) this_thread::yield();
+        uint64_t cnt = min(Batch, ticks - seq);
+        int64_t t = Now();
+        write_batch(seq, cnt);
+        write_ns += Now() - t;
+    }
+    while(min_read() < ticks) this_thread::yield();
+    return {write_ns, Now() - start};
+}
+
+void Report(const char* name, uint32_t readers, uint64_t ticks, pair<int64_t, int64_t> ns, bool ok) {
+    cout << name << ", " << readers << " readers: " << static_cast<double>(ns.first) / ticks
+         << " writer ns per tick, all read in " << ns.second / 1000000.0 << " ms, "
+         << static_cast<int64_t>(ticks * 1e9 / ns.second) << " ticks per second" << (ok ? "" : ", WRONG SUM") << endl;
+}
+
+void BenchBroadcast(uint32_t readers, uint64_t ticks) {
+    auto q = make_unique<BQ>();
+    vector<ReadCnt> cnts(readers);
+    atomic<uint32_t> attached{0};
+    atomic<bool> ok{true};
+    vector<thread> thrs;
+    for(uint32_t i = 0; i < readers; i++) {
+        thrs.emplace_back([&, i]() {
+            BQ::Reader reader;
+            if(!reader.Attach(q.get())) exit(1);
+            attached++;
+            uint64_t n = 0, sum = 0;
+            while(n < ticks) {
+                MsgHeader* header = reader.Front();
+                if(!header) {
+                    if(reader.IsEvicted()) {
+                        cout << "reader evicted" << endl;
+                        exit(1);
+                    }
+                    this_thread::yield();
+                    continue;
+                }
+                sum += ReadTick(header);
+                reader.Pop();
+                cnts[i].n.store(++n, memory_order_release);
+            }
+            if(sum != TickSum(ticks)) ok = false;
+        });
+    }
+    while(attached < readers) this_thread::yield();
+    auto ns = WriteTicks(ticks, cnts, [&](uint64_t seq, uint64_t cnt) {
+        for(uint64_t s = seq; s < seq + cnt; s++) {
+            MsgHeader* header = q->Alloc(TickSize);
+            FillTick(header, s);
+            q->Push();
+        }
+    });
+    for(auto& thr : thrs) thr.join();
+    Report("broadcast queue", readers, ticks, ns, ok);
+}
+
+void BenchFanout(uint32_t readers, uint64_t ticks) {
+    vector<char*> bufs;
+    vector<Q*> qs;
+    for(uint32_t i = 0; i < readers; i++) {
+        bufs.push_back(new(align_val_t(128)) char[Q::MapSize(QueueBytes)]);
+        qs.push_back(new(bufs.back()) Q(QueueBytes));
+    }
+    vector<ReadCnt> cnts(readers);
+    atomic<bool> ok{true};
+    vector<thread> thrs;
+    for(uint32_t i = 0; i < readers; i++) {
+        thrs.emplace_back([&, i]() {
+            uint64_t n = 0, sum = 0;
+            while(n < ticks) {
+                MsgHeader* header = qs[i]->Front();
+                if(!header) {
+                    this_thread::yield();
+                    continue;
+                }
+                sum += ReadTick(header);
+                qs[i]->Pop();
+                cnts[i].n.store(++n, memory_order_release);
+            }
+            if(sum != TickSum(ticks)) ok = false;
+        });
+    }
+    auto ns = WriteTicks(ticks, cnts, [&](uint64_t seq, uint64_t cnt) {
+        for(uint64_t s = seq; s < seq + cnt; s++) {
+            for(Q* q : qs) {
+                MsgHeader* header = q->Alloc(TickSize);
+                FillTick(header, s);
+                q->Push();
+            }
+        }
+    });
+    for(auto& thr : thrs) thr.join();
+    for(char* buf : bufs) operator delete[](buf, align_val_t(128));
+    Report("queue per reader", readers, ticks, ns, ok);
+}
+
+int main(int argc, const char** argv) {
+    if(argc > 2) {
+        cout << "usage: broadcast_bench [TICKS]" << endl;
+        exit(1);
+    }
+    uint64_t ticks = argc == 2 ? atoll(argv[1]) : 200000;
+    if(ticks == 0) {
+        cout << "TICKS must be positive" << endl;
+        exit(1);
+    }
+    for(uint32_t readers : {1, 8, 32}) {
+        BenchBroadcast(readers, ticks);
+        BenchFanout(readers, ticks);
+    }
+    return 0;
+}
@@ -0,0 +1,66 @@
+#include "../tsc_clock.h"
+#include <bits/stdc++.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// measure the cost of reading the clocks, and the error of TscClock against CLOCK_MONOTONIC while it's calibrated
+TscClock tsc_clock;
+
+template<class F>
+void BenchRead(const char* name, F f) {
+    const int n = 10000000;
+    int64_t sum = 0;
+    int64_t start = tsc_clock.ReadClock();
+    for(int i = 0; i < n; i++) sum += f();
+    int64_t latency = tsc_clock.ReadClock() - start;
+    // print sum so reads are not optimized away
+    cout << name << ": " << static_cast<double>(latency) / n << " ns per read, sum: " << sum << endl;
+}
+
+int main(int argc, const char** argv) {
+    if(argc > 2) {
+        cout << "usage: clock_bench [SECONDS]" << endl;
+        exit(1);
+    }
+    int seconds = argc == 2 ? atoi(argv[1]) : 10;
+    // calibrate every 100ms, so the drift correction is exercised many times in a short run
+    if(!tsc_clock.Init(20000000, 100000000)) {
+        cout << "tsc is not invariant, TscClock reads CLOCK_MONOTONIC" << endl;
+    }
+    cout << "tsc ghz: " << tsc_clock.GetTscGhz() << endl;
+
+    BenchRead("clock_gettime(CLOCK_REALTIME)", []() {
+        timespec ts;
+        ::clock_gettime(CLOCK_REALTIME, &ts);
+        return ts.tv_nsec;
+    });
+    BenchRead("clock_gettime(CLOCK_MONOTONIC)", []() { return tsc_clock.ReadClock(); });
+    BenchRead("ReadTsc()", []() { return TscClock::ReadTsc(); });
+    BenchRead("TscClock::Now()", []() { return tsc_clock.Now(); });
+
+    // error is sampled as Now() minus the middle of two reads of the clock
+    int64_t max_err = 0, sum_err = 0, cnt = 0, backwards = 0;
+    int64_t last = tsc_clock.Now();
+    int64_t end = tsc_clock.ReadClock() + seconds * 1000000000LL;
+    for(int64_t i = 1;; i++) {
+        tsc_clock.Calibrate();
+        if(i % 1000 == 0) this_thread::sleep_for(chrono::microseconds(100));
+        int64_t ns1 = tsc_clock.ReadClock();
+        if(ns1 >= end) break;
+        int64_t cur = tsc_clock.Now();
+        int64_t ns2 = tsc_clock.ReadClock();
+        if(cur < last) backwards++;
+        last = cur;
+        // skip samples interrupted by preemption
+        if(ns2 - ns1 > 1000) continue;
+        int64_t err = cur - (ns1 + ns2) / 2;
+        max_err = max(max_err, abs(err));
+        sum_err += abs(err);
+        cnt++;
+    }
+    cout << "samples: " << cnt << " avg abs err: " << static_cast<double>(sum_err) / cnt << " ns max abs err: " << max_err
+         << " ns backwards: " << backwards << endl;
+
+    return 0;
+}
@@ -1,4 +1,5 @@
 #pragma once
+#include "../msg_header.h"
 
 // configurations that must be the same between server and client
 struct CommonConf
@@ -16,6 +17,12 @@ struct MsgTpl
 {
     static constexpr uint16_t msg_type = MsgType;
     int val[N];
+
+    // called by conn.Send<T>() for tcp if host endian differs from Conf::ToLittleEndian
+    template<bool ToLittle>
+    void ConvertByteOrder() {
+        for(auto& v : val) tcpshm::Endian<ToLittle>::ConvertInPlace(v);
+    }
 };
 
 typedef MsgTpl<1, 1> Msg1;
@@ -36,5 +43,17 @@ struct MarketDepthMsg
     int instrument_id;
     PriceLevel bid[5];
     PriceLevel ask[5];
+
+    template<bool ToLittle>
+    void ConvertByteOrder() {
+        tcpshm::Endian<ToLittle> ed;
+        ed.ConvertInPlace(instrument_id);
+        for(auto* levels : {bid, ask}) {
+            for(int i = 0; i < 5; i++) {
+                ed.ConvertInPlace(levels[i].price);
+                ed.ConvertInPlace(levels[i].size);
+            }
+        }
+    }
 };
 
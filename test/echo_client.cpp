@@ -34,8 +34,10 @@ public:
         srand(time(nullptr));
     }
 
-    void Run(bool use_shm, const char* server_ipv4, uint16_t server_port) {
+    void Run(bool use_shm, bool slow, const char* server_ipv4, uint16_t server_port) {
         if(!Connect(use_shm, server_ipv4, server_port, 0)) return;
+        this->use_shm = use_shm;
+        this->slow = slow;
         // we mmap the send and recv number to file in case of program crash
         string send_num_file =
             string(conn.GetPtcpDir()) + "/" + conn.GetLocalName() + "_" + conn.GetRemoteName() + ".send_num";
@@ -66,6 +68,7 @@ public:
             // we still need to poll tcp for heartbeats even if using shm
             while(!conn.IsClosed()) {
               PollTcp(now());
+              tsc_clock.Calibrate();
             }
             shm_thr.join();
         }
@@ -79,6 +82,7 @@ public:
                     break;
                 }
                 PollTcp(now());
+                tsc_clock.Calibrate();
             }
         }
         uint64_t latency = stop_time - start_time;
@@ -104,46 +108,38 @@ private:
     }
 
     bool TrySendMarketDepthMsg() {
-        MsgHeader* header = conn.Alloc(sizeof(MarketDepthMsg));
-        if(!header) return false;
-        header->msg_type = MarketDepthMsg::msg_type;
-        MarketDepthMsg* msg = reinterpret_cast<MarketDepthMsg*>(header + 1);
-        
-        // Fill with test data
-        msg->instrument_id = (*send_num)++;
-        
-        // Generate some test prices and sizes for 5 levels
-        for(int i = 0; i < 5; i++) {
-            msg->bid[i].price = 100.0 - i * 0.1;
-            msg->bid[i].size = 100 + i * 10;
-            msg->ask[i].price = 100.1 + i * 0.1;
-            msg->ask[i].size = 100 + i * 10;
-        }
-        
-        conn.Push();
-        msg_sent++;
-        return true;
+        // msg is filled in place in send queue, and converted to configurated network byte order for tcp if needed
+        bool sent = conn.Send<MarketDepthMsg>([this](MarketDepthMsg& msg) {
+            // Fill with test data
+            msg.instrument_id = (*send_num)++;
+
+            // Generate some test prices and sizes for 5 levels
+            for(int i = 0; i < 5; i++) {
+                msg.bid[i].price = 100.0 - i * 0.1;
+                msg.bid[i].size = 100 + i * 10;
+                msg.ask[i].price = 100.1 + i * 0.1;
+                msg.ask[i].size = 100 + i * 10;
+            }
+        });
+        if(sent) msg_sent++;
+        return sent;
     }
 
     template<class T>
     bool TrySendMsg() {
-        MsgHeader* header = conn.Alloc(sizeof(T));
-        if(!header) return false;
-        header->msg_type = T::msg_type;
-        T* msg = reinterpret_cast<T*>(header + 1);
-        for(auto& v : msg->val) {
-            // convert to configurated network byte order, don't need this if you know server is using the same endian
-            v = Endian<ClientConf::ToLittleEndian>::Convert((*send_num)++);
-        }
-        conn.Push();
-        msg_sent++;
-        return true;
+        bool sent = conn.Send<T>([this](T& msg) {
+            for(auto& v : msg.val) {
+                v = (*send_num)++;
+            }
+        });
+        if(sent) msg_sent++;
+        return sent;
     }
 
-    void handleMarketDepthMsg(MarketDepthMsg* msg) {
+    void handleMarketDepthMsg(const MarketDepthMsg* msg) {
         int v = msg->instrument_id;
-        // convert from configurated network byte order if needed
-        // Endian<ClientConf::ToLittleEndian>::ConvertInPlace(v);
+        // convert from configurated network byte order, msgs from shm are always in host byte order
+        if(!use_shm) Endian<ClientConf::ToLittleEndian>::ConvertInPlace(v);
         if(v != *recv_num) {
             cout << "bad: v: " << v << " recv_num: " << (*recv_num) << endl;
             exit(1);
@@ -152,10 +148,10 @@ private:
     }
 
     template<class T>
-    void handleMsg(T* msg) {
+    void handleMsg(const T* msg) {
         for(auto v : msg->val) {
-            // convert from configurated network byte order
-            Endian<ClientConf::ToLittleEndian>::ConvertInPlace(v);
+            // convert from configurated network byte order, msgs from shm are always in host byte order
+            if(!use_shm) Endian<ClientConf::ToLittleEndian>::ConvertInPlace(v);
             if(v != *recv_num) {
                 cout << "bad: v: " << v << " recv_num: " << (*recv_num) << endl;
                 exit(1);
@@ -180,7 +176,7 @@ private:
 
     // called within Connect()
     // confirmation for login success
-    int64_t OnLoginSuccess(const LoginRspMsg* login_rsp) {
+    int64_t OnLoginSuccess(const LoginRspMsg* /*login_rsp*/) {
         cout << "Login Success" << endl;
         return now();
     }
@@ -199,17 +195,27 @@ private:
              << " remote_seq_start: " << remote_seq_start << " remote_seq_end: " << remote_seq_end << endl;
     }
 
+    // msgs of these types are dispatched to OnMsg() of the type by polling functions
+    using ServerMsgDispatcher = MsgDispatcher<EchoClient, Msg1, Msg2, Msg3, Msg4, MarketDepthMsg>;
+    friend ServerMsgDispatcher;
+
     // called by APP thread
-    void OnServerMsg(MsgHeader* header) {
-        // auto msg_type = header->msg_type;
-        switch(header->msg_type) {
-            case 1: handleMsg(reinterpret_cast<Msg1*>(header + 1)); break;
-            case 2: handleMsg(reinterpret_cast<Msg2*>(header + 1)); break;
-            case 3: handleMsg(reinterpret_cast<Msg3*>(header + 1)); break;
-            case 4: handleMsg(reinterpret_cast<Msg4*>(header + 1)); break;
-            case 5: handleMarketDepthMsg(reinterpret_cast<MarketDepthMsg*>(header + 1)); break;
-            default: assert(false);
-        }
+    template<class T>
+    void OnMsg(const T& msg) {
+        handleMsg(&msg);
+        conn.Pop();
+    }
+
+    // called by APP thread
+    void OnMsg(const MarketDepthMsg& msg) {
+        handleMarketDepthMsg(&msg);
+        conn.Pop();
+    }
+
+    // called by APP thread
+    // msgs that ServerMsgDispatcher can't dispatch
+    void OnServerMsg(MsgHeader* /*header*/) {
+        assert(false);
         conn.Pop();
     }
 
@@ -221,10 +227,12 @@ private:
 private:
     static constexpr int MaxNum = 10000000;
     Connection& conn;
+    bool use_shm = false;
     int msg_sent = 0;
     uint64_t start_time = 0;
     uint64_t stop_time = 0;
-    // set slow to false to send msgs as fast as it can
+    // if slow is false, send msgs as fast as it can, and avg rtt is the cost per msg under full load
+    // otherwise it waits for the echo of a msg before sending the next one, and avg rtt is the round trip latency
     bool slow = false;
     // set do_cpupin to true to get more stable latency
     bool do_cpupin = true;
@@ -233,16 +241,20 @@ private:
 };
 
 int main(int argc, const char** argv) {
-    if(argc != 4) {
-        cout << "usage: echo_client NAME SERVER_IP USE_SHM[0|1]" << endl;
+    if(argc != 4 && argc != 5) {
+        cout << "usage: echo_client NAME SERVER_IP USE_SHM[0|1] [SLOW[0|1]]" << endl;
         exit(1);
     }
     const char* name = argv[1];
     const char* server_ip = argv[2];
     bool use_shm = argv[3][0] != '0';
+    bool slow = argc == 5 && argv[4][0] != '0';
 
+    if(!tsc_clock.Init()) {
+        cout << "tsc is not invariant, now() reads the system clock" << endl;
+    }
     EchoClient client(name, name);
-    client.Run(use_shm, server_ip, 12345);
+    client.Run(use_shm, slow, server_ip, 12345);
 
     return 0;
 }
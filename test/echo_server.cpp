@@ -46,15 +46,27 @@ public:
         std::signal(SIGTERM, EchoServer::SignalHandler);
     }
 
-    static void SignalHandler(int s) {
+    static void SignalHandler(int) {
         stopped = true;
     }
 
-    void Run(const char* listen_ipv4, uint16_t listen_port) {
+    // if single_thread, the whole server is polled by PollAll() in this thread, e.g. for comparing latency with the
+    // layout of a thread per group
+    void Run(const char* listen_ipv4, uint16_t listen_port, bool single_thread) {
         if(!Start(listen_ipv4, listen_port)) return;
+        if(single_thread) {
+            if(do_cpupin) cpupin(4);
+            while(!stopped) {
+                PollAll(now());
+                tsc_clock.Calibrate();
+            }
+            Stop();
+            cout << "Server stopped" << endl;
+            return;
+        }
         vector<thread> threads;
         // create threads for polling tcp
-        for(int i = 0; i < ServerConf::MaxTcpGrps; i++) {
+        for(uint32_t i = 0; i < ServerConf::MaxTcpGrps; i++) {
           threads.emplace_back([this, i]() {
             if (do_cpupin) cpupin(4 + i);
             while (!stopped) {
@@ -64,7 +76,7 @@ public:
         }
 
         // create threads for polling shm
-        for(int i = 0; i < ServerConf::MaxShmGrps; i++) {
+        for(uint32_t i = 0; i < ServerConf::MaxShmGrps; i++) {
           threads.emplace_back([this, i]() {
             if (do_cpupin) cpupin(4 + ServerConf::MaxTcpGrps + i);
             while (!stopped) {
@@ -76,6 +88,7 @@ public:
         // polling control using this thread
         while(!stopped) {
           PollCtl(now());
+          tsc_clock.Calibrate();
         }
 
         for(auto& thr : threads) {
@@ -162,11 +175,11 @@ private:
 
     // called by APP thread
     void OnClientMsg(Connection& conn, MsgHeader* recv_header) {
-        auto size = recv_header->size - sizeof(MsgHeader);
+        auto size = recv_header->BodySize();
         MsgHeader* send_header = conn.Alloc(size);
         if(!send_header) return;
         send_header->msg_type = recv_header->msg_type;
-        std::memcpy(send_header + 1, recv_header + 1, size);
+        std::memcpy(send_header->Body(), recv_header->Body(), size);
         // if we call Push() before Pop(), there's a good chance Pop() is not called in case of program crash
         conn.Pop();
         conn.Push();
@@ -177,9 +190,16 @@ private:
     bool do_cpupin = true;
 };
 
-int main() {
+int main(int argc, const char** argv) {
+    if(argc > 2 || (argc == 2 && strcmp(argv[1], "single") != 0)) {
+        cout << "usage: echo_server [single]" << endl;
+        exit(1);
+    }
+    if(!tsc_clock.Init()) {
+        cout << "tsc is not invariant, now() reads the system clock" << endl;
+    }
     EchoServer server("server", "server");
-    server.Run("0.0.0.0", 12345);
+    server.Run("0.0.0.0", 12345, argc == 2);
 
     return 0;
 }
@@ -0,0 +1,70 @@
+#include "../ptcp_conn.h"
+#include <bits/stdc++.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// a heartbeat interval requested by the peer is clamped, so the heartbeat and timeout times derived from it never
+// overflow, even if timestamps are ns since epoch
+int failures = 0;
+
+#define CHECK(cond)                                                                                                    \
+    do {                                                                                                               \
+        if(!(cond)) {                                                                                                  \
+            cout << __FILE__ << ":" << __LINE__ << " check failed: " #cond << endl;                                    \
+            failures++;                                                                                                \
+        }                                                                                                              \
+    } while(0)
+
+struct Conf
+{
+    static constexpr uint32_t NameSize = 16;
+    static constexpr bool ToLittleEndian = true;
+    static constexpr uint32_t TcpQueueSize = 4096;
+    static constexpr uint32_t TcpRecvBufInitSize = 4096;
+    static constexpr uint32_t TcpRecvBufMaxSize = 8192;
+    static constexpr bool TcpNoDelay = true;
+    static constexpr int64_t HeartBeatInverval = 1000000000LL; // 1s in ns
+    static constexpr int64_t ConnectionTimeout = 10000000000LL;
+};
+
+// a timeout so long that 64 times of it would overflow
+struct LongTimeoutConf : Conf
+{
+    static constexpr int64_t ConnectionTimeout = INT64_MAX / 8;
+};
+
+template<class C>
+void TestClamp() {
+    using Conn = PTCPConnection<C>;
+    CHECK(Conn::ClampHeartbeatInterval(0) == 0);
+    CHECK(Conn::ClampHeartbeatInterval(-1) == 0);
+    CHECK(Conn::ClampHeartbeatInterval(INT64_MIN) == 0);
+    CHECK(Conn::ClampHeartbeatInterval(1) == Conn::MinHeartbeatInterval);
+    CHECK(Conn::ClampHeartbeatInterval(INT64_MAX) == Conn::MaxHeartbeatInterval);
+    CHECK(Conn::ClampHeartbeatInterval(C::HeartBeatInverval) == C::HeartBeatInverval);
+    CHECK(Conn::MinHeartbeatInterval <= C::HeartBeatInverval && C::HeartBeatInverval <= Conn::MaxHeartbeatInterval);
+
+    // timestamps of now, e.g. ns since epoch in 2100
+    const int64_t now = 4102444800LL * 1000000000LL;
+    auto conn = make_unique<Conn>();
+    for(int64_t interval : {INT64_MAX, INT64_MAX / 2, INT64_MIN, int64_t(-1), int64_t(0), int64_t(1)}) {
+        conn->SetHeartbeatInterval(interval);
+        int64_t hb = conn->GetHeartbeatInterval();
+        CHECK(hb >= Conn::MinHeartbeatInterval && hb <= Conn::MaxHeartbeatInterval);
+        if(interval <= 0) CHECK(hb == C::HeartBeatInverval);
+        // NextTimerTime() with send and recv time 0 is min(heartbeat interval, timeout + 1)
+        int64_t next = conn->NextTimerTime();
+        CHECK(next > 0 && next <= hb);
+        CHECK(now + hb > now && now + next > now);
+    }
+}
+
+int main() {
+    TestClamp<Conf>();
+    CHECK(PTCPConnection<Conf>::MaxHeartbeatInterval == Conf::HeartBeatInverval * 64);
+    TestClamp<LongTimeoutConf>();
+    CHECK(PTCPConnection<LongTimeoutConf>::MaxHeartbeatInterval < Conf::HeartBeatInverval * 64);
+    cout << (failures ? "FAILED" : "PASSED") << endl;
+    return failures ? 1 : 0;
+}
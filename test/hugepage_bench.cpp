@@ -0,0 +1,169 @@
+#include "../mmap.h"
+#include "../spsc_varq.h"
+#include <bits/stdc++.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// measure a large shm queue mapped by my_mmap_queue() over 4KB pages, with MmapTransparentHugePage, and in a
+// hugetlbfs mount as with MmapHugetlbfsDir, all populated at mapping time so no page fault is timed
+// one thread writes msgs and reads each one back half a queue later, so every pass over the queue walks 2 far apart
+// positions, and the time of writing and reading a msg is taken along with dTLB misses from perf_event_open(), which
+// may be unavailable, e.g. in a VM without PMU or with kernel.perf_event_paranoid above 2
+// the part of the mapping actually backed by huge pages is read from /proc/self/smaps
+const uint32_t MsgBodySize = 1024;
+const uint32_t Laps = 64;
+
+using Q = SPSCVarQueue<>;
+
+string shm_file = "/hugepage_bench_" + to_string(getpid());
+
+int64_t Now() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// a counter of dTLB misses of this thread in user space, cache_op is PERF_COUNT_HW_CACHE_OP_READ or _WRITE
+class TlbMissCounter
+{
+public:
+    explicit TlbMissCounter(uint64_t cache_op) {
+        perf_event_attr attr = {};
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_DTLB | (cache_op << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if(fd < 0) error = strerror(errno);
+    }
+
+    ~TlbMissCounter() {
+        if(fd >= 0) close(fd);
+    }
+
+    void Start() {
+        if(fd < 0) return;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    // return -1 if unavailable
+    int64_t Stop() {
+        uint64_t cnt;
+        if(fd < 0) return -1;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if(read(fd, &cnt, sizeof(cnt)) != sizeof(cnt)) return -1;
+        return cnt;
+    }
+
+    int fd;
+    string error;
+};
+
+// KB of the mapping at addr backed by huge pages
+uint64_t HugePageKB(void* addr) {
+    ifstream smaps("/proc/self/smaps");
+    char start[32];
+    snprintf(start, sizeof(start), "%lx-", reinterpret_cast<unsigned long>(addr));
+    string line;
+    bool found = false;
+    uint64_t size_kb = 0;
+    while(getline(smaps, line)) {
+        if(!found) {
+            found = line.compare(0, strlen(start), start) == 0;
+            continue;
+        }
+        // the next mapping
+        if(isxdigit(line[0]) && line.find('-') < line.find(' ')) break;
+        istringstream is(line);
+        string key;
+        uint64_t kb;
+        if(!(is >> key >> kb)) continue;
+        if(key == "Size:") size_kb = kb;
+        else if(key == "KernelPageSize:" && kb > 4) return size_kb;
+        else if(key == "ShmemPmdMapped:" || key == "FilePmdMapped:") {
+            if(kb) return kb;
+        }
+    }
+    return 0;
+}
+
+void Bench(const char* name, uint32_t capacity, const MmapOpt& opt) {
+    string file = opt.hugetlbfs_dir ? string(opt.hugetlbfs_dir) + shm_file : "/dev/shm" + shm_file;
+    unlink(file.c_str());
+    const char* error_msg = "Unknown error";
+    Q* q = my_mmap_queue<Q>(shm_file.c_str(), true, capacity, &error_msg, opt);
+    if(!q) {
+        cout << name << ": mapping failed: " << error_msg << ": " << strerror(errno) << endl;
+        unlink(file.c_str());
+        return;
+    }
+    uint64_t huge_kb = HugePageKB(q);
+
+    uint32_t msg_blks = (MsgSizeOf(MsgBodySize) + 63) / 64;
+    uint64_t lag = capacity / 64 / msg_blks / 2;
+    uint64_t msgs = uint64_t(capacity) * Laps / (msg_blks * 64);
+    vector<int64_t> lats;
+    lats.reserve(msgs);
+    uint64_t sum = 0;
+    TlbMissCounter load_misses(PERF_COUNT_HW_CACHE_OP_READ);
+    TlbMissCounter store_misses(PERF_COUNT_HW_CACHE_OP_WRITE);
+    load_misses.Start();
+    store_misses.Start();
+    for(uint64_t i = 0; i < msgs; i++) {
+        int64_t t = Now();
+        MsgHeader* header = q->Alloc(MsgBodySize);
+        header->msg_type = 1;
+        uint64_t* body = static_cast<uint64_t*>(header->Body());
+        for(uint32_t j = 0; j < MsgBodySize / 8; j++) body[j] = i + j;
+        q->Push();
+        if(i >= lag) {
+            const uint64_t* read_body = static_cast<const uint64_t*>(q->Front()->Body());
+            for(uint32_t j = 0; j < MsgBodySize / 8; j++) sum += read_body[j];
+            q->Pop();
+        }
+        lats.push_back(Now() - t);
+    }
+    int64_t loads = load_misses.Stop();
+    int64_t stores = store_misses.Stop();
+    my_munmap_queue(q, true, opt);
+    unlink(file.c_str());
+
+    sort(lats.begin(), lats.end());
+    cout << name << ": " << huge_kb / 1024 << " of " << my_mmap_size(Q::MapSize(capacity), true, opt) / 1024 / 1024
+         << " MB in huge pages, write and read msg p50 " << lats[lats.size() / 2] << " ns, p99 "
+         << lats[lats.size() * 99 / 100] << " ns, p99.99 " << lats[lats.size() * 9999 / 10000] << " ns";
+    if(loads < 0 || stores < 0)
+        cout << ", dTLB misses unavailable: " << (loads < 0 ? load_misses.error : store_misses.error);
+    else
+        cout << ", dTLB load misses per msg " << double(loads) / msgs << ", store misses per msg "
+             << double(stores) / msgs;
+    // print sum so reads are not optimized away
+    cout << ", sum " << sum << endl;
+}
+
+int main(int argc, const char** argv) {
+    if(argc > 3) {
+        cout << "usage: hugepage_bench [HUGETLBFS_DIR] [QUEUE_MB]" << endl;
+        exit(1);
+    }
+    const char* hugetlbfs_dir = argc >= 2 ? argv[1] : "/dev/hugepages";
+    uint32_t queue_mb = argc == 3 ? atoi(argv[2]) : 16;
+    if(queue_mb == 0 || queue_mb > 1024 || !Q::ValidCapacity(queue_mb << 20)) {
+        cout << "QUEUE_MB must be a power of 2 no more than 1024" << endl;
+        exit(1);
+    }
+    uint32_t capacity = queue_mb << 20;
+    MmapOpt opt;
+    opt.populate = true;
+    Bench("4KB pages", capacity, opt);
+    opt.thp = true;
+    Bench("MmapTransparentHugePage", capacity, opt);
+    opt.thp = false;
+    opt.hugetlbfs_dir = hugetlbfs_dir;
+    Bench((string("MmapHugetlbfsDir ") + hugetlbfs_dir).c_str(), capacity, opt);
+    return 0;
+}
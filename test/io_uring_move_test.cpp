@@ -0,0 +1,146 @@
+#include "../ptcp_conn.h"
+#include <bits/stdc++.h>
+#include <sys/socket.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// a tcp connection handed over to the uring of another polling thread is detached from the current one first, its
+// poll request there has ended once IsIoUringDetached(), so no completion of that uring touches it afterwards
+int failures = 0;
+
+#define CHECK(cond)                                                                                                    \
+    do {                                                                                                               \
+        if(!(cond)) {                                                                                                  \
+            cout << __FILE__ << ":" << __LINE__ << " check failed: " #cond << endl;                                    \
+            failures++;                                                                                                \
+        }                                                                                                              \
+    } while(0)
+
+struct Conf
+{
+    static constexpr uint32_t NameSize = 16;
+    static constexpr bool ToLittleEndian = true;
+    static constexpr uint32_t TcpQueueSize = 4096;
+    static constexpr uint32_t TcpRecvBufInitSize = 4096;
+    static constexpr uint32_t TcpRecvBufMaxSize = 8192;
+    static constexpr bool TcpNoDelay = true;
+    static constexpr int64_t HeartBeatInverval = 1000000000LL;
+    static constexpr int64_t ConnectionTimeout = 10000000000LL;
+    static constexpr bool TcpUseIoUring = true;
+};
+using Conn = PTCPConnection<Conf>;
+
+string file = "/tmp/io_uring_move_test_" + to_string(getpid()) + ".ptcp";
+int peer_fd = -1;
+uint64_t seq = 0;
+
+void SendMsg() {
+    struct
+    {
+        MsgHeader header;
+        uint64_t body;
+    } msg;
+    msg.header.size = sizeof(msg);
+    msg.header.msg_type = 1;
+    msg.header.ack_seq = 0;
+    msg.header.ConvertByteOrder<Conf::ToLittleEndian>();
+    msg.body = ++seq;
+    CHECK(::send(peer_fd, &msg, sizeof(msg), MSG_NOSIGNAL) == sizeof(msg));
+}
+
+// the msg sent last, after completions of uring are handled as the polling thread does
+bool RecvMsg(Conn& conn, IoUring& uring) {
+    for(int i = 0; i < 1000; i++) {
+        uring.ForEachCqe([&uring](const io_uring_cqe& cqe) { Conn::OnIoUringCqe(uring, cqe); });
+        MsgHeader* header = conn.Front();
+        uring.Submit();
+        if(header) {
+            uint64_t body;
+            memcpy(&body, header->Body(), sizeof(body));
+            conn.Pop();
+            return body == seq;
+        }
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    return false;
+}
+
+bool Detach(Conn& conn, IoUring& uring) {
+    CHECK(conn.DetachIoUring());
+    for(int i = 0; i < 1000 && !conn.IsIoUringDetached(); i++) {
+        uring.Submit();
+        uring.ForEachCqe([&uring](const io_uring_cqe& cqe) { Conn::OnIoUringCqe(uring, cqe); });
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    return conn.IsIoUringDetached();
+}
+
+// completions of requests of conn in uring, stale ones included
+int CountCqes(Conn& conn, IoUring& uring) {
+    uring.Submit();
+    this_thread::sleep_for(chrono::milliseconds(20));
+    int cnt = 0;
+    uring.ForEachCqe([&](const io_uring_cqe& cqe) {
+        if((cqe.user_data & ((1ULL << 48) - 1)) == reinterpret_cast<uint64_t>(&conn)) cnt++;
+        Conn::OnIoUringCqe(uring, cqe);
+    });
+    return cnt;
+}
+
+int main() {
+    IoUring urings[2];
+    const char* error_msg;
+    for(auto& uring : urings) {
+        if(!uring.Init(16, &error_msg)) {
+            cout << "io_uring not available: " << error_msg << ", SKIPPED" << endl;
+            return 0;
+        }
+    }
+    auto conn = make_unique<Conn>();
+    unlink(file.c_str());
+    CHECK(conn->OpenFile(file.c_str(), Conf::TcpQueueSize, &error_msg));
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+    peer_fd = fds[1];
+    conn->Open(fds[0], 0, 0);
+    conn->SetIoUring(&urings[0]);
+
+    // moved back and forth with its poll request armed, and once more after the request got a completion
+    for(int round = 0; round < 10; round++) {
+        IoUring& from = urings[round % 2];
+        IoUring& to = urings[(round + 1) % 2];
+        SendMsg();
+        CHECK(RecvMsg(*conn, from));
+        if(round == 9) {
+            SendMsg();
+            CountCqes(*conn, from);
+        }
+        CHECK(Detach(*conn, from));
+        conn->MoveIoUring(&to);
+        if(round == 9) {
+            CHECK(RecvMsg(*conn, to));
+        }
+        SendMsg();
+        CHECK(CountCqes(*conn, from) == 0);
+        CHECK(RecvMsg(*conn, to));
+    }
+
+    // a closed conn is detached at once, its request is removed as stale once it fires in the old uring
+    IoUring& from = urings[0];
+    SendMsg();
+    CHECK(RecvMsg(*conn, from));
+    conn->RequestClose();
+    CHECK(conn->DetachIoUring() && conn->IsIoUringDetached());
+    conn->MoveIoUring(&urings[1]);
+    CHECK(conn->TryCloseFd());
+    int cnt = 0;
+    for(int i = 0; i < 3; i++) cnt = CountCqes(*conn, from);
+    CHECK(cnt == 0);
+
+    ::close(peer_fd);
+    conn->Release();
+    unlink(file.c_str());
+    cout << (failures ? "FAILED" : "PASSED") << endl;
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,290 @@
+#include "../tcpshm_server.h"
+#include "../tcpshm_client.h"
+#include <bits/stdc++.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// measure throughput of 256KB, 1MB and 4MB snapshots sent as one large msg, read in place by the receiver, against
+// split into msgs of FragSize bytes, which the receiver copies into a buffer to put the snapshot together, as it
+// had to be done when a msg was at most 64KB
+// snapshots go through an SPSCVarQueue between two threads, and over tcp by a server to a client requesting them
+// one by one, the receiver sums the whole snapshot in both cases
+const uint32_t FragSize = 60000;
+const uint32_t ShmQueueBytes = 64 << 20;
+
+struct Conf
+{
+    static constexpr uint32_t NameSize = 16;
+    static constexpr uint32_t ShmQueueSize = 4096;
+    static constexpr bool ToLittleEndian = true;
+    static constexpr uint32_t MaxNewConnections = 4;
+    static constexpr uint32_t MaxShmConnsPerGrp = 1;
+    static constexpr uint32_t MaxShmGrps = 1;
+    static constexpr uint32_t MaxTcpConnsPerGrp = 4;
+    static constexpr uint32_t MaxTcpGrps = 1;
+    static constexpr uint32_t TcpQueueSize = 64 << 20;
+    static constexpr uint32_t TcpRecvBufInitSize = 1 << 16;
+    static constexpr uint32_t TcpRecvBufMaxSize = 8 << 20;
+    static constexpr bool TcpNoDelay = true;
+    static constexpr int64_t NewConnectionTimeout = 3000000000LL;
+    static constexpr int64_t ConnectionTimeout = 10000000000LL;
+    static constexpr int64_t HeartBeatInverval = 1000000000LL;
+    using LoginUserData = char;
+    using LoginRspUserData = char;
+    using ConnectionUserData = char;
+};
+
+using Q = SPSCVarQueue<>;
+
+string dir = "/tmp/large_msg_bench_" + to_string(getpid());
+uint16_t port = 20000 + getpid() % 20000;
+
+int64_t Now() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// fill bytes [offset, offset + size) of snapshot seq, size and offset are multiples of 8
+void Fill(void* p, uint32_t offset, uint32_t size, uint64_t seq) {
+    uint64_t* body = static_cast<uint64_t*>(p);
+    for(uint32_t i = 0; i < size / 8; i++) body[i] = seq + offset / 8 + i;
+}
+
+uint64_t Sum(const void* p, uint32_t size) {
+    const uint64_t* body = static_cast<const uint64_t*>(p);
+    uint64_t sum = 0;
+    for(uint32_t i = 0; i < size / 8; i++) sum += body[i];
+    return sum;
+}
+
+uint64_t SnapshotSum(uint32_t size, uint64_t seq) {
+    uint64_t n = size / 8;
+    return n * seq + n * (n - 1) / 2;
+}
+
+// receives snapshots of size from large msgs or fragments
+struct Receiver
+{
+    explicit Receiver(uint32_t size)
+        : size(size)
+        , buf(new uint64_t[size / 8]) {}
+
+    // return true if a snapshot is complete
+    bool OnMsg(MsgHeader* header) {
+        uint32_t body_size = header->BodySize();
+        if(body_size == size) {
+            Check(Sum(header->Body(), size));
+            return true;
+        }
+        memcpy(reinterpret_cast<char*>(buf.get()) + got, header->Body(), body_size);
+        got += body_size;
+        if(got < size) return false;
+        got = 0;
+        Check(Sum(buf.get(), size));
+        return true;
+    }
+
+    void Check(uint64_t sum) {
+        if(sum != SnapshotSum(size, seq++)) ok = false;
+    }
+
+    uint32_t size;
+    unique_ptr<uint64_t[]> buf;
+    uint32_t got = 0;
+    uint64_t seq = 0;
+    bool ok = true;
+};
+
+// send snapshot seq by alloc(size) and push()
+template<class A, class P>
+void SendSnapshot(uint32_t size, bool large, uint64_t seq, A alloc, P push) {
+    uint32_t frag = large ? size : FragSize;
+    for(uint32_t offset = 0; offset < size; offset += frag) {
+        uint32_t n = min(frag, size - offset);
+        MsgHeader* header;
+        while(!(header = alloc(n))) this_thread::yield();
+        header->msg_type = 1;
+        Fill(header->Body(), offset, n, seq);
+        push();
+    }
+}
+
+void Report(const char* path, uint32_t size, bool large, uint64_t snapshots, int64_t ns, bool ok) {
+    cout << path << ", " << (size >> 10) << "KB snapshots " << (large ? "in one msg" : "in fragments") << ": "
+         << double(size) * snapshots / ns << " GB/s, " << static_cast<int64_t>(snapshots * 1e9 / ns)
+         << " snapshots per second" << (ok ? "" : ", WRONG SUM") << endl;
+}
+
+void BenchShm(uint32_t size, bool large, uint64_t snapshots) {
+    char* buf = new(align_val_t(128)) char[Q::MapSize(ShmQueueBytes)];
+    memset(buf, 0, Q::MapSize(ShmQueueBytes));
+    Q* q = new(buf) Q(ShmQueueBytes);
+    Receiver receiver(size);
+    int64_t start = Now();
+    thread consumer([&]() {
+        for(uint64_t n = 0; n < snapshots;) {
+            MsgHeader* header = q->Front();
+            if(!header) {
+                this_thread::yield();
+                continue;
+            }
+            n += receiver.OnMsg(header);
+            q->Pop();
+        }
+    });
+    for(uint64_t seq = 0; seq < snapshots; seq++) {
+        SendSnapshot(size, large, seq, [&](uint32_t n) { return q->Alloc(n); }, [&]() { q->Push(); });
+    }
+    consumer.join();
+    Report("shm", size, large, snapshots, Now() - start, receiver.ok);
+    operator delete[](buf, align_val_t(128));
+}
+
+class Server;
+using TSServer = TcpShmServer<Server, Conf>;
+
+class Server : public TSServer
+{
+public:
+    Server(uint32_t size, bool large)
+        : TSServer("server", dir + "/server")
+        , size(size)
+        , large(large) {
+        if(!Start("127.0.0.1", port)) exit(1);
+        thr = thread([this]() {
+            while(!stopped.load(memory_order_relaxed)) {
+                int64_t now = Now();
+                PollCtl(now);
+                PollTcp(now, 0);
+                // send out the part of a snapshot beyond the socket buffer
+                if(snapshot_conn) snapshot_conn->Flush();
+                this_thread::yield();
+            }
+        });
+    }
+
+    ~Server() {
+        stopped = true;
+        thr.join();
+        Stop();
+    }
+
+private:
+    friend TSServer;
+
+    void OnSystemError(const char* error_msg, int sys_errno) {
+        cout << "server error: " << error_msg << " " << sys_errno << endl;
+    }
+
+    int OnNewConnection(const struct sockaddr_in&, const LoginMsg* login, LoginRspMsg*) {
+        return login->use_shm ? -1 : 0;
+    }
+
+    void OnClientFileError(Connection&, const char* reason, int sys_errno) {
+        cout << "client file error: " << reason << " " << sys_errno << endl;
+    }
+
+    void OnSeqNumberMismatch(Connection&, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t) {}
+
+    void OnClientLogon(const struct sockaddr_in&, Connection&) {}
+
+    void OnClientDisconnected(Connection&, const char*, int) {}
+
+    // a snapshot request
+    void OnClientMsg(Connection& conn, MsgHeader*) {
+        snapshot_conn = &conn;
+        conn.Pop();
+        SendSnapshot(
+            size, large, seq++, [&](uint32_t n) { return conn.Alloc(n); }, [&]() { conn.Push(); });
+    }
+
+    uint32_t size;
+    bool large;
+    uint64_t seq = 0;
+    Connection* snapshot_conn = nullptr;
+    thread thr;
+    atomic<bool> stopped{false};
+};
+
+class Client;
+using TSClient = TcpShmClient<Client, Conf>;
+
+class Client : public TSClient
+{
+public:
+    explicit Client(uint32_t size)
+        : TSClient("client", dir + "/client")
+        , receiver(size) {
+        if(!Connect(false, "127.0.0.1", port, 0)) exit(1);
+    }
+
+    void RequestSnapshot() {
+        MsgHeader* header = GetConnection().Alloc(8);
+        header->msg_type = 2;
+        GetConnection().Push();
+        for(done = false; !done;) PollTcp(Now());
+    }
+
+    Receiver receiver;
+
+private:
+    friend TSClient;
+
+    void OnSystemError(const char* error_msg, int sys_errno) {
+        cout << "client error: " << error_msg << " " << sys_errno << endl;
+    }
+
+    void OnLoginReject(const LoginRspMsg* login_rsp) {
+        cout << "login rejected: " << login_rsp->error_msg << endl;
+    }
+
+    int64_t OnLoginSuccess(const LoginRspMsg*) {
+        return Now();
+    }
+
+    void OnSeqNumberMismatch(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t) {}
+
+    void OnServerMsg(MsgHeader* header) {
+        done = receiver.OnMsg(header);
+        GetConnection().Pop();
+    }
+
+    void OnDisconnected(const char* reason, int sys_errno) {
+        cout << "client disconnected: " << reason << " " << sys_errno << endl;
+        exit(1);
+    }
+
+    bool done = false;
+};
+
+void BenchTcp(uint32_t size, bool large, uint64_t snapshots) {
+    filesystem::remove_all(dir);
+    filesystem::create_directories(dir);
+    Server server(size, large);
+    Client client(size);
+    int64_t start = Now();
+    for(uint64_t i = 0; i < snapshots; i++) client.RequestSnapshot();
+    Report("tcp", size, large, snapshots, Now() - start, client.receiver.ok);
+    port++;
+}
+
+int main(int argc, const char** argv) {
+    if(argc > 2) {
+        cout << "usage: large_msg_bench [MB]" << endl;
+        exit(1);
+    }
+    // data of each case, a quarter of it for tcp
+    uint64_t mb = argc == 2 ? atoi(argv[1]) : 1024;
+    if(mb < 16) {
+        cout << "MB must be at least 16" << endl;
+        exit(1);
+    }
+    for(uint32_t size : {256u << 10, 1u << 20, 4u << 20}) {
+        for(bool large : {true, false}) BenchShm(size, large, (mb << 20) / size);
+    }
+    for(uint32_t size : {256u << 10, 1u << 20, 4u << 20}) {
+        for(bool large : {true, false}) BenchTcp(size, large, (mb << 18) / size);
+    }
+    filesystem::remove_all(dir);
+    return 0;
+}
@@ -0,0 +1,74 @@
+#include "../latency_stats.h"
+#include <bits/stdc++.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// print latency stats of a connection with ConfOpt<Conf>::LatencyStats from its shm file, without disturbing the
+// polling threads recording them, e.g. lat_stats /dev/shm/client_server.lat 5
+TscClock tsc_clock;
+
+void Print(const char* name, const LatencyHistogram::Snapshot& s) {
+    double ns_per_tick = 1.0 / tsc_clock.GetTscGhz();
+    auto ns = [&](uint64_t ticks) { return static_cast<uint64_t>(ticks * ns_per_tick); };
+    cout << name << ": cnt: " << s.total_cnt << " avg: " << (s.total_cnt ? ns(s.total / s.total_cnt) : 0)
+         << " p50: " << ns(s.Percentile(50)) << " p90: " << ns(s.Percentile(90)) << " p99: " << ns(s.Percentile(99))
+         << " p99.9: " << ns(s.Percentile(99.9)) << " p99.99: " << ns(s.Percentile(99.99)) << " max: " << ns(s.max)
+         << " ns" << endl;
+}
+
+int main(int argc, const char** argv) {
+    if(argc != 2 && argc != 3) {
+        cout << "usage: lat_stats FILE [INTERVAL_SECONDS]" << endl;
+        exit(1);
+    }
+    int interval = argc == 3 ? atoi(argv[2]) : 0;
+    int fd = open(argv[1], O_RDONLY);
+    if(fd < 0) {
+        cout << "open " << argv[1] << " error: " << strerror(errno) << endl;
+        exit(1);
+    }
+    void* addr = mmap(nullptr, sizeof(ConnLatencyStats), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED) {
+        cout << "mmap error: " << strerror(errno) << endl;
+        exit(1);
+    }
+    const ConnLatencyStats* stats = static_cast<const ConnLatencyStats*>(addr);
+    // histograms are in tsc ticks of the same host, which is calibrated here
+    if(!tsc_clock.Init()) {
+        cout << "tsc is not invariant, latencies can't be converted" << endl;
+        exit(1);
+    }
+
+    // with an interval, print stats of msgs recorded in each interval, otherwise all since the file was created
+    auto last_one_way = make_unique<LatencyHistogram::Snapshot>();
+    auto last_handler = make_unique<LatencyHistogram::Snapshot>();
+    last_one_way->Load(stats->one_way);
+    last_handler->Load(stats->handler);
+    if(!interval) {
+        Print("one way", *last_one_way);
+        Print("handler", *last_handler);
+        return 0;
+    }
+    auto one_way = make_unique<LatencyHistogram::Snapshot>();
+    auto handler = make_unique<LatencyHistogram::Snapshot>();
+    auto delta = make_unique<LatencyHistogram::Snapshot>();
+    while(true) {
+        this_thread::sleep_for(chrono::seconds(interval));
+        one_way->Load(stats->one_way);
+        handler->Load(stats->handler);
+        *delta = *one_way;
+        delta->Subtract(*last_one_way);
+        Print("one way", *delta);
+        *delta = *handler;
+        delta->Subtract(*last_handler);
+        Print("handler", *delta);
+        swap(one_way, last_one_way);
+        swap(handler, last_handler);
+    }
+    return 0;
+}
@@ -0,0 +1,164 @@
+#include "../latency_stats.h"
+#include "../spsc_varq.h"
+#include <bits/stdc++.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// counts of ConnLatencyStats recorded by LatencyRecorder over the single and batch receiving interfaces, a msg is
+// counted in one_way once when it's first seen, and handler once per Pop() or PopN()
+using Q = SPSCVarQueue<>;
+using Recorder = LatencyRecorder<Q::Iterator>;
+
+int failures = 0;
+
+#define CHECK(cond)                                                                                                    \
+    do {                                                                                                               \
+        if(!(cond)) {                                                                                                  \
+            cout << __FILE__ << ":" << __LINE__ << " check failed: " #cond << endl;                                    \
+            failures++;                                                                                                \
+        }                                                                                                              \
+    } while(0)
+
+struct QueueBuf
+{
+    explicit QueueBuf(uint32_t capacity)
+        : buf(new(align_val_t(128)) char[Q::MapSize(capacity)]) {
+        q = new(buf) Q(capacity);
+    }
+
+    ~QueueBuf() {
+        operator delete[](buf, align_val_t(128));
+    }
+
+    char* buf;
+    Q* q;
+};
+
+void PushMsgs(Q* q, int n) {
+    for(int i = 0; i < n; i++) {
+        MsgHeader* header = q->Alloc(8 + i % 3 * 64);
+        header->msg_type = 1;
+        header->ack_seq = LatencyStamp();
+        q->Push();
+    }
+}
+
+uint64_t Count(const LatencyHistogram& h) {
+    return h.total_cnt.load(memory_order_relaxed);
+}
+
+// a pending msg returned by Front() many times is counted once
+void TestFrontPop() {
+    QueueBuf buf(4096);
+    auto stats = make_unique<ConnLatencyStats>();
+    Recorder rec;
+    rec.Reset(stats.get(), true);
+    PushMsgs(buf.q, 3);
+    for(int i = 0; i < 3; i++) {
+        for(int j = 0; j < 4; j++) rec.OnFront(buf.q->Front());
+        rec.OnPop();
+        buf.q->Pop();
+        CHECK(Count(stats->one_way) == uint64_t(i + 1));
+        CHECK(Count(stats->handler) == uint64_t(i + 1));
+    }
+    rec.OnFront(buf.q->Front()); // empty
+    CHECK(Count(stats->one_way) == 3);
+
+    // one_way is not recorded for tcp, whose msgs carry no stamp
+    auto tcp_stats = make_unique<ConnLatencyStats>();
+    rec.Reset(tcp_stats.get(), false);
+    PushMsgs(buf.q, 1);
+    rec.OnFront(buf.q->Front());
+    rec.OnFront(buf.q->Front());
+    rec.OnPop();
+    buf.q->Pop();
+    CHECK(Count(tcp_stats->one_way) == 0);
+    CHECK(Count(tcp_stats->handler) == 1);
+}
+
+// a run consumed by several PopN() calls, with more msgs arriving in between, is counted in handler once per PopN(),
+// and each msg in one_way once
+void TestSplitPopN() {
+    QueueBuf buf(4096);
+    auto stats = make_unique<ConnLatencyStats>();
+    Recorder rec;
+    rec.Reset(stats.get(), true);
+    for(int round = 1; round <= 20; round++) {
+        PushMsgs(buf.q, 10);
+        auto msgs = buf.q->FrontN();
+        rec.OnFrontN(msgs.begin(), msgs.end());
+        CHECK(Count(stats->one_way) == uint64_t(round * 13 - 3));
+
+        // pop 4 of them
+        auto pos = msgs.begin();
+        for(int i = 0; i < 4; i++) ++pos;
+        rec.OnPopN(pos);
+        buf.q->PopN(pos);
+        CHECK(Count(stats->handler) == uint64_t(round * 3 - 2));
+
+        // 3 more arrive, the 6 left are not counted again
+        PushMsgs(buf.q, 3);
+        msgs = buf.q->FrontN();
+        rec.OnFrontN(msgs.begin(), msgs.end());
+        CHECK(Count(stats->one_way) == uint64_t(round * 13));
+
+        // pop all but the last, then the last
+        pos = msgs.begin();
+        for(int i = 0; i < 8; i++) ++pos;
+        rec.OnPopN(pos);
+        buf.q->PopN(pos);
+        CHECK(Count(stats->handler) == uint64_t(round * 3 - 1));
+        rec.OnPopN(msgs.end());
+        buf.q->PopN(msgs.end());
+        CHECK(Count(stats->handler) == uint64_t(round * 3));
+
+        // nothing pending
+        msgs = buf.q->FrontN();
+        CHECK(msgs.empty());
+        rec.OnFrontN(msgs.begin(), msgs.end());
+        rec.OnPopN(msgs.end());
+        CHECK(Count(stats->handler) == uint64_t(round * 3));
+    }
+}
+
+// handler of a PopN() counts from when the first msg it consumes was first seen, not from the first FrontN() of
+// msgs pending
+void TestHandlerStart() {
+    QueueBuf buf(4096);
+    auto stats = make_unique<ConnLatencyStats>();
+    Recorder rec;
+    rec.Reset(stats.get(), true);
+    PushMsgs(buf.q, 4);
+    auto msgs = buf.q->FrontN();
+    rec.OnFrontN(msgs.begin(), msgs.end());
+    int64_t tsc = TscClock::ReadTsc();
+    this_thread::sleep_for(chrono::milliseconds(20));
+    uint64_t slept = TscClock::ReadTsc() - tsc;
+    PushMsgs(buf.q, 4);
+    msgs = buf.q->FrontN();
+    rec.OnFrontN(msgs.begin(), msgs.end());
+
+    // the first 4 were seen before the sleep
+    auto pos = msgs.begin();
+    for(int i = 0; i < 4; i++) ++pos;
+    rec.OnPopN(pos);
+    buf.q->PopN(pos);
+    uint64_t total = stats->handler.total.load(memory_order_relaxed);
+    CHECK(total >= slept);
+
+    // the last 4 after it
+    rec.OnPopN(msgs.end());
+    buf.q->PopN(msgs.end());
+    CHECK(stats->handler.total.load(memory_order_relaxed) - total < slept);
+    CHECK(Count(stats->handler) == 2);
+    CHECK(Count(stats->one_way) == 8);
+}
+
+int main() {
+    TestFrontPop();
+    TestSplitPopN();
+    TestHandlerStart();
+    cout << (failures ? "FAILED" : "PASSED") << endl;
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,168 @@
+#include "../tcpshm_server.h"
+#include <bits/stdc++.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// measure logins per second of the control thread for many named clients of a group: first logins allocating conns,
+// clients of known names reconnecting at once, e.g. after a network blip, and the same after a server restart, when
+// the conns are restored from the name file
+// clients log in by raw sockets, MaxNewConnections at a time, and disconnect right after the login response
+struct Conf
+{
+    static constexpr uint32_t NameSize = 16;
+    static constexpr uint32_t ShmQueueSize = 4096;
+    static constexpr bool ToLittleEndian = true;
+    static constexpr uint32_t MaxNewConnections = 64;
+    static constexpr uint32_t MaxShmConnsPerGrp = 1;
+    static constexpr uint32_t MaxShmGrps = 1;
+    static constexpr uint32_t MaxTcpConnsPerGrp = 4096;
+    static constexpr uint32_t MaxTcpGrps = 1;
+    static constexpr uint32_t TcpQueueSize = 1024;
+    static constexpr uint32_t TcpRecvBufInitSize = 1024;
+    static constexpr uint32_t TcpRecvBufMaxSize = 4096;
+    static constexpr bool TcpNoDelay = true;
+    static constexpr int64_t NewConnectionTimeout = 3000000000LL;
+    static constexpr int64_t ConnectionTimeout = 10000000000LL;
+    static constexpr int64_t HeartBeatInverval = 1000000000LL;
+    using LoginUserData = char;
+    using LoginRspUserData = char;
+    using ConnectionUserData = char;
+};
+using LoginMsg = LoginMsgTpl<Conf>;
+using LoginRspMsg = LoginRspMsgTpl<Conf>;
+
+string dir = "/tmp/login_bench_" + to_string(getpid());
+uint16_t port = 20000 + getpid() % 20000;
+
+int64_t Now() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class Server;
+using TSServer = TcpShmServer<Server, Conf>;
+
+class Server : public TSServer
+{
+public:
+    Server()
+        : TSServer("server", dir) {
+        if(!Start("127.0.0.1", port)) exit(1);
+        thr = thread([this]() {
+            while(!stopped.load(memory_order_relaxed)) {
+                int64_t now = Now();
+                PollCtl(now);
+                PollTcp(now, 0);
+            }
+        });
+    }
+
+    ~Server() {
+        stopped = true;
+        thr.join();
+        Stop();
+    }
+
+    using TSServer::GetGroupStats;
+
+private:
+    friend TSServer;
+
+    void OnSystemError(const char* error_msg, int sys_errno) {
+        cout << "server error: " << error_msg << " " << sys_errno << endl;
+    }
+
+    int OnNewConnection(const struct sockaddr_in&, const LoginMsg* login, LoginRspMsg*) {
+        return login->use_shm ? -1 : 0;
+    }
+
+    void OnClientFileError(Connection&, const char* reason, int sys_errno) {
+        cout << "client file error: " << reason << " " << sys_errno << endl;
+    }
+
+    void OnSeqNumberMismatch(Connection&, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t) {}
+
+    void OnClientLogon(const struct sockaddr_in&, Connection&) {}
+
+    void OnClientDisconnected(Connection&, const char*, int) {}
+
+    void OnClientMsg(Connection& conn, MsgHeader*) {
+        conn.Pop();
+    }
+
+    thread thr;
+    atomic<bool> stopped{false};
+};
+
+// connect and send the login of each name, then wait for all responses, return the count of logins accepted
+int LoginBatch(const vector<string>& names, size_t begin, size_t end) {
+    vector<int> fds;
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    addr.sin_port = htons(port);
+    for(size_t i = begin; i < end; i++) {
+        MsgHeader sendbuf[1 + (sizeof(LoginMsg) + 7) / 8] = {};
+        sendbuf[0].size = sizeof(MsgHeader) + sizeof(LoginMsg);
+        sendbuf[0].msg_type = LoginMsg::msg_type;
+        sendbuf[0].ConvertByteOrder<Conf::ToLittleEndian>();
+        LoginMsg* login = reinterpret_cast<LoginMsg*>(sendbuf + 1);
+        strncpy(login->client_name, names[i].c_str(), sizeof(login->client_name) - 1);
+        strncpy(login->last_server_name, "server", sizeof(login->last_server_name) - 1);
+        login->ConvertByteOrder();
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+           send(fd, sendbuf, sizeof(sendbuf), MSG_NOSIGNAL) != sizeof(sendbuf)) {
+            cout << "connect or send failed: " << strerror(errno) << endl;
+            exit(1);
+        }
+        fds.push_back(fd);
+    }
+    int ok = 0;
+    for(int fd : fds) {
+        MsgHeader recvbuf[1 + (sizeof(LoginRspMsg) + 7) / 8];
+        if(recv(fd, recvbuf, sizeof(recvbuf), MSG_WAITALL) == sizeof(recvbuf)) {
+            LoginRspMsg* rsp = reinterpret_cast<LoginRspMsg*>(recvbuf + 1);
+            if(rsp->error_msg[0] == 0) ok++;
+        }
+        ::close(fd);
+    }
+    return ok;
+}
+
+// log in all names and wait until the server has seen them all disconnect
+void BenchRound(const char* name, Server& server, const vector<string>& names) {
+    int64_t start = Now();
+    int ok = 0;
+    for(size_t i = 0; i < names.size(); i += Conf::MaxNewConnections) {
+        ok += LoginBatch(names, i, min(names.size(), i + Conf::MaxNewConnections));
+    }
+    int64_t latency = Now() - start;
+    cout << name << ": " << ok << "/" << names.size() << " logins in " << latency / 1000000.0
+         << " ms, logins per second: " << static_cast<int64_t>(names.size() * 1e9 / latency) << endl;
+    while(server.GetGroupStats(false, 0).conn_cnt) this_thread::sleep_for(chrono::milliseconds(1));
+}
+
+int main(int argc, const char** argv) {
+    if(argc > 2) {
+        cout << "usage: login_bench [CLIENTS]" << endl;
+        exit(1);
+    }
+    uint32_t clients = argc == 2 ? atoi(argv[1]) : 2000;
+    if(clients == 0 || clients > Conf::MaxTcpConnsPerGrp) {
+        cout << "CLIENTS must be in [1, " << Conf::MaxTcpConnsPerGrp << "]" << endl;
+        exit(1);
+    }
+    filesystem::remove_all(dir);
+    vector<string> names;
+    for(uint32_t i = 0; i < clients; i++) names.push_back("client" + to_string(i));
+    auto server = make_unique<Server>();
+    BenchRound("first logins", *server, names);
+    BenchRound("reconnect of known names", *server, names);
+    server.reset();
+    server = make_unique<Server>();
+    BenchRound("reconnect after restart", *server, names);
+    server.reset();
+    filesystem::remove_all(dir);
+    return 0;
+}
@@ -0,0 +1,137 @@
+#include "../mpsc_varq.h"
+#include "../spsc_varq.h"
+#include <bits/stdc++.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// measure 2, 4 and 8 producer threads sending msgs to one consumer through a shared MPSCVarQueue, against through an
+// SPSCVarQueue guarded by a mutex, the simplest way to share a connection without the multi producer queue
+// the cost of a send is the time of Alloc(), filling the msg and Push(), including the wait for the lock or for room
+// msgs are of 64 bytes, and the consumer checks every producer's msgs arrive in order
+const uint32_t QueueBytes = 1 << 20;
+const uint32_t MsgBodySize = 56;
+
+using MQ = MPSCVarQueue<>;
+using Q = SPSCVarQueue<>;
+
+int64_t Now() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Msg
+{
+    uint32_t producer;
+    uint64_t seq;
+};
+
+template<class QT>
+struct QueueBuf
+{
+    QueueBuf()
+        : buf(new(align_val_t(128)) char[QT::MapSize(QueueBytes)]) {
+        q = new(buf) QT(QueueBytes);
+    }
+
+    ~QueueBuf() {
+        operator delete[](buf, align_val_t(128));
+    }
+
+    char* buf;
+    QT* q;
+};
+
+// start producers calling send(producer, seq) for their msgs and a consumer calling q->Front() and Pop(), then print
+// send latencies and the throughput
+template<class QT, class F>
+void Bench(const char* name, QT* q, uint32_t producers, uint64_t msgs, F send) {
+    uint64_t per_producer = msgs / producers;
+    atomic<bool> ok{true};
+    thread consumer([&]() {
+        vector<uint64_t> next(producers, 0);
+        for(uint64_t n = 0; n < per_producer * producers;) {
+            MsgHeader* header = q->Front();
+            if(!header) {
+                this_thread::yield();
+                continue;
+            }
+            Msg msg;
+            memcpy(&msg, header->Body(), sizeof(msg));
+            q->Pop();
+            if(msg.producer >= producers || msg.seq != next[msg.producer]++) ok = false;
+            n++;
+        }
+    });
+    vector<vector<int64_t>> lats(producers);
+    vector<thread> thrs;
+    atomic<uint32_t> ready{0};
+    int64_t start = 0;
+    for(uint32_t p = 0; p < producers; p++) {
+        thrs.emplace_back([&, p]() {
+            auto& lat = lats[p];
+            lat.reserve(per_producer);
+            if(++ready == producers) start = Now();
+            while(ready < producers) this_thread::yield();
+            for(uint64_t seq = 0; seq < per_producer; seq++) {
+                int64_t t = Now();
+                send(p, seq);
+                lat.push_back(Now() - t);
+            }
+        });
+    }
+    for(auto& thr : thrs) thr.join();
+    consumer.join();
+    int64_t total_ns = Now() - start;
+    vector<int64_t> all;
+    for(auto& lat : lats) all.insert(all.end(), lat.begin(), lat.end());
+    sort(all.begin(), all.end());
+    cout << name << ", " << producers << " producers: send p50 " << all[all.size() / 2] << " ns, p99 "
+         << all[all.size() * 99 / 100] << " ns, p99.99 " << all[all.size() * 9999 / 10000] << " ns, "
+         << static_cast<int64_t>(all.size() * 1e9 / total_ns) << " msgs per second" << (ok ? "" : ", OUT OF ORDER")
+         << endl;
+}
+
+void FillMsg(MsgHeader* header, uint32_t producer, uint64_t seq) {
+    header->msg_type = 1;
+    Msg msg{producer, seq};
+    memcpy(header->Body(), &msg, sizeof(msg));
+}
+
+int main(int argc, const char** argv) {
+    if(argc > 2) {
+        cout << "usage: mpsc_bench [MSGS]" << endl;
+        exit(1);
+    }
+    uint64_t msgs = argc == 2 ? atoll(argv[1]) : 2000000;
+    if(msgs < 8) {
+        cout << "MSGS must be at least 8" << endl;
+        exit(1);
+    }
+    for(uint32_t producers : {2, 4, 8}) {
+        QueueBuf<MQ> mbuf;
+        Bench("MPSCVarQueue", mbuf.q, producers, msgs, [&](uint32_t p, uint64_t seq) {
+            MsgHeader* header;
+            while(!(header = mbuf.q->Alloc(MsgBodySize))) this_thread::yield();
+            FillMsg(header, p, seq);
+            mbuf.q->Push(header);
+        });
+
+        QueueBuf<Q> buf;
+        mutex mtx;
+        Bench("SPSCVarQueue with mutex", buf.q, producers, msgs, [&](uint32_t p, uint64_t seq) {
+            while(true) {
+                {
+                    lock_guard<mutex> lock(mtx);
+                    MsgHeader* header = buf.q->Alloc(MsgBodySize);
+                    if(header) {
+                        FillMsg(header, p, seq);
+                        buf.q->Push();
+                        return;
+                    }
+                }
+                this_thread::yield();
+            }
+        });
+    }
+    return 0;
+}
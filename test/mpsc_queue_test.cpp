@@ -0,0 +1,152 @@
+#include "../mpsc_varq.h"
+#include <bits/stdc++.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// a msg of MPSCVarQueue is pushed by its header, so msgs allocated by one thread from several queues, or several from
+// one queue, are each published by their own Push(), and producers racing on one queue never lose a msg
+using Q = MPSCVarQueue<>;
+
+int failures = 0;
+
+#define CHECK(cond)                                                                                                    \
+    do {                                                                                                               \
+        if(!(cond)) {                                                                                                  \
+            cout << __FILE__ << ":" << __LINE__ << " check failed: " #cond << endl;                                    \
+            failures++;                                                                                                \
+        }                                                                                                              \
+    } while(0)
+
+struct QueueBuf
+{
+    explicit QueueBuf(uint32_t capacity)
+        : buf(new(align_val_t(128)) char[Q::MapSize(capacity)]) {
+        q = new(buf) Q(capacity);
+    }
+
+    ~QueueBuf() {
+        operator delete[](buf, align_val_t(128));
+    }
+
+    char* buf;
+    Q* q;
+};
+
+MsgHeader* AllocMsg(Q* q, uint32_t size, uint64_t val) {
+    MsgHeader* header = q->Alloc(size);
+    if(!header) return nullptr;
+    header->msg_type = 1;
+    memcpy(header->Body(), &val, sizeof(val));
+    return header;
+}
+
+uint64_t BodyOf(MsgHeader* header) {
+    uint64_t val;
+    memcpy(&val, header->Body(), sizeof(val));
+    return val;
+}
+
+// Alloc A, Alloc B, Push A must publish the msg of A, not that of B
+void TestInterleaveQueues() {
+    QueueBuf a(4096), b(4096);
+    for(uint64_t i = 0; i < 200; i++) {
+        MsgHeader* ha = AllocMsg(a.q, 8 * (1 + i % 5), i);
+        MsgHeader* hb = AllocMsg(b.q, 8 * (1 + i % 3), i + 1000);
+        CHECK(ha && hb);
+        a.q->Push(ha);
+        CHECK(!b.q->Front());
+        MsgHeader* fa = a.q->Front();
+        CHECK(fa == ha && BodyOf(fa) == i);
+        a.q->Pop();
+        b.q->Push(hb);
+        MsgHeader* fb = b.q->Front();
+        CHECK(fb == hb && BodyOf(fb) == i + 1000);
+        b.q->Pop();
+        CHECK(!a.q->Front() && !b.q->Front());
+    }
+}
+
+// several msgs of one queue allocated before being pushed in reverse order, the reader sees them only when the
+// first one is pushed
+void TestOutOfOrderPush() {
+    QueueBuf a(1024);
+    for(uint64_t round = 0; round < 100; round++) {
+        MsgHeader* h[4];
+        for(uint64_t i = 0; i < 4; i++) {
+            h[i] = AllocMsg(a.q, 8 + 64 * (round % 3), round * 4 + i);
+            CHECK(h[i]);
+        }
+        for(int i = 3; i > 0; i--) {
+            a.q->Push(h[i]);
+            CHECK(!a.q->Front());
+        }
+        a.q->Push(h[0]);
+        for(uint64_t i = 0; i < 4; i++) {
+            MsgHeader* f = a.q->Front();
+            CHECK(f && BodyOf(f) == round * 4 + i);
+            a.q->Pop();
+        }
+    }
+}
+
+// a msg taking the whole queue is as far from write_idx_ as the queue size
+void TestWholeQueueMsg() {
+    const uint32_t capacity = 1024;
+    QueueBuf a(capacity);
+    for(uint64_t i = 0; i < 10; i++) {
+        MsgHeader* h = AllocMsg(a.q, capacity - sizeof(MsgHeader), i);
+        CHECK(h);
+        if(!h) return;
+        CHECK(!a.q->Alloc(8));
+        a.q->Push(h);
+        MsgHeader* f = a.q->Front();
+        CHECK(f == h && BodyOf(f) == i);
+        a.q->Pop();
+    }
+}
+
+// producers each allocating two msgs before pushing them in reverse order, the consumer sees every msg of a
+// producer in order
+void TestProducers() {
+    const int producer_cnt = 4;
+    const uint64_t per_producer = 200000;
+    QueueBuf a(4096);
+    vector<thread> producers;
+    for(int p = 0; p < producer_cnt; p++) {
+        producers.emplace_back([&, p]() {
+            for(uint64_t i = 0; i < per_producer; i += 2) {
+                MsgHeader *h1, *h2;
+                while(!(h1 = AllocMsg(a.q, 8, uint64_t(p) << 32 | i))) this_thread::yield();
+                while(!(h2 = AllocMsg(a.q, 16, uint64_t(p) << 32 | (i + 1)))) this_thread::yield();
+                a.q->Push(h2);
+                a.q->Push(h1);
+            }
+        });
+    }
+    vector<uint64_t> next(producer_cnt, 0);
+    for(uint64_t n = 0; n < producer_cnt * per_producer;) {
+        MsgHeader* f = a.q->Front();
+        if(!f) {
+            this_thread::yield();
+            continue;
+        }
+        uint64_t val = BodyOf(f);
+        uint32_t p = val >> 32;
+        CHECK(p < producer_cnt && (val & 0xffffffff) == next[p]);
+        // go on consuming after a failure, so producers are not blocked
+        if(p < producer_cnt) next[p] = (val & 0xffffffff) + 1;
+        a.q->Pop();
+        n++;
+    }
+    for(auto& t : producers) t.join();
+}
+
+int main() {
+    TestInterleaveQueues();
+    TestOutOfOrderPush();
+    TestWholeQueueMsg();
+    TestProducers();
+    cout << (failures ? "FAILED" : "PASSED") << endl;
+    return failures ? 1 : 0;
+}
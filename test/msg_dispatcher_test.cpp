@@ -0,0 +1,97 @@
+#include "../msg_dispatcher.h"
+#include <bits/stdc++.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// MsgDispatcher calls OnMsg() of the type of a msg and passes the extra args through, and returns false without
+// calling it for an unknown msg_type, a msg_type beyond its table, or a msg smaller than its type, while a larger msg
+// is dispatched
+int failures = 0;
+
+#define CHECK(cond)                                                                                                    \
+    do {                                                                                                               \
+        if(!(cond)) {                                                                                                  \
+            cout << __FILE__ << ":" << __LINE__ << " check failed: " #cond << endl;                                    \
+            failures++;                                                                                                \
+        }                                                                                                              \
+    } while(0)
+
+struct SmallMsg
+{
+    static constexpr uint16_t msg_type = 1;
+    int64_t val;
+};
+
+struct BigMsg
+{
+    static constexpr uint16_t msg_type = 4;
+    int64_t vals[4];
+};
+
+class Handler;
+using Dispatcher = MsgDispatcher<Handler, SmallMsg, BigMsg>;
+
+class Handler
+{
+public:
+    // the msg_type of the last msg dispatched, and its first field
+    uint16_t got_type = 0;
+    int64_t got_val = 0;
+
+    void OnMsg(int& calls, const SmallMsg& msg) {
+        calls++;
+        got_type = SmallMsg::msg_type;
+        got_val = msg.val;
+    }
+
+    void OnMsg(int& calls, const BigMsg& msg) {
+        calls++;
+        got_type = BigMsg::msg_type;
+        got_val = msg.vals[0];
+    }
+};
+
+// a msg of msg_type with body_size bytes, the first 8 of which are val
+struct MsgBuf
+{
+    MsgBuf(uint16_t msg_type, uint32_t body_size, int64_t val) {
+        Header()->msg_type = msg_type;
+        SetMsgSize(*Header(), MsgSizeOf(body_size));
+        memcpy(Header()->Body(), &val, min<uint32_t>(body_size, sizeof(val)));
+    }
+
+    MsgHeader* Header() {
+        return reinterpret_cast<MsgHeader*>(buf);
+    }
+
+    alignas(8) char buf[256] = {};
+};
+
+// dispatch msg, and check whether it's dispatched to OnMsg() of expect_type
+void CheckDispatch(MsgBuf msg, bool expect, uint16_t expect_type = 0, int64_t expect_val = 0) {
+    Handler handler;
+    int calls = 0;
+    bool ok = Dispatcher::Dispatch(handler, msg.Header(), calls);
+    CHECK(ok == expect);
+    CHECK(calls == (expect ? 1 : 0));
+    CHECK(handler.got_type == expect_type && handler.got_val == expect_val);
+}
+
+int main() {
+    CheckDispatch(MsgBuf(SmallMsg::msg_type, sizeof(SmallMsg), 11), true, SmallMsg::msg_type, 11);
+    CheckDispatch(MsgBuf(BigMsg::msg_type, sizeof(BigMsg), 22), true, BigMsg::msg_type, 22);
+    // unknown msg_type within the table, and msg_types beyond it
+    CheckDispatch(MsgBuf(2, sizeof(BigMsg), 33), false);
+    CheckDispatch(MsgBuf(0, sizeof(BigMsg), 33), false);
+    CheckDispatch(MsgBuf(5, sizeof(BigMsg), 33), false);
+    CheckDispatch(MsgBuf(UINT16_MAX, sizeof(BigMsg), 33), false);
+    // smaller than its type, even by one byte, or with no body at all
+    CheckDispatch(MsgBuf(BigMsg::msg_type, sizeof(BigMsg) - 1, 44), false);
+    CheckDispatch(MsgBuf(SmallMsg::msg_type, 0, 0), false);
+    // larger than its type, e.g. a newer version with fields appended
+    CheckDispatch(MsgBuf(SmallMsg::msg_type, sizeof(SmallMsg) + 24, 55), true, SmallMsg::msg_type, 55);
+    CheckDispatch(MsgBuf(BigMsg::msg_type, sizeof(BigMsg) + 100, 66), true, BigMsg::msg_type, 66);
+    cout << (failures ? "FAILED" : "PASSED") << endl;
+    return failures ? 1 : 0;
+}
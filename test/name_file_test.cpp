@@ -0,0 +1,185 @@
+#include "../tcpshm_server.h"
+#include "../tcpshm_client.h"
+#include <bits/stdc++.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// names of the clients of a group are persisted in its name file, so after a restart the known clients keep their
+// places, and the group is as full for new names as it was before, e.g. name_file_test
+int failures = 0;
+
+#define CHECK(cond)                                                                                                    \
+    do {                                                                                                               \
+        if(!(cond)) {                                                                                                  \
+            cout << __FILE__ << ":" << __LINE__ << " check failed: " #cond << endl;                                    \
+            failures++;                                                                                                \
+        }                                                                                                              \
+    } while(0)
+
+struct Conf
+{
+    static constexpr uint32_t NameSize = 16;
+    static constexpr uint32_t ShmQueueSize = 4096;
+    static constexpr bool ToLittleEndian = true;
+    static constexpr uint32_t MaxNewConnections = 4;
+    static constexpr uint32_t MaxShmConnsPerGrp = 2;
+    static constexpr uint32_t MaxShmGrps = 1;
+    static constexpr uint32_t MaxTcpConnsPerGrp = 2;
+    static constexpr uint32_t MaxTcpGrps = 1;
+    static constexpr uint32_t TcpQueueSize = 4096;
+    static constexpr uint32_t TcpRecvBufInitSize = 1024;
+    static constexpr uint32_t TcpRecvBufMaxSize = 4096;
+    static constexpr bool TcpNoDelay = true;
+    static constexpr int64_t NewConnectionTimeout = 3000000000LL;
+    static constexpr int64_t ConnectionTimeout = 10000000000LL;
+    static constexpr int64_t HeartBeatInverval = 1000000000LL;
+    using LoginUserData = char;
+    using LoginRspUserData = char;
+    using ConnectionUserData = char;
+};
+
+string dir = "/tmp/name_file_test_" + to_string(getpid());
+uint16_t port = 20000 + getpid() % 20000;
+
+int64_t Now() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class Server;
+using TSServer = TcpShmServer<Server, Conf>;
+
+class Server : public TSServer
+{
+public:
+    Server()
+        : TSServer("server", dir + "/server") {
+        CHECK(Start("127.0.0.1", port));
+        thr = thread([this]() {
+            while(!stopped.load(memory_order_relaxed)) {
+                int64_t now = Now();
+                PollCtl(now);
+                PollTcp(now, 0);
+                this_thread::yield();
+            }
+        });
+    }
+
+    ~Server() {
+        stopped = true;
+        thr.join();
+        Stop();
+    }
+
+private:
+    friend TSServer;
+
+    void OnSystemError(const char* error_msg, int sys_errno) {
+        cout << "server error: " << error_msg << " " << sys_errno << endl;
+    }
+
+    int OnNewConnection(const struct sockaddr_in&, const LoginMsg* login, LoginRspMsg*) {
+        return login->use_shm ? -1 : 0;
+    }
+
+    void OnClientFileError(Connection&, const char* reason, int sys_errno) {
+        cout << "client file error: " << reason << " " << sys_errno << endl;
+    }
+
+    void OnSeqNumberMismatch(Connection&, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t) {}
+
+    void OnClientLogon(const struct sockaddr_in&, Connection&) {}
+
+    void OnClientDisconnected(Connection&, const char*, int) {}
+
+    void OnClientMsg(Connection& conn, MsgHeader*) {
+        conn.Pop();
+    }
+
+    thread thr;
+    atomic<bool> stopped{false};
+};
+
+class Client;
+using TSClient = TcpShmClient<Client, Conf>;
+
+class Client : public TSClient
+{
+public:
+    explicit Client(const string& name)
+        : TSClient(name, dir + "/client") {}
+
+    // return the reject reason, or "" if logged on
+    string Login() {
+        reject.clear();
+        if(Connect(false, "127.0.0.1", port, 0)) {
+            GetConnection().Close();
+            PollTcp(Now());
+            return "";
+        }
+        return reject.empty() ? "connect failed" : reject;
+    }
+
+private:
+    friend TSClient;
+
+    void OnSystemError(const char*, int) {}
+
+    void OnLoginReject(const LoginRspMsg* login_rsp) {
+        reject = login_rsp->error_msg;
+    }
+
+    int64_t OnLoginSuccess(const LoginRspMsg*) {
+        return Now();
+    }
+
+    void OnSeqNumberMismatch(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t) {}
+
+    void OnServerMsg(MsgHeader*) {
+        GetConnection().Pop();
+    }
+
+    void OnDisconnected(const char*, int) {}
+
+    string reject;
+};
+
+int main() {
+    filesystem::remove_all(dir);
+    filesystem::create_directories(dir);
+    Client a("a"), b("b"), c("c");
+    {
+        Server server;
+        CHECK(a.Login() == "");
+        CHECK(b.Login() == "");
+        CHECK(c.Login() == "Max client cnt exceeded");
+    }
+    {
+        // a and b are restored offline, so the group is still full for c
+        Server server;
+        CHECK(c.Login() == "Max client cnt exceeded");
+        CHECK(b.Login() == "");
+        CHECK(a.Login() == "");
+    }
+
+    // a file of another layout is started over
+    string file = dir + "/server/server_tcp0.idx";
+    CHECK(filesystem::exists(file));
+    {
+        fstream f(file, ios::in | ios::out | ios::binary);
+        uint32_t magic = 0;
+        f.write(reinterpret_cast<const char*>(&magic), sizeof(magic));
+    }
+    {
+        Server server;
+        CHECK(c.Login() == "");
+    }
+    {
+        Server server;
+        CHECK(a.Login() == "");
+        CHECK(b.Login() == "Max client cnt exceeded");
+    }
+    filesystem::remove_all(dir);
+    cout << (failures ? "FAILED" : "PASSED") << endl;
+    return failures ? 1 : 0;
+}
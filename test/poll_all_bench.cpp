@@ -0,0 +1,233 @@
+#include "../tcpshm_server.h"
+#include "../tcpshm_client.h"
+#include <bits/stdc++.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// measure round trip latency of an echo server serving everything from one thread with PollAll(), against the layout
+// of a thread per group, PollCtl(), PollShm() and PollTcp() each in its own thread
+// a shm client and a tcp client take turns sending a msg and polling until it's echoed back, so with PollAll() each
+// round trip also pays for polling the groups of the other client, while with a thread per group the polling threads
+// share the cores, which the result depends on, and every polling loop yields as in the other benches
+struct Conf
+{
+    static constexpr uint32_t NameSize = 16;
+    static constexpr uint32_t ShmQueueSize = 4096;
+    static constexpr bool ToLittleEndian = true;
+    static constexpr uint32_t MaxNewConnections = 4;
+    static constexpr uint32_t MaxShmConnsPerGrp = 4;
+    static constexpr uint32_t MaxShmGrps = 2;
+    static constexpr uint32_t MaxTcpConnsPerGrp = 4;
+    static constexpr uint32_t MaxTcpGrps = 2;
+    static constexpr uint32_t TcpQueueSize = 4096;
+    static constexpr uint32_t TcpRecvBufInitSize = 1024;
+    static constexpr uint32_t TcpRecvBufMaxSize = 4096;
+    static constexpr bool TcpNoDelay = true;
+    static constexpr int64_t NewConnectionTimeout = 3000000000LL;
+    // the shm client only polls shm while measuring, so it doesn't send heartbeats
+    static constexpr int64_t ConnectionTimeout = 600000000000LL;
+    static constexpr int64_t HeartBeatInverval = 1000000000LL;
+    using LoginUserData = char;
+    using LoginRspUserData = char;
+    using ConnectionUserData = char;
+};
+
+string dir = "/tmp/poll_all_bench_" + to_string(getpid());
+uint16_t port = 20000 + getpid() % 20000;
+
+int64_t Now() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class Server;
+using TSServer = TcpShmServer<Server, Conf>;
+
+class Server : public TSServer
+{
+public:
+    explicit Server(bool single_thread)
+        : TSServer("server", dir + "/server") {
+        if(!Start("127.0.0.1", port)) exit(1);
+        if(single_thread) {
+            threads.emplace_back([this]() {
+                while(!stopped.load(memory_order_relaxed)) {
+                    PollAll(Now());
+                    this_thread::yield();
+                }
+            });
+            return;
+        }
+        threads.emplace_back([this]() {
+            while(!stopped.load(memory_order_relaxed)) {
+                PollCtl(Now());
+                this_thread::yield();
+            }
+        });
+        for(uint32_t i = 0; i < Conf::MaxShmGrps; i++) {
+            threads.emplace_back([this, i]() {
+                while(!stopped.load(memory_order_relaxed)) {
+                    PollShm(i);
+                    this_thread::yield();
+                }
+            });
+        }
+        for(uint32_t i = 0; i < Conf::MaxTcpGrps; i++) {
+            threads.emplace_back([this, i]() {
+                while(!stopped.load(memory_order_relaxed)) {
+                    PollTcp(Now(), i);
+                    this_thread::yield();
+                }
+            });
+        }
+    }
+
+    ~Server() {
+        stopped = true;
+        for(auto& thr : threads) thr.join();
+        Stop();
+    }
+
+private:
+    friend TSServer;
+
+    void OnSystemError(const char* error_msg, int sys_errno) {
+        cout << "server error: " << error_msg << " " << sys_errno << endl;
+    }
+
+    // each client in the last group of its kind, so PollAll() polls the others before getting to it
+    int OnNewConnection(const struct sockaddr_in&, const LoginMsg* login, LoginRspMsg*) {
+        return login->use_shm ? Conf::MaxShmGrps - 1 : Conf::MaxTcpGrps - 1;
+    }
+
+    void OnClientFileError(Connection&, const char* reason, int sys_errno) {
+        cout << "client file error: " << reason << " " << sys_errno << endl;
+    }
+
+    void OnSeqNumberMismatch(Connection&, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t) {}
+
+    void OnClientLogon(const struct sockaddr_in&, Connection&) {}
+
+    void OnClientDisconnected(Connection&, const char*, int) {}
+
+    // echo back
+    void OnClientMsg(Connection& conn, MsgHeader* recv_header) {
+        auto size = recv_header->BodySize();
+        MsgHeader* send_header = conn.Alloc(size);
+        if(!send_header) return;
+        send_header->msg_type = recv_header->msg_type;
+        memcpy(send_header->Body(), recv_header->Body(), size);
+        conn.Pop();
+        conn.Push();
+    }
+
+    vector<thread> threads;
+    atomic<bool> stopped{false};
+};
+
+class Client;
+using TSClient = TcpShmClient<Client, Conf>;
+
+class Client : public TSClient
+{
+public:
+    Client(const string& name, bool use_shm)
+        : TSClient(name, dir + "/client")
+        , use_shm(use_shm) {}
+
+    void Login() {
+        if(!Connect(use_shm, "127.0.0.1", port, 0)) exit(1);
+    }
+
+    // send a msg and poll until it's echoed back, return the round trip time
+    int64_t RoundTrip() {
+        int64_t start = Now();
+        MsgHeader* header = GetConnection().Alloc(sizeof(start));
+        header->msg_type = 1;
+        memcpy(header->Body(), &start, sizeof(start));
+        GetConnection().Push();
+        for(got = false; !got; this_thread::yield()) {
+            if(use_shm)
+                PollShm();
+            else
+                PollTcp(Now());
+        }
+        return Now() - start;
+    }
+
+private:
+    friend TSClient;
+
+    void OnSystemError(const char* error_msg, int sys_errno) {
+        cout << "client error: " << error_msg << " " << sys_errno << endl;
+    }
+
+    void OnLoginReject(const LoginRspMsg* login_rsp) {
+        cout << "login rejected: " << login_rsp->error_msg << endl;
+    }
+
+    int64_t OnLoginSuccess(const LoginRspMsg*) {
+        return Now();
+    }
+
+    void OnSeqNumberMismatch(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t) {}
+
+    void OnServerMsg(MsgHeader*) {
+        got = true;
+        GetConnection().Pop();
+    }
+
+    void OnDisconnected(const char* reason, int sys_errno) {
+        cout << "client disconnected: " << reason << " " << sys_errno << endl;
+        exit(1);
+    }
+
+    bool use_shm;
+    bool got = false;
+};
+
+void Print(const char* name, const char* kind, vector<int64_t>& lats) {
+    sort(lats.begin(), lats.end());
+    cout << name << ", " << kind << ": rtt p50 " << lats[lats.size() / 2] / 1000.0 << " us, p99 "
+         << lats[lats.size() * 99 / 100] / 1000.0 << " us, p99.9 " << lats[lats.size() * 999 / 1000] / 1000.0 << " us"
+         << endl;
+}
+
+void Bench(const char* name, bool single_thread, uint32_t round_trips) {
+    filesystem::remove_all(dir);
+    filesystem::create_directories(dir);
+    Server server(single_thread);
+    Client shm_client("shm", true), tcp_client("tcp", false);
+    shm_client.Login();
+    tcp_client.Login();
+    for(int i = 0; i < 100; i++) {
+        shm_client.RoundTrip();
+        tcp_client.RoundTrip();
+    }
+
+    vector<int64_t> shm_lats, tcp_lats;
+    for(uint32_t i = 0; i < round_trips; i++) {
+        shm_lats.push_back(shm_client.RoundTrip());
+        tcp_lats.push_back(tcp_client.RoundTrip());
+    }
+    Print(name, "shm", shm_lats);
+    Print(name, "tcp", tcp_lats);
+}
+
+int main(int argc, const char** argv) {
+    if(argc > 2) {
+        cout << "usage: poll_all_bench [ROUND_TRIPS]" << endl;
+        exit(1);
+    }
+    uint32_t round_trips = argc == 2 ? atoi(argv[1]) : 10000;
+    if(round_trips == 0) {
+        cout << "ROUND_TRIPS must be positive" << endl;
+        exit(1);
+    }
+    cout << thread::hardware_concurrency() << " cpus" << endl;
+    Bench("thread per group", false, round_trips);
+    port++;
+    Bench("PollAll", true, round_trips);
+    filesystem::remove_all(dir);
+    return 0;
+}
@@ -0,0 +1,135 @@
+#include "../ptcp_queue.h"
+#include <bits/stdc++.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// measure latencies of Alloc() and Push() of a ptcp queue whose peer acks lazily, keeping about half of the queue
+// unacked, against the former layout which moved all unacked msgs to the front of the queue when the tail ran out
+// every msg is sent out right after Push(), and the peer acks a quarter of the queue at a time
+const uint32_t MsgBodySize = 56;
+
+using Q = PTCPQueue<true>;
+
+// Alloc(), Push() and Ack() of PTCPQueue before it became a ring, msgs are kept in host byte order
+class MemmoveQueue
+{
+public:
+    explicit MemmoveQueue(uint32_t capacity)
+        : blk_cnt_(capacity / sizeof(MsgHeader))
+        , blk_(new MsgHeader[blk_cnt_]) {
+        memset(blk_.get(), 0, capacity);
+    }
+
+    MsgHeader* Alloc(uint32_t size) {
+        size += sizeof(MsgHeader);
+        uint32_t blk_sz = (size + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
+        uint32_t avail_sz = blk_cnt_ - write_idx_;
+        if(blk_sz > avail_sz) {
+            if(blk_sz > avail_sz + read_idx_) return nullptr;
+            memmove(blk_.get(), blk_.get() + read_idx_, (write_idx_ - read_idx_) * sizeof(MsgHeader));
+            write_idx_ -= read_idx_;
+            send_idx_ -= read_idx_;
+            read_idx_ = 0;
+        }
+        MsgHeader& header = blk_[write_idx_];
+        header.size = size;
+        return &header;
+    }
+
+    void Push() {
+        write_idx_ += (blk_[write_idx_].size + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
+    }
+
+    const void* GetSendable(int& blk_sz) const {
+        blk_sz = write_idx_ - send_idx_;
+        return blk_.get() + send_idx_;
+    }
+
+    void Sendout(int blk_sz) {
+        send_idx_ += blk_sz;
+    }
+
+    void Ack(uint32_t ack_seq) {
+        if(static_cast<int>(ack_seq - read_seq_num_) <= 0) return;
+        do {
+            read_idx_ += (blk_[read_idx_].size + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
+            read_seq_num_++;
+        } while(read_seq_num_ != ack_seq);
+        if(read_idx_ == write_idx_) {
+            read_idx_ = write_idx_ = send_idx_ = 0;
+        }
+    }
+
+private:
+    uint32_t blk_cnt_;
+    unique_ptr<MsgHeader[]> blk_;
+    uint32_t write_idx_ = 0;
+    uint32_t read_idx_ = 0;
+    uint32_t send_idx_ = 0;
+    uint32_t read_seq_num_ = 0;
+};
+
+int64_t Now() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// send msgs through the queue for laps times of its capacity and print latencies of Alloc() and Push()
+template<class QT>
+void Bench(const char* name, QT* q, uint32_t capacity, uint32_t laps) {
+    uint32_t msg_blks = (MsgBodySize + sizeof(MsgHeader) * 2 - 1) / sizeof(MsgHeader);
+    uint32_t lap_msgs = capacity / sizeof(MsgHeader) / msg_blks;
+    uint64_t msgs = uint64_t(lap_msgs) * laps;
+    // faulted in before timing
+    vector<int32_t> lats(msgs);
+    uint32_t acked = 0;
+    for(uint64_t seq = 0; seq < msgs; seq++) {
+        int64_t t = Now();
+        MsgHeader* header = q->Alloc(MsgBodySize);
+        if(!header) {
+            cout << name << ": queue full" << endl;
+            exit(1);
+        }
+        header->msg_type = 1;
+        memcpy(header->Body(), &seq, sizeof(seq));
+        q->Push();
+        lats[seq] = Now() - t;
+        int blk_sz;
+        if(q->GetSendable(blk_sz) && blk_sz) q->Sendout(blk_sz);
+        // the peer acks when 3/4 of the queue is unacked, leaving 1/2 unacked
+        if(seq + 1 - acked >= lap_msgs / 4 * 3) {
+            acked = seq + 1 - lap_msgs / 2;
+            q->Ack(acked);
+        }
+    }
+    int64_t sum = accumulate(lats.begin(), lats.end(), int64_t(0));
+    sort(lats.begin(), lats.end());
+    cout << name << ": " << msgs << " msgs, mean " << static_cast<double>(sum) / msgs << " ns, p99.99 "
+         << lats[msgs * 9999 / 10000] << " ns, p99.9999 " << lats[msgs * 999999 / 1000000] << " ns, max "
+         << lats.back() / 1000.0 << " us, " << lats.end() - upper_bound(lats.begin(), lats.end(), 1000000)
+         << " over 1 ms" << endl;
+}
+
+int main(int argc, const char** argv) {
+    if(argc > 3) {
+        cout << "usage: ptcp_queue_bench [QUEUE_MB] [LAPS]" << endl;
+        exit(1);
+    }
+    uint32_t queue_mb = argc >= 2 ? atoi(argv[1]) : 64;
+    uint32_t laps = argc == 3 ? atoi(argv[2]) : 8;
+    if(queue_mb == 0 || queue_mb > 1024 || laps == 0) {
+        cout << "QUEUE_MB must be in [1, 1024] and LAPS positive" << endl;
+        exit(1);
+    }
+    uint32_t capacity = queue_mb << 20;
+
+    char* buf = new(align_val_t(64)) char[Q::MapSize(capacity)];
+    memset(buf, 0, Q::MapSize(capacity));
+    Q* q = new(buf) Q(capacity);
+    Bench("ring", q, capacity, laps);
+    operator delete[](buf, align_val_t(64));
+
+    auto mq = make_unique<MemmoveQueue>(capacity);
+    Bench("memmove", mq.get(), capacity, laps);
+    return 0;
+}
@@ -0,0 +1,89 @@
+#include "../ptcp_conn.h"
+#include <bits/stdc++.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// a ptcp file of the layout before the capacity was stored in the queue, Conf::TcpQueueSize bytes of blocks followed
+// by the indexes, is converted on open, so its unacked msgs and seq numbers survive the upgrade
+int failures = 0;
+
+#define CHECK(cond)                                                                                                    \
+    do {                                                                                                               \
+        if(!(cond)) {                                                                                                  \
+            cout << __FILE__ << ":" << __LINE__ << " check failed: " #cond << endl;                                    \
+            failures++;                                                                                                \
+        }                                                                                                              \
+    } while(0)
+
+struct Conf
+{
+    static constexpr uint32_t NameSize = 16;
+    static constexpr bool ToLittleEndian = true;
+    static constexpr uint32_t TcpQueueSize = 4096;
+    static constexpr uint32_t TcpRecvBufInitSize = 4096;
+    static constexpr uint32_t TcpRecvBufMaxSize = 8192;
+    static constexpr bool TcpNoDelay = true;
+    static constexpr int64_t HeartBeatInverval = 1000000000LL;
+    static constexpr int64_t ConnectionTimeout = 10000000000LL;
+};
+
+using Conn = PTCPConnection<Conf>;
+using Q = PTCPQueue<Conf::ToLittleEndian>;
+
+string file = "/tmp/ptcp_upgrade_test_" + to_string(getpid()) + ".ptcp";
+
+// a legacy file with msgs of 8 byte bodies at blks, the indexes are cut to 5 words if !ring, as before wrap_idx
+void WriteLegacy(const vector<uint32_t>& blks, const Q::LegacyIndexes& idx, bool ring) {
+    vector<char> buf(Conf::TcpQueueSize + sizeof(idx));
+    for(uint32_t blk : blks) {
+        MsgHeader header{16, 1, 0};
+        header.ConvertByteOrder<Conf::ToLittleEndian>();
+        memcpy(buf.data() + blk * sizeof(MsgHeader), &header, sizeof(header));
+        uint64_t body = blk;
+        memcpy(buf.data() + (blk + 1) * sizeof(MsgHeader), &body, sizeof(body));
+    }
+    memcpy(buf.data() + Conf::TcpQueueSize, &idx, sizeof(idx));
+    unlink(file.c_str());
+    ofstream(file, ios::binary).write(buf.data(), buf.size() - (ring ? 0 : sizeof(uint32_t)));
+}
+
+void CheckOpen(uint32_t ack, uint32_t seq_start, uint32_t seq_end) {
+    for(int i = 0; i < 2; i++) { // converted, then opened as is
+        auto conn = make_unique<Conn>();
+        const char* err = nullptr;
+        CHECK(conn->OpenFile(file.c_str(), 1024, &err));
+        if(err) cout << err << endl;
+        CHECK(conn->GetQueueSize() == Conf::TcpQueueSize);
+        uint32_t local_ack = 0, start = 0, end = 0;
+        CHECK(conn->GetSeq(&local_ack, &start, &end));
+        CHECK(local_ack == ack && start == seq_start && end == seq_end);
+        CHECK(filesystem::file_size(file) == Q::MapSize(Conf::TcpQueueSize));
+        conn->Release();
+    }
+}
+
+int main() {
+    // 3 unacked msgs, the first one sent
+    WriteLegacy({0, 2, 4}, {6, 0, 2, 10, 5, 0}, false);
+    CheckOpen(5, 10, 13);
+    WriteLegacy({0, 2, 4}, {6, 0, 2, 10, 5, 0}, true);
+    CheckOpen(5, 10, 13);
+    // wrapped, a msg at the end of the ring and one at the beginning
+    WriteLegacy({500, 0}, {2, 500, 500, 7, 3, 502}, true);
+    CheckOpen(3, 7, 9);
+
+    // a file of another size is not taken as legacy
+    {
+        vector<char> buf(Conf::TcpQueueSize + 8, 1);
+        unlink(file.c_str());
+        ofstream(file, ios::binary).write(buf.data(), buf.size());
+        auto conn = make_unique<Conn>();
+        const char* err = nullptr;
+        CHECK(!conn->OpenFile(file.c_str(), 1024, &err));
+        CHECK(err && string(err) == "Queue file of unknown layout");
+    }
+    unlink(file.c_str());
+    cout << (failures ? "FAILED" : "PASSED") << endl;
+    return failures ? 1 : 0;
+}
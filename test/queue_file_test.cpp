@@ -0,0 +1,89 @@
+#include "../spsc_varq.h"
+#include "../mpsc_varq.h"
+#include "../ptcp_queue.h"
+#include "../mmap.h"
+#include <bits/stdc++.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// my_mmap_queue() keeps the capacity of an existing queue file, and rejects one of another queue type or layout, or
+// with a header inconsistent with its capacity
+int failures = 0;
+
+#define CHECK(cond)                                                                                                    \
+    do {                                                                                                               \
+        if(!(cond)) {                                                                                                  \
+            cout << __FILE__ << ":" << __LINE__ << " check failed: " #cond << endl;                                    \
+            failures++;                                                                                                \
+        }                                                                                                              \
+    } while(0)
+
+string file = "/tmp/queue_file_test_" + to_string(getpid()) + ".q";
+
+template<class Q>
+Q* Open(uint32_t capacity, const char** error_msg) {
+    *error_msg = nullptr;
+    return my_mmap_queue<Q>(file.c_str(), false, capacity, error_msg);
+}
+
+void Overwrite(uint32_t offset, uint32_t val) {
+    int fd = open(file.c_str(), O_RDWR);
+    CHECK(pwrite(fd, &val, sizeof(val), offset) == sizeof(val));
+    close(fd);
+}
+
+template<class Q>
+void TestQueue(uint32_t capacity, uint32_t other_capacity) {
+    const char* err;
+    unlink(file.c_str());
+    Q* q = Open<Q>(capacity, &err);
+    CHECK(q && q->Capacity() == capacity);
+    if(!q) return;
+    my_munmap_queue(q);
+
+    // an existing file keeps its capacity
+    q = Open<Q>(other_capacity, &err);
+    CHECK(q && q->Capacity() == capacity);
+    if(q) my_munmap_queue(q);
+
+    // block count inconsistent with capacity
+    Overwrite(12, 12345);
+    q = Open<Q>(capacity, &err);
+    CHECK(!q && err && string(err) == "Queue file corrupt");
+
+    // the first msg header of the layout without magic, {size = 16, msg_type = 1}
+    unlink(file.c_str());
+    q = Open<Q>(capacity, &err);
+    if(q) my_munmap_queue(q);
+    Overwrite(0, 16 | 1 << 16);
+    q = Open<Q>(capacity, &err);
+    CHECK(!q && err && string(err) == "Queue file of unknown layout");
+
+    // a newer layout version
+    unlink(file.c_str());
+    q = Open<Q>(capacity, &err);
+    if(q) my_munmap_queue(q);
+    Overwrite(4, Q::LayoutVersion + 1);
+    q = Open<Q>(capacity, &err);
+    CHECK(!q && err && string(err) == "Queue file of unknown layout");
+}
+
+int main() {
+    TestQueue<SPSCVarQueue<>>(4096, 1024);
+    TestQueue<MPSCVarQueue<>>(4096, 1024);
+    TestQueue<PTCPQueue<true>>(4000, 800);
+
+    // a file of one queue type is not taken as another
+    const char* err;
+    unlink(file.c_str());
+    auto* spsc = Open<SPSCVarQueue<>>(4096, &err);
+    CHECK(spsc);
+    if(spsc) my_munmap_queue(spsc);
+    auto* mpsc = Open<MPSCVarQueue<>>(4096, &err);
+    CHECK(!mpsc && err && string(err) == "Queue file of unknown layout");
+    unlink(file.c_str());
+
+    cout << (failures ? "FAILED" : "PASSED") << endl;
+    return failures ? 1 : 0;
+}
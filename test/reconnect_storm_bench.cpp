@@ -0,0 +1,213 @@
+#include "../tcpshm_server.h"
+#include <bits/stdc++.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// measure the time until all of N clients connecting at the same moment, e.g. after a failover, are logged in
+// the server accepting one connection per PollCtl() with a listen backlog of 5, as it did before accepts were batched,
+// is compared with the default of accepting until the backlog is drained with a backlog of SOMAXCONN
+// clients connect by raw non-blocking sockets, send the login once connected, and disconnect after the login response
+struct Conf
+{
+    static constexpr uint32_t NameSize = 16;
+    static constexpr uint32_t ShmQueueSize = 4096;
+    static constexpr bool ToLittleEndian = true;
+    static constexpr uint32_t MaxNewConnections = 512;
+    static constexpr uint32_t MaxShmConnsPerGrp = 1;
+    static constexpr uint32_t MaxShmGrps = 1;
+    static constexpr uint32_t MaxTcpConnsPerGrp = 2048;
+    static constexpr uint32_t MaxTcpGrps = 1;
+    static constexpr uint32_t TcpQueueSize = 1024;
+    static constexpr uint32_t TcpRecvBufInitSize = 1024;
+    static constexpr uint32_t TcpRecvBufMaxSize = 4096;
+    static constexpr bool TcpNoDelay = true;
+    static constexpr int64_t NewConnectionTimeout = 3000000000LL;
+    static constexpr int64_t ConnectionTimeout = 10000000000LL;
+    static constexpr int64_t HeartBeatInverval = 1000000000LL;
+    using LoginUserData = char;
+    using LoginRspUserData = char;
+    using ConnectionUserData = char;
+};
+
+struct OneAcceptConf : Conf
+{
+    static constexpr int ListenBacklog = 5;
+    static constexpr uint32_t MaxAcceptPerPoll = 1;
+};
+
+using LoginMsg = LoginMsgTpl<Conf>;
+using LoginRspMsg = LoginRspMsgTpl<Conf>;
+
+string dir = "/tmp/reconnect_storm_bench_" + to_string(getpid());
+uint16_t port = 20000 + getpid() % 20000;
+
+int64_t Now() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template<class C>
+class Server : public TcpShmServer<Server<C>, C>
+{
+    using TSServer = TcpShmServer<Server<C>, C>;
+    using Connection = typename TSServer::Connection;
+    using LoginMsg = typename TSServer::LoginMsg;
+    using LoginRspMsg = typename TSServer::LoginRspMsg;
+
+public:
+    Server()
+        : TSServer("server", dir) {
+        if(!this->Start("127.0.0.1", port)) exit(1);
+        thr = thread([this]() {
+            while(!stopped.load(memory_order_relaxed)) {
+                int64_t now = Now();
+                this->PollCtl(now);
+                this->PollTcp(now, 0);
+            }
+        });
+    }
+
+    ~Server() {
+        stopped = true;
+        thr.join();
+        this->Stop();
+    }
+
+private:
+    friend TSServer;
+
+    void OnSystemError(const char* error_msg, int sys_errno) {
+        cout << "server error: " << error_msg << " " << sys_errno << endl;
+    }
+
+    int OnNewConnection(const struct sockaddr_in&, const LoginMsg* login, LoginRspMsg*) {
+        return login->use_shm ? -1 : 0;
+    }
+
+    void OnClientFileError(Connection&, const char* reason, int sys_errno) {
+        cout << "client file error: " << reason << " " << sys_errno << endl;
+    }
+
+    void OnSeqNumberMismatch(Connection&, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t) {}
+
+    void OnClientLogon(const struct sockaddr_in&, Connection&) {}
+
+    void OnClientDisconnected(Connection&, const char*, int) {}
+
+    void OnClientMsg(Connection& conn, MsgHeader*) {
+        conn.Pop();
+    }
+
+    thread thr;
+    atomic<bool> stopped{false};
+};
+
+struct Client
+{
+    int fd = -1;
+    bool sent = false;
+    uint32_t received = 0;
+    MsgHeader recvbuf[1 + (sizeof(LoginRspMsg) + 7) / 8];
+};
+
+// connect all clients at once and return the number logged in when all are done or 30s passed
+template<class C>
+uint32_t Storm(const char* name, uint32_t n) {
+    filesystem::remove_all(dir);
+    Server<C> server;
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    addr.sin_port = htons(port);
+    MsgHeader sendbuf[1 + (sizeof(LoginMsg) + 7) / 8] = {};
+    sendbuf[0].size = sizeof(MsgHeader) + sizeof(LoginMsg);
+    sendbuf[0].msg_type = LoginMsg::msg_type;
+    sendbuf[0].ConvertByteOrder<Conf::ToLittleEndian>();
+    LoginMsg* login = reinterpret_cast<LoginMsg*>(sendbuf + 1);
+    strncpy(login->last_server_name, "server", sizeof(login->last_server_name) - 1);
+
+    int epfd = epoll_create1(0);
+    vector<Client> clients(n);
+    int64_t start = Now();
+    for(uint32_t i = 0; i < n; i++) {
+        Client& c = clients[i];
+        c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if(connect(c.fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 && errno != EINPROGRESS) {
+            cout << "connect failed: " << strerror(errno) << endl;
+            exit(1);
+        }
+        epoll_event ev;
+        ev.events = EPOLLOUT | EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c.fd, &ev);
+    }
+    uint32_t done = 0, ok = 0;
+    int64_t deadline = start + 30000000000LL;
+    epoll_event events[64];
+    while(done < n && Now() < deadline) {
+        int cnt = epoll_wait(epfd, events, 64, 100);
+        for(int j = 0; j < cnt; j++) {
+            Client& c = clients[events[j].data.u32];
+            if(!c.sent && (events[j].events & EPOLLOUT)) {
+                memset(login->client_name, 0, sizeof(login->client_name));
+                snprintf(login->client_name, sizeof(login->client_name), "client%u", events[j].data.u32);
+                login->ConvertByteOrder();
+                if(send(c.fd, sendbuf, sizeof(sendbuf), MSG_NOSIGNAL) != sizeof(sendbuf)) {
+                    cout << "send failed: " << strerror(errno) << endl;
+                    exit(1);
+                }
+                login->ConvertByteOrder();
+                c.sent = true;
+                epoll_event ev;
+                ev.events = EPOLLIN;
+                ev.data.u32 = events[j].data.u32;
+                epoll_ctl(epfd, EPOLL_CTL_MOD, c.fd, &ev);
+                continue;
+            }
+            if(!c.sent || !(events[j].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) continue;
+            int ret = recv(c.fd, reinterpret_cast<char*>(c.recvbuf) + c.received, sizeof(c.recvbuf) - c.received, 0);
+            if(ret > 0) c.received += ret;
+            else if(ret < 0 && errno == EAGAIN) continue;
+            if(ret > 0 && c.received < sizeof(c.recvbuf)) continue;
+            if(c.received == sizeof(c.recvbuf) && reinterpret_cast<LoginRspMsg*>(c.recvbuf + 1)->error_msg[0] == 0) ok++;
+            ::close(c.fd);
+            c.fd = -1;
+            done++;
+        }
+    }
+    int64_t latency = Now() - start;
+    for(auto& c : clients) {
+        if(c.fd >= 0) ::close(c.fd);
+    }
+    ::close(epfd);
+    cout << name << ": " << ok << "/" << n << " clients logged in after " << latency / 1000000.0 << " ms" << endl;
+    return ok;
+}
+
+int main(int argc, const char** argv) {
+    if(argc > 2) {
+        cout << "usage: reconnect_storm_bench [CLIENTS]" << endl;
+        exit(1);
+    }
+    uint32_t clients = argc == 2 ? atoi(argv[1]) : 500;
+    if(clients == 0 || clients > Conf::MaxTcpConnsPerGrp) {
+        cout << "CLIENTS must be in [1, " << Conf::MaxTcpConnsPerGrp << "]" << endl;
+        exit(1);
+    }
+    // each client takes an fd on both sides
+    rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if(rl.rlim_cur < clients * 2 + 64) {
+        cout << "too many clients for fd limit " << rl.rlim_cur << endl;
+        exit(1);
+    }
+    Storm<OneAcceptConf>("one accept per poll, backlog 5", clients);
+    port++;
+    Storm<Conf>("batched accepts, backlog SOMAXCONN", clients);
+    filesystem::remove_all(dir);
+    return 0;
+}
@@ -0,0 +1,229 @@
+#include "../tcpshm_server.h"
+#include "../tcpshm_client.h"
+#include <bits/stdc++.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// an offline conn is not reopened by a login of its client while the polling thread may still visit it, e.g. when
+// it's in the middle of a poll holding the conn, the login is rejected and succeeds once the poll is over
+int failures = 0;
+
+#define CHECK(cond)                                                                                                    \
+    do {                                                                                                               \
+        if(!(cond)) {                                                                                                  \
+            cout << __FILE__ << ":" << __LINE__ << " check failed: " #cond << endl;                                    \
+            failures++;                                                                                                \
+        }                                                                                                              \
+    } while(0)
+
+struct Conf
+{
+    static constexpr uint32_t NameSize = 16;
+    static constexpr uint32_t ShmQueueSize = 4096;
+    static constexpr bool ToLittleEndian = true;
+    static constexpr uint32_t MaxNewConnections = 4;
+    static constexpr uint32_t MaxShmConnsPerGrp = 1;
+    static constexpr uint32_t MaxShmGrps = 1;
+    static constexpr uint32_t MaxTcpConnsPerGrp = 4;
+    static constexpr uint32_t MaxTcpGrps = 1;
+    static constexpr uint32_t TcpQueueSize = 4096;
+    static constexpr uint32_t TcpRecvBufInitSize = 1024;
+    static constexpr uint32_t TcpRecvBufMaxSize = 4096;
+    static constexpr bool TcpNoDelay = true;
+    static constexpr int64_t NewConnectionTimeout = 3000000000LL;
+    static constexpr int64_t ConnectionTimeout = 10000000000LL;
+    static constexpr int64_t HeartBeatInverval = 1000000000LL;
+    using LoginUserData = char;
+    using LoginRspUserData = char;
+    using ConnectionUserData = char;
+};
+
+struct EpollConf : Conf
+{
+    static constexpr bool TcpUseEpoll = true;
+};
+
+string dir = "/tmp/relogin_test_" + to_string(getpid());
+uint16_t port = 20000 + getpid() % 20000;
+
+int64_t Now() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// wait up to 5 seconds for cond
+template<class F>
+bool WaitFor(F cond) {
+    for(int i = 0; i < 500; i++) {
+        if(cond()) return true;
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    return false;
+}
+
+// ctl and tcp polling in their own threads, and a msg blocks the polling thread while block is set
+template<class C>
+class Server : public TcpShmServer<Server<C>, C>
+{
+    using TSServer = TcpShmServer<Server<C>, C>;
+    using Connection = typename TSServer::Connection;
+    using LoginMsg = typename TSServer::LoginMsg;
+    using LoginRspMsg = typename TSServer::LoginRspMsg;
+
+public:
+    Server()
+        : TSServer("server", dir + "/server") {
+        CHECK(this->Start("127.0.0.1", port));
+        ctl_thr = thread([this]() {
+            while(!stopped.load(memory_order_relaxed)) {
+                this->PollCtl(Now());
+                this_thread::yield();
+            }
+        });
+        tcp_thr = thread([this]() {
+            while(!stopped.load(memory_order_relaxed)) {
+                this->PollTcp(Now(), 0);
+                this_thread::yield();
+            }
+        });
+    }
+
+    ~Server() {
+        block = false;
+        stopped = true;
+        ctl_thr.join();
+        tcp_thr.join();
+        this->Stop();
+    }
+
+    // close the conn of name from this thread, as the polling thread is busy
+    void CloseConn(const string& name) {
+        lock_guard<mutex> lock(mtx);
+        conns[name]->Close();
+    }
+
+    atomic<bool> block{false};
+    atomic<bool> in_msg{false};
+
+private:
+    friend TSServer;
+
+    void OnSystemError(const char* error_msg, int sys_errno) {
+        cout << "server error: " << error_msg << " " << sys_errno << endl;
+    }
+
+    int OnNewConnection(const struct sockaddr_in&, const LoginMsg* login, LoginRspMsg*) {
+        return login->use_shm ? -1 : 0;
+    }
+
+    void OnClientFileError(Connection&, const char* reason, int sys_errno) {
+        cout << "client file error: " << reason << " " << sys_errno << endl;
+    }
+
+    void OnSeqNumberMismatch(Connection&, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t) {}
+
+    void OnClientLogon(const struct sockaddr_in&, Connection& conn) {
+        lock_guard<mutex> lock(mtx);
+        conns[conn.GetRemoteName()] = &conn;
+    }
+
+    void OnClientDisconnected(Connection&, const char*, int) {}
+
+    void OnClientMsg(Connection& conn, MsgHeader*) {
+        in_msg = true;
+        while(block) this_thread::yield();
+        in_msg = false;
+        conn.Pop();
+    }
+
+    mutex mtx;
+    map<string, Connection*> conns;
+    thread ctl_thr;
+    thread tcp_thr;
+    atomic<bool> stopped{false};
+};
+
+class Client;
+using TSClient = TcpShmClient<Client, Conf>;
+
+class Client : public TSClient
+{
+public:
+    Client(const string& name, const string& client_dir)
+        : TSClient(name, dir + "/" + client_dir) {}
+
+    // return the reject reason, or "" if logged on
+    string Login() {
+        reject.clear();
+        if(Connect(false, "127.0.0.1", port, 0)) return "";
+        return reject.empty() ? "connect failed" : reject;
+    }
+
+    void Send() {
+        MsgHeader* header = GetConnection().Alloc(8);
+        header->msg_type = 1;
+        GetConnection().Push();
+    }
+
+    void Logout() {
+        GetConnection().Close();
+        PollTcp(Now());
+    }
+
+private:
+    friend TSClient;
+
+    void OnSystemError(const char*, int) {}
+
+    void OnLoginReject(const LoginRspMsg* login_rsp) {
+        reject = login_rsp->error_msg;
+    }
+
+    int64_t OnLoginSuccess(const LoginRspMsg*) {
+        return Now();
+    }
+
+    void OnSeqNumberMismatch(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t) {}
+
+    void OnServerMsg(MsgHeader*) {
+        GetConnection().Pop();
+    }
+
+    void OnDisconnected(const char*, int) {}
+
+    string reject;
+};
+
+template<class C>
+void Test() {
+    filesystem::remove_all(dir);
+    filesystem::create_directories(dir);
+    Server<C> server;
+    Client a("a", "a"), b("b", "b"), b_again("b", "b_again");
+    CHECK(b.Login() == "");
+    CHECK(a.Login() == "");
+    // the polling thread holds b in its poll while it's blocked by the msg of a
+    this_thread::sleep_for(chrono::milliseconds(100));
+    server.block = true;
+    a.Send();
+    CHECK(WaitFor([&]() { return server.in_msg.load(); }));
+
+    server.CloseConn("b");
+    // give ctl thread time to handle the close
+    this_thread::sleep_for(chrono::milliseconds(100));
+    CHECK(b_again.Login() != "");
+
+    server.block = false;
+    CHECK(WaitFor([&]() { return b_again.Login() == ""; }));
+    b_again.Logout();
+    a.Logout();
+    port++;
+}
+
+int main() {
+    Test<Conf>();
+    Test<EpollConf>();
+    filesystem::remove_all(dir);
+    cout << (failures ? "FAILED" : "PASSED") << endl;
+    return failures ? 1 : 0;
+}
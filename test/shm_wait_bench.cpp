@@ -0,0 +1,112 @@
+#include "../spsc_varq.h"
+#include <bits/stdc++.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// measure a shm reader that spins forever, against one that parks on the futex of an SPSCVarQueue<true> after
+// SpinCount empty polls, as PollShm() does with ShmWaitSpinCount set
+// for each, the cpu time of the reader thread is read from its cpu clock while no msg is sent, and then while a msg
+// is sent every INTERVAL_US, along with the latency from before Push() until the reader gets the msg, and the time
+// of Push(), which includes the wake syscall if the reader is parked
+const uint32_t QueueBytes = 1 << 20;
+const uint32_t SpinCount = 1000;
+const int64_t WaitTimeoutNs = 1000000;
+
+int64_t Now() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int64_t CpuNs(clockid_t cid) {
+    timespec ts;
+    clock_gettime(cid, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// cpu time of thr, which must be running
+int64_t CpuNs(thread& thr) {
+    clockid_t cid;
+    pthread_getcpuclockid(thr.native_handle(), &cid);
+    return CpuNs(cid);
+}
+
+// run a reader calling on_idle(q, idle_cnt) on each empty poll, then send msgs from this thread and print the stats
+template<bool WakeReader, class F>
+void Bench(const char* name, uint32_t msgs, int64_t interval_ns, F on_idle) {
+    using Q = SPSCVarQueue<WakeReader>;
+    char* buf = new(align_val_t(128)) char[Q::MapSize(QueueBytes)];
+    Q* q = new(buf) Q(QueueBytes);
+    vector<int64_t> lats;
+    lats.reserve(msgs);
+    // cpu time of reader when it gets the last msg
+    int64_t end_cpu_ns = 0;
+    thread reader([&]() {
+        uint32_t idle_cnt = 0;
+        while(lats.size() < msgs) {
+            MsgHeader* header = q->Front();
+            if(!header) {
+                on_idle(q, idle_cnt);
+                continue;
+            }
+            idle_cnt = 0;
+            int64_t sent;
+            memcpy(&sent, header->Body(), sizeof(sent));
+            lats.push_back(Now() - sent);
+            q->Pop();
+        }
+        end_cpu_ns = CpuNs(CLOCK_THREAD_CPUTIME_ID);
+    });
+
+    int64_t cpu_ns = CpuNs(reader);
+    int64_t start = Now();
+    this_thread::sleep_for(chrono::seconds(1));
+    double idle_cpu = double(CpuNs(reader) - cpu_ns) / (Now() - start);
+
+    vector<int64_t> push_lats;
+    cpu_ns = CpuNs(reader);
+    start = Now();
+    for(uint32_t i = 0; i < msgs; i++) {
+        this_thread::sleep_for(chrono::nanoseconds(interval_ns));
+        MsgHeader* header = q->Alloc(sizeof(int64_t));
+        header->msg_type = 1;
+        int64_t t = Now();
+        memcpy(header->Body(), &t, sizeof(t));
+        q->Push();
+        push_lats.push_back(Now() - t);
+    }
+    reader.join();
+    double busy_cpu = double(end_cpu_ns - cpu_ns) / (Now() - start);
+    operator delete[](buf, align_val_t(128));
+
+    sort(lats.begin(), lats.end());
+    sort(push_lats.begin(), push_lats.end());
+    cout << name << ": idle reader cpu " << idle_cpu * 100 << "%, with a msg every " << interval_ns / 1000
+         << " us: reader cpu " << busy_cpu * 100 << "%, wake-up p50 " << lats[lats.size() / 2] / 1000.0 << " us, p99 "
+         << lats[lats.size() * 99 / 100] / 1000.0 << " us, Push() p50 " << push_lats[push_lats.size() / 2]
+         << " ns, p99 " << push_lats[push_lats.size() * 99 / 100] << " ns" << endl;
+}
+
+int main(int argc, const char** argv) {
+    if(argc > 3) {
+        cout << "usage: shm_wait_bench [MSGS] [INTERVAL_US]" << endl;
+        exit(1);
+    }
+    uint32_t msgs = argc >= 2 ? atoi(argv[1]) : 2000;
+    int64_t interval_us = argc == 3 ? atoi(argv[2]) : 1000;
+    if(msgs == 0 || interval_us <= 0) {
+        cout << "MSGS and INTERVAL_US must be positive" << endl;
+        exit(1);
+    }
+    Bench<false>("spinning", msgs, interval_us * 1000, [](auto*, uint32_t&) {});
+    string name = "ShmWaitSpinCount " + to_string(SpinCount);
+    Bench<true>(name.c_str(), msgs, interval_us * 1000, [](auto* q, uint32_t& idle_cnt) {
+        if(idle_cnt < SpinCount) {
+            idle_cnt++;
+            return;
+        }
+        futex_waitv w;
+        if(q->PrepareWait(w)) FutexWaitv(&w, 1, WaitTimeoutNs);
+        q->FinishWait();
+    });
+    return 0;
+}
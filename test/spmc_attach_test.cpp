@@ -0,0 +1,89 @@
+#include "../spmc_varq.h"
+#include <bits/stdc++.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// readers keep attaching to a small SPMCVarQueue while the writer writes continuously without waiting, a msg read by
+// a reader that has not been evicted must be intact, e.g. spmc_attach_test 3
+using Q = SPMCVarQueue<4096, 4>;
+
+// body of msg seq is filled with seq, and its size varies with seq so rewinds happen at different offsets
+uint32_t BodySize(uint64_t seq) {
+    return 8 * (1 + seq % 13);
+}
+
+int main(int argc, const char** argv) {
+    if(argc > 2) {
+        cout << "usage: spmc_attach_test [SECONDS]" << endl;
+        exit(1);
+    }
+    int seconds = argc == 2 ? atoi(argv[1]) : 2;
+    auto q = make_unique<Q>();
+    atomic<bool> stop{false};
+    atomic<uint64_t> attaches{0}, reads{0}, evictions{0}, errors{0};
+
+    auto read_fn = [&]() {
+        Q::Reader reader;
+        uint64_t buf[16];
+        while(!stop.load(memory_order_relaxed)) {
+            if(!reader.Attach(q.get())) continue;
+            attaches++;
+            uint64_t last = 0;
+            // read a few msgs, then attach again
+            for(int n = 0; n < 100 && !stop.load(memory_order_relaxed);) {
+                MsgHeader* header = reader.Front();
+                if(!header) {
+                    if(reader.IsEvicted()) {
+                        evictions++;
+                        break;
+                    }
+                    this_thread::yield();
+                    continue;
+                }
+                uint32_t size = min<uint32_t>(header->BodySize(), sizeof(buf));
+                memcpy(buf, header->Body(), size);
+                if(!reader.Pop()) {
+                    evictions++;
+                    break;
+                }
+                uint64_t seq = buf[0];
+                bool ok = size == BodySize(seq) && (!n || seq == last + 1);
+                for(uint32_t i = 1; i < size / 8; i++) ok = ok && buf[i] == seq;
+                if(!ok) {
+                    if(!errors++) cout << "corrupt msg after attach: seq " << seq << " last " << last << endl;
+                    break;
+                }
+                last = seq;
+                reads++;
+                n++;
+            }
+            reader.Detach();
+        }
+    };
+    int reader_cnt = 3;
+    vector<thread> readers;
+    for(int i = 0; i < reader_cnt; i++) readers.emplace_back(read_fn);
+
+    auto end = chrono::steady_clock::now() + chrono::seconds(seconds);
+    uint64_t seq = 0;
+    for(uint64_t loop = 1; chrono::steady_clock::now() < end; loop++) {
+        // mostly short runs, and sometimes long ones lapping readers
+        int run = loop % 16 ? 8 : 256;
+        for(int i = 0; i < run; i++, seq++) {
+            uint32_t size = BodySize(seq);
+            MsgHeader* header = q->Alloc(size);
+            header->msg_type = 1;
+            uint64_t* body = static_cast<uint64_t*>(header->Body());
+            for(uint32_t j = 0; j < size / 8; j++) body[j] = seq;
+            q->Push();
+        }
+        // give readers on a single cpu a chance to attach in the middle of writes
+        this_thread::yield();
+    }
+    stop = true;
+    for(auto& t : readers) t.join();
+    cout << "writes: " << seq << " attaches: " << attaches << " reads: " << reads << " evictions: " << evictions
+         << " errors: " << errors << endl;
+    return errors || !reads ? 1 : 0;
+}
@@ -0,0 +1,108 @@
+#include "../spsc_varq.h"
+#include <bits/stdc++.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// msgs submitted by PushMore() of SPSCVarQueue are published when Alloc() fails for lack of space, so a producer
+// filling the queue with PushMore() and retrying Alloc() until it succeeds never waits for the reader forever
+using Q = SPSCVarQueue<>;
+
+int failures = 0;
+
+#define CHECK(cond)                                                                                                    \
+    do {                                                                                                               \
+        if(!(cond)) {                                                                                                  \
+            cout << __FILE__ << ":" << __LINE__ << " check failed: " #cond << endl;                                    \
+            failures++;                                                                                                \
+        }                                                                                                              \
+    } while(0)
+
+struct QueueBuf
+{
+    explicit QueueBuf(uint32_t capacity)
+        : buf(new(align_val_t(128)) char[Q::MapSize(capacity)]) {
+        q = new(buf) Q(capacity);
+    }
+
+    ~QueueBuf() {
+        operator delete[](buf, align_val_t(128));
+    }
+
+    char* buf;
+    Q* q;
+};
+
+MsgHeader* AllocMsg(Q* q, uint32_t size, uint64_t val) {
+    MsgHeader* header = q->Alloc(size);
+    if(!header) return nullptr;
+    header->msg_type = 1;
+    memcpy(header->Body(), &val, sizeof(val));
+    return header;
+}
+
+uint64_t BodyOf(MsgHeader* header) {
+    uint64_t val;
+    memcpy(&val, header->Body(), sizeof(val));
+    return val;
+}
+
+// msgs are invisible until the queue is full, then the failing Alloc() publishes all of them
+void TestFullQueuePublishes() {
+    QueueBuf a(4096);
+    uint64_t cnt = 0;
+    while(AllocMsg(a.q, 56, cnt)) {
+        a.q->PushMore();
+        CHECK(!a.q->Front());
+        cnt++;
+    }
+    CHECK(cnt == 4096 / 64);
+    for(uint64_t i = 0; i < cnt; i++) {
+        MsgHeader* header = a.q->Front();
+        CHECK(header && BodyOf(header) == i);
+        if(!header) return;
+        a.q->Pop();
+    }
+    CHECK(!a.q->Front());
+}
+
+// a producer only calling PushMore() and retrying Alloc() until it succeeds, with msgs of varying sizes so the queue
+// also rewinds while full
+void TestPushMoreOnly() {
+    QueueBuf a(4096);
+    const uint64_t msgs = 100000;
+    atomic<bool> ok{true};
+    thread reader([&]() {
+        for(uint64_t i = 0; i < msgs;) {
+            MsgHeader* header = a.q->Front();
+            if(!header) {
+                this_thread::yield();
+                continue;
+            }
+            if(BodyOf(header) != i) ok = false;
+            a.q->Pop();
+            i++;
+        }
+    });
+    int64_t deadline = chrono::steady_clock::now().time_since_epoch().count() + 10000000000LL;
+    for(uint64_t i = 0; i < msgs; i++) {
+        while(!AllocMsg(a.q, 8 + 40 * (i % 7), i)) {
+            if(chrono::steady_clock::now().time_since_epoch().count() > deadline) {
+                cout << "producer stuck at msg " << i << endl;
+                exit(1);
+            }
+            this_thread::yield();
+        }
+        a.q->PushMore();
+    }
+    a.q->Flush();
+    reader.join();
+    CHECK(ok);
+}
+
+int main() {
+    TestFullQueuePublishes();
+    TestPushMoreOnly();
+    cout << (failures ? "FAILED" : "PASSED") << endl;
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,296 @@
+#include "../tcpshm_server.h"
+#include "../tcpshm_client.h"
+#include <bits/stdc++.h>
+#include <dlfcn.h>
+#include <sys/resource.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// measure syscalls of a tcp polling thread of server, and round trip latency of one active client, when the group
+// also holds many idle connections, with the default of reading every connection per poll, TcpUseEpoll and
+// TcpUseIoUring
+// syscalls are counted by wrapping the libc functions the library calls, only in the tcp polling thread of server
+struct Conf
+{
+    static constexpr uint32_t NameSize = 16;
+    static constexpr uint32_t ShmQueueSize = 4096;
+    static constexpr bool ToLittleEndian = true;
+    static constexpr uint32_t MaxNewConnections = 64;
+    static constexpr uint32_t MaxShmConnsPerGrp = 1;
+    static constexpr uint32_t MaxShmGrps = 1;
+    static constexpr uint32_t MaxTcpConnsPerGrp = 4096;
+    static constexpr uint32_t MaxTcpGrps = 1;
+    static constexpr uint32_t TcpQueueSize = 4096;
+    static constexpr uint32_t TcpRecvBufInitSize = 1024;
+    static constexpr uint32_t TcpRecvBufMaxSize = 4096;
+    static constexpr bool TcpNoDelay = true;
+    static constexpr int64_t NewConnectionTimeout = 3000000000LL;
+    // idle clients are never polled, so they don't send heartbeats
+    static constexpr int64_t ConnectionTimeout = 600000000000LL;
+    static constexpr int64_t HeartBeatInverval = 1000000000LL;
+    using LoginUserData = char;
+    using LoginRspUserData = char;
+    using ConnectionUserData = char;
+};
+
+struct EpollConf : Conf
+{
+    static constexpr bool TcpUseEpoll = true;
+};
+
+struct IoUringConf : Conf
+{
+    static constexpr bool TcpUseIoUring = true;
+};
+
+string dir = "/tmp/tcp_poll_bench_" + to_string(getpid());
+uint16_t port = 20000 + getpid() % 20000;
+
+thread_local bool count_syscalls = false;
+atomic<uint64_t> syscall_cnt{0};
+
+template<class F>
+F RealFn(const char* name) {
+    return reinterpret_cast<F>(dlsym(RTLD_NEXT, name));
+}
+
+void CountSyscall() {
+    if(count_syscalls) syscall_cnt.fetch_add(1, memory_order_relaxed);
+}
+
+extern "C" {
+ssize_t read(int fd, void* buf, size_t count) {
+    static auto fn = RealFn<ssize_t (*)(int, void*, size_t)>("read");
+    CountSyscall();
+    return fn(fd, buf, count);
+}
+
+ssize_t readv(int fd, const struct iovec* iov, int iovcnt) {
+    static auto fn = RealFn<ssize_t (*)(int, const struct iovec*, int)>("readv");
+    CountSyscall();
+    return fn(fd, iov, iovcnt);
+}
+
+ssize_t send(int fd, const void* buf, size_t len, int flags) {
+    static auto fn = RealFn<ssize_t (*)(int, const void*, size_t, int)>("send");
+    CountSyscall();
+    return fn(fd, buf, len, flags);
+}
+
+ssize_t recv(int fd, void* buf, size_t len, int flags) {
+    static auto fn = RealFn<ssize_t (*)(int, void*, size_t, int)>("recv");
+    CountSyscall();
+    return fn(fd, buf, len, flags);
+}
+
+ssize_t recvmsg(int fd, struct msghdr* msg, int flags) {
+    static auto fn = RealFn<ssize_t (*)(int, struct msghdr*, int)>("recvmsg");
+    CountSyscall();
+    return fn(fd, msg, flags);
+}
+
+int epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout) {
+    static auto fn = RealFn<int (*)(int, struct epoll_event*, int, int)>("epoll_wait");
+    CountSyscall();
+    return fn(epfd, events, maxevents, timeout);
+}
+
+// io_uring_enter is called by syscall()
+long syscall(long number, ...) noexcept {
+    static auto fn = RealFn<long (*)(long, ...)>("syscall");
+    va_list ap;
+    va_start(ap, number);
+    long a[6];
+    for(auto& arg : a) arg = va_arg(ap, long);
+    va_end(ap);
+    CountSyscall();
+    return fn(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+}
+
+int64_t Now() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template<class C>
+class Server : public TcpShmServer<Server<C>, C>
+{
+    using TSServer = TcpShmServer<Server<C>, C>;
+    using Connection = typename TSServer::Connection;
+    using LoginMsg = typename TSServer::LoginMsg;
+    using LoginRspMsg = typename TSServer::LoginRspMsg;
+
+public:
+    Server()
+        : TSServer("server", dir + "/server") {
+        if(!this->Start("127.0.0.1", port)) exit(1);
+        ctl_thr = thread([this]() {
+            while(!stopped.load(memory_order_relaxed)) {
+                this->PollCtl(Now());
+                this_thread::yield();
+            }
+        });
+        tcp_thr = thread([this]() {
+            count_syscalls = true;
+            while(!stopped.load(memory_order_relaxed)) {
+                this->PollTcp(Now(), 0);
+                this_thread::yield();
+            }
+        });
+    }
+
+    ~Server() {
+        stopped = true;
+        ctl_thr.join();
+        tcp_thr.join();
+        this->Stop();
+    }
+
+private:
+    friend TSServer;
+
+    void OnSystemError(const char* error_msg, int sys_errno) {
+        cout << "server error: " << error_msg << " " << sys_errno << endl;
+    }
+
+    int OnNewConnection(const struct sockaddr_in&, const LoginMsg* login, LoginRspMsg*) {
+        return login->use_shm ? -1 : 0;
+    }
+
+    void OnClientFileError(Connection&, const char* reason, int sys_errno) {
+        cout << "client file error: " << reason << " " << sys_errno << endl;
+    }
+
+    void OnSeqNumberMismatch(Connection&, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t) {}
+
+    void OnClientLogon(const struct sockaddr_in&, Connection&) {}
+
+    void OnClientDisconnected(Connection&, const char*, int) {}
+
+    // echo back
+    void OnClientMsg(Connection& conn, MsgHeader* recv_header) {
+        auto size = recv_header->BodySize();
+        MsgHeader* send_header = conn.Alloc(size);
+        if(!send_header) return;
+        send_header->msg_type = recv_header->msg_type;
+        memcpy(send_header->Body(), recv_header->Body(), size);
+        conn.Pop();
+        conn.Push();
+    }
+
+    thread ctl_thr;
+    thread tcp_thr;
+    atomic<bool> stopped{false};
+};
+
+class Client;
+using TSClient = TcpShmClient<Client, Conf>;
+
+class Client : public TSClient
+{
+public:
+    explicit Client(const string& name)
+        : TSClient(name, dir + "/client") {}
+
+    void Login() {
+        if(!Connect(false, "127.0.0.1", port, 0)) exit(1);
+    }
+
+    // send a msg and poll until it's echoed back, return the round trip time
+    int64_t RoundTrip() {
+        int64_t start = Now();
+        MsgHeader* header = GetConnection().Alloc(sizeof(start));
+        header->msg_type = 1;
+        memcpy(header->Body(), &start, sizeof(start));
+        GetConnection().Push();
+        for(got = false; !got; this_thread::yield()) PollTcp(Now());
+        return Now() - start;
+    }
+
+private:
+    friend TSClient;
+
+    void OnSystemError(const char* error_msg, int sys_errno) {
+        cout << "client error: " << error_msg << " " << sys_errno << endl;
+    }
+
+    void OnLoginReject(const LoginRspMsg* login_rsp) {
+        cout << "login rejected: " << login_rsp->error_msg << endl;
+    }
+
+    int64_t OnLoginSuccess(const LoginRspMsg*) {
+        return Now();
+    }
+
+    void OnSeqNumberMismatch(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t) {}
+
+    void OnServerMsg(MsgHeader*) {
+        got = true;
+        GetConnection().Pop();
+    }
+
+    void OnDisconnected(const char* reason, int sys_errno) {
+        cout << "client disconnected: " << reason << " " << sys_errno << endl;
+        exit(1);
+    }
+
+    bool got = false;
+};
+
+template<class C>
+void Bench(const char* name, uint32_t idle_cnt, uint32_t round_trips) {
+    filesystem::remove_all(dir);
+    filesystem::create_directories(dir);
+    Server<C> server;
+    vector<unique_ptr<Client>> idle;
+    for(uint32_t i = 0; i < idle_cnt; i++) {
+        idle.push_back(make_unique<Client>("idle" + to_string(i)));
+        idle.back()->Login();
+    }
+    Client client("active");
+    client.Login();
+    for(int i = 0; i < 100; i++) client.RoundTrip();
+
+    uint64_t cnt = syscall_cnt.load();
+    int64_t start = Now();
+    this_thread::sleep_for(chrono::seconds(1));
+    double idle_rate = (syscall_cnt.load() - cnt) * 1e9 / (Now() - start);
+
+    vector<int64_t> lats;
+    cnt = syscall_cnt.load();
+    start = Now();
+    for(uint32_t i = 0; i < round_trips; i++) lats.push_back(client.RoundTrip());
+    int64_t ns = Now() - start;
+    cnt = syscall_cnt.load() - cnt;
+    sort(lats.begin(), lats.end());
+    cout << name << ", " << idle_cnt << " idle conns: idle syscalls per second " << static_cast<int64_t>(idle_rate)
+         << ", busy syscalls per second " << static_cast<int64_t>(cnt * 1e9 / ns) << " and per round trip "
+         << cnt / round_trips << ", rtt p50 " << lats[lats.size() / 2] / 1000.0 << " us, p99 "
+         << lats[lats.size() * 99 / 100] / 1000.0 << " us" << endl;
+}
+
+int main(int argc, const char** argv) {
+    if(argc > 3) {
+        cout << "usage: tcp_poll_bench [IDLE_CONNS] [ROUND_TRIPS]" << endl;
+        exit(1);
+    }
+    uint32_t idle_cnt = argc >= 2 ? atoi(argv[1]) : 1000;
+    uint32_t round_trips = argc == 3 ? atoi(argv[2]) : 5000;
+    if(idle_cnt >= Conf::MaxTcpConnsPerGrp || round_trips == 0) {
+        cout << "IDLE_CONNS must be less than " << Conf::MaxTcpConnsPerGrp << " and ROUND_TRIPS positive" << endl;
+        exit(1);
+    }
+    // each conn takes an fd on both sides
+    rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    Bench<Conf>("read per conn", idle_cnt, round_trips);
+    port++;
+    Bench<EpollConf>("TcpUseEpoll", idle_cnt, round_trips);
+    port++;
+    Bench<IoUringConf>("TcpUseIoUring", idle_cnt, round_trips);
+    filesystem::remove_all(dir);
+    return 0;
+}
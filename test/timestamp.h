@@ -1,8 +1,8 @@
-#include <time.h>
+#include "../tsc_clock.h"
+
+// initialized by tsc_clock.Init() in main(), and calibrated by the control thread
+inline tcpshm::TscClock tsc_clock;
 
 inline unsigned long long now() {
-  timespec ts;
-  ::clock_gettime(CLOCK_REALTIME, &ts);
-  return ts.tv_sec * 1000000000 + ts.tv_nsec;
+  return tsc_clock.Now();
 }
-
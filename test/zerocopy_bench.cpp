@@ -0,0 +1,233 @@
+#include "../tcpshm_server.h"
+#include "../tcpshm_client.h"
+#include <bits/stdc++.h>
+#include <dlfcn.h>
+
+using namespace std;
+using namespace tcpshm;
+
+// measure snapshot bursts sent by server over tcp with the copy path, against with TcpZeroCopyMinSize set, a client
+// requests a snapshot and waits until all of it arrives, then requests the next one, which also acks the last one
+// the cpu time of the server thread per GB is read from its cpu clock, and sends with MSG_ZEROCOPY are counted by
+// wrapping send() of libc, as kernel copies loopback traffic anyway and the connection goes back to copying once
+// kernel reports it
+struct Conf
+{
+    static constexpr uint32_t NameSize = 16;
+    static constexpr uint32_t ShmQueueSize = 4096;
+    static constexpr bool ToLittleEndian = true;
+    static constexpr uint32_t MaxNewConnections = 4;
+    static constexpr uint32_t MaxShmConnsPerGrp = 1;
+    static constexpr uint32_t MaxShmGrps = 1;
+    static constexpr uint32_t MaxTcpConnsPerGrp = 4;
+    static constexpr uint32_t MaxTcpGrps = 1;
+    static constexpr uint32_t TcpQueueSize = 64 << 20;
+    static constexpr uint32_t TcpRecvBufInitSize = 1 << 16;
+    static constexpr uint32_t TcpRecvBufMaxSize = 1 << 17;
+    static constexpr bool TcpNoDelay = true;
+    static constexpr int64_t NewConnectionTimeout = 3000000000LL;
+    static constexpr int64_t ConnectionTimeout = 10000000000LL;
+    static constexpr int64_t HeartBeatInverval = 1000000000LL;
+    using LoginUserData = char;
+    using LoginRspUserData = char;
+    using ConnectionUserData = char;
+};
+
+struct ZeroCopyConf : Conf
+{
+    static constexpr uint32_t TcpZeroCopyMinSize = 16384;
+};
+
+const uint32_t MsgBodySize = 60000;
+
+string dir = "/tmp/zerocopy_bench_" + to_string(getpid());
+uint16_t port = 20000 + getpid() % 20000;
+
+atomic<uint64_t> send_cnt{0}, zerocopy_send_cnt{0};
+
+extern "C" ssize_t send(int fd, const void* buf, size_t len, int flags) {
+    static auto fn = reinterpret_cast<ssize_t (*)(int, const void*, size_t, int)>(dlsym(RTLD_NEXT, "send"));
+    send_cnt.fetch_add(1, memory_order_relaxed);
+    if(flags & MSG_ZEROCOPY) zerocopy_send_cnt.fetch_add(1, memory_order_relaxed);
+    return fn(fd, buf, len, flags);
+}
+
+int64_t Now() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template<class C>
+class Server : public TcpShmServer<Server<C>, C>
+{
+    using TSServer = TcpShmServer<Server<C>, C>;
+    using Connection = typename TSServer::Connection;
+    using LoginMsg = typename TSServer::LoginMsg;
+    using LoginRspMsg = typename TSServer::LoginRspMsg;
+
+public:
+    explicit Server(uint32_t snapshot_msgs)
+        : TSServer("server", dir + "/server")
+        , snapshot_msgs(snapshot_msgs) {
+        if(!this->Start("127.0.0.1", port)) exit(1);
+        thr = thread([this]() {
+            while(!stopped.load(memory_order_relaxed)) {
+                int64_t now = Now();
+                this->PollCtl(now);
+                this->PollTcp(now, 0);
+                // the part of a snapshot beyond the socket buffer is otherwise sent by the next Push() or heartbeat
+                if(snapshot_conn) snapshot_conn->Flush();
+                this_thread::yield();
+            }
+        });
+    }
+
+    ~Server() {
+        stopped = true;
+        thr.join();
+        this->Stop();
+    }
+
+    // cpu time of the server thread
+    int64_t CpuNs() {
+        clockid_t cid;
+        timespec ts;
+        pthread_getcpuclockid(thr.native_handle(), &cid);
+        clock_gettime(cid, &ts);
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+
+private:
+    friend TSServer;
+
+    void OnSystemError(const char* error_msg, int sys_errno) {
+        cout << "server error: " << error_msg << " " << sys_errno << endl;
+    }
+
+    int OnNewConnection(const struct sockaddr_in&, const LoginMsg* login, LoginRspMsg*) {
+        return login->use_shm ? -1 : 0;
+    }
+
+    void OnClientFileError(Connection&, const char* reason, int sys_errno) {
+        cout << "client file error: " << reason << " " << sys_errno << endl;
+    }
+
+    void OnSeqNumberMismatch(Connection&, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t) {}
+
+    void OnClientLogon(const struct sockaddr_in&, Connection&) {}
+
+    void OnClientDisconnected(Connection&, const char*, int) {}
+
+    // a snapshot request
+    void OnClientMsg(Connection& conn, MsgHeader*) {
+        snapshot_conn = &conn;
+        conn.Pop();
+        for(uint32_t i = 0; i < snapshot_msgs; i++) {
+            MsgHeader* header = conn.Alloc(MsgBodySize);
+            if(!header) {
+                cout << "server queue full" << endl;
+                exit(1);
+            }
+            header->msg_type = 2;
+            memset(header->Body(), i, MsgBodySize);
+            conn.Push();
+        }
+    }
+
+    uint32_t snapshot_msgs;
+    Connection* snapshot_conn = nullptr;
+    thread thr;
+    atomic<bool> stopped{false};
+};
+
+class Client;
+using TSClient = TcpShmClient<Client, Conf>;
+
+class Client : public TSClient
+{
+public:
+    Client()
+        : TSClient("client", dir + "/client") {
+        if(!Connect(false, "127.0.0.1", port, 0)) exit(1);
+    }
+
+    // request a snapshot of msgs and poll until all of them arrive, return the time it took
+    int64_t RequestSnapshot(uint32_t msgs) {
+        int64_t start = Now();
+        MsgHeader* header = GetConnection().Alloc(8);
+        header->msg_type = 1;
+        GetConnection().Push();
+        for(got = 0; got < msgs;) PollTcp(Now());
+        return Now() - start;
+    }
+
+private:
+    friend TSClient;
+
+    void OnSystemError(const char* error_msg, int sys_errno) {
+        cout << "client error: " << error_msg << " " << sys_errno << endl;
+    }
+
+    void OnLoginReject(const LoginRspMsg* login_rsp) {
+        cout << "login rejected: " << login_rsp->error_msg << endl;
+    }
+
+    int64_t OnLoginSuccess(const LoginRspMsg*) {
+        return Now();
+    }
+
+    void OnSeqNumberMismatch(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t) {}
+
+    void OnServerMsg(MsgHeader* header) {
+        if(header->BodySize() == MsgBodySize) got++;
+        GetConnection().Pop();
+    }
+
+    void OnDisconnected(const char* reason, int sys_errno) {
+        cout << "client disconnected: " << reason << " " << sys_errno << endl;
+        exit(1);
+    }
+
+    uint32_t got = 0;
+};
+
+template<class C>
+void Bench(const char* name, uint32_t snapshot_mb, uint32_t rounds) {
+    filesystem::remove_all(dir);
+    filesystem::create_directories(dir);
+    uint32_t msgs = (uint64_t(snapshot_mb) << 20) / MsgBodySize;
+    // counted from the first snapshot, before kernel reports copying
+    send_cnt = zerocopy_send_cnt = 0;
+    Server<C> server(msgs);
+    Client client;
+    client.RequestSnapshot(msgs);
+    vector<int64_t> lats;
+    int64_t cpu_ns = server.CpuNs();
+    int64_t start = Now();
+    for(uint32_t i = 0; i < rounds; i++) lats.push_back(client.RequestSnapshot(msgs));
+    int64_t ns = Now() - start;
+    cpu_ns = server.CpuNs() - cpu_ns;
+    double gb = double(msgs) * MsgBodySize * rounds / (1 << 30);
+    sort(lats.begin(), lats.end());
+    cout << name << ", " << msgs << " msgs of " << MsgBodySize << " bytes per snapshot: " << gb / ns * 1e9
+         << " GB/s, snapshot p50 " << lats[lats.size() / 2] / 1000.0 << " us, p99 " << lats[lats.size() * 99 / 100] / 1000.0
+         << " us, server cpu " << cpu_ns / gb / 1000000.0 << " ms per GB, " << zerocopy_send_cnt
+         << " of " << send_cnt << " sends with MSG_ZEROCOPY" << endl;
+}
+
+int main(int argc, const char** argv) {
+    if(argc > 3) {
+        cout << "usage: zerocopy_bench [SNAPSHOT_MB] [ROUNDS]" << endl;
+        exit(1);
+    }
+    uint32_t snapshot_mb = argc >= 2 ? atoi(argv[1]) : 4;
+    uint32_t rounds = argc == 3 ? atoi(argv[2]) : 200;
+    if(snapshot_mb == 0 || snapshot_mb > 16 || rounds == 0) {
+        cout << "SNAPSHOT_MB must be in [1, 16] and ROUNDS positive" << endl;
+        exit(1);
+    }
+    Bench<Conf>("copy", snapshot_mb, rounds);
+    port++;
+    Bench<ZeroCopyConf>("TcpZeroCopyMinSize 16384", snapshot_mb, rounds);
+    filesystem::remove_all(dir);
+    return 0;
+}
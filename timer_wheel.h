@@ -0,0 +1,158 @@
+#pragma once
+#include <cstdint>
+#include <algorithm>
+#include <bit>
+
+namespace tcpshm {
+
+// intrusive node of TimerWheel, embedded in the object to be scheduled
+template<class T>
+struct TimerNode
+{
+    TimerNode* prev = nullptr; // nullptr if not scheduled
+    TimerNode* next = nullptr;
+    int64_t expire = 0;
+    T* owner = nullptr;
+    uint32_t level = 0; // level of the wheel it's in
+
+    [[nodiscard]] bool IsScheduled() const {
+        return prev != nullptr;
+    }
+};
+
+// Hierarchical timing wheel, Schedule() and Cancel() are O(1) and Expire() only visits slots of elapsed ticks
+// a slot of level l spans SlotCnt^l ticks, a node is put in the lowest level whose current span covers its tick,
+// and moved down when its slot is reached, so it's visited at most LevelCnt times before expiring
+// a node due more than one round of the top level ahead just stays in its slot until its round comes
+// ticks of empty levels are skipped at once, so time passing costs little when timers are far apart
+// Single thread class
+template<class T, uint32_t SlotCnt, uint32_t LevelCnt = 1>
+class TimerWheel
+{
+    static_assert(SlotCnt && !(SlotCnt & (SlotCnt - 1)), "SlotCnt must be a power of 2");
+    static_assert(LevelCnt > 0 && std::countr_zero(SlotCnt) * LevelCnt < 48, "too many ticks in a round");
+    static constexpr uint32_t SlotBits = std::countr_zero(SlotCnt);
+    static constexpr int64_t RoundTicks = int64_t(SlotCnt) << (SlotBits * (LevelCnt - 1));
+
+public:
+    using Node = TimerNode<T>;
+
+    // granularity is the time span of a tick, measured in user provided timestamp
+    explicit TimerWheel(int64_t granularity)
+        : granularity_(granularity) {
+        for(auto& level : slots_) {
+            for(auto& slot : level) slot.prev = slot.next = &slot;
+        }
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // (re)schedule node to expire at the specified time, an expire time already passed fires in the next Expire()
+    void Schedule(Node* node, int64_t expire) {
+        Cancel(node);
+        node->expire = expire;
+        Place(node);
+    }
+
+    void Cancel(Node* node) {
+        if(!node->IsScheduled()) return;
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = node->next = nullptr;
+        cnt_[node->level]--;
+    }
+
+    // call handler(T&) for each node expired at now, the node is unscheduled before the call
+    // so handler can schedule it again, but it should not cancel other nodes
+    template<class Handler>
+    void Expire(int64_t now, Handler handler) {
+        int64_t cur = now / granularity_;
+        if(cur < tick_) cur = tick_;
+        if(cur - tick_ >= RoundTicks) {
+            // every slot would be reached, so take all nodes out and place them again from the new tick
+            Node all;
+            all.prev = all.next = &all;
+            for(uint32_t l = 0; l < LevelCnt; l++) {
+                for(auto& slot : slots_[l]) {
+                    if(slot.next == &slot) continue;
+                    slot.next->prev = all.prev;
+                    all.prev->next = slot.next;
+                    slot.prev->next = &all;
+                    all.prev = slot.prev;
+                    slot.prev = slot.next = &slot;
+                }
+            }
+            tick_ = cur;
+            Drain(&all, now, handler);
+            return; // the current tick is not finished
+        }
+        while(true) {
+            if(cnt_[0]) Drain(&slots_[0][tick_ & (SlotCnt - 1)], now, handler);
+            // current tick is not finished, it'll be visited again in the next Expire()
+            if(tick_ == cur) break;
+            // go to the next tick if level 0 is not empty, otherwise the start of the next slot of the lowest
+            // non-empty level, and move down nodes of the slots starting there
+            int64_t next = cur;
+            for(uint32_t l = 0; l < LevelCnt; l++) {
+                if(cnt_[l]) {
+                    next = std::min(next, ((tick_ >> (SlotBits * l)) + 1) << (SlotBits * l));
+                    break;
+                }
+            }
+            tick_ = next;
+            for(uint32_t l = LevelCnt - 1; l > 0; l--) {
+                if(tick_ & ((int64_t(1) << (SlotBits * l)) - 1)) continue;
+                Node& slot = slots_[l][(tick_ >> (SlotBits * l)) & (SlotCnt - 1)];
+                if(slot.next != &slot) Drain(&slot, now, [](T&) {}, true);
+            }
+        }
+    }
+
+private:
+    // take all nodes out of the list, fire the expired ones and place the others again
+    // the list is detached first, so nodes scheduled by handler won't be visited in this run
+    // if move_down, all nodes are placed again, and the due ones expire when the loop of Expire() reaches their tick
+    template<class Handler>
+    void Drain(Node* list, int64_t now, Handler&& handler, bool move_down = false) {
+        if(list->next == list) return;
+        Node* node = list->next;
+        list->prev->next = nullptr;
+        list->prev = list->next = list;
+        while(node) {
+            Node* next = node->next;
+            cnt_[node->level]--;
+            if(!move_down && node->expire <= now) {
+                node->prev = node->next = nullptr;
+                handler(*node->owner);
+            }
+            else { // not due in this round, later in current tick, or moved down
+                Place(node);
+            }
+            node = next;
+        }
+    }
+
+    void Place(Node* node) {
+        int64_t tick = node->expire / granularity_;
+        if(tick < tick_) tick = tick_;
+        uint32_t l = 0;
+        while(l + 1 < LevelCnt && ((tick ^ tick_) >> (SlotBits * (l + 1))) != 0) l++;
+        node->level = l;
+        cnt_[l]++;
+        Link(&slots_[l][(tick >> (SlotBits * l)) & (SlotCnt - 1)], node);
+    }
+
+    void Link(Node* slot, Node* node) {
+        node->prev = slot->prev;
+        node->next = slot;
+        slot->prev->next = node;
+        slot->prev = node;
+    }
+
+    const int64_t granularity_;
+    int64_t tick_ = 0; // the earliest tick not finished
+    uint32_t cnt_[LevelCnt] = {}; // nodes in each level
+    Node slots_[LevelCnt][SlotCnt];
+};
+} // namespace tcpshm
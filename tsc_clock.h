@@ -0,0 +1,183 @@
+#pragma once
+#include <cstdint>
+#include <atomic>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+
+namespace tcpshm {
+
+// Clock source of nanosecond timestamps computed from the cpu's invariant time stamp counter, a read costs a few ns
+// instead of ~20ns of clock_gettime(), and the result can be passed as now to the polling functions of server and
+// client, or used for latency stats
+// the tsc rate is calibrated against a system clock(CLOCK_MONOTONIC by default) in Init(), and Calibrate() corrects
+// the drift, so timestamps of processes calibrated against the same clock on a host are comparable
+// without an invariant tsc(or on cpus other than x86 and aarch64), it falls back to reading the system clock
+// Usage:
+//   TscClock clock;
+//   clock.Init(); // before starting threads reading it
+//   ...
+//   server.PollCtl(clock.Now()); clock.Calibrate(); // in a thread not sensitive to latency, e.g. the control thread
+//   server.PollTcp(clock.Now(), grpid); // in polling threads
+// Now() can be called from any threads, Init() and Calibrate() should be called by a single thread
+class TscClock
+{
+public:
+    // calibrate for init_calibrate_ns, blocking
+    // calibrate_interval_ns is the min interval at which Calibrate() actually corrects the drift
+    // return false if tsc is not usable, and Now() reads clock directly
+    bool Init(int64_t init_calibrate_ns = 20000000,
+              int64_t calibrate_interval_ns = 1000000000,
+              clockid_t clock = CLOCK_MONOTONIC) {
+        clock_ = clock;
+        calibrate_interval_ns_ = calibrate_interval_ns;
+        use_tsc_ = false;
+        if(!IsTscInvariant()) return false;
+
+        int64_t tsc = 0, ns = 0;
+        SyncTime(tsc, ns);
+        int64_t end_ns = ns + init_calibrate_ns;
+        int64_t cur_tsc = 0, cur_ns = 0;
+        do {
+            SyncTime(cur_tsc, cur_ns);
+        } while(cur_ns < end_ns);
+        if(cur_tsc <= tsc) return false;
+
+        rate_base_tsc_ = tsc;
+        rate_base_ns_ = ns;
+        SaveParam(cur_tsc, cur_ns, double(cur_ns - ns) / (cur_tsc - tsc));
+        next_calibrate_tsc_ = cur_tsc + int64_t(calibrate_interval_ns_ / ns_per_tsc_.load(std::memory_order_relaxed));
+        use_tsc_ = true;
+        return true;
+    }
+
+    // current time in ns of the calibrated clock
+    int64_t Now() const {
+        if(!use_tsc_) return ReadClock();
+        return TscToNs(ReadTsc());
+    }
+
+    int64_t TscToNs(int64_t tsc) const {
+        while(true) {
+            uint32_t seq = param_seq_.load(std::memory_order_acquire);
+            int64_t ns = base_ns_.load(std::memory_order_relaxed) +
+                         int64_t((tsc - base_tsc_.load(std::memory_order_relaxed)) *
+                                 ns_per_tsc_.load(std::memory_order_relaxed));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(!(seq & 1) && param_seq_.load(std::memory_order_relaxed) == seq) return ns;
+        }
+    }
+
+    // correct the drift between tsc and the clock if calibrate_interval_ns has passed since the last correction
+    // it's cheap otherwise, so it can be called in a loop
+    // the rate is adjusted so the error is removed within the next interval, and Now() never goes backwards unless
+    // the clock itself steps, e.g. CLOCK_REALTIME set by user, in which case it rebases on the clock at once
+    void Calibrate() {
+        if(!use_tsc_ || ReadTsc() < next_calibrate_tsc_) return;
+        int64_t tsc = 0, ns = 0;
+        SyncTime(tsc, ns);
+        int64_t err = TscToNs(tsc) - ns;
+        double ns_per_tsc;
+        int64_t base_ns;
+        if(err > calibrate_interval_ns_ / 2 || err < -calibrate_interval_ns_ / 2 || tsc <= rate_base_tsc_) {
+            rate_base_tsc_ = tsc;
+            rate_base_ns_ = ns;
+            ns_per_tsc = ns_per_tsc_.load(std::memory_order_relaxed);
+            base_ns = ns;
+        }
+        else {
+            // the long term rate since Init(), sped up or slowed down to catch up err in an interval
+            double rate = double(ns - rate_base_ns_) / (tsc - rate_base_tsc_);
+            ns_per_tsc = rate * (1.0 - double(err) / calibrate_interval_ns_);
+            base_ns = ns + err;
+        }
+        SaveParam(tsc, base_ns, ns_per_tsc);
+        next_calibrate_tsc_ = tsc + int64_t(calibrate_interval_ns_ / ns_per_tsc);
+    }
+
+    // read the clock directly, e.g. for checking the accuracy of Now()
+    int64_t ReadClock() const {
+        timespec ts;
+        ::clock_gettime(clock_, &ts);
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+
+    static int64_t ReadTsc() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#elif defined(__aarch64__)
+        int64_t tsc;
+        asm volatile("mrs %0, cntvct_el0" : "=r"(tsc));
+        return tsc;
+#else
+        return 0;
+#endif
+    }
+
+    [[nodiscard]] bool IsUsingTsc() const {
+        return use_tsc_;
+    }
+
+    // calibrated frequency of tsc in GHz, 0 if not using tsc
+    double GetTscGhz() const {
+        return use_tsc_ ? 1.0 / ns_per_tsc_.load(std::memory_order_relaxed) : 0.0;
+    }
+
+    static bool IsTscInvariant() {
+#if defined(__x86_64__) || defined(__i386__)
+        // CPUID.80000007H:EDX[8], tsc runs at a constant rate in all ACPI P-, C- and T-states
+        unsigned int eax, ebx, ecx, edx;
+        if(!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) return false;
+        return edx & (1u << 8);
+#elif defined(__aarch64__)
+        return true; // the generic timer counts at a fixed frequency
+#else
+        return false;
+#endif
+    }
+
+private:
+    // read a pair of tsc and clock taken at about the same time, the one with the shortest window of a few tries
+    void SyncTime(int64_t& tsc, int64_t& ns) const {
+        tsc = ns = 0;
+        int64_t best = INT64_MAX;
+        for(int i = 0; i < 5; i++) {
+            int64_t tsc1 = ReadTsc();
+            int64_t cur_ns = ReadClock();
+            int64_t tsc2 = ReadTsc();
+            if(tsc2 - tsc1 < best) {
+                best = tsc2 - tsc1;
+                tsc = tsc1 + (tsc2 - tsc1) / 2;
+                ns = cur_ns;
+            }
+        }
+    }
+
+    // seqlock write, there's only one writer
+    void SaveParam(int64_t base_tsc, int64_t base_ns, double ns_per_tsc) {
+        uint32_t seq = param_seq_.load(std::memory_order_relaxed);
+        param_seq_.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        base_tsc_.store(base_tsc, std::memory_order_relaxed);
+        base_ns_.store(base_ns, std::memory_order_relaxed);
+        ns_per_tsc_.store(ns_per_tsc, std::memory_order_relaxed);
+        param_seq_.store(seq + 2, std::memory_order_release);
+    }
+
+    // read by all threads
+    alignas(64) std::atomic<uint32_t> param_seq_{0};
+    std::atomic<int64_t> base_tsc_{0};
+    std::atomic<int64_t> base_ns_{0};
+    std::atomic<double> ns_per_tsc_{1.0};
+    bool use_tsc_ = false;
+    clockid_t clock_ = CLOCK_MONOTONIC;
+
+    // used by the calibrating thread only
+    alignas(64) int64_t calibrate_interval_ns_ = 1000000000;
+    int64_t next_calibrate_tsc_ = 0;
+    int64_t rate_base_tsc_ = 0;
+    int64_t rate_base_ns_ = 0;
+};
+} // namespace tcpshm